@@ -0,0 +1,738 @@
+/*
+ * Aggregator.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#include "Aggregator.h"
+#include "GatewayResourcesProvider.h"
+#include "GatewayDefines.h"
+#include "ErrorMessage.h"
+#include "lib/ProcessFramework.h"
+#include "lib/Messages.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*=====================================
+        Class AggregateSubscription
+ =====================================*/
+AggregateSubscription::AggregateSubscription(){
+	connNo = 0;
+	granted = false;
+	grantedQos = 0;
+}
+
+int AggregateSubscription::find(ClientHandle client){
+	for(int i = 0; i < (int)subscribers.size(); i++){
+		if(subscribers[i].client == client){
+			return i;
+		}
+	}
+	return -1;
+}
+
+uint8_t AggregateSubscription::getMaxQos(){
+	uint8_t qos = 0;
+	for(int i = 0; i < (int)subscribers.size(); i++){
+		if(subscribers[i].qos > qos){
+			qos = subscribers[i].qos;
+		}
+	}
+	return qos;
+}
+
+/*=====================================
+        Class AggregateConnection
+ =====================================*/
+AggregateConnection::AggregateConnection(){
+	node = 0;
+	sendCnt = 0;
+}
+
+/*=====================================
+        Class Aggregator
+ =====================================*/
+Aggregator::Aggregator(){
+	_res = 0;
+	_aggregating = false;
+	_connCnt = 1;
+	_keepAlive = KEEP_ALIVE_TIME;
+}
+
+Aggregator::~Aggregator(){
+	for(int i = 0; i < MAX_AGGREGATE_CONNECTIONS; i++){
+		if(_conn[i].node){
+			_res->getClientList()->erase(_conn[i].node);    // deleted with ClientList
+		}
+	}
+}
+
+void Aggregator::initialize(GatewayResourcesProvider* res){
+	char param[TOMYFRAME_PARAM_MAX];
+	char clientId[32];
+
+	_res = res;
+	if(_res->getParam("AggregatingGateway", param) == 0){
+		if(!strcasecmp(param, "YES")){
+			_aggregating = true;
+		}
+	}
+	if(!_aggregating){
+		return;
+	}
+
+	if(_res->getParam("AggregatingConnections", param) == 0){
+		_connCnt = atoi(param);
+	}
+	if(_connCnt < 1 || _connCnt > MAX_AGGREGATE_CONNECTIONS){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_08, "Invalid AggregatingConnections");  // ABORT
+	}
+
+	GatewayContext* ctx = _res->getGatewayContext();
+	ctx->initialize(_res);
+	_keepAlive = ctx->getKeepAlive();
+
+	for(int i = 0; i < _connCnt; i++){
+		sprintf(clientId, "TomyGateway-%d-%d", ctx->getGatewayId(), i);
+		string id = string(clientId);
+		_conn[i].node = _res->getClientList()->createGatewayNode(ctx->isSecure());
+		if(_conn[i].node == 0){
+			THROW_EXCEPTION(ExFatal, ERRNO_APL_08, "Can't allocate AggregatingConnections");  // ABORT
+		}
+		_conn[i].node->setNodeId(&id);
+	}
+	LOGWRITE("Aggregating gateway with %d Broker connection(s)\n", _connCnt);
+}
+
+bool Aggregator::isAggregating(){
+	return _aggregating;
+}
+
+bool Aggregator::isAggregateNode(ClientNode* clnode){
+	for(int i = 0; i < _connCnt; i++){
+		if(_conn[i].node == clnode){
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ *  A client always uses the same connection, which keeps the order
+ *  of its messages.
+ */
+AggregateConnection* Aggregator::getConnection(ClientNode* clnode){
+	for(int i = 0; i < _connCnt; i++){
+		if(_conn[i].node == clnode){
+			return &_conn[i];
+		}
+	}
+	return &_conn[clnode->getSlotNo() % _connCnt];    // sharded by slot as in getControlTaskNo()
+}
+
+/*
+ *  Sends CONNECT of the gateway and restores the subscriptions
+ *  owned by the connection.
+ */
+void Aggregator::startSession(AggregateConnection* conn){
+	GatewayContext* ctx = _res->getGatewayContext();
+	int connNo = conn - _conn;
+
+	MQTTConnect* mqMsg = new MQTTConnect();
+	mqMsg->setProtocol(ctx->getProtocol());
+	mqMsg->setClientId(conn->node->getNodeId());
+	mqMsg->setKeepAliveTime(_keepAlive);
+	if(*ctx->getLoginId() != "" && *ctx->getPassword() != ""){
+		mqMsg->setUserName(ctx->getLoginId());
+		mqMsg->setPassword(ctx->getPassword());
+	}
+	mqMsg->setCleanSessionFlg();
+
+	conn->routes.clear();
+	conn->publishRoutes.clear();
+	conn->keepAliveTimer.start(_keepAlive * 500UL);
+	conn->node->connectQued();
+	sendToBroker(conn, mqMsg);
+
+	for(map<string, AggregateSubscription>::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ++it){
+		if(it->second.connNo == connNo){
+			string topic = it->first;
+			MQTTSubscribe* subscribe = new MQTTSubscribe();
+			it->second.granted = false;
+			subscribe->setTopic(&topic, it->second.getMaxQos());
+			subscribe->setMessageId(addRoute(conn, 0, 0, &topic));
+			sendToBroker(conn, subscribe);
+		}
+	}
+}
+
+void Aggregator::sendToBroker(AggregateConnection* conn, MQTTMessage* msg){
+	conn->node->setBrokerSendMessage(msg);
+	conn->sendCnt++;
+}
+
+/*
+ *  BrokerSendTask may wait for the lock, so the events are posted
+ *  to BrokerSendQue after it is released.
+ */
+void Aggregator::unlock(){
+	int sendCnt[MAX_AGGREGATE_CONNECTIONS];
+
+	for(int i = 0; i < _connCnt; i++){
+		sendCnt[i] = _conn[i].sendCnt;
+		_conn[i].sendCnt = 0;
+	}
+	_mutex.unlock();
+
+	for(int i = 0; i < _connCnt; i++){
+		for(int j = 0; j < sendCnt[i]; j++){
+			Event* ev = new Event();
+			ev->setBrokerSendEvent(_conn[i].node);
+			_res->getBrokerSendQue()->post(ev);
+		}
+	}
+}
+
+/*
+ *  Responses are delivered as if they came from the Broker,
+ *  GatewayControlTask handles them as usual.
+ *  The message is discarded if the client was erased from ClientList.
+ */
+void Aggregator::sendToClient(ClientHandle client, MQTTMessage* msg){
+	ClientNode* clnode = _res->getClientList()->getClient(client);
+	if(clnode == 0){
+		delete msg;
+		return;
+	}
+	clnode->setBrokerRecvMessage(msg);
+	Event* ev = new Event();
+	ev->setBrokerRecvEvent(clnode);
+	_res->getGatewayEventQue(clnode)->post(ev);
+}
+
+uint16_t Aggregator::addRoute(AggregateConnection* conn, ClientHandle client, uint16_t msgId, string* topic){
+	uint16_t id = conn->node->getNextMessageId();
+	while(conn->routes.count(id)){
+		id = conn->node->getNextMessageId();
+	}
+	AggregateRoute& route = conn->routes[id];
+	route.client = client;
+	route.msgId = msgId;
+	if(topic){
+		route.topic = *topic;
+	}
+	return id;
+}
+
+/*=====================================
+        Client ---> Broker
+ =====================================*/
+void Aggregator::translate(Event* ev){
+	ClientNode* clnode = ev->getClientNode();
+	MQTTMessage* msg = clnode->getBrokerSendMessage();
+	AggregateConnection* conn = getConnection(clnode);
+
+	_mutex.lock();
+
+	if(conn->node->isDisconnect() && msg->getType() != MQTT_TYPE_DISCONNECT){
+		startSession(conn);
+	}
+
+	switch(msg->getType()){
+	case MQTT_TYPE_CONNECT:
+		connect(clnode, static_cast<MQTTConnect*>(msg));
+		break;
+	case MQTT_TYPE_PINGREQ:
+		sendToClient(clnode->getHandle(), new MQTTPingResp());
+		break;
+	case MQTT_TYPE_SUBSCRIBE:
+		subscribe(clnode, static_cast<MQTTSubscribe*>(msg));
+		break;
+	case MQTT_TYPE_UNSUBSCRIBE:
+		unsubscribe(clnode, static_cast<MQTTUnsubscribe*>(msg));
+		break;
+	case MQTT_TYPE_PUBLISH:
+		publish(clnode, static_cast<MQTTPublish*>(msg));
+		break;
+	case MQTT_TYPE_PUBREL:
+		pubRel(clnode, static_cast<MQTTPubRel*>(msg));
+		break;
+	case MQTT_TYPE_PUBREC:{
+		/*  QoS2 PUBLISH delivered by the aggregator  */
+		MQTTPubRel* pubRel = new MQTTPubRel();
+		pubRel->setMessageId(static_cast<MQTTPubRec*>(msg)->getMessageId());
+		sendToClient(clnode->getHandle(), pubRel);
+	}
+		break;
+	case MQTT_TYPE_DISCONNECT:
+		if(!clnode->isSleep()){
+			unsubscribeAll(clnode->getHandle());
+		}
+		break;
+	default:     // PUBACK, PUBCOMP were answered to the Broker already
+		break;
+	}
+
+	unlock();
+	delete ev;
+}
+
+void Aggregator::connect(ClientNode* clnode, MQTTConnect* msg){
+	AggregateConnection* conn = getConnection(clnode);
+
+	clnode->connectSended();
+	if(msg->isCleanSession()){
+		unsubscribeAll(clnode->getHandle());
+	}
+
+	if(conn->node->isActive()){
+		sendToClient(clnode->getHandle(), new MQTTConnAck());
+	}else{
+		conn->connectingClients.push_back(clnode->getHandle());
+	}
+}
+
+void Aggregator::subscribe(ClientNode* clnode, MQTTSubscribe* msg){
+	string* topic = msg->getTopic();
+	uint8_t qos = msg->getRequestedQos();
+	bool forward = false;
+
+	map<string, AggregateSubscription>::iterator it = _subscriptions.find(*topic);
+	if(it == _subscriptions.end()){
+		it = _subscriptions.insert(make_pair(*topic, AggregateSubscription())).first;
+		it->second.connNo = getConnection(clnode) - _conn;
+		forward = true;
+	}else{
+		AggregateConnection* owner = &_conn[it->second.connNo];
+		if(owner->node->isDisconnect()){
+			startSession(owner);
+		}
+		forward = !it->second.granted || it->second.grantedQos < qos;
+	}
+
+	AggregateSubscription* sub = &it->second;
+	int pos = sub->find(clnode->getHandle());
+	if(pos < 0){
+		AggregateSubscriber subscriber = {clnode->getHandle(), qos};
+		sub->subscribers.push_back(subscriber);
+	}else{
+		sub->subscribers[pos].qos = qos;
+	}
+
+	if(forward){
+		AggregateConnection* conn = &_conn[sub->connNo];
+		MQTTSubscribe* subscribe = new MQTTSubscribe();
+		subscribe->setTopic(topic, sub->getMaxQos());
+		subscribe->setMessageId(addRoute(conn, clnode->getHandle(), msg->getMessageId(), topic));
+		sendToBroker(conn, subscribe);
+	}else{
+		MQTTSubAck* subAck = new MQTTSubAck();
+		subAck->setMessageId(msg->getMessageId());
+		subAck->setGrantedQos(qos);
+		sendToClient(clnode->getHandle(), subAck);
+	}
+}
+
+void Aggregator::unsubscribe(ClientNode* clnode, MQTTUnsubscribe* msg){
+	string* topic = msg->getTopicName();
+
+	map<string, AggregateSubscription>::iterator it = _subscriptions.find(*topic);
+	if(it != _subscriptions.end()){
+		int pos = it->second.find(clnode->getHandle());
+		if(pos >= 0){
+			it->second.subscribers.erase(it->second.subscribers.begin() + pos);
+		}
+		if(it->second.subscribers.empty()){
+			AggregateConnection* conn = &_conn[it->second.connNo];
+			_subscriptions.erase(it);
+
+			/*------ the last subscriber ------*/
+			if(!conn->node->isDisconnect()){
+				MQTTUnsubscribe* unsubscribe = new MQTTUnsubscribe();
+				unsubscribe->setTopicName(topic);
+				unsubscribe->setMessageId(addRoute(conn, clnode->getHandle(), msg->getMessageId(), topic));
+				sendToBroker(conn, unsubscribe);
+				return;
+			}
+		}
+	}
+	MQTTUnsubAck* unsubAck = new MQTTUnsubAck();
+	unsubAck->setMessageId(msg->getMessageId());
+	sendToClient(clnode->getHandle(), unsubAck);
+}
+
+void Aggregator::unsubscribeAll(ClientHandle client){
+	map<string, AggregateSubscription>::iterator it = _subscriptions.begin();
+
+	while(it != _subscriptions.end()){
+		int pos = it->second.find(client);
+		if(pos < 0){
+			++it;
+			continue;
+		}
+		it->second.subscribers.erase(it->second.subscribers.begin() + pos);
+		if(!it->second.subscribers.empty()){
+			++it;
+			continue;
+		}
+
+		AggregateConnection* conn = &_conn[it->second.connNo];
+		if(!conn->node->isDisconnect()){
+			string topic = it->first;
+			MQTTUnsubscribe* unsubscribe = new MQTTUnsubscribe();
+			unsubscribe->setTopicName(&topic);
+			unsubscribe->setMessageId(addRoute(conn, 0, 0, &topic));
+			sendToBroker(conn, unsubscribe);
+		}
+		_subscriptions.erase(it++);
+	}
+}
+
+void Aggregator::publish(ClientNode* clnode, MQTTPublish* msg){
+	AggregateConnection* conn = getConnection(clnode);
+	MQTTPublish* publish = new MQTTPublish();
+
+	publish->absorb(msg);
+	publish->setTopic(msg->getTopic());
+	publish->setPayload(msg->getPayloadBuffer(), msg->getPayload(), msg->getPayloadLength());
+
+	if(msg->getQos()){
+		/*------ MessageId is unique in the connection ------*/
+		pair<ClientHandle, uint16_t> key = make_pair(clnode->getHandle(), msg->getMessageId());
+		map<pair<ClientHandle, uint16_t>, uint16_t>::iterator it = conn->publishRoutes.find(key);
+		if(it != conn->publishRoutes.end()){
+			publish->setMessageId(it->second);   // DUP
+		}else{
+			uint16_t id = addRoute(conn, clnode->getHandle(), msg->getMessageId(), 0);
+			conn->publishRoutes[key] = id;
+			publish->setMessageId(id);
+		}
+	}
+	sendToBroker(conn, publish);
+}
+
+void Aggregator::pubRel(ClientNode* clnode, MQTTPubRel* msg){
+	AggregateConnection* conn = getConnection(clnode);
+
+	map<pair<ClientHandle, uint16_t>, uint16_t>::iterator it =
+			conn->publishRoutes.find(make_pair(clnode->getHandle(), msg->getMessageId()));
+	if(it != conn->publishRoutes.end()){
+		MQTTPubRel* pubRel = new MQTTPubRel();
+		pubRel->setMessageId(it->second);
+		sendToBroker(conn, pubRel);
+	}else{
+		/*  the session was lost, complete the flow locally  */
+		MQTTPubComp* pubComp = new MQTTPubComp();
+		pubComp->setMessageId(msg->getMessageId());
+		sendToClient(clnode->getHandle(), pubComp);
+	}
+}
+
+/*
+ *  Called by BrokerSendTask every second.
+ */
+void Aggregator::checkKeepAlive(){
+	_mutex.lock();
+	for(int i = 0; i < _connCnt; i++){
+		AggregateConnection* conn = &_conn[i];
+
+		if(conn->node->isActive()){
+			if(conn->keepAliveTimer.isTimeup()){
+				conn->keepAliveTimer.start(_keepAlive * 500UL);
+				sendToBroker(conn, new MQTTPingReq());
+			}
+		}else if(conn->node->isDisconnect() && conn->keepAliveTimer.isTimeup(TIMEOUT_PERIOD * 1000UL)){
+			/*------ reconnect if subscribers are left ------*/
+			for(map<string, AggregateSubscription>::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ++it){
+				if(it->second.connNo == i){
+					startSession(conn);
+					break;
+				}
+			}
+		}
+	}
+	unlock();
+}
+
+/*
+ *  Called by BrokerSendTask when BrokerConnectTask failed.
+ */
+void Aggregator::connectFailed(ClientNode* aggNode){
+	AggregateConnection* conn = getConnection(aggNode);
+
+	_mutex.lock();
+	for(int i = 0; i < (int)conn->connectingClients.size(); i++){
+		MQTTConnAck* connAck = new MQTTConnAck();
+		connAck->setReturnCd(MQTT_RC_REFUSED_SERVER_UNAVAILABLE);
+		sendToClient(conn->connectingClients[i], connAck);
+	}
+	conn->connectingClients.clear();
+	unlock();
+}
+
+/*=====================================
+        Broker ---> Client
+ =====================================*/
+void Aggregator::received(ClientNode* aggNode){
+	AggregateConnection* conn = getConnection(aggNode);
+	MQTTMessage* msg = aggNode->getBrokerRecvMessage();
+
+	_mutex.lock();
+
+	switch(msg->getType()){
+	case MQTT_TYPE_CONNACK:
+		receivedConnAck(conn, static_cast<MQTTConnAck*>(msg));
+		break;
+	case MQTT_TYPE_SUBACK:
+		receivedSubAck(conn, static_cast<MQTTSubAck*>(msg));
+		break;
+	case MQTT_TYPE_PUBLISH:
+		receivedPublish(conn, static_cast<MQTTPublish*>(msg));
+		break;
+	case MQTT_TYPE_PUBACK:
+		receivedAck(conn, msg->getType(), static_cast<MQTTPubAck*>(msg)->getMessageId());
+		break;
+	case MQTT_TYPE_PUBREC:
+	case MQTT_TYPE_PUBCOMP:
+		receivedAck(conn, msg->getType(), static_cast<MQTTPubRec*>(msg)->getMessageId());
+		break;
+	case MQTT_TYPE_UNSUBACK:
+		receivedAck(conn, msg->getType(), static_cast<MQTTUnsubAck*>(msg)->getMessageId());
+		break;
+	case MQTT_TYPE_PUBREL:{
+		MQTTPubComp* pubComp = new MQTTPubComp();
+		pubComp->setMessageId(static_cast<MQTTPubRel*>(msg)->getMessageId());
+		sendToBroker(conn, pubComp);
+	}
+		break;
+	default:     // PINGRESP
+		break;
+	}
+
+	unlock();
+	aggNode->deleteBrokerRecvMessage();
+}
+
+void Aggregator::receivedConnAck(AggregateConnection* conn, MQTTConnAck* msg){
+	uint8_t rc = msg->getReturnCd();
+
+	if(rc == 0){
+		conn->node->updateStatus(Cstat_Active);
+		LOGWRITE("%s is connected.\n", conn->node->getNodeId()->c_str());
+	}else{
+		LOGWRITE("%s is refused. ReturnCode=%d\n", conn->node->getNodeId()->c_str(), rc);
+		if(rc == MQTT_RC_REFUSED_PROTOCOL_VERSION){
+			_res->getGatewayContext()->switchProtocol();
+			rc = MQTT_RC_REFUSED_SERVER_UNAVAILABLE;
+		}
+		conn->node->disconnected();
+		conn->node->getStack()->close();
+	}
+
+	for(int i = 0; i < (int)conn->connectingClients.size(); i++){
+		MQTTConnAck* connAck = new MQTTConnAck();
+		connAck->setReturnCd(rc);
+		sendToClient(conn->connectingClients[i], connAck);
+	}
+	conn->connectingClients.clear();
+}
+
+void Aggregator::receivedSubAck(AggregateConnection* conn, MQTTSubAck* msg){
+	map<uint16_t, AggregateRoute>::iterator it = conn->routes.find(msg->getMessageId());
+	if(it == conn->routes.end()){
+		return;
+	}
+	AggregateRoute route = it->second;
+	conn->routes.erase(it);
+
+	uint8_t rc = msg->getGrantedQos();
+	map<string, AggregateSubscription>::iterator sit = _subscriptions.find(route.topic);
+	if(sit != _subscriptions.end()){
+		int pos = sit->second.find(route.client);
+		if(rc == 0x80){
+			LOGWRITE("SUBSCRIBE %s is refused.\n", route.topic.c_str());
+			if(pos >= 0){
+				sit->second.subscribers.erase(sit->second.subscribers.begin() + pos);
+				if(sit->second.subscribers.empty()){
+					_subscriptions.erase(sit);
+				}
+			}
+		}else{
+			sit->second.granted = true;
+			sit->second.grantedQos = rc;
+			if(pos >= 0 && sit->second.subscribers[pos].qos < rc){
+				rc = sit->second.subscribers[pos].qos;
+			}
+		}
+	}
+
+	if(route.client){
+		MQTTSubAck* subAck = new MQTTSubAck();
+		subAck->setMessageId(route.msgId);
+		subAck->setGrantedQos(rc);
+		sendToClient(route.client, subAck);
+	}
+}
+
+/*
+ *  The Broker's PUBLISH is acknowledged by the aggregator and
+ *  delivered to every client subscribing a matched topic filter.
+ */
+void Aggregator::receivedPublish(AggregateConnection* conn, MQTTPublish* msg){
+	vector<AggregateSubscriber> targets;
+	vector<ClientHandle> erased;
+	int connNo = conn - _conn;
+
+	for(map<string, AggregateSubscription>::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ++it){
+		if(it->second.connNo != connNo || !isTopicMatched(it->first, *msg->getTopic())){
+			continue;
+		}
+		vector<AggregateSubscriber>* subscribers = &it->second.subscribers;
+		for(int i = 0; i < (int)subscribers->size(); i++){
+			int j = 0;
+			for(; j < (int)targets.size(); j++){
+				if(targets[j].client == (*subscribers)[i].client){
+					break;
+				}
+			}
+			if(j == (int)targets.size()){
+				targets.push_back((*subscribers)[i]);
+			}else if(targets[j].qos < (*subscribers)[i].qos){
+				targets[j].qos = (*subscribers)[i].qos;
+			}
+		}
+	}
+
+	for(int i = 0; i < (int)targets.size(); i++){
+		ClientNode* clnode = _res->getClientList()->getClient(targets[i].client);
+		if(clnode == 0){
+			erased.push_back(targets[i].client);
+			continue;
+		}
+		uint8_t qos = msg->getQos() < targets[i].qos ? msg->getQos() : targets[i].qos;
+		MQTTPublish* publish = new MQTTPublish();
+		publish->setTopic(msg->getTopic());
+		publish->setPayload(msg->getPayloadBuffer(), msg->getPayload(), msg->getPayloadLength());
+		publish->setQos(qos);
+		if(msg->isRetain()){
+			publish->setRetain();
+		}
+		if(qos){
+			publish->setMessageId(clnode->getNextMessageId());
+		}
+		sendToClient(targets[i].client, publish);
+	}
+
+	/*------ subscriptions left by the clients erased from ClientList ------*/
+	for(int i = 0; i < (int)erased.size(); i++){
+		unsubscribeAll(erased[i]);
+	}
+
+	if(msg->getQos() == 1){
+		MQTTPubAck* pubAck = new MQTTPubAck();
+		pubAck->setMessageId(msg->getMessageId());
+		sendToBroker(conn, pubAck);
+	}else if(msg->getQos() == 2){
+		MQTTPubRec* pubRec = new MQTTPubRec();
+		pubRec->setMessageId(msg->getMessageId());
+		sendToBroker(conn, pubRec);
+	}
+}
+
+void Aggregator::receivedAck(AggregateConnection* conn, uint8_t type, uint16_t msgId){
+	map<uint16_t, AggregateRoute>::iterator it = conn->routes.find(msgId);
+	if(it == conn->routes.end()){
+		return;
+	}
+	ClientHandle client = it->second.client;
+	uint16_t clientMsgId = it->second.msgId;
+
+	if(type != MQTT_TYPE_PUBREC){
+		if(type != MQTT_TYPE_UNSUBACK){
+			conn->publishRoutes.erase(make_pair(client, clientMsgId));
+		}
+		conn->routes.erase(it);
+	}
+	if(client == 0){
+		return;
+	}
+
+	if(type == MQTT_TYPE_PUBACK){
+		MQTTPubAck* pubAck = new MQTTPubAck();
+		pubAck->setMessageId(clientMsgId);
+		sendToClient(client, pubAck);
+	}else if(type == MQTT_TYPE_PUBREC){
+		MQTTPubRec* pubRec = new MQTTPubRec();
+		pubRec->setMessageId(clientMsgId);
+		sendToClient(client, pubRec);
+	}else if(type == MQTT_TYPE_PUBCOMP){
+		MQTTPubComp* pubComp = new MQTTPubComp();
+		pubComp->setMessageId(clientMsgId);
+		sendToClient(client, pubComp);
+	}else{
+		MQTTUnsubAck* unsubAck = new MQTTUnsubAck();
+		unsubAck->setMessageId(clientMsgId);
+		sendToClient(client, unsubAck);
+	}
+}
+
+/*
+ *  MQTT topic filter, '+' matches a level, '#' matches the rest.
+ */
+bool Aggregator::isTopicMatched(const string& filter, const string& topic){
+	size_t f = 0;
+	size_t t = 0;
+
+	if(!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')){
+		return false;
+	}
+
+	while(f < filter.size()){
+		if(filter[f] == '#'){
+			return true;
+		}else if(filter[f] == '+'){
+			while(t < topic.size() && topic[t] != '/'){
+				t++;
+			}
+			f++;
+		}else if(t == topic.size() && filter.compare(f, 2, "/#") == 0){
+			return true;    // "a/#" matches "a"
+		}else if(t < topic.size() && filter[f] == topic[t]){
+			f++;
+			t++;
+		}else{
+			return false;
+		}
+	}
+	return t == topic.size();
+}
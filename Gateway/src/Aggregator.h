@@ -0,0 +1,137 @@
+/*
+ * Aggregator.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef AGGREGATOR_H_
+#define AGGREGATOR_H_
+
+#include "lib/ProcessFramework.h"
+#include "lib/Messages.h"
+#include "GatewayResourcesProvider.h"
+#include <map>
+#include <vector>
+
+/*=====================================
+        Class AggregateSubscription
+ =====================================*/
+struct AggregateSubscriber{
+	ClientHandle client;
+	uint8_t qos;
+};
+
+class AggregateSubscription{
+public:
+	AggregateSubscription();
+	int  find(ClientHandle client);
+	uint8_t getMaxQos();
+	int  connNo;
+	bool granted;
+	uint8_t grantedQos;
+	vector<AggregateSubscriber> subscribers;    // reference count is the size
+};
+
+/*=====================================
+        Class AggregateRoute
+ =====================================*/
+struct AggregateRoute{
+	ClientHandle client;     // 0: issued by the aggregator itself
+	uint16_t msgId;          // MessageId of the client
+	string   topic;          // SUBSCRIBE, UNSUBSCRIBE
+};
+
+/*=====================================
+        Class AggregateConnection
+ =====================================*/
+class AggregateConnection{
+public:
+	AggregateConnection();
+	ClientNode* node;        // status of the session
+	Timer keepAliveTimer;
+	int sendCnt;             // events posted after the lock is released
+	map<uint16_t, AggregateRoute> routes;                       // broker's MessageId
+	map<pair<ClientHandle, uint16_t>, uint16_t> publishRoutes;  // client's QoS2 PUBLISH
+	vector<ClientHandle> connectingClients;                     // waiting for CONNACK
+};
+
+/*=====================================
+        Class Aggregator
+ =====================================*/
+class Aggregator{
+public:
+	Aggregator();
+	~Aggregator();
+	void initialize(GatewayResourcesProvider* res);
+	bool isAggregating();
+	bool isAggregateNode(ClientNode* clnode);
+
+	/* BrokerSendTask */
+	void translate(Event* ev);
+	void checkKeepAlive();
+	void connectFailed(ClientNode* aggNode);
+
+	/* BrokerRecvTask */
+	void received(ClientNode* aggNode);
+
+	static bool isTopicMatched(const string& filter, const string& topic);
+
+private:
+	void unlock();
+	AggregateConnection* getConnection(ClientNode* clnode);
+	void startSession(AggregateConnection* conn);
+	void sendToBroker(AggregateConnection* conn, MQTTMessage* msg);
+	void sendToClient(ClientHandle client, MQTTMessage* msg);
+	uint16_t addRoute(AggregateConnection* conn, ClientHandle client, uint16_t msgId, string* topic);
+
+	void subscribe(ClientNode* clnode, MQTTSubscribe* msg);
+	void unsubscribe(ClientNode* clnode, MQTTUnsubscribe* msg);
+	void unsubscribeAll(ClientHandle client);
+	void publish(ClientNode* clnode, MQTTPublish* msg);
+	void pubRel(ClientNode* clnode, MQTTPubRel* msg);
+	void connect(ClientNode* clnode, MQTTConnect* msg);
+
+	void receivedConnAck(AggregateConnection* conn, MQTTConnAck* msg);
+	void receivedSubAck(AggregateConnection* conn, MQTTSubAck* msg);
+	void receivedPublish(AggregateConnection* conn, MQTTPublish* msg);
+	void receivedAck(AggregateConnection* conn, uint8_t type, uint16_t msgId);
+
+	GatewayResourcesProvider* _res;
+	Mutex _mutex;
+	bool _aggregating;
+	int  _connCnt;
+	uint32_t _keepAlive;
+	AggregateConnection _conn[MAX_AGGREGATE_CONNECTIONS];
+	map<string, AggregateSubscription> _subscriptions;
+};
+
+#endif /* AGGREGATOR_H_ */
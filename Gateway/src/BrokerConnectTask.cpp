@@ -0,0 +1,97 @@
+/*
+ * BrokerConnectTask.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#include "BrokerConnectTask.h"
+#include "GatewayResourcesProvider.h"
+#include "GatewayDefines.h"
+#include "lib/ProcessFramework.h"
+#include "lib/Resolver.h"
+#include <string.h>
+
+/*=====================================
+        Class BrokerConnectTask
+ =====================================*/
+BrokerConnectTask::BrokerConnectTask(GatewayResourcesProvider* res, int taskNo){
+	_res = res;
+	_res->attach(this);
+	_taskNo = taskNo;
+}
+
+BrokerConnectTask::~BrokerConnectTask(){
+
+}
+
+/*
+ *  Connects (TCP and TLS handshake) on behalf of BrokerSendTask,
+ *  which parks the client's messages until EtBrokerConnected arrives.
+ */
+void BrokerConnectTask::run(){
+	char param[TOMYFRAME_PARAM_MAX];
+
+	if(_res->getParam("BrokerName",param) == 0){
+		_host = param;
+	}
+	if(_res->getParam("BrokerPortNo",param) == 0){
+		_service = param;
+	}
+	if(_res->getParam("ResolverTTL",param) == 0){
+		theResolverCache.setTTL(atoi(param), RESOLVER_NEGATIVE_TTL);
+	}
+
+	EventQue<Event>* eventQue = _res->getBrokerConnectTaskQue(_taskNo);
+
+	while(true){
+		Event* ev = eventQue->wait();
+		ClientNode* clnode = ev->getClientNode();
+		if(ev->isStale()){
+			delete ev;
+			continue;
+		}
+
+		METRIC_INC(MC_BROKER_CONNECTS);
+		uint64_t start = metricsNow();
+		if(clnode->getStack()->connect(_host.c_str(), _service.c_str())){
+			METRIC_RECORD(MH_BROKER_CONNECT, metricsNow() - start);
+		}else{
+			METRIC_INC(MC_BROKER_CONNECT_FAILURES);
+			LOGWRITE("\n  \x1b[0m\x1b[31merror:\x1b[0m\x1b[37m Can't connect to the Broker.\n");
+		}
+
+		Event* ev1 = new Event();
+		ev1->setBrokerConnectedEvent(clnode);
+		_res->getBrokerSendQue()->post(ev1);
+		delete ev;
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * BrokerConnectTask.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef BROKERCONNECTTASK_H_
+#define BROKERCONNECTTASK_H_
+
+#include "lib/ProcessFramework.h"
+#include "GatewayResourcesProvider.h"
+
+/*=====================================
+        Class BrokerConnectTask
+ =====================================*/
+class BrokerConnectTask : public Thread{
+	MAGIC_WORD_FOR_TASK;
+public:
+	BrokerConnectTask(GatewayResourcesProvider* res, int taskNo = 0);
+	~BrokerConnectTask();
+	void run();
+
+private:
+	GatewayResourcesProvider* _res;
+	int _taskNo;
+	string _host;
+	string _service;
+};
+
+
+#endif /* BROKERCONNECTTASK_H_ */
@@ -35,25 +35,33 @@
 
 #include "BrokerRecvTask.h"
 #include "GatewayResourcesProvider.h"
+#include "Aggregator.h"
 #include "GatewayDefines.h"
 #include "lib/ProcessFramework.h"
 #include "lib/Messages.h"
+#include "ErrorMessage.h"
 #include <string.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
-extern char* currentDateTime();
-
 
 BrokerRecvTask::BrokerRecvTask(GatewayResourcesProvider* res){
 	_res = res;
 	_res->attach(this);
 	_stableNetwork = true;
+
+	/*  sockets are registered by TLSStack::connect() before any task runs  */
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	TCPStack::setPollFd(_epfd);
 }
 
 BrokerRecvTask::~BrokerRecvTask(){
-
+	if(_epfd >= 0){
+		close(_epfd);
+	}
 }
 
 
@@ -65,58 +73,37 @@ void BrokerRecvTask::run(){
 		}
 	}
 
-	struct timeval timeout;
+	if(_epfd < 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_02, "can't create epoll for BrokerRecvTask.");
+	}
 
 	LightIndicator* lightIndicator = _res->getLightIndicator();
-	ClientList* clist = _res->getClientList();
-	fd_set rset;
-	fd_set wset;
+	struct epoll_event events[BROKER_POLL_EVENTS];
 
 	while(true){
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 500000;    // 500 msec
-		FD_ZERO(&rset);
-		FD_ZERO(&wset);
-		int maxSock = 0;
-		int sockfd = 0;
-
-		/*------- Prepare socket list to check -------*/
-		for( int i = 0; i < clist->getClientCount(); i++){
-			if((*clist)[i]){
-				if((*clist)[i]->getStack()->isValid()){
-					sockfd = (*clist)[i]->getStack()->getSock();
-					FD_SET(sockfd, &rset);
-					FD_SET(sockfd, &wset);
-					if(sockfd > maxSock){
-						maxSock = sockfd;
-					}
-				}
-			}else{
-				break;
-			}
+		int activity = epoll_wait(_epfd, events, BROKER_POLL_EVENTS, 500);    // 500 msec
+
+		if(activity < 0 && errno != EINTR){
+			THROW_EXCEPTION(ExFatal, ERRNO_APL_02, "epoll_wait() error in BrokerRecvTask.");
 		}
 
-		if(maxSock == 0){
+		if(TCPStack::getPollCount() == 0){
 			lightIndicator->greenLight(false);
-		}else{
-
-			/*------- Check socket to receive -------*/
-			int activity =  select( maxSock + 1 , &rset , 0 , 0 , &timeout);
-
-			if (activity > 0){
-				for( int i = 0; i < clist->getClientCount(); i++){
-					if((*clist)[i]){
-						if((*clist)[i]->getStack()->isValid()){
-							int sockfd = (*clist)[i]->getStack()->getSock();
-							if(FD_ISSET(sockfd, &rset)){
-								recvAndFireEvent((*clist)[i]);
-								lightIndicator->greenLight(true);
-							}
-						}
-					}else{
-						break;
-					}
-				}
+		}
+
+		for(int i = 0; i < activity; i++){
+			ClientNode* clnode = _res->getClientList()->getClient((ClientHandle)events[i].data.u64);
+			if(clnode == 0){
+				continue;     // the client was erased
+			}
+
+			/*------- disconnect() requested, the socket is closed here -------*/
+			if(!clnode->getStack()->isValid()){
+				continue;
+			}
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+				recvAndFireEvent(clnode);
+				lightIndicator->greenLight(true);
 			}
 		}
 	}
@@ -127,128 +114,137 @@ void BrokerRecvTask::run(){
      Recv socket & Create MQTT Messages
  -----------------------------------------*/
 void BrokerRecvTask::recvAndFireEvent(ClientNode* clnode){
+	TLSStack* stack = clnode->getStack();
+	uint8_t* packet;
+	int packetLength;
+	int readLength;
+	int recvLength;
+
+	/*------ read as much as the socket holds, packets may span reads ------*/
+	do{
+		readLength = stack->getReadableLength();
+		if(readLength < SOCKET_MAXBUFFER_LENGTH){
+			readLength = SOCKET_MAXBUFFER_LENGTH;
+		}else if(readLength > SOCKET_READ_MAX){
+			readLength = SOCKET_READ_MAX;
+		}
+		uint8_t* buffer = stack->reserveInput(readLength);
+		recvLength = (buffer ? stack->recv(buffer, readLength) : -1);
 
-	uint8_t sbuff[SOCKET_MAXBUFFER_LENGTH * 5];
-	uint8_t buffer[SOCKET_MAXBUFFER_LENGTH];
-	memset(buffer, 0, SOCKET_MAXBUFFER_LENGTH);
-	int recvLength = 0;
-	uint8_t* packet = buffer;
-
-	recvLength = clnode->getStack()->recv(packet,SOCKET_MAXBUFFER_LENGTH);
-
-	if (recvLength == -1){
-		LOGWRITE(" Client : %s Error: BrokerRecvTask can't Receive data from Broker\n", clnode->getNodeId()->c_str());
-		clnode->disconnected();
-	}
-
-	while(recvLength > 0){
-
-		if((*packet & 0xf0) == MQTT_TYPE_PUBACK){
-			MQTTPubAck* puback = new MQTTPubAck();
-			puback->deserialize(packet);
-			puback->serialize(sbuff);
-			LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBACK", LEFTARROW, BROKER, msgPrint(sbuff, puback));
-
-			clnode->setBrokerRecvMessage(puback);
-		}else if((*packet & 0xf0) == MQTT_TYPE_PUBREC){
-			MQTTPubRec* pubRec = new MQTTPubRec();
-			pubRec->deserialize(packet);
-			pubRec->serialize(sbuff);
-			LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBREC", LEFTARROW, BROKER, msgPrint(sbuff, pubRec));
-
-			clnode->setBrokerRecvMessage(pubRec);
-
-		}else if((*packet & 0xf0) == MQTT_TYPE_PUBREL){
-			MQTTPubRel* pubRel = new MQTTPubRel();
-			pubRel->deserialize(packet);
-			pubRel->serialize(sbuff);
-			LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBREL", LEFTARROW, BROKER, msgPrint(sbuff, pubRel));
-
-			clnode->setBrokerRecvMessage(pubRel);
-
-		}else if((*packet & 0xf0) == MQTT_TYPE_PUBCOMP){
-			MQTTPubComp* pubComp = new MQTTPubComp();
-			pubComp->deserialize(packet);
-			pubComp->serialize(sbuff);
-			LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBCOMP", LEFTARROW, BROKER, msgPrint(sbuff, pubComp));
-
-			clnode->setBrokerRecvMessage(pubComp);
-
-		}else if((*packet & 0xf0) == MQTT_TYPE_PUBLISH){
-			MQTTPublish* publish = new MQTTPublish();
-			if(!publish->deserialize(packet)){
-				clnode->disconnected();
-				clnode->getStack()->disconnect();
-				LOGWRITE("%s ill-formed UTF-8\n",currentDateTime());
+		if (recvLength == -1){
+			LOGWRITE(" Client : %s Error: BrokerRecvTask can't Receive data from Broker\n", clnode->getNodeId()->c_str());
+			clnode->disconnected();
+			stack->close();
+			return;
+		}
+		stack->commitInput(recvLength);
+		METRIC_ADD(MC_BYTES_IN + (stack->isSecure() ? MT_TLS : MT_TCP), recvLength);
+		uint64_t now = metricsNow();
+
+		_res->getLightIndicator()->blueLight(true);
+		while((packetLength = stack->getPacket(&packet)) > 0){
+			if(!fireEvent(clnode, packet, packetLength, now)){
+				_res->getLightIndicator()->blueLight(false);
+				return;
 			}
-			publish->serialize(sbuff);
-			LOGWRITE(GREEN_FORMAT2, currentDateTime(), "PUBLISH", LEFTARROW, BROKER, msgPrint(sbuff, publish));
+		}
+		_res->getLightIndicator()->blueLight(false);
+		if(packetLength < 0){
+			LOGWRITE("Client : %s Error: malformed packet from Broker\n", clnode->getNodeId()->c_str());
+			clnode->disconnected();
+			stack->close();
+			return;
+		}
+	}while(recvLength == readLength);     // TLS may hold decrypted bytes the socket no longer shows
+}
 
-			clnode->setBrokerRecvMessage(publish);
+/*
+ *  returns false when the connection is closed.
+ */
+bool BrokerRecvTask::fireEvent(ClientNode* clnode, uint8_t* packet, int packetLength, uint64_t recvTime){
+	METRIC_INC(MC_PACKETS_IN + (clnode->getStack()->isSecure() ? MT_TLS : MT_TCP));
+	METRIC_INC(MC_MQTT_IN + (*packet >> 4));
+
+	if((*packet & 0xf0) == MQTT_TYPE_PUBACK){
+		MQTTPubAck* puback = new MQTTPubAck();
+		puback->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), BLUE_FORMAT1, "PUBACK", LEFTARROW, BROKER, packet, packetLength);
+
+		clnode->setBrokerRecvMessage(puback);
+	}else if((*packet & 0xf0) == MQTT_TYPE_PUBREC){
+		MQTTPubRec* pubRec = new MQTTPubRec();
+		pubRec->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), BLUE_FORMAT1, "PUBREC", LEFTARROW, BROKER, packet, packetLength);
+
+		clnode->setBrokerRecvMessage(pubRec);
+
+	}else if((*packet & 0xf0) == MQTT_TYPE_PUBREL){
+		MQTTPubRel* pubRel = new MQTTPubRel();
+		pubRel->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), BLUE_FORMAT1, "PUBREL", LEFTARROW, BROKER, packet, packetLength);
+
+		clnode->setBrokerRecvMessage(pubRel);
+
+	}else if((*packet & 0xf0) == MQTT_TYPE_PUBCOMP){
+		MQTTPubComp* pubComp = new MQTTPubComp();
+		pubComp->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), BLUE_FORMAT1, "PUBCOMP", LEFTARROW, BROKER, packet, packetLength);
+
+		clnode->setBrokerRecvMessage(pubComp);
+
+	}else if((*packet & 0xf0) == MQTT_TYPE_PUBLISH){
+		MQTTPublish* publish = new MQTTPublish();
+		if(!publish->deserialize(packet)){
+			delete publish;
+			clnode->disconnected();
+			clnode->getStack()->close();
+			LOGWRITE("ill-formed PUBLISH\n");
+			return false;
+		}
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), GREEN_FORMAT2, "PUBLISH", LEFTARROW, BROKER, packet, packetLength);
 
-		}else if((*packet & 0xf0) == MQTT_TYPE_SUBACK){
-			MQTTSubAck* suback = new MQTTSubAck();
-			suback->deserialize(packet);
-			suback->serialize(sbuff);
-			LOGWRITE(FORMAT1, currentDateTime(), "SUBACK", LEFTARROW, BROKER, msgPrint(sbuff, suback));
+		clnode->setBrokerRecvMessage(publish);
 
-			clnode->setBrokerRecvMessage(suback);
+	}else if((*packet & 0xf0) == MQTT_TYPE_SUBACK){
+		MQTTSubAck* suback = new MQTTSubAck();
+		suback->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT1, "SUBACK", LEFTARROW, BROKER, packet, packetLength);
 
-		}else if((*packet & 0xf0) == MQTT_TYPE_PINGRESP){
-			MQTTPingResp* pingresp = new MQTTPingResp();
-			pingresp->deserialize(packet);
-			pingresp->serialize(sbuff);
-			LOGWRITE(FORMAT1, currentDateTime(), "PINGRESP", LEFTARROW, BROKER, msgPrint(sbuff, pingresp));
+		clnode->setBrokerRecvMessage(suback);
 
-			clnode->setBrokerRecvMessage(pingresp);
+	}else if((*packet & 0xf0) == MQTT_TYPE_PINGRESP){
+		MQTTPingResp* pingresp = new MQTTPingResp();
+		pingresp->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT1, "PINGRESP", LEFTARROW, BROKER, packet, packetLength);
 
-		}else if((*packet & 0xf0) == MQTT_TYPE_UNSUBACK){
-			MQTTUnsubAck* unsuback = new MQTTUnsubAck();
-			unsuback->deserialize(packet);
-			unsuback->serialize(sbuff);
-			LOGWRITE(FORMAT1, currentDateTime(), "UNSUBACK", LEFTARROW, BROKER, msgPrint(sbuff, unsuback));
+		clnode->setBrokerRecvMessage(pingresp);
 
-			clnode->setBrokerRecvMessage(unsuback);
+	}else if((*packet & 0xf0) == MQTT_TYPE_UNSUBACK){
+		MQTTUnsubAck* unsuback = new MQTTUnsubAck();
+		unsuback->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT1, "UNSUBACK", LEFTARROW, BROKER, packet, packetLength);
 
-		}else if((*packet & 0xf0) == MQTT_TYPE_CONNACK){
-			MQTTConnAck* connack = new MQTTConnAck();
-			connack->deserialize(packet);
-			connack->serialize(sbuff);
-			LOGWRITE(CYAN_FORMAT1, currentDateTime(), "CONNACK", LEFTARROW, BROKER, msgPrint(sbuff, connack));
+		clnode->setBrokerRecvMessage(unsuback);
 
-			clnode->setBrokerRecvMessage(connack);
+	}else if((*packet & 0xf0) == MQTT_TYPE_CONNACK){
+		MQTTConnAck* connack = new MQTTConnAck();
+		connack->deserialize(packet);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), CYAN_FORMAT1, "CONNACK", LEFTARROW, BROKER, packet, packetLength);
 
-		}else{
-			LOGWRITE("%s UNKOWN_TYPE  packetLength=%d\n",currentDateTime(), recvLength);
-			return;
-		}
+		clnode->setBrokerRecvMessage(connack);
 
-		Event* ev = new Event();
-		ev->setBrokerRecvEvent(clnode);
-		_res->getGatewayEventQue()->post(ev);
-
-		RemainingLength rl;
-		rl.deserialize(packet + 1);
-		uint16_t  packetLength = 1 + rl.getSize() + rl.decode();
-		recvLength -= packetLength;
-		packet += packetLength;
+	}else{
+		LOGWRITE("UNKOWN_TYPE  packetLength=%d\n", packetLength);
+		return true;
 	}
-}
-
-
-char*  BrokerRecvTask::msgPrint(uint8_t* buffer, MQTTMessage* msg){
-	char* buf = _printBuf;
 
-	_res->getLightIndicator()->blueLight(true);
-
-	sprintf(buf, " %02X", *buffer);
-	buf += 3;
-
-	for(int i = 0; i < msg->getRemainLength() + msg->getRemainLengthSize(); i++){
-		sprintf(buf, " %02X", *( buffer + 1 + i));
-		buf += 3;
+	if(_res->getAggregator()->isAggregateNode(clnode)){
+		_res->getAggregator()->received(clnode);     // demultiplexed to the clients
+	}else{
+		Event* ev = new Event();
+		ev->setBrokerRecvEvent(clnode);
+		traceStart(ev->getTrace(), TRACE_BROKER, *packet >> 4, recvTime);
+		_res->getGatewayEventQue(ev->getClientNode())->post(ev);
 	}
-	*buf = 0;
-	_res->getLightIndicator()->blueLight(false);
-	return _printBuf;
+	return true;
 }
@@ -48,13 +48,13 @@ public:
 	~BrokerRecvTask();
 	void initialize();
 	void run();
-	char* msgPrint(uint8_t* buf, MQTTMessage* msg);
 
 private:
 	void recvAndFireEvent(ClientNode*);
+	bool fireEvent(ClientNode* clnode, uint8_t* packet, int packetLength, uint64_t recvTime);
 	GatewayResourcesProvider* _res;
-	char _printBuf[SOCKET_MAXBUFFER_LENGTH * 5];
 	bool _stableNetwork;
+	int  _epfd;
 };
 
 
@@ -35,163 +35,288 @@
 
 #include "BrokerSendTask.h"
 #include "GatewayResourcesProvider.h"
+#include "Aggregator.h"
 #include "GatewayDefines.h"
 #include "lib/ProcessFramework.h"
 #include "lib/Messages.h"
 #include "lib/Defines.h"
+#include "ErrorMessage.h"
 #include <string.h>
 #include <errno.h>
 #include <iostream>
 #include <sys/types.h>
 #include <sys/socket.h>
-
-extern char* currentDateTime();
+#include <sys/epoll.h>
+#include <unistd.h>
 
 
 BrokerSendTask::BrokerSendTask(GatewayResourcesProvider* res){
 	_res = res;
 	_res->attach(this);
+	_light = 0;
+	_epfd = epoll_create1(EPOLL_CLOEXEC);    // broker sockets with output left
 }
 
 BrokerSendTask::~BrokerSendTask(){
-	if(_host){
-		delete _host;
-	}
-	if(_service){
-		delete _service;
+	if(_epfd >= 0){
+		close(_epfd);
 	}
 }
 
+/*
+ *  Packets are queued in the output buffer of each connection and
+ *  written once per batch of events. A connection which can't take
+ *  them all is written again when EPOLLOUT comes, others are not held up.
+ */
 void BrokerSendTask::run(){
-	Event* ev = 0;
-	MQTTMessage* srcMsg = 0;
-	ClientNode* clnode = 0;
-	char param[TOMYFRAME_PARAM_MAX];
+	Event* evs[MAX_EVENT_BATCH];
+	struct epoll_event events[BROKER_POLL_EVENTS];
+	Aggregator* aggregator = _res->getAggregator();
+	Timer keepAliveTimer;
 
-		if(_res->getParam("BrokerName",param) == 0){
-			_host = strdup(param);
-		}
-		if(_res->getParam("BrokerPortNo",param) == 0){
-			_service =strdup( param);
+	if(_epfd < 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_02, "can't create epoll for BrokerSendTask.");
+	}
+	_light = _res->getLightIndicator();
+	if(aggregator->isAggregating()){
+		keepAliveTimer.start(1000);
+	}
+
+	while(true){
+		int cnt = _res->getBrokerSendQue()->drain(MAX_EVENT_BATCH, evs, 1000, _epfd);    // 1 sec
+
+		if(aggregator->isAggregating() && keepAliveTimer.isTimeup()){
+			keepAliveTimer.start(1000);
+			aggregator->checkKeepAlive();
 		}
-		_light = _res->getLightIndicator();
 
+		/*------ connections which can take the rest of their output ------*/
+		int activity = epoll_wait(_epfd, events, BROKER_POLL_EVENTS, 0);
+		for(int i = 0; i < activity; i++){
+			ClientNode* clnode = _res->getClientList()->getClient((ClientHandle)events[i].data.u64);
+			if(clnode){
+				flush(clnode);
+			}
+		}
 
-	while(true){
+		for(int i = 0; i < cnt; i++){
+			dispatch(evs[i]);
+		}
 
-		uint16_t length = 0;
-		memset(_buffer, 0, SOCKET_MAXBUFFER_LENGTH);
-
-		ev = _res->getBrokerSendQue()->wait();
-
-		clnode = ev->getClientNode();
-		srcMsg = clnode->getBrokerSendMessage();
-
-		if(srcMsg->getType() == MQTT_TYPE_PUBLISH){
-			MQTTPublish* msg = static_cast<MQTTPublish*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(BLUE_FORMAT, currentDateTime(), "PUBLISH", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_PUBACK){
-			MQTTPubAck* msg = static_cast<MQTTPubAck*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(GREEN_FORMAT, currentDateTime(), "PUBACK", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_PUBREL){
-			MQTTPubRel* msg = static_cast<MQTTPubRel*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(GREEN_FORMAT, currentDateTime(), "PUBREL", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_PINGREQ){
-			MQTTPingReq* msg = static_cast<MQTTPingReq*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(FORMAT, currentDateTime(), "PINGREQ", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_SUBSCRIBE){
-			MQTTSubscribe* msg = static_cast<MQTTSubscribe*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(FORMAT, currentDateTime(), "SUBSCRIBE", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_UNSUBSCRIBE){
-			MQTTUnsubscribe* msg = static_cast<MQTTUnsubscribe*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(FORMAT, currentDateTime(), "UNSUBSCRIBE", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_CONNECT){
-			MQTTConnect* msg = static_cast<MQTTConnect*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(FORMAT, currentDateTime(), "CONNECT", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			clnode->connectSended();
-			send(clnode, length);
-
-		}else if(srcMsg->getType() == MQTT_TYPE_DISCONNECT){
-			MQTTDisconnect* msg = static_cast<MQTTDisconnect*>(srcMsg);
-			length = msg->serialize(_buffer);
-			LOGWRITE(FORMAT, currentDateTime(), "DISCONNECT", RIGHTARROW, GREEN_BROKER, msgPrint(msg));
-			send(clnode, length);
-
-			clnode->getStack()->disconnect();
+		/*------ one write per connection for the whole batch ------*/
+		for(size_t i = 0; i < _pending.size(); i++){
+			flush(_pending[i]);
 		}
+		_pending.clear();
+		finishTraces();
+	}
+}
 
-		delete ev;
+/*
+ *  The output of the batch is written, or waits for EPOLLOUT.
+ */
+void BrokerSendTask::finishTraces(void){
+	if(_sent.empty()){
+		return;
+	}
+	uint64_t now = metricsNow();
+	for(size_t i = 0; i < _sent.size(); i++){
+		traceFinish(&_sent[i].trace, TRACE_BROKER, now, _sent[i].clnode->getNodeId()->c_str());
 	}
+	_sent.clear();
 }
 
+void BrokerSendTask::dispatch(Event* ev){
+	ClientNode* clnode = ev->getClientNode();
+	Aggregator* aggregator = _res->getAggregator();
 
-int BrokerSendTask::send(ClientNode* clnode, int length){
-	int rc = -1;
+	/*------ the client was erased after the event was posted ------*/
+	if(ev->isStale()){
+		delete ev;
+		return;
+	}
 
-	if(length <= 0){
-		return rc;
+	/*------ BrokerConnectTask finished ------*/
+	if(ev->getEventType() == EtBrokerConnected){
+		connected(clnode);
+		delete ev;
+		return;
 	}
 
-	if( clnode->getStack()->isValid()){
-		rc = clnode->getStack()->send(_buffer, length);
-		if(rc != length){
-			LOGWRITE("\n%s   \x1b[0m\x1b[31merror:\x1b[0m\x1b[37m Can't Xmit to the Broker. errno=%d\n", currentDateTime(), rc == -1 ? errno : 0);
-			clnode->getStack()->disconnect();
-			clnode->disconnected();
-		}else{
-			_light->greenLight(true);
-		}
+	/*------ Aggregating gateway, clients share the aggregator's connections ------*/
+	if(aggregator->isAggregating() && !aggregator->isAggregateNode(clnode)){
+		aggregator->translate(ev);
+		return;
+	}
+
+	/*------ park messages until the connection is ready ------*/
+	if(clnode->isBrokerConnecting()){
+		clnode->parkBrokerSendEvent(ev);
+	}else if(!clnode->getStack()->isValid()){
+		clnode->getStack()->clearOutput();
+		clnode->parkBrokerSendEvent(ev);
+		clnode->setBrokerConnecting(true);
+		Event* ev1 = new Event();
+		ev1->setBrokerConnectEvent(clnode);
+		_res->getBrokerConnectQue(clnode)->post(ev1);
 	}else{
-		if(clnode->getStack()->connect(_host, _service)){
-			rc = clnode->getStack()->send(_buffer, length);
-			if(rc != length){
-				LOGWRITE("\n%s   \x1b[0m\x1b[31merror:\x1b[0m\x1b[37m Can't Xmit to the Broker. errno=%d\n", currentDateTime(), rc == -1 ? errno : 0);
-				clnode->getStack()->disconnect();
-				clnode->disconnected();
-			}else{
-				_light->greenLight(true);
-			}
-		}else{
-			LOGWRITE("\n%s   \x1b[0m\x1b[31merror:\x1b[0m\x1b[37m Can't connect to the Broker.\n", currentDateTime());
-			clnode->getStack()->disconnect();
-			clnode->disconnected();
+		sendMessage(ev);
+		delete ev;
+	}
+}
+
+/*
+ *  Flush or discard the parked messages.
+ */
+void BrokerSendTask::connected(ClientNode* clnode){
+	Event* ev;
+	bool valid = clnode->getStack()->isValid();
+
+	clnode->setBrokerConnecting(false);
+	clnode->getStack()->clearOutput();
+	if(!valid){
+		clnode->disconnected();
+		if(_res->getAggregator()->isAggregateNode(clnode)){
+			_res->getAggregator()->connectFailed(clnode);
 		}
 	}
-	return rc;
+	while((ev = clnode->getParkedBrokerSendEvent())){
+		if(valid){
+			sendMessage(ev);
+		}
+		delete ev;
+	}
 }
 
-char*  BrokerSendTask::msgPrint(MQTTMessage* msg){
-	char* buf = _printBuf;
+void BrokerSendTask::sendMessage(Event* ev){
+	uint16_t length = 0;
+	ClientNode* clnode = ev->getClientNode();
+	MQTTMessage* srcMsg = clnode->getBrokerSendMessage();
+
+	METRIC_INC(MC_MQTT_OUT + (srcMsg->getType() >> 4));
 	_light->blueLight(true);
 
-	sprintf(buf, " %02X", *_buffer);
-	buf += 3;
+	if(srcMsg->getType() == MQTT_TYPE_PUBLISH){
+		/*------ header is encoded here, payload is sent from the MQTT-SN buffer without a copy ------*/
+		MQTTPublish* msg = static_cast<MQTTPublish*>(srcMsg);
+		struct iovec iov[2];
+		iov[0].iov_base = _buffer;
+		iov[0].iov_len = msg->serializeHeader(_buffer);
+		iov[1].iov_base = msg->getPayload();
+		iov[1].iov_len = msg->getPayloadLength();
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), BLUE_FORMAT, "PUBLISH", RIGHTARROW, GREEN_BROKER, _buffer, iov[0].iov_len, msg->getPayload(), msg->getPayloadLength());
+		send(clnode, iov, 2, msg->getPayloadBuffer());
+
+	}else if(srcMsg->getType() == MQTT_TYPE_PUBACK){
+		MQTTPubAck* msg = static_cast<MQTTPubAck*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), GREEN_FORMAT, "PUBACK", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		send(clnode, length);
+
+	}else if(srcMsg->getType() == MQTT_TYPE_PUBREL){
+		MQTTPubRel* msg = static_cast<MQTTPubRel*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), GREEN_FORMAT, "PUBREL", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		send(clnode, length);
+
+	}else if(srcMsg->getType() == MQTT_TYPE_PINGREQ){
+		MQTTPingReq* msg = static_cast<MQTTPingReq*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT, "PINGREQ", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		send(clnode, length);
+
+	}else if(srcMsg->getType() == MQTT_TYPE_SUBSCRIBE){
+		MQTTSubscribe* msg = static_cast<MQTTSubscribe*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT, "SUBSCRIBE", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		send(clnode, length);
 
-	for(int i = 0; i < msg->getRemainLength() + msg->getRemainLengthSize(); i++){
-		sprintf(buf, " %02X", *( _buffer + 1  + i));
-		buf += 3;
+	}else if(srcMsg->getType() == MQTT_TYPE_UNSUBSCRIBE){
+		MQTTUnsubscribe* msg = static_cast<MQTTUnsubscribe*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT, "UNSUBSCRIBE", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		send(clnode, length);
+
+	}else if(srcMsg->getType() == MQTT_TYPE_CONNECT){
+		MQTTConnect* msg = static_cast<MQTTConnect*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT, "CONNECT", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		clnode->connectSended();
+		send(clnode, length);
+
+	}else if(srcMsg->getType() == MQTT_TYPE_DISCONNECT){
+		MQTTDisconnect* msg = static_cast<MQTTDisconnect*>(srcMsg);
+		length = msg->serialize(_buffer);
+		LOGTRACE_CLIENT(clnode->getNodeId()->c_str(), FORMAT, "DISCONNECT", RIGHTARROW, GREEN_BROKER, _buffer, length);
+		send(clnode, length);
+		flush(clnode);
+
+		clnode->getStack()->disconnect();
+	}
+	if(ev->getTrace()->origin != TRACE_NONE){
+		SentTrace sent;
+		sent.trace = *ev->getTrace();
+		sent.clnode = clnode;
+		_sent.push_back(sent);
 	}
-	*buf = 0;
 	_light->blueLight(false);
-	return _printBuf;
 }
 
+
+int BrokerSendTask::send(ClientNode* clnode, int length){
+	struct iovec iov;
+	iov.iov_base = _buffer;
+	iov.iov_len = length;
+	return send(clnode, &iov, 1);
+}
+
+/*
+ *  Queues the packet, the connection is written at the end of the batch.
+ *  The last iov may be a part of shared, which is held until it is written.
+ */
+int BrokerSendTask::send(ClientNode* clnode, struct iovec* iov, int iovcnt, PacketBuffer* shared){
+	TLSStack* stack = clnode->getStack();
+
+	if(!stack->isValid()){
+		return -1;
+	}
+	bool idle = !stack->hasOutput();
+	if(!stack->queue(iov, iovcnt, shared)){
+		LOGWRITE("\n  \x1b[0m\x1b[31merror:\x1b[0m\x1b[37m Broker doesn't take data. Output buffer is full.\n");
+		stack->clearOutput();
+		stack->disconnect();
+		clnode->disconnected();
+		return -1;
+	}
+	int transport = (stack->isSecure() ? MT_TLS : MT_TCP);
+	METRIC_INC(MC_PACKETS_OUT + transport);
+	for(int i = 0; i < iovcnt; i++){
+		METRIC_ADD(MC_BYTES_OUT + transport, iov[i].iov_len);
+	}
+	if(idle){
+		_pending.push_back(clnode);    // otherwise it already waits for EPOLLOUT or is pending
+	}
+	return 0;
+}
+
+/*
+ *  Writes the output without blocking, the rest waits for the stack's event.
+ */
+void BrokerSendTask::flush(ClientNode* clnode){
+	TLSStack* stack = clnode->getStack();
+
+	if(!stack->isValid()){
+		stack->clearOutput();
+		return;
+	}
+	int rc = stack->flush();
+	if(rc < 0){
+		LOGWRITE("\n  \x1b[0m\x1b[31merror:\x1b[0m\x1b[37m Can't Xmit to the Broker. errno=%d\n", errno);
+		stack->clearOutput();
+		stack->disconnect();
+		clnode->disconnected();
+	}else{
+		stack->watchOutput(_epfd, rc > 0);
+		_light->greenLight(true);
+	}
+}
@@ -39,6 +39,15 @@
 #include "lib/ProcessFramework.h"
 #include "lib/Messages.h"
 #include "GatewayResourcesProvider.h"
+#include <vector>
+
+/*
+ *  Trace of a message queued in the batch, finished when the batch is written.
+ */
+struct SentTrace{
+	MessageTrace trace;
+	ClientNode*  clnode;
+};
 
 class BrokerSendTask : public Thread{
 	MAGIC_WORD_FOR_TASK;
@@ -48,15 +57,20 @@ public:
 	void run();
 
 private:
-	char* msgPrint(MQTTMessage* msg);
+	void  dispatch(Event* ev);
+	void  sendMessage(Event* ev);
 	int   send(ClientNode* clnode, int length);
+	int   send(ClientNode* clnode, struct iovec* iov, int iovcnt, PacketBuffer* shared = 0);
+	void  flush(ClientNode* clnode);
+	void  connected(ClientNode* clnode);
+	void  finishTraces(void);
 
 	GatewayResourcesProvider* _res;
-	char _printBuf[SOCKET_MAXBUFFER_LENGTH * 5];
 	uint8_t _buffer[SOCKET_MAXBUFFER_LENGTH];
-	const char* _host;
-	const char* _service;
 	LightIndicator* _light;
+	int _epfd;
+	vector<ClientNode*> _pending;    // connections with output queued in this batch
+	vector<SentTrace> _sent;         // traced messages queued in this batch
 };
 
 
@@ -50,9 +50,12 @@
 
 extern char* currentDateTime();
 
-ClientRecvTask::ClientRecvTask(GatewayResourcesProvider* res){
+ClientRecvTask::ClientRecvTask(GatewayResourcesProvider* res, int taskNo){
 	_res = res;
 	_res->attach(this);
+	_taskNo = taskNo;
+	_network = 0;
+	_secure = false;   // TCP
 }
 
 ClientRecvTask::~ClientRecvTask(){
@@ -64,7 +67,6 @@ ClientRecvTask::~ClientRecvTask(){
 void ClientRecvTask::run(){
 	NETWORK_CONFIG config;
 	char param[TOMYFRAME_PARAM_MAX];
-	bool secure = false;   // TCP
 
 #ifdef NETWORK_XBEE
 
@@ -100,11 +102,11 @@ void ClientRecvTask::run(){
 
 	if(_res->getParam("SecureConnection",param) == 0){
 		if(!strcasecmp(param, "YES")){
-			secure = true;  // TLS
+			_secure = true;  // TLS
 		}
 	}
 
-	_res->getClientList()->authorize(FILE_NAME_CLIENT_LIST, secure);
+	_res->getClientList()->authorize(FILE_NAME_CLIENT_LIST, _secure);
 	_network = new Network();
 
 #endif
@@ -119,7 +121,8 @@ void ClientRecvTask::run(){
 	if(_res->getParam("GatewayPortNo",param) == 0){
 		config.uPortNo = atoi(param);
 	}
-	_network = _res->getNetwork();
+	/* task 0 shares its socket with ClientSendTask, the others own a socket of the SO_REUSEPORT group */
+	_network = (_taskNo == 0 ? _res->getNetwork() : new Network());
 #endif
 
 #ifdef NETWORK_UDP6
@@ -132,172 +135,202 @@ void ClientRecvTask::run(){
 	if(_res->getParam("GatewayPortNo",param) == 0){
 		config.uPortNo = atoi(param);
 	}
-	_network = _res->getNetwork();
+	/* task 0 shares its socket with ClientSendTask, the others own a socket of the SO_REUSEPORT group */
+	_network = (_taskNo == 0 ? _res->getNetwork() : new Network());
 #endif
 
 #ifdef NETWORK_XXXXX
 	_network = _res->getNetwork();
 #endif
+#ifdef NW_REUSEPORT
+	if(_network->initialize(config, _taskNo, _res->getClientRecvTaskCount()) < 0){
+#else
 	if(_network->initialize(config) < 0){
+#endif
 		THROW_EXCEPTION(ExFatal, ERRNO_APL_01, "can't open the client port.");  // ABORT
 	}
 
-	while(true){
+#ifdef NW_RECV_BATCH
+	/*------ responses are reused, their buffers only replaced once a message holds them ------*/
+	NWResponse* resps[UDP_RECV_BATCH];
+	for(int i = 0; i < UDP_RECV_BATCH; i++){
+		resps[i] = new NWResponse();
+	}
 
+	while(true){
+		int cnt = _network->getResponses(resps, UDP_RECV_BATCH);
+		uint64_t now = metricsNow();
+		for(int i = 0; i < cnt; i++){
+			dispatch(resps[i], now);
+			resps[i]->recycle();
+		}
+	}
+#else
+	while(true){
 		NWResponse* resp = new NWResponse();
-		bool eventSetFlg = true;
-
 		if(_network->getResponse(resp)){
-			Event* ev = new Event();
-			#ifdef ADDRESS_64
-				ClientNode* clnode = _res->getClientList()->getClient(resp->getClientAddress64(),
-					                                              resp->getClientAddress16());
-			#endif
-			#ifdef ADDRESS_128
-				ClientNode* clnode = _res->getClientList()->getClient(resp->getClientAddress128(),
-					                                              resp->getClientAddress16());
-			#endif
-
-			if(!clnode){
-				if(resp->getMsgType() == MQTTSN_TYPE_CONNECT){
-
-				#ifdef NETWORK_XBEE
-					ClientNode* node = _res->getClientList()->createNode(secure, resp->getClientAddress64(),0);
-				#endif
-				#ifdef NETWORK_UDP
-					ClientNode* node = _res->getClientList()->createNode(secure, resp->getClientAddress64(),
-																	resp->getClientAddress16());
-				#endif
-				#ifdef NETWORK_UDP6
-					ClientNode* node = _res->getClientList()->createNode(secure, resp->getClientAddress128(),
-																	#ifdef SCOPE_ID
-																		resp->getClientScopeId(),
-																	#endif
-																	resp->getClientAddress16());
-				#endif
-				#ifdef NETWORK_XXXXX
-					ClientNode* node = _res->getClientList()->createNode(secure, resp->getClientAddress64(),
-																	resp->getClientAddress16());
-				#endif
-
-					if(!node){
-						delete ev;
-						LOGWRITE("Client is not authorized.\n");
-						continue;
-					}
-
-					MQTTSnConnect* msg = new MQTTSnConnect();
-					msg->absorb(resp);
-					node->setClientAddress16(resp->getClientAddress16());
-					if(msg->getClientId()->size() > 0){
-						node->setNodeId(msg->getClientId());
-					}
-					node->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(node);
-				}else if(resp->getMsgType() == MQTTSN_TYPE_SEARCHGW){
-					MQTTSnSearchGw* msg = new MQTTSnSearchGw();
-					msg->absorb(resp);
-					ev->setEvent(msg);
-
-				}else{
-					eventSetFlg = false;
-				}
-			}else{
-				if (resp->getMsgType() == MQTTSN_TYPE_CONNECT){
-					MQTTSnConnect* msg = new MQTTSnConnect();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					clnode->setClientAddress16(resp->getClientAddress16());
-					ev->setClientRecvEvent(clnode);
-
-				}else if(resp->getMsgType() == MQTTSN_TYPE_PUBLISH){
-					MQTTSnPublish* msg = new MQTTSnPublish();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if(resp->getMsgType() == MQTTSN_TYPE_PUBACK){
-					MQTTSnPubAck* msg = new MQTTSnPubAck();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if(resp->getMsgType() == MQTTSN_TYPE_PUBREL){
-					MQTTSnPubRel* msg = new MQTTSnPubRel();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_CONNECT){
-					MQTTSnConnect* msg = new MQTTSnConnect();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_PINGREQ){
-					MQTTSnPingReq* msg = new MQTTSnPingReq();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_DISCONNECT){
-					MQTTSnDisconnect* msg = new MQTTSnDisconnect();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_REGISTER){
-					MQTTSnRegister* msg = new MQTTSnRegister();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_REGACK){
-					MQTTSnRegAck* msg = new MQTTSnRegAck();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_UNSUBSCRIBE){
-					MQTTSnUnsubscribe* msg = new MQTTSnUnsubscribe();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_SUBSCRIBE){
-					MQTTSnSubscribe* msg = new MQTTSnSubscribe();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_WILLTOPIC){
-					MQTTSnWillTopic* msg = new MQTTSnWillTopic();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if (resp->getMsgType() == MQTTSN_TYPE_WILLMSG){
-					MQTTSnWillMsg* msg = new MQTTSnWillMsg();
-					msg->absorb(resp);
-					clnode->setClientRecvMessage(msg);
-					ev->setClientRecvEvent(clnode);
-
-				}else if(resp->getMsgType() == MQTTSN_TYPE_SEARCHGW){
-					MQTTSnSearchGw* msg = new MQTTSnSearchGw();
-					clnode->disconnected();
-					msg->absorb(resp);
-					ev->setEvent(msg);
-				}else{
-					eventSetFlg = false;
-				}
-			}
-			if(eventSetFlg){
-				_res->getGatewayEventQue()->post(ev);
-			}else{
+			dispatch(resp, metricsNow());
+		}
+		delete resp;
+	}
+#endif
+}
+
+/*
+ *  Converts a received frame into a message and posts its event to the ControlTask.
+ */
+void ClientRecvTask::dispatch(NWResponse* resp, uint64_t recvTime){
+	bool eventSetFlg = true;
+
+	METRIC_INC(MC_SN_IN + metricsSnIndex(resp->getMsgType()));
+	Event* ev = new Event();
+	traceStart(ev->getTrace(), TRACE_CLIENT, resp->getMsgType(), recvTime);
+	#ifdef ADDRESS_64
+		ClientNode* clnode = _res->getClientList()->getClient(resp->getClientAddress64(),
+			                                              resp->getClientAddress16());
+	#endif
+	#ifdef ADDRESS_128
+		ClientNode* clnode = _res->getClientList()->getClient(resp->getClientAddress128(),
+			                                              resp->getClientAddress16());
+	#endif
+
+	if(!clnode){
+		if(resp->getMsgType() == MQTTSN_TYPE_CONNECT){
+
+		#ifdef NETWORK_XBEE
+			ClientNode* node = _res->getClientList()->createNode(_secure, resp->getClientAddress64(),0);
+		#endif
+		#ifdef NETWORK_UDP
+			ClientNode* node = _res->getClientList()->createNode(_secure, resp->getClientAddress64(),
+															resp->getClientAddress16());
+		#endif
+		#ifdef NETWORK_UDP6
+			ClientNode* node = _res->getClientList()->createNode(_secure, resp->getClientAddress128(),
+															#ifdef SCOPE_ID
+																resp->getClientScopeId(),
+															#endif
+															resp->getClientAddress16());
+		#endif
+		#ifdef NETWORK_XXXXX
+			ClientNode* node = _res->getClientList()->createNode(_secure, resp->getClientAddress64(),
+															resp->getClientAddress16());
+		#endif
+
+			if(!node){
 				delete ev;
+				LOGWRITE("Client is not authorized.\n");
+				return;
 			}
+
+			MQTTSnConnect* msg = new MQTTSnConnect();
+			msg->absorb(resp);
+			_res->getClientList()->setClientAddress16(node, resp->getClientAddress16());
+			if(msg->getClientId()->size() > 0){
+				node->setNodeId(msg->getClientId());
+			}
+			node->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(node);
+		}else if(resp->getMsgType() == MQTTSN_TYPE_SEARCHGW){
+			MQTTSnSearchGw* msg = new MQTTSnSearchGw();
+			msg->absorb(resp);
+			ev->setEvent(msg);
+
+		}else{
+			eventSetFlg = false;
 		}
-		delete resp;
+	}else{
+		if (resp->getMsgType() == MQTTSN_TYPE_CONNECT){
+			MQTTSnConnect* msg = new MQTTSnConnect();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			_res->getClientList()->setClientAddress16(clnode, resp->getClientAddress16());
+			ev->setClientRecvEvent(clnode);
+
+		}else if(resp->getMsgType() == MQTTSN_TYPE_PUBLISH){
+			MQTTSnPublish* msg = new MQTTSnPublish();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if(resp->getMsgType() == MQTTSN_TYPE_PUBACK){
+			MQTTSnPubAck* msg = new MQTTSnPubAck();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if(resp->getMsgType() == MQTTSN_TYPE_PUBREL){
+			MQTTSnPubRel* msg = new MQTTSnPubRel();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_CONNECT){
+			MQTTSnConnect* msg = new MQTTSnConnect();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_PINGREQ){
+			MQTTSnPingReq* msg = new MQTTSnPingReq();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_DISCONNECT){
+			MQTTSnDisconnect* msg = new MQTTSnDisconnect();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_REGISTER){
+			MQTTSnRegister* msg = new MQTTSnRegister();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_REGACK){
+			MQTTSnRegAck* msg = new MQTTSnRegAck();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_UNSUBSCRIBE){
+			MQTTSnUnsubscribe* msg = new MQTTSnUnsubscribe();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_SUBSCRIBE){
+			MQTTSnSubscribe* msg = new MQTTSnSubscribe();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_WILLTOPIC){
+			MQTTSnWillTopic* msg = new MQTTSnWillTopic();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if (resp->getMsgType() == MQTTSN_TYPE_WILLMSG){
+			MQTTSnWillMsg* msg = new MQTTSnWillMsg();
+			msg->absorb(resp);
+			clnode->setClientRecvMessage(msg);
+			ev->setClientRecvEvent(clnode);
+
+		}else if(resp->getMsgType() == MQTTSN_TYPE_SEARCHGW){
+			MQTTSnSearchGw* msg = new MQTTSnSearchGw();
+			clnode->disconnected();
+			msg->absorb(resp);
+			ev->setEvent(msg);
+		}else{
+			eventSetFlg = false;
+		}
+	}
+	if(eventSetFlg){
+		_res->getGatewayEventQue(ev->getClientNode())->post(ev);
+	}else{
+		delete ev;
 	}
 }
 
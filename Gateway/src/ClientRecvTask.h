@@ -44,13 +44,17 @@
 class ClientRecvTask:public Thread{
 	MAGIC_WORD_FOR_TASK;
 public:
-	ClientRecvTask(GatewayResourcesProvider*);
+	ClientRecvTask(GatewayResourcesProvider*, int taskNo = 0);
 	~ClientRecvTask();
 	void run();
 
 private:
+	void dispatch(NWResponse* resp, uint64_t recvTime);
+
 	GatewayResourcesProvider* _res;
 	Network* _network;
+	int  _taskNo;
+	bool _secure;
 };
 
 
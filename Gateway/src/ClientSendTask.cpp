@@ -121,31 +121,79 @@ void ClientSendTask::run(){
 #endif
 
 
+	Event* evs[MAX_SEND_BATCH];
+
 	while(true){
-		Event* ev = _res->getClientSendQue()->wait();
-
-		if(ev->getEventType() == EtClientSend){
-			MQTTSnMessage msg = MQTTSnMessage();
-			ClientNode* clnode = ev->getClientNode();
-			msg.absorb( clnode->getClientSendMessage() );
-			#ifdef ADDRESS_64
-				_network->unicast(clnode->getAddress64Ptr(), clnode->getAddress16(),
-					msg.getMessagePtr(), msg.getMessageLength());
-			#endif
-			#ifdef ADDRESS_128
-				_network->unicast(clnode->getAddress128Ptr(),
-					#ifdef SCOPE_ID
-						clnode->getScopeId(),
-					#endif
-					clnode->getAddress16(),
-					msg.getMessagePtr(), msg.getMessageLength());
+		int cnt = _res->getClientSendQue()->drain(MAX_SEND_BATCH, evs, CLIENT_SEND_IDLE_MSEC);
+		int flushed = 0;
+
+		for(int i = 0; i < cnt; i++){
+			/*------ sent from the buffer of the queued message ------*/
+			if(evs[i]->getEventType() == EtClientSend){
+				if(evs[i]->isStale()){
+					continue;     // deleted by flush(), the client was erased
+				}
+				ClientNode* clnode = evs[i]->getClientNode();
+
+				/* The client's next message stays at the front of its queue until the staged one is deleted. */
+				for(int j = flushed; j < i; j++){
+					if(evs[j]->getEventType() == EtClientSend && evs[j]->getClientNode() == clnode){
+						flush(evs + flushed, i - flushed);
+						flushed = i;
+						break;
+					}
+				}
+				unicast(clnode, clnode->getClientSendMessage());
+			}else if(evs[i]->getEventType() == EtBroadcast){
+				MQTTSnMessage* msg = evs[i]->getMqttSnMessage();
+				METRIC_INC(MC_SN_OUT + metricsSnIndex(msg->getType()));
+				#ifdef NW_SEND_BATCH
+					_network->broadcastDeferred(msg->getMessagePtr(), msg->getMessageLength());
+				#else
+					_network->broadcast(msg->getMessagePtr(), msg->getMessageLength());
+				#endif
+			}
+		}
+		flush(evs + flushed, cnt - flushed);
+	}
+}
+
+void ClientSendTask::unicast(ClientNode* clnode, MQTTSnMessage* msg){
+	METRIC_INC(MC_SN_OUT + metricsSnIndex(msg->getType()));
+	#ifdef ADDRESS_64
+		#ifdef NW_SEND_BATCH
+			_network->unicastDeferred(clnode->getAddress64Ptr(), clnode->getAddress16(),
+				msg->getMessagePtr(), msg->getMessageLength());
+		#else
+			_network->unicast(clnode->getAddress64Ptr(), clnode->getAddress16(),
+				msg->getMessagePtr(), msg->getMessageLength());
+		#endif
+	#endif
+	#ifdef ADDRESS_128
+		_network->unicastDeferred(clnode->getAddress128Ptr(),
+			#ifdef SCOPE_ID
+				clnode->getScopeId(),
 			#endif
-		}else if(ev->getEventType() == EtBroadcast){
-			MQTTSnMessage msg = MQTTSnMessage();
-			msg.absorb( ev->getMqttSnMessage() );
-			_network->broadcast(msg.getMessagePtr(), msg.getMessageLength());
+			clnode->getAddress16(),
+			msg->getMessagePtr(), msg->getMessageLength());
+	#endif
+}
+
+/*
+ *  Hands the staged datagrams to the network, then finishes the traces
+ *  and deletes the events, which releases the messages they were sent from.
+ */
+void ClientSendTask::flush(Event** evs, int cnt){
+	#ifdef NW_SEND_BATCH
+		if(cnt > 0){
+			_network->flush();
 		}
-		delete ev;
+	#endif
+	uint64_t now = (cnt > 0 ? metricsNow() : 0);
+	for(int i = 0; i < cnt; i++){
+		ClientNode* clnode = evs[i]->getClientNode();
+		traceFinish(evs[i]->getTrace(), TRACE_CLIENT, now, (clnode ? clnode->getNodeId()->c_str() : ""));
+		delete evs[i];
 	}
 }
 
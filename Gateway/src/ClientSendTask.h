@@ -47,6 +47,9 @@ public:
 	void run();
 
 private:
+	void unicast(ClientNode* clnode, MQTTSnMessage* msg);
+	void flush(Event** evs, int cnt);
+
 	GatewayResourcesProvider* _res;
 	Network* _network;
 };
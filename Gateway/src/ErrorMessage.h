@@ -42,5 +42,11 @@
 #define ERRNO_APL_03  1003   // can't create a clientNode.
 #define ERRNO_APL_04  1004   // invalid GatewayId
 #define ERRNO_APL_05  1005   // KeepAliveTime is grater than 65536 Secs
+#define ERRNO_APL_06  1006   // invalid number of ControlTasks
+#define ERRNO_APL_07  1007   // invalid number of BrokerConnectTasks
+#define ERRNO_APL_08  1008   // invalid number of AggregatingConnections
+#define ERRNO_APL_09  1009   // invalid number of ClientRecvTasks
+#define ERRNO_APL_10  1010   // invalid LogLevel
+#define ERRNO_APL_11  1011   // invalid TraceSampling
 
 #endif /* ERRORMESSAGE_H_ */
@@ -44,23 +44,33 @@
 #include "lib/Messages.h"
 #include "ErrorMessage.h"
 
-extern char* currentDateTime();
 extern uint16_t getUint16(uint8_t* pos);
 extern void setUint32(uint8_t* pos, uint32_t val);
 
+/*=====================================
+        Class ControlTaskTimer
+ =====================================*/
+ControlTaskTimer::ControlTaskTimer(GatewayControlTask* task, void (GatewayControlTask::*handler)()){
+	_task = task;
+	_handler = handler;
+}
+
+void ControlTaskTimer::timeout(){
+	(_task->*_handler)();
+}
+
 /*=====================================
         Class GatewayControlTask
  =====================================*/
 
-GatewayControlTask::GatewayControlTask(GatewayResourcesProvider* res){
+GatewayControlTask::GatewayControlTask(GatewayResourcesProvider* res, int taskNo)
+	: _advertiseTimer(this, &GatewayControlTask::sendAdvertise),
+	  _unixTimeTimer(this, &GatewayControlTask::sendUnixTime){
 	_res = res;
 	_res->attach(this);
 	_eventQue = 0;
-	_protocol = MQTT_PROTOCOL_VER4;
-	_loginId = "";
-	_password = "";
-	_secure = false;
-	_stableNetwork = true;
+	_ctx = 0;
+	_taskNo = taskNo;
 }
 
 GatewayControlTask::~GatewayControlTask(){
@@ -69,196 +79,186 @@ GatewayControlTask::~GatewayControlTask(){
 
 
 void GatewayControlTask::run(){
-	Timer advertiseTimer;
-	Timer sendUnixTimer;
 	Event* ev = 0;
-	char param[TOMYFRAME_PARAM_MAX];
+	Event* evs[MAX_EVENT_BATCH];
 
-	if( _res->getParam("GatewayID", param) == 0){
-		_gatewayId = atoi(param);
-	}else{
-		_gatewayId = 0;
-	}
-	if (_gatewayId == 0 || _gatewayId > 255){
-		THROW_EXCEPTION(ExFatal, ERRNO_APL_04, "Invalid Gateway Id");  // ABORT
-	}
+	_ctx = _res->getGatewayContext();
+	_ctx->initialize(_res);
+	_eventQue = _res->getControlTaskEventQue(_taskNo);
 
-	int keepAlive = KEEP_ALIVE_TIME;
-	if( _res->getParam("KeepAlive", param) == 0){
-		keepAlive =atoi(param);
+	if(_taskNo == 0){
+		LOGWRITE("TomyGateway started. %s %s\n",GATEWAY_NETWORK,GATEWAY_VERSION);
+		_wheel.start(&_advertiseTimer, _ctx->getKeepAlive() * 1000UL);
 	}
-	if (keepAlive > 65536){
-			THROW_EXCEPTION(ExFatal, ERRNO_APL_05, "KeepAliveTime is grater than 65536 Secs");  // ABORT
-	}
-
-	if(_res->getParam("LoginID", param) == 0){
-		_loginId = strdup(param);
-	}
-	if(_res->getParam("Password", param) == 0){
-		_password = strdup(param);
-	}
-
-	if(_res->getParam("SecureConnection",param) == 0){
-		if(!strcasecmp(param, "YES")){
-			_secure = true;  // TLS
-		}
-	}
-	if(_res->getParam("NetworkIsStable",param) == 0){
-		if(!strcasecmp(param, "NO")){
-			_stableNetwork = false;
-		}
-	}
-
-	_eventQue = _res->getGatewayEventQue();
-
-	advertiseTimer.start(keepAlive * 1000UL);
-
-	LOGWRITE("%s TomyGateway started. %s %s\n", currentDateTime(),GATEWAY_NETWORK,GATEWAY_VERSION);
 
 
 	while(true){
 
-		ev = _eventQue->timedwait(TIMEOUT_PERIOD);
+		int cnt = _eventQue->drain(MAX_EVENT_BATCH, evs, _wheel.getWaitMsec());
 
-		/*------     Check Client is Lost    ---------*/
-		if(ev->getEventType() == EtTimeout){
-			ClientList* clist = _res->getClientList();
+		for(int n = 0; n < cnt; n++){
+			ev = evs[n];
+			if(ev->isStale()){
+				delete ev;
+				continue;
+			}
+			traceSetCurrent(ev->getTrace());    // inherited by the events the handler posts
+
+			/*------   Check  SEARCHGW & send GWINFO      ---------*/
+			if(ev->getEventType() == EtBroadcast){
+				MQTTSnMessage* msg = ev->getMqttSnMessage();
+				LOGTRACE(YELLOW_FORMAT2, "SERCHGW", LEFTARROW, CLIENT, msg->getBodyPtr(), msg->getBodyLength());
+
+				if(msg->getType() == MQTTSN_TYPE_SEARCHGW){
+					if(_res->getClientList()->getClientCount() <  MAX_CLIENT_NODES ){
+						MQTTSnGwInfo* gwinfo = new MQTTSnGwInfo();
+						gwinfo->setGwId(_ctx->getGatewayId());
+						Event* ev1 = new Event();
+						ev1->setEvent(gwinfo);
+						LOGTRACE(YELLOW_FORMAT1, "GWINFO", RIGHTARROW, CLIENT, gwinfo->getBodyPtr(), gwinfo->getBodyLength());
+
+						_res->getClientSendQue()->postDeferred(ev1);
+					}
+				}
 
-			for( int i = 0; i < clist->getClientCount(); i++){
-				if((*clist)[i]){
-					(*clist)[i]->checkTimeover();
+			}
+		
+			/*------   Message form Clients      ---------*/
+			else if(ev->getEventType() == EtClientRecv){
+
+				ClientNode* clnode = ev->getClientNode();
+				MQTTSnMessage* msg = clnode->getClientRecvMessage();
+
+				clnode->updateStatus(msg);
+
+				if(msg->getType() == MQTTSN_TYPE_PUBLISH){
+					handleSnPublish(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_SUBSCRIBE){
+					handleSnSubscribe(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_UNSUBSCRIBE){
+					handleSnUnsubscribe(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_PINGREQ){
+					handleSnPingReq(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_PUBACK){
+					handleSnPubAck(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_WILLTOPIC){
+					handleSnWillTopic(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_WILLMSG){
+					handleSnWillMsg(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_CONNECT) {
+					handleSnConnect(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_DISCONNECT){
+					handleSnDisconnect(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_REGISTER){
+					handleSnRegister(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_PUBREC){
+					handleSnPubRec(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_PUBREL){
+					handleSnPubRel(ev, clnode, msg);
+				}else if(msg->getType() == MQTTSN_TYPE_PUBCOMP){
+					handleSnPubComp(ev, clnode, msg);
 				}else{
-					break;
+					LOGWRITE("  Irregular ClientRecvMessage\n");
 				}
-			}
+				armLostTimer(clnode);
 
-			/*------ Check Keep Alive Timer & send Advertise ------*/
-			if(advertiseTimer.isTimeup()){
-				MQTTSnAdvertise* adv = new MQTTSnAdvertise();
-				adv->setGwId(_gatewayId);
-				adv->setDuration(keepAlive);
-				Event* ev1 = new Event();
-				ev1->setEvent(adv);  //broadcast
-				LOGWRITE(YELLOW_FORMAT2, currentDateTime(), "ADVERTISE", LEFTARROW, GATEWAY, msgPrint(adv));
+			}
+			/*------   Message form Broker      ---------*/
+			else if(ev->getEventType() == EtBrokerRecv){
 
-				_res->getClientSendQue()->post(ev1);
-				advertiseTimer.start(keepAlive * 1000UL);
-				sendUnixTimer.start(SEND_UNIXTIME_TIME * 1000UL);
+				ClientNode* clnode = ev->getClientNode();
+				MQTTMessage* msg = clnode->getBrokerRecvMessage();
+			
+				if(msg->getType() == MQTT_TYPE_PUBACK){
+					handlePuback(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_PINGRESP){
+					handlePingresp(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_SUBACK){
+					handleSuback(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_UNSUBACK){
+					handleUnsuback(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_CONNACK){
+					handleConnack(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_PUBLISH){
+					handlePublish(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_DISCONNECT){
+					handleDisconnect(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_PUBREC){
+					handlePubRec(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_PUBREL){
+					handlePubRel(ev, clnode, msg);
+				}else if(msg->getType() == MQTT_TYPE_PUBCOMP){
+					handlePubComp(ev, clnode, msg);
+				}else{
+					LOGWRITE("  Irregular BrokerRecvMessage\n");
+				}
+				armLostTimer(clnode);
 			}
 
-			/*------ Check Timer & send UixTime ------*/
-			if(sendUnixTimer.isTimeup()){
-				uint8_t buf[4];
-				uint32_t tm = time(0);
-				setUint32(buf,tm);
+			traceSetCurrent(0);
+			delete ev;
+		}
 
-				MQTTSnPublish* msg = new MQTTSnPublish();
+		/*------ Check Client is Lost, send ADVERTISE & UnixTime ------*/
+		_wheel.advance();
 
-				msg->setTopicId(MQTTSN_TOPICID_PREDEFINED_TIME);
-				msg->setTopicIdType(MQTTSN_TOPIC_TYPE_PREDEFINED);
-				msg->setData(buf, 4);
-				msg->setQos(0);
+		/*------ one wakeup per batch for the send tasks ------*/
+		_res->getClientSendQue()->flush();
+		_res->getBrokerSendQue()->flush();
+	}
+}
 
-				Event* ev1 = new Event();
-				ev1->setEvent(msg);
-				LOGWRITE(YELLOW_FORMAT2, currentDateTime(), "PUBLISH", LEFTARROW, GATEWAY, msgPrint(msg));
+/*
+ *  A client is checked when its keep alive would expire, not on every tick.
+ *  A lost or disconnected client is erased from ClientList after CLIENT_RECLAIM_TIME.
+ */
+void GatewayControlTask::armLostTimer(ClientNode* clnode){
+	ClientTimer* timer = clnode->getLostTimer();
 
-				_res->getClientSendQue()->post(ev1);
-				sendUnixTimer.stop();
-			}
+	if(clnode->isActive()){
+		if(!timer->isPending() || timer->isReclaiming()){
+			timer->setReclaiming(false);
+			_wheel.start(timer, clnode->getKeepAliveRemain());
 		}
+	}else if(clnode->isLost() || clnode->isDisconnect()){
+		if(!timer->isPending() || !timer->isReclaiming()){
+			timer->setReclaiming(true);
+			_wheel.start(timer, CLIENT_RECLAIM_TIME * 1000UL);
+		}
+	}
+}
 
-		/*------   Check  SEARCHGW & send GWINFO      ---------*/
-		else if(ev->getEventType() == EtBroadcast){
-			MQTTSnMessage* msg = ev->getMqttSnMessage();
-			LOGWRITE(YELLOW_FORMAT2, currentDateTime(), "SERCHGW", LEFTARROW, CLIENT, msgPrint(msg));
+void GatewayControlTask::sendAdvertise(){
+	MQTTSnAdvertise* adv = new MQTTSnAdvertise();
+	adv->setGwId(_ctx->getGatewayId());
+	adv->setDuration(_ctx->getKeepAlive());
+	Event* ev1 = new Event();
+	ev1->setEvent(adv);  //broadcast
+	LOGTRACE(YELLOW_FORMAT2, "ADVERTISE", LEFTARROW, GATEWAY, adv->getBodyPtr(), adv->getBodyLength());
 
-			if(msg->getType() == MQTTSN_TYPE_SEARCHGW){
-				if(_res->getClientList()->getClientCount() <  MAX_CLIENT_NODES ){
-					MQTTSnGwInfo* gwinfo = new MQTTSnGwInfo();
-					gwinfo->setGwId(_gatewayId);
-					Event* ev1 = new Event();
-					ev1->setEvent(gwinfo);
-					LOGWRITE(YELLOW_FORMAT1, currentDateTime(), "GWINFO", RIGHTARROW, CLIENT, msgPrint(gwinfo));
+	_res->getClientSendQue()->postDeferred(ev1);
 
-					_res->getClientSendQue()->post(ev1);
-				}
-			}
+	_advertiseTimer.restart(_ctx->getKeepAlive() * 1000UL);
+	_wheel.start(&_unixTimeTimer, SEND_UNIXTIME_TIME * 1000UL);
+}
 
-		}
-		
-		/*------   Message form Clients      ---------*/
-		else if(ev->getEventType() == EtClientRecv){
-
-			ClientNode* clnode = ev->getClientNode();
-			MQTTSnMessage* msg = clnode->getClientRecvMessage();
-
-			clnode->updateStatus(msg);
-
-			if(msg->getType() == MQTTSN_TYPE_PUBLISH){
-				handleSnPublish(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_SUBSCRIBE){
-				handleSnSubscribe(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_UNSUBSCRIBE){
-				handleSnUnsubscribe(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_PINGREQ){
-				handleSnPingReq(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_PUBACK){
-				handleSnPubAck(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_WILLTOPIC){
-				handleSnWillTopic(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_WILLMSG){
-				handleSnWillMsg(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_CONNECT) {
-				handleSnConnect(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_DISCONNECT){
-				handleSnDisconnect(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_REGISTER){
-				handleSnRegister(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_PUBREC){
-				handleSnPubRec(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_PUBREL){
-				handleSnPubRel(ev, clnode, msg);
-			}else if(msg->getType() == MQTTSN_TYPE_PUBCOMP){
-				handleSnPubComp(ev, clnode, msg);
-			}else{
-				LOGWRITE("%s   Irregular ClientRecvMessage\n", currentDateTime());
-			}
+void GatewayControlTask::sendUnixTime(){
+	uint8_t buf[4];
+	uint32_t tm = time(0);
+	setUint32(buf,tm);
 
-		}
-		/*------   Message form Broker      ---------*/
-		else if(ev->getEventType() == EtBrokerRecv){
+	MQTTSnPublish* msg = new MQTTSnPublish();
 
-			ClientNode* clnode = ev->getClientNode();
-			MQTTMessage* msg = clnode->getBrokerRecvMessage();
-			
-			if(msg->getType() == MQTT_TYPE_PUBACK){
-				handlePuback(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_PINGRESP){
-				handlePingresp(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_SUBACK){
-				handleSuback(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_UNSUBACK){
-				handleUnsuback(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_CONNACK){
-				handleConnack(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_PUBLISH){
-				handlePublish(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_DISCONNECT){
-				handleDisconnect(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_PUBREC){
-				handlePubRec(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_PUBREL){
-				handlePubRel(ev, clnode, msg);
-			}else if(msg->getType() == MQTT_TYPE_PUBCOMP){
-				handlePubComp(ev, clnode, msg);
-			}else{
-				LOGWRITE("%s   Irregular BrokerRecvMessage\n", currentDateTime());
-			}
-		}
+	msg->setTopicId(MQTTSN_TOPICID_PREDEFINED_TIME);
+	msg->setTopicIdType(MQTTSN_TOPIC_TYPE_PREDEFINED);
+	msg->setData(buf, 4);
+	msg->setQos(0);
 
-		delete ev;
-	}
+	Event* ev1 = new Event();
+	ev1->setEvent(msg);
+	LOGTRACE(YELLOW_FORMAT2, "PUBLISH", LEFTARROW, GATEWAY, msg->getBodyPtr(), msg->getBodyLength());
+
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 /*=======================================================
@@ -270,20 +270,19 @@ void GatewayControlTask::run(){
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnPublish(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(BLUE_FORMAT2, currentDateTime(), "PUBLISH", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(BLUE_FORMAT2, "PUBLISH", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
-	MQTTSnPublish* sPublish = new MQTTSnPublish();
-	MQTTPublish* mqMsg = new MQTTPublish();
-	sPublish->absorb(msg);
+	MQTTSnPublish* sPublish = static_cast<MQTTSnPublish*>(msg);    // ClientRecvTask made it
 
 	Topic* tp = clnode->getTopics()->getTopic(sPublish->getTopicId());
 
-	if(tp || ((sPublish->getFlags() && MQTTSN_TOPIC_TYPE) == MQTTSN_TOPIC_TYPE_SHORT)){
+	if(tp || ((sPublish->getFlags() & MQTTSN_TOPIC_TYPE) == MQTTSN_TOPIC_TYPE_SHORT)){
+		MQTTPublish* mqMsg = new MQTTPublish();
 		if(tp){
-			mqMsg->setTopic(tp->getTopicName());
+			mqMsg->transcode(sPublish, tp->getTopicName());
 		}else{
 			string str;
-			mqMsg->setTopic(sPublish->getTopic(&str));
+			mqMsg->transcode(sPublish, sPublish->getTopic(&str));
 		}
 		if(sPublish->getMsgId()){
 			MQTTSnPubAck* sPuback = new MQTTSnPubAck();
@@ -293,25 +292,12 @@ void GatewayControlTask::handleSnPublish(Event* ev, ClientNode* clnode, MQTTSnMe
 				delete clnode->getWaitedPubAck();
 			}
 			clnode->setWaitedPubAck(sPuback);
-
-			mqMsg->setMessageId(sPublish->getMsgId());
-		}
-
-		mqMsg->setQos(sPublish->getQos());
-
-		if(sPublish->getFlags() & MQTTSN_FLAG_DUP){
-			mqMsg->setDup();
-		}
-		if(sPublish->getFlags() & MQTTSN_FLAG_RETAIN){
-			mqMsg->setRetain();
 		}
 
-		mqMsg->setPayload(sPublish->getData() , sPublish->getDataLength());
-
 		clnode->setBrokerSendMessage(mqMsg);
 		Event* ev1 = new Event();
 		ev1->setBrokerSendEvent(clnode);
-		_res->getBrokerSendQue()->post(ev1);
+		_res->getBrokerSendQue()->postDeferred(ev1);
 
 	}else{
 		if(sPublish->getMsgId()){
@@ -324,19 +310,18 @@ void GatewayControlTask::handleSnPublish(Event* ev, ClientNode* clnode, MQTTSnMe
 
 			Event* ev1 = new Event();
 			ev1->setClientSendEvent(clnode);
-			LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(sPuback));
+			LOGTRACE(BLUE_FORMAT1, "PUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), sPuback->getBodyPtr(), sPuback->getBodyLength());
 
-			_res->getClientSendQue()->post(ev1);  // Send PubAck INVALID_TOPIC_ID
+			_res->getClientSendQue()->postDeferred(ev1);  // Send PubAck INVALID_TOPIC_ID
 		}
 	}
-	delete sPublish;
 }
 
 /*-------------------------------------------------------
                 Upstream MQTTSnSubscribe
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnSubscribe(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
-	LOGWRITE(FORMAT2, currentDateTime(), "SUBSCRIBE", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT2, "SUBSCRIBE", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnSubscribe* sSubscribe = new MQTTSnSubscribe();
 	MQTTSubscribe* subscribe = new MQTTSubscribe();
@@ -374,9 +359,9 @@ void GatewayControlTask::handleSnSubscribe(Event* ev, ClientNode* clnode, MQTTSn
 
 				Event* evsuback = new Event();
 				evsuback->setClientSendEvent(clnode);
-				LOGWRITE(FORMAT1, currentDateTime(), "SUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(sSuback));
+				LOGTRACE(FORMAT1, "SUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), sSuback->getBodyPtr(), sSuback->getBodyLength());
 
-				_res->getClientSendQue()->post(evsuback);
+				_res->getClientSendQue()->postDeferred(evsuback);
 			}
 
 			if(sSubscribe->getTopicId() == MQTTSN_TOPICID_PREDEFINED_TIME){
@@ -391,13 +376,13 @@ void GatewayControlTask::handleSnSubscribe(Event* ev, ClientNode* clnode, MQTTSn
 				setUint32(buf,tm);
 
 				pub->setData(buf, 4);
-				LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBLISH", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(pub));
+				LOGTRACE(GREEN_FORMAT1, "PUBLISH", RIGHTARROW, clnode->getNodeId()->c_str(), pub->getBodyPtr(), pub->getBodyLength());
 
 				clnode->setClientSendMessage(pub);
 
 				Event *evpub = new Event();
 				evpub->setClientSendEvent(clnode);
-				_res->getClientSendQue()->post(evpub);
+				_res->getClientSendQue()->postDeferred(evpub);
 			}
 			delete subscribe;
 		}else{
@@ -421,7 +406,7 @@ void GatewayControlTask::handleSnSubscribe(Event* ev, ClientNode* clnode, MQTTSn
 			clnode->setBrokerSendMessage(subscribe);
 			Event* ev1 = new Event();
 			ev1->setBrokerSendEvent(clnode);
-			_res->getBrokerSendQue()->post(ev1);
+			_res->getBrokerSendQue()->postDeferred(ev1);
 			delete sSubscribe;
 			return;
 		}
@@ -438,9 +423,9 @@ void GatewayControlTask::handleSnSubscribe(Event* ev, ClientNode* clnode, MQTTSn
 
 			Event* evun = new Event();
 			evun->setClientSendEvent(clnode);
-			LOGWRITE(FORMAT1, currentDateTime(), "SUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(sSuback));
+			LOGTRACE(FORMAT1, "SUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), sSuback->getBodyPtr(), sSuback->getBodyLength());
 
-			_res->getClientSendQue()->post(evun);  // Send SUBACK to Client
+			_res->getClientSendQue()->postDeferred(evun);  // Send SUBACK to Client
 		}
 		delete subscribe;
 	}
@@ -452,7 +437,7 @@ void GatewayControlTask::handleSnSubscribe(Event* ev, ClientNode* clnode, MQTTSn
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnUnsubscribe(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT2, currentDateTime(), "UNSUBSCRIBE", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT2, "UNSUBSCRIBE", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnUnsubscribe* sUnsubscribe = new MQTTSnUnsubscribe();
 	MQTTUnsubscribe* unsubscribe = new MQTTUnsubscribe();
@@ -478,7 +463,7 @@ void GatewayControlTask::handleSnUnsubscribe(Event* ev, ClientNode* clnode, MQTT
 
 		Event* ev1 = new Event();
 		ev1->setBrokerSendEvent(clnode);
-		_res->getBrokerSendQue()->post(ev1);    //  UNSUBSCRIBE to Broker
+		_res->getBrokerSendQue()->postDeferred(ev1);    //  UNSUBSCRIBE to Broker
 		delete sUnsubscribe;
 		return;
 	}
@@ -493,9 +478,9 @@ uslbl1:
 
 		Event* evun = new Event();
 		evun->setClientSendEvent(clnode);
-		LOGWRITE(FORMAT1, currentDateTime(), "UNSUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(sUnsuback));
+		LOGTRACE(FORMAT1, "UNSUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), sUnsuback->getBodyPtr(), sUnsuback->getBodyLength());
 
-		_res->getClientSendQue()->post(evun);  // Send UNSUBACK to Client
+		_res->getClientSendQue()->postDeferred(evun);  // Send UNSUBACK to Client
 	}
 
 	delete sUnsubscribe;
@@ -506,7 +491,7 @@ uslbl1:
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnPingReq(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT2, currentDateTime(), "PINGREQ", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT2, "PINGREQ", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTPingReq* pingReq = new MQTTPingReq();
 
@@ -514,7 +499,7 @@ void GatewayControlTask::handleSnPingReq(Event* ev, ClientNode* clnode, MQTTSnMe
 
 	Event* ev1 = new Event();
 	ev1->setBrokerSendEvent(clnode);
-	_res->getBrokerSendQue()->post(ev1);
+	_res->getBrokerSendQue()->postDeferred(ev1);
 }
 
 /*-------------------------------------------------------
@@ -522,7 +507,7 @@ void GatewayControlTask::handleSnPingReq(Event* ev, ClientNode* clnode, MQTTSnMe
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnPubAck(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBACK", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(GREEN_FORMAT1, "PUBACK", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnPubAck* sPubAck = new MQTTSnPubAck();
 	MQTTPubAck* pubAck = new MQTTPubAck();
@@ -533,7 +518,7 @@ void GatewayControlTask::handleSnPubAck(Event* ev, ClientNode* clnode, MQTTSnMes
 	clnode->setBrokerSendMessage(pubAck);
 	Event* ev1 = new Event();
 	ev1->setBrokerSendEvent(clnode);
-	_res->getBrokerSendQue()->post(ev1);
+	_res->getBrokerSendQue()->postDeferred(ev1);
 	delete sPubAck;
 }
 
@@ -542,7 +527,7 @@ void GatewayControlTask::handleSnPubAck(Event* ev, ClientNode* clnode, MQTTSnMes
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnPubRec(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBREC", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(GREEN_FORMAT1, "PUBREC", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnPubRec* sPubRec = new MQTTSnPubRec();
 	MQTTPubRec* pubRec = new MQTTPubRec();
@@ -553,7 +538,7 @@ void GatewayControlTask::handleSnPubRec(Event* ev, ClientNode* clnode, MQTTSnMes
 	clnode->setBrokerSendMessage(pubRec);
 	Event* ev1 = new Event();
 	ev1->setBrokerSendEvent(clnode);
-	_res->getBrokerSendQue()->post(ev1);
+	_res->getBrokerSendQue()->postDeferred(ev1);
 	delete sPubRec;
 }
 
@@ -562,7 +547,7 @@ void GatewayControlTask::handleSnPubRec(Event* ev, ClientNode* clnode, MQTTSnMes
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnPubRel(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBREL", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(GREEN_FORMAT1, "PUBREL", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnPubRel* sPubRel = new MQTTSnPubRel();
 	MQTTPubRel* pubRel = new MQTTPubRel();
@@ -573,7 +558,7 @@ void GatewayControlTask::handleSnPubRel(Event* ev, ClientNode* clnode, MQTTSnMes
 	clnode->setBrokerSendMessage(pubRel);
 	Event* ev1 = new Event();
 	ev1->setBrokerSendEvent(clnode);
-	_res->getBrokerSendQue()->post(ev1);
+	_res->getBrokerSendQue()->postDeferred(ev1);
 	delete sPubRel;
 }
 
@@ -582,7 +567,7 @@ void GatewayControlTask::handleSnPubRel(Event* ev, ClientNode* clnode, MQTTSnMes
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnPubComp(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBREL", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(GREEN_FORMAT1, "PUBREL", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnPubComp* sPubComp= new MQTTSnPubComp();
 	MQTTPubComp* pubComp = new MQTTPubComp();
@@ -593,7 +578,7 @@ void GatewayControlTask::handleSnPubComp(Event* ev, ClientNode* clnode, MQTTSnMe
 	clnode->setBrokerSendMessage(pubComp);
 	Event* ev1 = new Event();
 	ev1->setBrokerSendEvent(clnode);
-	_res->getBrokerSendQue()->post(ev1);
+	_res->getBrokerSendQue()->postDeferred(ev1);
 	delete sPubComp;
 }
 
@@ -602,7 +587,7 @@ void GatewayControlTask::handleSnPubComp(Event* ev, ClientNode* clnode, MQTTSnMe
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnConnect(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT2, currentDateTime(), "CONNECT", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT2, "CONNECT", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 	MQTTConnect* mqMsg = 0;
 	Topics* topics = clnode->getTopics();
 	MQTTSnConnect* sConnect = new MQTTSnConnect();
@@ -617,13 +602,13 @@ void GatewayControlTask::handleSnConnect(Event* ev, ClientNode* clnode, MQTTSnMe
 	if(clnode->isConnectSendable()){
 		mqMsg = new MQTTConnect();
 
-		mqMsg->setProtocol(_protocol);
+		mqMsg->setProtocol(_ctx->getProtocol());
 		mqMsg->setClientId(clnode->getNodeId());
 		mqMsg->setKeepAliveTime(sConnect->getDuration());
 
-		if(_loginId != "" && _password != ""){
-			mqMsg->setUserName(&_loginId);
-			mqMsg->setPassword(&_password);
+		if(*_ctx->getLoginId() != "" && *_ctx->getPassword() != ""){
+			mqMsg->setUserName(_ctx->getLoginId());
+			mqMsg->setPassword(_ctx->getPassword());
 		}
 		clnode->setConnectMessage(mqMsg);
 
@@ -643,11 +628,11 @@ void GatewayControlTask::handleSnConnect(Event* ev, ClientNode* clnode, MQTTSnMe
 
 		clnode->setClientSendMessage(reqTopic);
 		evwr->setClientSendEvent(clnode);
-		LOGWRITE(FORMAT1, currentDateTime(), "WILLTOPICREQ", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(reqTopic));
+		LOGTRACE(FORMAT1, "WILLTOPICREQ", RIGHTARROW, clnode->getNodeId()->c_str(), reqTopic->getBodyPtr(), reqTopic->getBodyLength());
 		if(!clnode->isConnectSendable()){
 			clnode->setConnAckSaveFlg();
 		}
-		_res->getClientSendQue()->post(evwr);  // Send WILLTOPICREQ to Client
+		_res->getClientSendQue()->postDeferred(evwr);  // Send WILLTOPICREQ to Client
 	}else{
 		if(clnode->isConnectSendable()){
 			clnode->setConnectMessage(0);
@@ -655,7 +640,7 @@ void GatewayControlTask::handleSnConnect(Event* ev, ClientNode* clnode, MQTTSnMe
 			clnode->connectQued();
 			clnode->setBrokerSendMessage(mqMsg);
 			ev1->setBrokerSendEvent(clnode);
-			_res->getBrokerSendQue()->post(ev1);
+			_res->getBrokerSendQue()->postDeferred(ev1);
 		}
 	}
 	delete sConnect;
@@ -666,7 +651,7 @@ void GatewayControlTask::handleSnConnect(Event* ev, ClientNode* clnode, MQTTSnMe
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnWillTopic(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT1, currentDateTime(), "WILLTOPIC", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT1, "WILLTOPIC", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnWillTopic* snMsg = new MQTTSnWillTopic();
 	MQTTSnWillMsgReq* reqMsg = new MQTTSnWillMsgReq();
@@ -680,9 +665,9 @@ void GatewayControlTask::handleSnWillTopic(Event* ev, ClientNode* clnode, MQTTSn
 	clnode->setClientSendMessage(reqMsg);
 	Event* evt = new Event();
 	evt->setClientSendEvent(clnode);
-	LOGWRITE(FORMAT1, currentDateTime(), "WILLMSGREQ", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(reqMsg));
+	LOGTRACE(FORMAT1, "WILLMSGREQ", RIGHTARROW, clnode->getNodeId()->c_str(), reqMsg->getBodyPtr(), reqMsg->getBodyLength());
 
-	_res->getClientSendQue()->post(evt);  // Send WILLMSGREQ to Client
+	_res->getClientSendQue()->postDeferred(evt);  // Send WILLMSGREQ to Client
 
 	delete snMsg;
 }
@@ -692,7 +677,7 @@ void GatewayControlTask::handleSnWillTopic(Event* ev, ClientNode* clnode, MQTTSn
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnWillMsg(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT1, currentDateTime(), "WILLMSG", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT1, "WILLMSG", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnWillMsg* snMsg = new MQTTSnWillMsg();
 	snMsg->absorb(msg);
@@ -705,11 +690,11 @@ void GatewayControlTask::handleSnWillMsg(Event* ev, ClientNode* clnode, MQTTSnMe
 
 		Event* ev1 = new Event();
 		ev1->setBrokerSendEvent(clnode);
-		_res->getBrokerSendQue()->post(ev1);
+		_res->getBrokerSendQue()->postDeferred(ev1);
 	}else{
 		MQTTSnConnack* connack = 0;
 
-		if(!_secure && _stableNetwork){
+		if(!_ctx->isSecure() && _ctx->isStableNetwork()){
 			connack = new MQTTSnConnack();
 			connack->setReturnCode(MQTTSN_RC_REJECTED_CONGESTION);
 			clnode->setClientSendMessage(connack);
@@ -717,17 +702,17 @@ void GatewayControlTask::handleSnWillMsg(Event* ev, ClientNode* clnode, MQTTSnMe
 			ev1->setClientSendEvent(clnode);
 			//clnode->connackSended(connack->getReturnCode());
 			clnode->disconnected();
-			LOGWRITE(FORMAT1, currentDateTime(), "*CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(connack));
-			_res->getClientSendQue()->post(ev1);
+			LOGTRACE(FORMAT1, "*CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), connack->getBodyPtr(), connack->getBodyLength());
+			_res->getClientSendQue()->postDeferred(ev1);
 		}else{
 			connack = clnode->checkGetConnAck();
 			if(connack != 0){
-				LOGWRITE(CYAN_FORMAT1, currentDateTime(), "CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(connack));
+				LOGTRACE(CYAN_FORMAT1, "CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), connack->getBodyPtr(), connack->getBodyLength());
 				Event* ev1 = new Event();
 				clnode->setClientSendMessage(connack);
 				clnode->connackSended(connack->getReturnCode());
 				ev1->setClientSendEvent(clnode);
-				_res->getClientSendQue()->post(ev1);
+				_res->getClientSendQue()->postDeferred(ev1);
 			}else if(clnode->isDisconnect() || clnode->isActive()){
 				connack = new MQTTSnConnack();
 				connack->setReturnCode(MQTTSN_RC_REJECTED_CONGESTION);
@@ -735,8 +720,8 @@ void GatewayControlTask::handleSnWillMsg(Event* ev, ClientNode* clnode, MQTTSnMe
 				Event* ev1 = new Event();
 				ev1->setClientSendEvent(clnode);
 				clnode->connackSended(connack->getReturnCode());
-				LOGWRITE(FORMAT1, currentDateTime(), "*CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(connack));
-				_res->getClientSendQue()->post(ev1);
+				LOGTRACE(FORMAT1, "*CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), connack->getBodyPtr(), connack->getBodyLength());
+				_res->getClientSendQue()->postDeferred(ev1);
 			}
 		}
 	}
@@ -748,7 +733,7 @@ void GatewayControlTask::handleSnWillMsg(Event* ev, ClientNode* clnode, MQTTSnMe
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnDisconnect(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT2, currentDateTime(), "DISCONNECT", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT2, "DISCONNECT", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnDisconnect* snMsg = new MQTTSnDisconnect();
 	MQTTDisconnect* mqMsg = new MQTTDisconnect();
@@ -758,7 +743,7 @@ void GatewayControlTask::handleSnDisconnect(Event* ev, ClientNode* clnode, MQTTS
 
 	Event* ev1 = new Event();
 	ev1->setBrokerSendEvent(clnode);
-	_res->getBrokerSendQue()->post(ev1);
+	_res->getBrokerSendQue()->postDeferred(ev1);
 
 	delete snMsg;
 }
@@ -769,7 +754,7 @@ void GatewayControlTask::handleSnDisconnect(Event* ev, ClientNode* clnode, MQTTS
  -------------------------------------------------------*/
 void GatewayControlTask::handleSnRegister(Event* ev, ClientNode* clnode, MQTTSnMessage* msg){
 
-	LOGWRITE(FORMAT2, currentDateTime(), "REGISTER", LEFTARROW, clnode->getNodeId()->c_str(), msgPrint(msg));
+	LOGTRACE(FORMAT2, "REGISTER", LEFTARROW, clnode->getNodeId()->c_str(), msg->getBodyPtr(), msg->getBodyLength());
 
 	MQTTSnRegister* snMsg = new MQTTSnRegister();
 	MQTTSnRegAck* respMsg = new MQTTSnRegAck();
@@ -786,9 +771,9 @@ void GatewayControlTask::handleSnRegister(Event* ev, ClientNode* clnode, MQTTSnM
 
 	Event* evrg = new Event();
 	evrg->setClientSendEvent(clnode);
-	LOGWRITE(FORMAT1, currentDateTime(), "REGACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(respMsg));
+	LOGTRACE(FORMAT1, "REGACK", RIGHTARROW, clnode->getNodeId()->c_str(), respMsg->getBodyPtr(), respMsg->getBodyLength());
 
-	_res->getClientSendQue()->post(evrg);
+	_res->getClientSendQue()->postDeferred(evrg);
 
 	delete snMsg;
 }
@@ -806,7 +791,7 @@ void GatewayControlTask::handlePuback(Event* ev, ClientNode* clnode, MQTTMessage
 	MQTTPubAck* mqMsg = static_cast<MQTTPubAck*>(msg);
 	MQTTSnPubAck* snMsg = clnode->getWaitedPubAck();
 
-	LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(BLUE_FORMAT1, "PUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 
 	if(snMsg){
 		if(snMsg->getMsgId() == mqMsg->getMessageId()){
@@ -814,7 +799,7 @@ void GatewayControlTask::handlePuback(Event* ev, ClientNode* clnode, MQTTMessage
 			clnode->setClientSendMessage(snMsg);
 			Event* ev1 = new Event();
 			ev1->setClientSendEvent(clnode);
-			_res->getClientSendQue()->post(ev1);
+			_res->getClientSendQue()->postDeferred(ev1);
 			return;
 		}
 	}
@@ -828,12 +813,12 @@ void GatewayControlTask::handlePubRec(Event* ev, ClientNode* clnode, MQTTMessage
 	MQTTSnPubRec* snMsg = new MQTTSnPubRec();
 	MQTTPubRec* mqMsg = static_cast<MQTTPubRec*>(msg);
 	snMsg->setMsgId(mqMsg->getMessageId());
-	LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBREC", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(BLUE_FORMAT1, "PUBREC", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 	clnode->setClientSendMessage(snMsg);
 
 	Event* ev1 = new Event();
 	ev1->setClientSendEvent(clnode);
-	_res->getClientSendQue()->post(ev1);
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 /*-------------------------------------------------------
@@ -843,12 +828,12 @@ void GatewayControlTask::handlePubRel(Event* ev, ClientNode* clnode, MQTTMessage
 	MQTTSnPubRel* snMsg = new MQTTSnPubRel();
 	MQTTPubRel* mqMsg = static_cast<MQTTPubRel*>(msg);
 	snMsg->setMsgId(mqMsg->getMessageId());
-	LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBREL", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(BLUE_FORMAT1, "PUBREL", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 	clnode->setClientSendMessage(snMsg);
 
 	Event* ev1 = new Event();
 	ev1->setClientSendEvent(clnode);
-	_res->getClientSendQue()->post(ev1);
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 /*-------------------------------------------------------
@@ -858,12 +843,12 @@ void GatewayControlTask::handlePubComp(Event* ev, ClientNode* clnode, MQTTMessag
 	MQTTSnPubComp* snMsg = new MQTTSnPubComp();
 	MQTTPubComp* mqMsg = static_cast<MQTTPubComp*>(msg);
 	snMsg->setMsgId(mqMsg->getMessageId());
-	LOGWRITE(BLUE_FORMAT1, currentDateTime(), "PUBCOMP", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(BLUE_FORMAT1, "PUBCOMP", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 	clnode->setClientSendMessage(snMsg);
 
 	Event* ev1 = new Event();
 	ev1->setClientSendEvent(clnode);
-	_res->getClientSendQue()->post(ev1);
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 
@@ -874,13 +859,13 @@ void GatewayControlTask::handlePingresp(Event* ev, ClientNode* clnode, MQTTMessa
 
 	MQTTSnPingResp* snMsg = new MQTTSnPingResp();
 	//MQTTPingResp* mqMsg = static_cast<MQTTPingResp*>(msg);
-	LOGWRITE(FORMAT1, currentDateTime(), "PINGRESP", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(FORMAT1, "PINGRESP", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 
 	clnode->setClientSendMessage(snMsg);
 
 	Event* ev1 = new Event();
 	ev1->setClientSendEvent(clnode);
-	_res->getClientSendQue()->post(ev1);
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 /*-------------------------------------------------------
@@ -899,13 +884,13 @@ void GatewayControlTask::handleSuback(Event* ev, ClientNode* clnode, MQTTMessage
 				snMsg->setReturnCode(MQTTSN_RC_ACCEPTED);
 				snMsg->setQos(mqMsg->getGrantedQos());
 			}
-			LOGWRITE(FORMAT1, currentDateTime(), "SUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+			LOGTRACE(FORMAT1, "SUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 
 			clnode->setClientSendMessage(snMsg);
 
 			Event* ev1 = new Event();
 			ev1->setClientSendEvent(clnode);
-			_res->getClientSendQue()->post(ev1);
+			_res->getClientSendQue()->postDeferred(ev1);
 		}
 	}
 }
@@ -919,13 +904,13 @@ void GatewayControlTask::handleUnsuback(Event* ev, ClientNode* clnode, MQTTMessa
 	MQTTSnUnsubAck* snMsg = new MQTTSnUnsubAck();
 
 	snMsg->setMsgId(mqMsg->getMessageId());
-	LOGWRITE(FORMAT1, currentDateTime(), "UNSUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(FORMAT1, "UNSUBACK", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 
 	clnode->setClientSendMessage(snMsg);
 
 	Event* ev1 = new Event();
 	ev1->setClientSendEvent(clnode);
-	_res->getClientSendQue()->post(ev1);
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 
@@ -941,28 +926,29 @@ void GatewayControlTask::handleConnack(Event* ev, ClientNode* clnode, MQTTMessag
 		snMsg->setReturnCode(MQTTSN_RC_ACCEPTED);
 	}else if(mqMsg->getReturnCd() == MQTT_RC_REFUSED_PROTOCOL_VERSION){
 		snMsg->setReturnCode(MQTTSN_RC_REJECTED_NOT_SUPPORTED);
-		_protocol = (_protocol == MQTT_PROTOCOL_VER4) ? MQTT_PROTOCOL_VER3 : MQTT_PROTOCOL_VER4;
+		_ctx->switchProtocol();
 	}else if(mqMsg->getReturnCd() == MQTT_RC_REFUSED_SERVER_UNAVAILABLE){
 		snMsg->setReturnCode(MQTTSN_RC_REJECTED_CONGESTION);
 	}else{
 		snMsg->setReturnCode(MQTTSN_RC_REJECTED_INVALID_TOPIC_ID);
 	}
 	if( clnode->checkConnAck(snMsg) == 0){
-		LOGWRITE(CYAN_FORMAT1, currentDateTime(), "CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+		LOGTRACE(CYAN_FORMAT1, "CONNACK", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 		clnode->connackSended(snMsg->getReturnCode());
 		clnode->setClientSendMessage(snMsg);
 		Event* ev1 = new Event();
 		ev1->setClientSendEvent(clnode);
-		_res->getClientSendQue()->post(ev1);
+		_res->getClientSendQue()->postDeferred(ev1);
 	}
 
 	// Send saved messages while sleeping
 	if(clnode->isActive()){
-		while(clnode->getClientSleepMessage()){
+		MQTTSnMessage* sleepMsg;
+		while((sleepMsg = clnode->takeClientSleepMessage())){
 			Event* ev1 = new Event();
-			clnode->setClientSendMessage(clnode->getClientSleepMessage());
+			clnode->setClientSendMessage(sleepMsg);
 			ev1->setClientSendEvent(clnode);
-			_res->getClientSendQue()->post(ev1);
+			_res->getClientSendQue()->postDeferred(ev1);
 		}
 	}
 }
@@ -974,11 +960,11 @@ void GatewayControlTask::handleDisconnect(Event* ev, ClientNode* clnode, MQTTMes
 	MQTTSnDisconnect* snMsg = new MQTTSnDisconnect();
 	//MQTTDisconnect* mqMsg = static_cast<MQTTDisconnect*>(msg);
 	clnode->setClientSendMessage(snMsg);
-	LOGWRITE(FORMAT1, currentDateTime(), "DISCONNECT", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+	LOGTRACE(FORMAT1, "DISCONNECT", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 
 	Event* ev1 = new Event();
 	ev1->setClientSendEvent(clnode);
-	_res->getClientSendQue()->post(ev1);
+	_res->getClientSendQue()->postDeferred(ev1);
 }
 
 /*-------------------------------------------------------
@@ -987,17 +973,23 @@ void GatewayControlTask::handleDisconnect(Event* ev, ClientNode* clnode, MQTTMes
 void GatewayControlTask::handlePublish(Event* ev, ClientNode* clnode, MQTTMessage* msg){
 
 	MQTTPublish* mqMsg = static_cast<MQTTPublish*>(msg);
+
+	if(mqMsg->getPayloadLength() > MQTTSN_MAX_PUBLISH_DATA){
+		LOGWRITE("PUBLISH of %u bytes exceeds the MQTT-SN message size, dropped.\n", mqMsg->getPayloadLength());
+		return;
+	}
 	MQTTSnPublish* snMsg = new MQTTSnPublish();
 
 	string* tp = mqMsg->getTopic();
 	uint16_t tpId;
+	uint8_t tpType;
 
 	if(tp->size() == 2){
-		tpId = getUint16((uint8_t*)tp);
-		snMsg->setFlags(MQTTSN_TOPIC_TYPE_SHORT);
+		tpId = getUint16((uint8_t*)tp->data());
+		tpType = MQTTSN_TOPIC_TYPE_SHORT;
 	}else{
 		tpId = clnode->getTopics()->getTopicId(tp);
-		snMsg->setFlags(MQTTSN_TOPIC_TYPE_NORMAL);
+		tpType = MQTTSN_TOPIC_TYPE_NORMAL;
 	}
 	if(tpId == 0){
 		/* ----- may be a publish message response of subscribed with '#' or '+' -----*/
@@ -1009,16 +1001,16 @@ void GatewayControlTask::handlePublish(Event* ev, ClientNode* clnode, MQTTMessag
 			regMsg->setTopicName(tp);
 			if(clnode->isSleep()){
 				clnode->setClientSleepMessage(regMsg);
-				LOGWRITE(FORMAT2, currentDateTime(), "REGISTER", RIGHTARROW, clnode->getNodeId()->c_str(), "is sleeping. Message was saved.");
+				LOGNOTE(FORMAT2, "REGISTER", RIGHTARROW, clnode->getNodeId()->c_str(), "is sleeping. Message was saved.");
 			}else if(clnode->isActive()){
-				LOGWRITE(FORMAT2, currentDateTime(), "REGISTER", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(regMsg));
+				LOGTRACE(FORMAT2, "REGISTER", RIGHTARROW, clnode->getNodeId()->c_str(), regMsg->getBodyPtr(), regMsg->getBodyLength());
 				if(clnode->isSleep()){
 					clnode->setClientSleepMessage(regMsg);
 				}
 				clnode->setClientSendMessage(regMsg);
 				Event* evrg = new Event();
 				evrg->setClientSendEvent(clnode);
-				_res->getClientSendQue()->post(evrg);   // Send Register first.
+				_res->getClientSendQue()->postDeferred(evrg);   // Send Register first.
 			}
 		}else{
 			LOGWRITE("GatewayControlTask Can't create Topic   %s\n", tp->c_str());
@@ -1026,22 +1018,11 @@ void GatewayControlTask::handlePublish(Event* ev, ClientNode* clnode, MQTTMessag
 		}
 	}
 
-	snMsg->setTopicId(tpId);
-	snMsg->setMsgId(mqMsg->getMessageId());
-	snMsg->setData(mqMsg->getPayload(),mqMsg->getPayloadLength());
-	snMsg->setQos(mqMsg->getQos());
-
-	if(mqMsg->isDup()){
-		snMsg->setDup();
-	}
-
-	if(mqMsg->isRetain()){
-		snMsg->setDup();
-	}
+	snMsg->transcode(mqMsg, tpId, tpType);
 
 	if(clnode->isSleep()){
 		clnode->setClientSleepMessage(snMsg);
-		LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBLISH", RIGHTARROW, clnode->getNodeId()->c_str(), "is sleeping. Message was saved.");
+		LOGNOTE(GREEN_FORMAT1, "PUBLISH", RIGHTARROW, clnode->getNodeId()->c_str(), "is sleeping. Message was saved.");
 		if(snMsg->getQos() == MQTTSN_FLAG_QOS_1){
 			snMsg->setQos(MQTTSN_FLAG_QOS_0);
 			snMsg->setMsgId(0);
@@ -1052,40 +1033,15 @@ void GatewayControlTask::handlePublish(Event* ev, ClientNode* clnode, MQTTMessag
 			clnode->setBrokerSendMessage(pubAck);
 			Event* ev1 = new Event();
 			ev1->setBrokerSendEvent(clnode);
-			_res->getBrokerSendQue()->post(ev1);
+			_res->getBrokerSendQue()->postDeferred(ev1);
 		}
 	}else if(clnode->isActive()){
 		clnode->setClientSendMessage(snMsg);
-		LOGWRITE(GREEN_FORMAT1, currentDateTime(), "PUBLISH", RIGHTARROW, clnode->getNodeId()->c_str(), msgPrint(snMsg));
+		LOGTRACE(GREEN_FORMAT1, "PUBLISH", RIGHTARROW, clnode->getNodeId()->c_str(), snMsg->getBodyPtr(), snMsg->getBodyLength());
 
 		Event* ev1 = new Event();
 		ev1->setClientSendEvent(clnode);
-		_res->getClientSendQue()->post(ev1);
-	}
-
-}
-
-char*  GatewayControlTask::msgPrint(MQTTSnMessage* msg){
-
-	char* buf = _printBuf;
-	for(int i = 0; i < msg->getBodyLength(); i++){
-		sprintf(buf," %02X", *(msg->getBodyPtr() + i));
-		buf += 3;
+		_res->getClientSendQue()->postDeferred(ev1);
 	}
-	*buf = 0;
-	return _printBuf;
-}
-
-char*  GatewayControlTask::msgPrint(MQTTMessage* msg){
-	uint8_t sbuf[512];
-	char* buf = _printBuf;
-	msg->serialize(sbuf);
 
-	for(int i = 0; i < msg->getRemainLength() + msg->getRemainLengthSize(); i++){
-		sprintf(buf, " %02X", *( sbuf + i));
-		buf += 3;
-	}
-	*buf = 0;
-	return _printBuf;
 }
-
@@ -38,28 +38,45 @@
 
 #include "lib/ZBStack.h"
 #include "lib/ProcessFramework.h"
+#include "lib/TimingWheel.h"
 #include "GatewayResourcesProvider.h"
 
+class GatewayControlTask;
+
+/*=====================================
+        Class ControlTaskTimer
+ =====================================*/
+class ControlTaskTimer : public WheelTimer{
+public:
+	ControlTaskTimer(GatewayControlTask* task, void (GatewayControlTask::*handler)());
+	void timeout();
+private:
+	GatewayControlTask* _task;
+	void (GatewayControlTask::*_handler)();
+};
+
 /*=====================================
         Class GatewayControlTask
  =====================================*/
 class GatewayControlTask : public Thread{
 	MAGIC_WORD_FOR_TASK;
 public:
-	GatewayControlTask(GatewayResourcesProvider* res);
+	GatewayControlTask(GatewayResourcesProvider* res, int taskNo = 0);
 	~GatewayControlTask();
 
 	void run();
 private:
+	void armLostTimer(ClientNode* clnode);
+	void sendAdvertise();
+	void sendUnixTime();
+
 	EventQue<Event>* _eventQue;
 	GatewayResourcesProvider* _res;
-	char _printBuf[512];
-	uint8_t _protocol;
-	uint8_t _gatewayId;
-	string _loginId;
-	string _password;
-	bool _secure;
-	bool _stableNetwork;
+	GatewayContext* _ctx;
+	int _taskNo;
+	TimingWheel _wheel;
+	ControlTaskTimer _advertiseTimer;
+	ControlTaskTimer _unixTimeTimer;
 
 	void handleClientMessage(Event*);
 	void handleBrokerMessage(Event*);
@@ -88,8 +105,6 @@ private:
 	void handlePubRec(Event* ev, ClientNode* clnode, MQTTMessage* msg);
 	void handlePubRel(Event* ev, ClientNode* clnode, MQTTMessage* msg);
 	void handlePubComp(Event* ev, ClientNode* clnode, MQTTMessage* msg);
-	char* msgPrint(MQTTSnMessage* msg);
-	char* msgPrint(MQTTMessage* msg);
 };
 
 #endif /* GATEWAYCONTROLTASK_H_ */
@@ -45,26 +45,27 @@
 #define LEFTARROW   "<---"
 #define RIGHTARROW  "--->"
 
-#define FORMAT      "%s   %-14s%-8s%-44s%s\n"
-#define FORMAT1     "%s   %-14s%-8s%-26s%s\n"
-#define FORMAT2     "\n%s   %-14s%-8s%-26s%s\n"
+/*  trace formats of LOGTRACE, the strings are in lib/LogRecord.h  */
+#define FORMAT           LOG_FMT_PLAIN
+#define FORMAT1          LOG_FMT_PLAIN1
+#define FORMAT2          LOG_FMT_PLAIN2
 
-#define RED_FORMAT1      "%s   \x1b[0m\x1b[31m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n"
-#define RED_FORMAT2    "\n%s   \x1b[0m\x1b[31m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+#define RED_FORMAT1      LOG_FMT_RED1
+#define RED_FORMAT2      LOG_FMT_RED2
 
-#define GREEN_FORMAT     "%s   \x1b[0m\x1b[32m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n"
-#define GREEN_FORMAT1    "%s   \x1b[0m\x1b[32m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
-#define GREEN_FORMAT2  "\n%s   \x1b[0m\x1b[32m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+#define GREEN_FORMAT     LOG_FMT_GREEN
+#define GREEN_FORMAT1    LOG_FMT_GREEN1
+#define GREEN_FORMAT2    LOG_FMT_GREEN2
 
-#define YELLOW_FORMAT1   "%s   \x1b[0m\x1b[33m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
-#define YELLOW_FORMAT2 "\n%s   \x1b[0m\x1b[33m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+#define YELLOW_FORMAT1   LOG_FMT_YELLOW1
+#define YELLOW_FORMAT2   LOG_FMT_YELLOW2
 
-#define BLUE_FORMAT      "%s   \x1b[0m\x1b[34m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n"
-#define BLUE_FORMAT1     "%s   \x1b[0m\x1b[34m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
-#define BLUE_FORMAT2   "\n%s   \x1b[0m\x1b[34m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+#define BLUE_FORMAT      LOG_FMT_BLUE
+#define BLUE_FORMAT1     LOG_FMT_BLUE1
+#define BLUE_FORMAT2     LOG_FMT_BLUE2
 
-#define CYAN_FORMAT1     "%s   \x1b[0m\x1b[36m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
-#define SYAN_FORMAT2   "\n%s   \x1b[0m\x1b[36m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+#define CYAN_FORMAT1     LOG_FMT_CYAN1
+#define SYAN_FORMAT2     LOG_FMT_CYAN2
 
 /*===========================================
  *   Gateway Control Constants
@@ -78,11 +79,26 @@
 
 #define TIMEOUT_PERIOD     10    //  10 sec = 10 sec
 
+#define MAX_EVENT_BATCH    64    // events drained per GatewayControlTask and BrokerSendTask loop
+#define MAX_SEND_BATCH     32    // events drained per ClientSendTask loop
+#define CLIENT_SEND_IDLE_MSEC 1000    // ClientSendTask wakes up while idle
+
+#define MAX_CONTROL_TASKS   8    // upper limit of ControlTasks in param.conf
+#define MAX_CLIENT_RECV_TASKS 8    // upper limit of ClientRecvTasks in param.conf
+#define MAX_BROKER_CONNECT_TASKS 8    // upper limit of BrokerConnectTasks in param.conf
+#define MAX_AGGREGATE_CONNECTIONS 8   // upper limit of AggregatingConnections in param.conf
+
+#define BROKER_POLL_EVENTS 64    // epoll events handled per BrokerRecvTask loop
+
 #define SEND_UNIXTIME_TIME 30    // 30sec after KEEP_ALIVE_TIME
 
 
 
-#define MAX_CLIENT_NODES  500
+#define MAX_CLIENT_NODES  262144  // multiple of CLIENT_SLOT_CHUNK
+#define CLIENT_SLOT_CHUNK 1024    // slots of ClientList allocated at once
+#define CLIENT_HASH_SIZE  1024    // initial buckets of ClientList, doubled as clients grow
+#define CLIENT_RECLAIM_TIME 900  // sec a lost or disconnected client keeps its slot and session
+#define MESSAGEQUE_SIZE     16    // ring of a ClientNode's MessageQue, power of 2
 
 /*==========================================================
  *           Light Indicators
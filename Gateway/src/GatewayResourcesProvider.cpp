@@ -33,11 +33,16 @@
  *     Version: 0.0.0
  */
 #include "GatewayResourcesProvider.h"
+#include "GatewayControlTask.h"
+#include "ClientRecvTask.h"
+#include "BrokerConnectTask.h"
+#include "Aggregator.h"
 #include "GatewayDefines.h"
 #include "lib/ProcessFramework.h"
 #include "ErrorMessage.h"
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
 
@@ -48,8 +53,8 @@
 using namespace std;
 
 extern Process* theProcess;
-extern char* currentDateTime();
 extern void setUint32(uint8_t* pos, uint32_t val);
+extern uint32_t getUint32(uint8_t* pos);
 
 extern "C"{
 	int wiringPiSetup(void);
@@ -65,18 +70,124 @@ GatewayResourcesProvider* theGatewayResources = 0;
 GatewayResourcesProvider::GatewayResourcesProvider(): MultiTaskProcess(){
 	theMultiTask = this;
 	theProcess = this;
-	resetRingBuffer();
+	_controlTaskCnt = 1;
+	_clientRecvTaskCnt = 1;
+	_brokerConnectTaskCnt = 1;
+	_aggregator = new Aggregator();
 	_lightIndicator.greenLight(false);
+
+	for(int i = 0; i < MAX_CONTROL_TASKS; i++){
+		_gatewayEventQue[i].setMetrics(MQ_GATEWAY);
+	}
+	_clientSendQue.setMetrics(MQ_CLIENT_SEND);
+	_brokerSendQue.setMetrics(MQ_BROKER_SEND);
+	for(int i = 0; i < MAX_BROKER_CONNECT_TASKS; i++){
+		_brokerConnectQue[i].setMetrics(MQ_BROKER_CONNECT);
+	}
 }
 
 GatewayResourcesProvider::~GatewayResourcesProvider(){
-	LOGWRITE("%s TomyGateway stop\n", currentDateTime());
+	LOGWRITE("TomyGateway stop\n");
 	_lightIndicator.greenLight(false);
 	_lightIndicator.redLightOff();
+	delete _aggregator;
+}
+
+void GatewayResourcesProvider::run(){
+	char param[TOMYFRAME_PARAM_MAX];
+
+	if(getParam("ControlTasks", param) == 0){
+		_controlTaskCnt = atoi(param);
+	}
+	if(_controlTaskCnt < 1 || _controlTaskCnt > MAX_CONTROL_TASKS){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_06, "Invalid ControlTasks");  // ABORT
+	}
+
+	if(getParam("ClientRecvTasks", param) == 0){
+		_clientRecvTaskCnt = atoi(param);
+	}
+	if(_clientRecvTaskCnt < 1 || _clientRecvTaskCnt > MAX_CLIENT_RECV_TASKS){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_09, "Invalid ClientRecvTasks");  // ABORT
+	}
+#ifndef NW_REUSEPORT
+	if(_clientRecvTaskCnt > 1){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_09, "ClientRecvTasks needs UDP or UDP6");  // ABORT
+	}
+#endif
+
+	if(getParam("BrokerConnectTasks", param) == 0){
+		_brokerConnectTaskCnt = atoi(param);
+	}
+	if(_brokerConnectTaskCnt < 1 || _brokerConnectTaskCnt > MAX_BROKER_CONNECT_TASKS){
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_07, "Invalid BrokerConnectTasks");  // ABORT
+	}
+
+	if(getParam("LogLevel", param) == 0){
+		if(!strcasecmp(param, "NONE")){
+			setLogLevel(LOG_LEVEL_NONE);
+		}else if(!strcasecmp(param, "INFO")){
+			setLogLevel(LOG_LEVEL_INFO);
+		}else if(!strcasecmp(param, "TRACE")){
+			setLogLevel(LOG_LEVEL_TRACE);
+		}else{
+			THROW_EXCEPTION(ExFatal, ERRNO_APL_10, "Invalid LogLevel");  // ABORT
+		}
+	}
+	if(getParam("TraceSampling", param) == 0){
+		if(atoi(param) < 0){
+			THROW_EXCEPTION(ExFatal, ERRNO_APL_11, "Invalid TraceSampling");  // ABORT
+		}
+		traceSetSampling(atoi(param));
+	}
+
+	_aggregator->initialize(this);
+
+	/*  first tasks are created by the application, the others are attached here  */
+	for(int i = 1; i < _controlTaskCnt; i++){
+		new GatewayControlTask(this, i);
+	}
+	for(int i = 1; i < _clientRecvTaskCnt; i++){
+		new ClientRecvTask(this, i);
+	}
+	for(int i = 1; i < _brokerConnectTaskCnt; i++){
+		new BrokerConnectTask(this, i);
+	}
+	MultiTaskProcess::run();
+}
+
+/*
+ *  All events of a client go to the same control task, which keeps
+ *  the per-client order. Events without a client go to task 0.
+ */
+int GatewayResourcesProvider::getControlTaskNo(ClientNode* clnode){
+	if(clnode == 0 || _controlTaskCnt == 1){
+		return 0;
+	}
+	return (int)((uint32_t)clnode->getSlotNo() % _controlTaskCnt);
+}
+
+int GatewayResourcesProvider::getControlTaskCount(){
+	return _controlTaskCnt;
+}
+
+int GatewayResourcesProvider::getClientRecvTaskCount(){
+	return _clientRecvTaskCnt;
+}
+
+EventQue<Event>* GatewayResourcesProvider::getGatewayEventQue(ClientNode* clnode){
+	return &_gatewayEventQue[getControlTaskNo(clnode)];
+}
+
+EventQue<Event>* GatewayResourcesProvider::getControlTaskEventQue(int taskNo){
+	return &_gatewayEventQue[taskNo];
 }
 
-EventQue<Event>* GatewayResourcesProvider::getGatewayEventQue(){
-	return &_gatewayEventQue;
+Aggregator* GatewayResourcesProvider::getAggregator(){
+	return _aggregator;
+}
+
+GatewayContext* GatewayResourcesProvider::getGatewayContext(){
+	return &_gatewayContext;
 }
 
 EventQue<Event>* GatewayResourcesProvider::getClientSendQue(){
@@ -87,6 +198,18 @@ EventQue<Event>* GatewayResourcesProvider::getBrokerSendQue(){
 	return &_brokerSendQue;
 }
 
+/*
+ *  EventQue has a single consumer, each BrokerConnectTask has its own
+ *  queue, clients are sharded by slot as in getControlTaskNo().
+ */
+EventQue<Event>* GatewayResourcesProvider::getBrokerConnectQue(ClientNode* clnode){
+	return &_brokerConnectQue[clnode->getSlotNo() % _brokerConnectTaskCnt];
+}
+
+EventQue<Event>* GatewayResourcesProvider::getBrokerConnectTaskQue(int taskNo){
+	return &_brokerConnectQue[taskNo];
+}
+
 ClientList* GatewayResourcesProvider::getClientList(){
 	return &_clientList;
 }
@@ -99,14 +222,180 @@ LightIndicator* GatewayResourcesProvider::getLightIndicator(){
 	return &_lightIndicator;
 }
 
+/*=====================================
+        Class GatewayContext
+ =====================================*/
+GatewayContext::GatewayContext(){
+	_initialized = false;
+	_protocol = MQTT_PROTOCOL_VER4;
+	_gatewayId = 0;
+	_keepAlive = KEEP_ALIVE_TIME;
+	_loginId = "";
+	_password = "";
+	_secure = false;
+	_stableNetwork = true;
+}
+
+GatewayContext::~GatewayContext(){
+
+}
+
+/*
+ *  Called by every control task, parameters are read only once.
+ */
+void GatewayContext::initialize(GatewayResourcesProvider* res){
+	char param[TOMYFRAME_PARAM_MAX];
+
+	_mutex.lock();
+	if(_initialized){
+		_mutex.unlock();
+		return;
+	}
+
+	int gatewayId = 0;
+	if( res->getParam("GatewayID", param) == 0){
+		gatewayId = atoi(param);
+	}
+	if (gatewayId == 0 || gatewayId > 255){
+		_mutex.unlock();
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_04, "Invalid Gateway Id");  // ABORT
+	}
+	_gatewayId = gatewayId;
+
+	int keepAlive = KEEP_ALIVE_TIME;
+	if( res->getParam("KeepAlive", param) == 0){
+		keepAlive =atoi(param);
+	}
+	if (keepAlive > 65536){
+		_mutex.unlock();
+		THROW_EXCEPTION(ExFatal, ERRNO_APL_05, "KeepAliveTime is grater than 65536 Secs");  // ABORT
+	}
+	_keepAlive = keepAlive;
+
+	if(res->getParam("LoginID", param) == 0){
+		_loginId = param;
+	}
+	if(res->getParam("Password", param) == 0){
+		_password = param;
+	}
+	if(res->getParam("SecureConnection",param) == 0){
+		if(!strcasecmp(param, "YES")){
+			_secure = true;  // TLS
+		}
+	}
+	if(res->getParam("NetworkIsStable",param) == 0){
+		if(!strcasecmp(param, "NO")){
+			_stableNetwork = false;
+		}
+	}
+
+	_initialized = true;
+	_mutex.unlock();
+}
+
+uint8_t GatewayContext::getGatewayId(){
+	return _gatewayId;
+}
+
+uint32_t GatewayContext::getKeepAlive(){
+	return _keepAlive;
+}
+
+string* GatewayContext::getLoginId(){
+	return &_loginId;
+}
+
+string* GatewayContext::getPassword(){
+	return &_password;
+}
+
+bool GatewayContext::isSecure(){
+	return _secure;
+}
+
+bool GatewayContext::isStableNetwork(){
+	return _stableNetwork;
+}
+
+uint8_t GatewayContext::getProtocol(){
+	return __atomic_load_n(&_protocol, __ATOMIC_RELAXED);
+}
+
+/*
+ *  Broker refused the protocol version, try the other one.
+ */
+void GatewayContext::switchProtocol(){
+	uint8_t protocol = getProtocol();
+	uint8_t next;
+	do{
+		next = (protocol == MQTT_PROTOCOL_VER4) ? MQTT_PROTOCOL_VER3 : MQTT_PROTOCOL_VER4;
+	}while(!__atomic_compare_exchange_n(&_protocol, &protocol, next, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*=====================================
+        Class ClientTimer
+ =====================================*/
+ClientTimer::ClientTimer(){
+	_clnode = 0;
+	_clientList = 0;
+	_reclaiming = false;
+}
+
+void ClientTimer::setClientNode(ClientNode* clnode){
+	_clnode = clnode;
+}
+
+void ClientTimer::setClientList(ClientList* list){
+	_clientList = list;
+}
+
+void ClientTimer::setReclaiming(bool reclaiming){
+	_reclaiming = reclaiming;
+}
+
+bool ClientTimer::isReclaiming(){
+	return _reclaiming;
+}
+
+/*
+ *  Keep alive is restarted by every message of the client without touching
+ *  the wheel, the timer is re-armed lazily for the time left.
+ *  A lost client keeps its node for CLIENT_RECLAIM_TIME, then the slot is freed.
+ */
+void ClientTimer::timeout(){
+	if(_reclaiming){
+		if(_clnode->isLost() || _clnode->isDisconnect()){
+			#ifdef ADDRESS_64
+				if(_clientList->isAuthorized()){
+					return;       // nodes of the authorized clients are kept
+				}
+			#endif
+			_clientList->erase(_clnode);
+		}
+		return;
+	}
+	uint32_t remain = _clnode->checkTimeover();
+	if(remain){
+		restart(remain);
+	}else if(_clnode->isLost()){
+		_reclaiming = true;
+		restart(CLIENT_RECLAIM_TIME * 1000UL);
+	}
+}
+
 /*=====================================
         Class Client
  =====================================*/
 ClientNode::ClientNode(){
-	ClientNode(false);
+	initialize(false);
 }
 
 ClientNode::ClientNode(bool secure){
+	initialize(secure);
+}
+
+void ClientNode::initialize(bool secure){
 	_msgId = 0;
 	_snMsgId = 0;
 	_status = Cstat_Disconnected;
@@ -131,12 +420,94 @@ ClientNode::ClientNode(bool secure){
 	}else{
 		_stack = new TLSStack(false);
 	}
+	_clientRecvMessageQue.setOverflow(MqWait);    // back pressure on ClientRecvTask
+	_brokerConnecting = false;
+	_lostTimer.setClientNode(this);
+	_hashNext = 0;
+	_slot = 0;
+	_generation = 1;     // a handle is never 0
+	_nextFree = 0;
+	_inUse = false;
+	_indexed = false;
 	_connAckSaveFlg = false;
 	_connAck = 0;
 	_waitWillMsgFlg = false;
 }
 
+/*
+ *  A pooled node is reused by ClientList for a new client.
+ *  Queues, Topics and the stack are kept, their contents are cleared.
+ *  The lost timer is not pending, the node was erased at its timeout.
+ */
+void ClientNode::reset(bool secure){
+	_brokerSendMessageQue.clear();
+	_brokerRecvMessageQue.clear();
+	_clientSendMessageQue.clear();
+	_clientRecvMessageQue.clear();
+	_clientSleepMessageQue.clear();
+	while(!_parkedEventQue.empty()){
+		delete _parkedEventQue.front();     // stale, the messages are not touched
+		_parkedEventQue.pop();
+	}
+	if(_mqttConnect){
+		delete _mqttConnect;
+		_mqttConnect = 0;
+	}
+	if(_waitedPubAck){
+		delete _waitedPubAck;
+		_waitedPubAck = 0;
+	}
+	if(_waitedSubAck){
+		delete _waitedSubAck;
+		_waitedSubAck = 0;
+	}
+	if(_connAck){
+		delete _connAck;
+		_connAck = 0;
+	}
+	delete _topics;
+	_topics = new Topics();
+
+	if(_stack->isSecure() != secure){
+		delete _stack;
+		_stack = new TLSStack(secure);
+	}else{
+		_stack->clearOutput();
+		_stack->close();
+	}
+
+	_msgId = 0;
+	_snMsgId = 0;
+	_status = Cstat_Disconnected;
+	_keepAliveMsec = 0;
+	_lostTimer.setReclaiming(false);
+	#ifdef ADDRESS_64
+		_address64 = NWAddress64();
+	#endif
+	#ifdef ADDRESS_128
+		_address128 = NWAddress128();
+	#endif
+	_nodeId = "";
+	_address16 = 0;
+	_brokerConnecting = false;
+	_hashNext = 0;
+	_connAckSaveFlg = false;
+	_waitWillMsgFlg = false;
+}
+
+uint32_t ClientNode::getSlotNo(){
+	return _slot;
+}
+
+ClientHandle ClientNode::getHandle(){
+	return ((ClientHandle)__atomic_load_n(&_generation, __ATOMIC_ACQUIRE) << 32) | _slot;
+}
+
 ClientNode::~ClientNode(){
+	while(!_parkedEventQue.empty()){
+		delete _parkedEventQue.front();
+		_parkedEventQue.pop();
+	}
 	delete _topics;
 	if(_mqttConnect){
 		delete _mqttConnect;
@@ -201,6 +572,10 @@ MQTTSnMessage* ClientNode::getClientSleepMessage(){
 	return _clientSleepMessageQue.getMessage();
 }
 
+MQTTSnMessage* ClientNode::takeClientSleepMessage(){
+	return _clientSleepMessageQue.take();
+}
+
 MQTTSnMessage* ClientNode::getClientRecvMessage(){
 	return _clientRecvMessageQue.getMessage();
 }
@@ -242,11 +617,56 @@ void ClientNode::setConnectMessage(MQTTConnect* msg){
 }
 
 
-void ClientNode::checkTimeover(){
-	if(_status == Cstat_Active && _keepAliveTimer.isTimeup()){
-		_status = Cstat_Lost;
+void ClientNode::parkBrokerSendEvent(Event* ev){
+	_parkedEventQue.push(ev);
+}
+
+Event* ClientNode::getParkedBrokerSendEvent(){
+	if(_parkedEventQue.empty()){
+		return 0;
+	}
+	Event* ev = _parkedEventQue.front();
+	_parkedEventQue.pop();
+	return ev;
+}
+
+bool ClientNode::isBrokerConnecting(){
+	return _brokerConnecting;
+}
+
+void ClientNode::setBrokerConnecting(bool connecting){
+	_brokerConnecting = connecting;
+}
+
+ClientNode* ClientNode::getHashNext(){
+	return _hashNext;
+}
+
+void ClientNode::setHashNext(ClientNode* next){
+	_hashNext = next;
+}
+
+/*
+ *  Returns msecs left until the client is lost, 0 if it is lost or not active.
+ */
+uint32_t ClientNode::checkTimeover(){
+	if(_status != Cstat_Active){
+		return 0;
+	}
+	uint32_t remain = _keepAliveTimer.getRemain();
+	if(remain == 0){
+		setStatus(Cstat_Lost);
 		_stack->disconnect();
 	}
+	return remain;
+}
+
+uint32_t ClientNode::getKeepAliveRemain(){
+	return _keepAliveTimer.getRemain();
+}
+
+ClientTimer* ClientNode::getLostTimer(){
+	return &_lostTimer;
 }
 
 void ClientNode::setKeepAlive(MQTTSnMessage* msg){
@@ -264,12 +684,44 @@ bool ClientNode::isConnectSendable(){
 }
 
 void ClientNode::updateStatus(ClientStatus stat){
+	setStatus(stat);
+}
+
+/*
+ *  Gauge of the clients in the status, -1 if it is not counted.
+ */
+static int clientGauge(ClientStatus stat){
+	switch(stat){
+	case Cstat_Active:
+		return MG_CLIENTS_ACTIVE;
+	case Cstat_Asleep:
+	case Cstat_Awake:
+		return MG_CLIENTS_ASLEEP;
+	case Cstat_Lost:
+		return MG_CLIENTS_LOST;
+	default:
+		return -1;
+	}
+}
+
+void ClientNode::setStatus(ClientStatus stat){
+	int from = clientGauge(_status);
+	int to = clientGauge(stat);
+
+	if(from != to){
+		if(from >= 0){
+			METRIC_GAUGE(from, -1);
+		}
+		if(to >= 0){
+			METRIC_GAUGE(to, 1);
+		}
+	}
 	_status = stat;
 }
 
 void ClientNode::connectSended(){
 	if(_status == Cstat_TryConnecting){
-		_status = Cstat_Connecting;
+		setStatus(Cstat_Connecting);
 
 		if(_mqttConnect){
 			delete _mqttConnect;
@@ -280,12 +732,12 @@ void ClientNode::connectSended(){
 
 void ClientNode::connectQued(){
 	if(_status == Cstat_Disconnected || _status == Cstat_Lost){
-		_status = Cstat_TryConnecting;
+		setStatus(Cstat_TryConnecting);
 	}
 }
 
 void ClientNode::disconnected(){
-	_status = Cstat_Disconnected;
+	setStatus(Cstat_Disconnected);
 	_connAckSaveFlg = false;
 	_waitWillMsgFlg = false;
 }
@@ -302,10 +754,14 @@ bool ClientNode::isSleep(){
 	return (_status == Cstat_Asleep);
 }
 
+bool ClientNode::isLost(){
+	return (_status == Cstat_Lost);
+}
+
 void ClientNode::connackSended(int rc){
 	if(_status == Cstat_Connecting){
 		if(rc == MQTTSN_RC_ACCEPTED){
-			_status = Cstat_Active;
+			setStatus(Cstat_Active);
 		}else{
 			disconnected();
 		}
@@ -331,7 +787,7 @@ void ClientNode::updateStatus(MQTTSnMessage* msg){
 		case MQTTSN_TYPE_DISCONNECT:{
 			MQTTSnDisconnect* dcm = static_cast<MQTTSnDisconnect*>(msg);
 			if(dcm->getDuration()){
-				_status = Cstat_Asleep;
+				setStatus(Cstat_Asleep);
 				_keepAliveMsec = dcm->getDuration() * 1000UL;
 			}else{
 				disconnected();
@@ -345,24 +801,24 @@ void ClientNode::updateStatus(MQTTSnMessage* msg){
 	}else if(_status == Cstat_Asleep){
 		if(msg->getType() == MQTTSN_TYPE_CONNECT){
 			setKeepAlive(msg);
-			_status = Cstat_Connecting;
+			setStatus(Cstat_Connecting);
 		}else if( msg->getType() == MQTTSN_TYPE_PINGREQ ){
 			MQTTSnPingReq* pr = static_cast<MQTTSnPingReq*>(msg);
 			if(pr->getClientId()) {
-				_status = Cstat_Awake;
+				setStatus(Cstat_Awake);
 			}
 		}
 	}else if(_status == Cstat_Awake){
 		switch(msg->getType()){
 			case MQTTSN_TYPE_CONNECT:
-				_status = Cstat_Connecting;
+				setStatus(Cstat_Connecting);
 				setKeepAlive(msg);
 				break;
 			case MQTTSN_TYPE_DISCONNECT:
 				disconnected();
 				break;
 			case MQTTSN_TYPE_PINGRESP:
-				_status = Cstat_Asleep;
+				setStatus(Cstat_Asleep);
 				break;
 			default:
 				break;
@@ -497,9 +953,13 @@ void ClientNode::setTopics(Topics* topics){
         Class ClientList
  =====================================*/
 ClientList::ClientList(){
-	_clientVector = new vector<ClientNode*>();
-	_clientVector->reserve(MAX_CLIENT_NODES);
+	memset(_slotChunks, 0, sizeof(_slotChunks));
+	_slotCnt = 0;
+	_freeSlot = MAX_CLIENT_NODES;
 	_clientCnt = 0;
+	_hashSize = 0;
+	_hashTable = 0;
+	rehash(CLIENT_HASH_SIZE);
 	#ifdef ADDRESS_64
 		_authorize = false;
 	#endif
@@ -507,11 +967,13 @@ ClientList::ClientList(){
 
 ClientList::~ClientList(){
 	_mutex.lock();
-	vector<ClientNode*>::iterator client = _clientVector->begin();
-	while((!_clientVector->empty()) && *client){
-		delete *client;
-		_clientVector->erase(client);
+	for(uint32_t i = 0; i < _slotCnt; i++){
+		delete getSlot(i);
+	}
+	for(uint32_t i = 0; i < MAX_CLIENT_NODES / CLIENT_SLOT_CHUNK; i++){
+		free(_slotChunks[i]);
 	}
+	free(_hashTable);
 	_mutex.unlock();
 }
 
@@ -565,24 +1027,26 @@ ClientList::~ClientList(){
 		if(_clientCnt < MAX_CLIENT_NODES){
 #endif
 		_mutex.lock();
-		vector<ClientNode*>::iterator client = _clientVector->begin();
-		while( client != _clientVector->end()){
-			#ifdef ADDRESS_64
-				if(((*client)->getAddress64Ptr() == addr64) && ((*client)->getAddress16() == addr16)){
-			#endif
-			#ifdef ADDRESS_128
-				if(((*client)->getAddress128Ptr() == addr128)
-					#ifdef SCOPE_ID
-						&& ((*client)->getScopeId() == scopeId)
-					#endif
-					&& ((*client)->getAddress16() == addr16)){
+		#ifdef ADDRESS_64
+			ClientNode* client = find(addr64, addr16);
+		#endif
+		#ifdef ADDRESS_128
+			ClientNode* client = find(addr128, addr16);
+			#ifdef SCOPE_ID
+				if(client && client->getScopeId() != scopeId){
+					client = 0;
+				}
 			#endif
-				return 0;
-			}else{
-				++client;
-			}
+		#endif
+		if(client){
+			_mutex.unlock();
+			return 0;
+		}
+		ClientNode* node = allocNode(secure);
+		if(node == 0){
+			_mutex.unlock();
+			return 0;
 		}
-		ClientNode* node = new ClientNode(secure);
 		#ifdef ADDRESS_64
 			node->setClientAddress64(addr64);
 		#endif
@@ -596,8 +1060,12 @@ ClientList::~ClientList(){
 		if (nodeId){
 			node->setNodeId(nodeId);
 		}
-		_clientVector->push_back(node);
 		_clientCnt++;
+		node->_indexed = true;
+		link(node);
+		if(_clientCnt > _hashSize){
+			rehash(_hashSize * 2);
+		}
 		_mutex.unlock();
 		return node;
 	}else{
@@ -610,65 +1078,221 @@ ClientList::~ClientList(){
 	}
 }
 
-void ClientList::erase(ClientNode* clnode){
+/*
+ *  A node of the gateway itself, e.g. a connection of the Aggregator.
+ *  It has a slot and a handle but is not indexed by address.
+ */
+ClientNode* ClientList::createGatewayNode(bool secure){
+	_mutex.lock();
+	ClientNode* node = allocNode(secure);
+	_mutex.unlock();
+	return node;
+}
 
-	uint16_t pos = 0;
+/*
+ *  The node is not deleted, it stays in the slot and is reused
+ *  by allocNode(). Handles of the client become stale.
+ */
+void ClientList::erase(ClientNode* clnode){
 	_mutex.lock();
-	vector<ClientNode*>::iterator client = _clientVector->begin();
+	if(clnode->_inUse){
+		if(clnode->_indexed){
+			unlink(clnode);
+			clnode->_indexed = false;
+			_clientCnt--;
+		}
+		clnode->setStatus(Cstat_Disconnected);
+		clnode->_inUse = false;
+		__atomic_store_n(&clnode->_generation, clnode->_generation + 1, __ATOMIC_RELEASE);
+		clnode->_nextFree = _freeSlot;
+		_freeSlot = clnode->_slot;
+	}
+	_mutex.unlock();
+}
 
-	while( (client != _clientVector->end()) && *client){
+ClientNode* ClientList::allocNode(bool secure){
+	ClientNode* node;
 
-		if((*client) == clnode){
-			delete(*client);
-			_clientVector->erase(client);
-			_clientCnt--;
-			for(; pos < _clientCnt; pos++){
-				_clientVector[pos] = _clientVector[pos + 1];
+	if(_freeSlot != MAX_CLIENT_NODES){
+		node = getSlot(_freeSlot);
+		_freeSlot = node->_nextFree;
+		node->reset(secure);
+	}else{
+		if(_slotCnt == MAX_CLIENT_NODES){
+			return 0;
+		}
+		uint32_t chunk = _slotCnt / CLIENT_SLOT_CHUNK;
+		if(_slotChunks[chunk] == 0){
+			_slotChunks[chunk] = (ClientNode**)calloc(CLIENT_SLOT_CHUNK, sizeof(ClientNode*));
+			if(_slotChunks[chunk] == 0){
+				return 0;
 			}
-		}else{
-			++client;
-			++pos;
 		}
+		node = new ClientNode(secure);
+		node->_slot = _slotCnt;
+		node->_lostTimer.setClientList(this);
+		_slotChunks[chunk][_slotCnt % CLIENT_SLOT_CHUNK] = node;
+		__atomic_store_n(&_slotCnt, _slotCnt + 1, __ATOMIC_RELEASE);    // publishes the node to operator[]
 	}
-	_mutex.unlock();
+	node->_stack->setPollData(node->getHandle());
+	__atomic_store_n(&node->_inUse, true, __ATOMIC_RELEASE);
+	return node;
+}
+
+ClientNode* ClientList::getSlot(uint32_t slot){
+	return _slotChunks[slot / CLIENT_SLOT_CHUNK][slot % CLIENT_SLOT_CHUNK];
+}
+
+/*
+ *  Resolves a handle without the lock, 0 if the client was erased.
+ */
+ClientNode* ClientList::getClient(ClientHandle handle){
+	uint32_t slot = (uint32_t)handle;
+
+	if(slot >= getSlotCount()){
+		return 0;
+	}
+	ClientNode* node = getSlot(slot);
+	if(!__atomic_load_n(&node->_inUse, __ATOMIC_ACQUIRE) || node->getHandle() != handle){
+		return 0;
+	}
+	return node;
 }
 
 #ifdef ADDRESS_64
 	ClientNode* ClientList::getClient(NWAddress64* addr64, uint16_t addr16){
+		_mutex.lock();
+		ClientNode* client = find(addr64, addr16);
+		_mutex.unlock();
+		return client;
+	}
+
+	ClientNode* ClientList::find(NWAddress64* addr64, uint16_t addr16){
+		ClientNode* client = _hashTable[hash(addr64, addr16) & (_hashSize - 1)];
+		while(client){
+			if(*(client->getAddress64Ptr()) == *addr64 && client->getAddress16() == addr16){
+				break;
+			}
+			client = client->getHashNext();
+		}
+		return client;
+	}
+
+	uint32_t ClientList::hash(NWAddress64* addr64, uint16_t addr16){
+		uint32_t h = addr64->getMsb() * 0x9E3779B1;
+		h = (h ^ addr64->getLsb()) * 0x9E3779B1;
+		h = (h ^ addr16) * 0x9E3779B1;
+		return h ^ (h >> 16);
+	}
 #endif
 #ifdef ADDRESS_128
 	ClientNode* ClientList::getClient(NWAddress128* addr128, uint16_t addr16){
+		_mutex.lock();
+		ClientNode* client = find(addr128, addr16);
+		_mutex.unlock();
+		return client;
+	}
+
+	ClientNode* ClientList::find(NWAddress128* addr128, uint16_t addr16){
+		ClientNode* client = _hashTable[hash(addr128, addr16) & (_hashSize - 1)];
+		while(client){
+			if(*(client->getAddress128Ptr()) == *addr128 && client->getAddress16() == addr16){
+				break;
+			}
+			client = client->getHashNext();
+		}
+		return client;
+	}
+
+	uint32_t ClientList::hash(NWAddress128* addr128, uint16_t addr16){
+		uint8_t addr[16];
+		uint32_t h = addr16;
+
+		addr128->getAddress(addr);
+		for(int i = 0; i < 16; i += 4){
+			h = (h ^ getUint32(addr + i)) * 0x9E3779B1;
+		}
+		return h ^ (h >> 16);
+	}
 #endif
-	_mutex.lock();
-	vector<ClientNode*>::iterator client = _clientVector->begin();
-	while( (client != _clientVector->end()) && *client){
-			#ifdef ADDRESS_64
-				if(*((*client)->getAddress64Ptr()) == *addr64 &&
-					(*client)->getAddress16() == addr16){
-			#endif
-			#ifdef ADDRESS_128
-				if(*((*client)->getAddress128Ptr()) == *addr128 &&
-					(*client)->getAddress16() == addr16){
-			#endif
-				_mutex.unlock();
-				return *client;
+
+uint32_t ClientList::hash(ClientNode* clnode){
+	#ifdef ADDRESS_64
+		return hash(clnode->getAddress64Ptr(), clnode->getAddress16());
+	#endif
+	#ifdef ADDRESS_128
+		return hash(clnode->getAddress128Ptr(), clnode->getAddress16());
+	#endif
+}
+
+void ClientList::link(ClientNode* clnode){
+	uint32_t pos = hash(clnode) & (_hashSize - 1);
+	clnode->setHashNext(_hashTable[pos]);
+	_hashTable[pos] = clnode;
+}
+
+void ClientList::unlink(ClientNode* clnode){
+	uint32_t pos = hash(clnode) & (_hashSize - 1);
+	ClientNode* prev = 0;
+	ClientNode* client = _hashTable[pos];
+
+	while(client){
+		if(client == clnode){
+			if(prev){
+				prev->setHashNext(client->getHashNext());
 			}else{
-				++client;
+				_hashTable[pos] = client->getHashNext();
 			}
+			clnode->setHashNext(0);
+			return;
+		}
+		prev = client;
+		client = client->getHashNext();
+	}
+}
+
+void ClientList::rehash(uint32_t size){
+	ClientNode** table = (ClientNode**)calloc(size, sizeof(ClientNode*));
+	if(table == 0){
+		return;       // keep the current table, chains get longer
+	}
+	free(_hashTable);
+	_hashTable = table;
+	_hashSize = size;
+	for(uint32_t i = 0; i < _slotCnt; i++){
+		if(getSlot(i)->_indexed){
+			link(getSlot(i));
+		}
+	}
+}
+
+/*
+ *  addr16 is a part of the key, the node is re-indexed.
+ */
+void ClientList::setClientAddress16(ClientNode* clnode, uint16_t addr16){
+	_mutex.lock();
+	if(clnode->getAddress16() != addr16){
+		unlink(clnode);
+		clnode->setClientAddress16(addr16);
+		link(clnode);
 	}
 	_mutex.unlock();
-	return 0;
 }
 
-uint16_t ClientList::getClientCount(){
+uint32_t ClientList::getClientCount(){
 	return _clientCnt;
 }
 
+uint32_t ClientList::getSlotCount(){
+	return __atomic_load_n(&_slotCnt, __ATOMIC_ACQUIRE);
+}
+
+/*
+ *  Slots are never moved, a scan of pos < getSlotCount() needs no lock.
+ */
 ClientNode* ClientList::operator[](int pos){
-	_mutex.lock();
-	ClientNode* node = (*_clientVector)[pos];
-	_mutex.unlock();
-	return node;
+	ClientNode* node = getSlot(pos);
+	return __atomic_load_n(&node->_inUse, __ATOMIC_ACQUIRE) ? node : 0;
 }
 
 #ifdef ADDRESS_64
@@ -683,16 +1307,23 @@ ClientNode* ClientList::operator[](int pos){
 Event::Event(){
 	_eventType = Et_NA;
 	_clientNode = 0;
+	_handle = 0;
 	_mqttSnMessage = 0;
+	traceInherit(&_trace);
 }
 
 Event::Event(EventType type){
 	_eventType = type;
 	_clientNode = 0;
+	_handle = 0;
 	_mqttSnMessage = 0;
+	traceInherit(&_trace);
 }
 
 Event::~Event(){
+	if(isStale()){
+		return;       // its messages are cleared when the node is reused
+	}
 	switch(_eventType){
 	case EtClientRecv:
 		if(_clientNode){
@@ -730,24 +1361,40 @@ EventType Event::getEventType(){
 
 void Event::setClientSendEvent(ClientNode* client){
 	_clientNode = client;
+	_handle = client->getHandle();
 	_eventType = EtClientSend;
 }
 
 void Event::setClientRecvEvent(ClientNode* client){
 	_clientNode = client;
+	_handle = client->getHandle();
 	_eventType = EtClientRecv;
 }
 
 void Event::setBrokerSendEvent(ClientNode* client){
 	_clientNode = client;
+	_handle = client->getHandle();
 	_eventType = EtBrokerSend;
 }
 
 void Event::setBrokerRecvEvent(ClientNode* client){
 	_clientNode = client;
+	_handle = client->getHandle();
 	_eventType = EtBrokerRecv;
 }
 
+void Event::setBrokerConnectEvent(ClientNode* client){
+	_clientNode = client;
+	_handle = client->getHandle();
+	_eventType = EtBrokerConnect;
+}
+
+void Event::setBrokerConnectedEvent(ClientNode* client){
+	_clientNode = client;
+	_handle = client->getHandle();
+	_eventType = EtBrokerConnected;
+}
+
 void Event::setTimeout(){
 	_eventType = EtTimeout;
 }
@@ -762,11 +1409,23 @@ ClientNode* Event::getClientNode(){
 	return _clientNode;
 }
 
+/*
+ *  The client was erased from ClientList after the event was set,
+ *  its node may already serve another client.
+ */
+bool Event::isStale(){
+	return _clientNode && _clientNode->getHandle() != _handle;
+}
+
 
 MQTTSnMessage* Event::getMqttSnMessage(){
 	return _mqttSnMessage;
 }
 
+MessageTrace* Event::getTrace(){
+	return &_trace;
+}
+
 /*=====================================
         Class LightIndicator
  =====================================*/
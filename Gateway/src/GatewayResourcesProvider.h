@@ -40,23 +40,43 @@
 #include "lib/Messages.h"
 #include "lib/Topics.h"
 #include "lib/TLSStack.h"
+#include "lib/TimingWheel.h"
+#include "GatewayDefines.h"
 
 #define FILE_NAME_CLIENT_LIST "/usr/local/etc/tomygateway/config/clientList.conf"
 
 /*=====================================
         Class MessageQue
  =====================================*/
+enum MessageQueOverflow{
+	MqSpill = 0,    // overflow list, kept in FIFO order behind the ring
+	MqWait          // producer yields until the consumer makes room
+};
+
+/*
+ *  Single producer, single consumer ring.
+ *  push() belongs to the producer thread, the others to the consumer thread.
+ */
 template<class T> class MessageQue{
 public:
 	MessageQue();
 	~MessageQue();
 	T* getMessage();
+	T* take();
 	void push(T*);
 	void pop();
 	void clear();
+	void setOverflow(MessageQueOverflow policy);
+	uint32_t getOverflowCount();
 private:
-	queue<T*> _que;
-	Mutex  _mutex;
+	T* _ring[MESSAGEQUE_SIZE];
+	uint32_t _head;                   // written by the consumer
+	uint32_t _tail;                   // written by the producer
+	uint32_t _spillCnt;
+	uint32_t _overflowCnt;
+	MessageQueOverflow _policy;
+	queue<T*>* _spill;                // created on the first overflow
+	Mutex  _mutex;                    // guards _spill
 };
 
 
@@ -70,10 +90,35 @@ enum ClientStatus {
 	Cstat_Lost
 };
 
+/*=====================================
+        Class ClientTimer
+ =====================================*/
+class ClientNode;
+class ClientList;
+
+class ClientTimer : public WheelTimer{
+public:
+	ClientTimer();
+	void setClientNode(ClientNode* clnode);
+	void setClientList(ClientList* list);
+	void setReclaiming(bool reclaiming);
+	bool isReclaiming();
+	void timeout();
+private:
+	ClientNode* _clnode;
+	ClientList* _clientList;
+	bool _reclaiming;                 // a lost or disconnected client is erased at timeout
+};
+
 /*=====================================
         Class ClientNode
  =====================================*/
+class Event;
+
+typedef uint64_t ClientHandle;    // generation << 32 | slot of ClientList, never 0
+
 class ClientNode{
+	friend class ClientList;
 public:
 	ClientNode();
 	ClientNode(bool secure);
@@ -87,6 +132,7 @@ public:
 	MQTTSnPubAck*  getWaitedPubAck();
 	MQTTSnSubAck*  getWaitedSubAck();
 	MQTTSnMessage* getClientSleepMessage();
+	MQTTSnMessage* takeClientSleepMessage();
 
 	void setBrokerSendMessage(MQTTMessage*);
 	void setBrokerRecvMessage(MQTTMessage*);
@@ -102,7 +148,7 @@ public:
 	void deleteClientSendMessage();
 	void deleteClientRecvMessage();
 
-	void checkTimeover();
+	uint32_t checkTimeover();
 	void updateStatus(MQTTSnMessage*);
 	void updateStatus(ClientStatus);
 	void connectSended();
@@ -152,9 +198,29 @@ public:
 	bool isDisconnect();
 	bool isActive();
 	bool isSleep();
+	bool isLost();
+	uint32_t getSlotNo();
+	ClientHandle getHandle();
+	uint32_t getKeepAliveRemain();
+
+	// used by GatewayControlTask only
+	ClientTimer* getLostTimer();
+
+	// used by BrokerSendTask only
+	void parkBrokerSendEvent(Event* ev);
+	Event* getParkedBrokerSendEvent();
+	bool isBrokerConnecting();
+	void setBrokerConnecting(bool);
+
+	// used by ClientList only
+	ClientNode* getHashNext();
+	void setHashNext(ClientNode*);
 
 private:
+	void initialize(bool secure);
+	void reset(bool secure);
 	void setKeepAlive(MQTTSnMessage* msg);
+	void setStatus(ClientStatus stat);
 
 	MessageQue<MQTTMessage>   _brokerSendMessageQue;
 	MessageQue<MQTTMessage>   _brokerRecvMessageQue;
@@ -162,6 +228,16 @@ private:
 	MessageQue<MQTTSnMessage> _clientRecvMessageQue;
 	MessageQue<MQTTSnMessage> _clientSleepMessageQue;
 
+	queue<Event*> _parkedEventQue;    // EtBrokerSend while connecting
+	bool _brokerConnecting;
+
+	ClientNode* _hashNext;            // chain of ClientList's hash index
+	uint32_t _slot;                   // ClientList's slot
+	uint32_t _generation;             // incremented when the slot is freed
+	uint32_t _nextFree;               // free list of ClientList
+	bool     _inUse;
+	bool     _indexed;                // linked in the hash index, not a node of the gateway itself
+
 	MQTTConnect*   _mqttConnect;
 
 	MQTTSnPubAck*  _waitedPubAck;
@@ -173,6 +249,7 @@ private:
 	ClientStatus _status;
 	uint32_t _keepAliveMsec;
 	Timer _keepAliveTimer;
+	ClientTimer _lostTimer;           // armed on the wheel of the control task
 
 	TLSStack* _stack;
 
@@ -203,7 +280,6 @@ public:
 	#ifdef ADDRESS_64
 		void authorize(const char* fileName, bool secure);
 	#endif
-	void erase(ClientNode*);
 	#ifdef ADDRESS_64
 		ClientNode* getClient(NWAddress64* addr64, uint16_t addr16);
 		ClientNode* createNode(bool secure, NWAddress64* addr64, uint16_t addr16, string* nodeId = 0);
@@ -216,15 +292,39 @@ public:
 		#endif
 		uint16_t addr16, string* nodeId = 0);
 	#endif
-	uint16_t getClientCount();
-	ClientNode* operator[](int);
+	ClientNode* createGatewayNode(bool secure);
+	ClientNode* getClient(ClientHandle handle);
+	void erase(ClientNode* clnode);
+	void setClientAddress16(ClientNode* clnode, uint16_t addr16);
+	uint32_t getClientCount();
+	uint32_t getSlotCount();
+	ClientNode* operator[](int);    // 0 if the slot is free
 	#ifdef ADDRESS_64
 		bool isAuthorized();
 	#endif
 private:
-	vector<ClientNode*>*  _clientVector;
+	#ifdef ADDRESS_64
+		uint32_t hash(NWAddress64* addr64, uint16_t addr16);
+		ClientNode* find(NWAddress64* addr64, uint16_t addr16);
+	#endif
+	#ifdef ADDRESS_128
+		uint32_t hash(NWAddress128* addr128, uint16_t addr16);
+		ClientNode* find(NWAddress128* addr128, uint16_t addr16);
+	#endif
+	ClientNode* allocNode(bool secure);
+	ClientNode* getSlot(uint32_t slot);
+	uint32_t hash(ClientNode* clnode);
+	void link(ClientNode* clnode);
+	void unlink(ClientNode* clnode);
+	void rehash(uint32_t size);
+
+	ClientNode** _slotChunks[MAX_CLIENT_NODES / CLIENT_SLOT_CHUNK];    // never moved
+	uint32_t _slotCnt;          // slots ever used
+	uint32_t _freeSlot;         // head of the free list
+	ClientNode** _hashTable;    // (address, addr16) -> ClientNode
+	uint32_t _hashSize;         // power of 2
 	Mutex _mutex;
-	uint16_t _clientCnt;
+	uint32_t _clientCnt;
 	#ifdef ADDRESS_64
 		bool _authorize;
 	#endif
@@ -242,10 +342,13 @@ enum EventType{
 	EtClientSend,
 	EtClientRecv,
 	EtBroadcast,
-	EtSocketAlive
+	EtSocketAlive,
+	EtBrokerConnect,
+	EtBrokerConnected
 };
 
 class Event{
+	POOLED_ALLOCATION;
 public:
 	Event();
 	Event(EventType);
@@ -255,14 +358,20 @@ public:
 	void setBrokerSendEvent(ClientNode*);
 	void setClientRecvEvent(ClientNode*);
 	void setBrokerRecvEvent(ClientNode*);
+	void setBrokerConnectEvent(ClientNode*);
+	void setBrokerConnectedEvent(ClientNode*);
 	void setEvent(MQTTSnMessage*);
 	void setTimeout();
 	ClientNode* getClientNode();
+	bool isStale();
 	MQTTSnMessage* getMqttSnMessage();
+	MessageTrace* getTrace();
 private:
 	EventType   _eventType;
 	ClientNode* _clientNode;
+	ClientHandle _handle;             // of _clientNode when the event was set
 	MQTTSnMessage* _mqttSnMessage;
+	MessageTrace _trace;
 };
 
 /*=====================================
@@ -283,24 +392,71 @@ private:
 	bool _gpioAvailable;
 };
 
+/*=====================================
+     Class GatewayContext
+ =====================================*/
+class GatewayResourcesProvider;
+
+class GatewayContext{
+public:
+	GatewayContext();
+	~GatewayContext();
+	void initialize(GatewayResourcesProvider* res);
+	uint8_t getGatewayId();
+	uint32_t getKeepAlive();
+	string* getLoginId();
+	string* getPassword();
+	bool isSecure();
+	bool isStableNetwork();
+	uint8_t getProtocol();
+	void switchProtocol();
+private:
+	Mutex _mutex;
+	bool _initialized;
+	uint8_t _protocol;
+	uint8_t _gatewayId;
+	uint32_t _keepAlive;
+	string _loginId;
+	string _password;
+	bool _secure;
+	bool _stableNetwork;
+};
+
 /*=====================================
      Class GatewayResourcesProvider
  =====================================*/
+class Aggregator;
+
 class GatewayResourcesProvider: public MultiTaskProcess{
 public:
 	GatewayResourcesProvider();
 	~GatewayResourcesProvider();
+	void run();
 
-	EventQue<Event>* getGatewayEventQue();
+	EventQue<Event>* getGatewayEventQue(ClientNode* clnode);
+	EventQue<Event>* getControlTaskEventQue(int taskNo);
 	EventQue<Event>* getClientSendQue();
 	EventQue<Event>* getBrokerSendQue();
+	EventQue<Event>* getBrokerConnectQue(ClientNode* clnode);
+	EventQue<Event>* getBrokerConnectTaskQue(int taskNo);
+	int getControlTaskNo(ClientNode* clnode);
+	int getControlTaskCount();
+	int getClientRecvTaskCount();
+	GatewayContext* getGatewayContext();
+	Aggregator* getAggregator();
 	ClientList* getClientList();
 	Network* getNetwork();
 	LightIndicator* getLightIndicator();
 private:
 	ClientList _clientList;
-	EventQue<Event> _gatewayEventQue;
+	GatewayContext _gatewayContext;
+	Aggregator* _aggregator;
+	int _controlTaskCnt;
+	int _clientRecvTaskCnt;
+	int _brokerConnectTaskCnt;
+	EventQue<Event> _gatewayEventQue[MAX_CONTROL_TASKS];
 	EventQue<Event> _brokerSendQue;
+	EventQue<Event> _brokerConnectQue[MAX_BROKER_CONNECT_TASKS];
 	EventQue<Event> _clientSendQue;
 	Network _network;
 	LightIndicator _lightIndicator;
@@ -312,47 +468,106 @@ private:
     Class MessageQue Implementation
  =====================================*/
 template<class T> MessageQue<T>::MessageQue(){
-
+	_head = 0;
+	_tail = 0;
+	_spillCnt = 0;
+	_overflowCnt = 0;
+	_policy = MqSpill;
+	_spill = 0;
 }
 
 template<class T> MessageQue<T>::~MessageQue(){
 	clear();
+	if(_spill){
+		delete _spill;
+	}
 }
 
-template<class T> T* MessageQue<T>::getMessage(){
-	T* msg;
-	if(!_que.empty()){
-		_mutex.lock();
-		msg = _que.front();
-		_mutex.unlock();
-		return msg;
-	}else{
-		return 0;
-	}
+template<class T> void MessageQue<T>::setOverflow(MessageQueOverflow policy){
+	_policy = policy;
+}
+
+template<class T> uint32_t MessageQue<T>::getOverflowCount(){
+	return __atomic_load_n(&_overflowCnt, __ATOMIC_RELAXED);
 }
 
+/*
+ *  While messages are spilled the ring is not used, so every message
+ *  in the ring is older than the spilled ones.
+ */
 template<class T> void MessageQue<T>::push(T* msg){
+	uint32_t tail = _tail;
+
+	if(__atomic_load_n(&_spillCnt, __ATOMIC_ACQUIRE) == 0){
+		while(true){
+			if(tail - __atomic_load_n(&_head, __ATOMIC_ACQUIRE) < MESSAGEQUE_SIZE){
+				_ring[tail & (MESSAGEQUE_SIZE - 1)] = msg;
+				__atomic_store_n(&_tail, tail + 1, __ATOMIC_RELEASE);
+				return;
+			}
+			if(_policy != MqWait){
+				break;
+			}
+			sched_yield();
+		}
+	}
+
+	__atomic_add_fetch(&_overflowCnt, 1, __ATOMIC_RELAXED);
 	_mutex.lock();
-	_que.push(msg);
+	if(_spill == 0){
+		_spill = new queue<T*>();
+	}
+	_spill->push(msg);
+	__atomic_add_fetch(&_spillCnt, 1, __ATOMIC_RELEASE);
 	_mutex.unlock();
 }
 
-template<class T> void MessageQue<T>::pop(){
-	if(!_que.empty()){
+template<class T> T* MessageQue<T>::getMessage(){
+	T* msg = 0;
+	uint32_t head = _head;
+
+	if(head != __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)){
+		msg = _ring[head & (MESSAGEQUE_SIZE - 1)];
+	}else if(__atomic_load_n(&_spillCnt, __ATOMIC_ACQUIRE)){
+		_mutex.lock();
+		msg = _spill->front();
+		_mutex.unlock();
+	}
+	return msg;
+}
+
+/*
+ *  Removes the front message without deleting it.
+ */
+template<class T> T* MessageQue<T>::take(){
+	T* msg = 0;
+	uint32_t head = _head;
+
+	if(head != __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)){
+		msg = _ring[head & (MESSAGEQUE_SIZE - 1)];
+		__atomic_store_n(&_head, head + 1, __ATOMIC_RELEASE);
+	}else if(__atomic_load_n(&_spillCnt, __ATOMIC_ACQUIRE)){
 		_mutex.lock();
-		delete _que.front();
-		_que.pop();
+		msg = _spill->front();
+		_spill->pop();
+		__atomic_sub_fetch(&_spillCnt, 1, __ATOMIC_RELEASE);
 		_mutex.unlock();
 	}
+	return msg;
+}
+
+template<class T> void MessageQue<T>::pop(){
+	T* msg = take();
+	if(msg){
+		delete msg;
+	}
 }
 
 template<class T> void MessageQue<T>::clear(){
-	_mutex.lock();
-	while(!_que.empty()){
-		delete _que.front();
-		_que.pop();
+	T* msg;
+	while((msg = take())){
+		delete msg;
 	}
-	_mutex.unlock();
 }
 
 #endif /* GATEWAY_RESOURCES_PROVIDER_H_ */
@@ -0,0 +1,158 @@
+/*
+ * MetricsTask.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+
+#include "MetricsTask.h"
+#include "GatewayResourcesProvider.h"
+#include "lib/ProcessFramework.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*=====================================
+        Class MetricsTask
+ =====================================*/
+MetricsTask::MetricsTask(GatewayResourcesProvider* res){
+	_res = res;
+	_res->attach(this);
+	_sockfd = -1;
+}
+
+MetricsTask::~MetricsTask(){
+	if(_sockfd >= 0){
+		close(_sockfd);
+		unlink(_path.c_str());
+	}
+}
+
+/*
+ *  Publishes the metrics into the shared memory every METRICS_PUBLISH_MSEC
+ *  and answers each connection to the socket with them in plain text.
+ *  Neither takes a lock of the tasks which count.
+ */
+void MetricsTask::run(){
+	char param[TOMYFRAME_PARAM_MAX];
+
+	_path = METRICS_SOCKET;
+	if(_res->getParam("MetricsSocket", param) == 0){
+		_path = param;
+	}
+	_exporter.open();
+	if(strcasecmp(_path.c_str(), "NONE") && (_sockfd = listen(_path.c_str())) < 0){
+		LOGWRITE("  Metrics are not served on %s, errno=%d\n", _path.c_str(), errno);
+	}
+
+	uint64_t next = metricsNow();
+	while(true){
+		uint64_t now = metricsNow();
+		if(now >= next){
+			_exporter.publish();
+			next = now + METRICS_PUBLISH_MSEC * 1000000ULL;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = _sockfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if(poll(&pfd, (_sockfd < 0 ? 0 : 1), (int)((next - now) / 1000000) + 1) > 0 && (pfd.revents & POLLIN)){
+			int fd = accept4(_sockfd, NULL, NULL, SOCK_CLOEXEC);
+			if(fd >= 0){
+				serve(fd);
+			}
+		}
+	}
+}
+
+/*
+ *  A socket left by the last run is replaced.
+ */
+int MetricsTask::listen(const char* path){
+	struct sockaddr_un addr;
+
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sockfd < 0){
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(sockfd, SOMAXCONN) < 0){
+		int err = errno;
+		close(sockfd);
+		errno = err;
+		return -1;
+	}
+	return sockfd;
+}
+
+/*
+ *  The text is made before it is sent, a reader which does not
+ *  read delays the next publication by SO_SNDTIMEO at most.
+ */
+void MetricsTask::serve(int fd){
+	char* text = 0;
+	size_t length = 0;
+	struct timeval tv;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	FILE* fp = open_memstream(&text, &length);
+	if(fp){
+		_exporter.write(fp);
+		fclose(fp);
+		size_t pos = 0;
+		while(pos < length){
+			ssize_t rc = send(fd, text + pos, length - pos, MSG_NOSIGNAL);
+			if(rc < 0 && errno == EINTR){
+				continue;
+			}else if(rc <= 0){
+				break;
+			}
+			pos += rc;
+		}
+		free(text);
+	}
+	close(fd);
+}
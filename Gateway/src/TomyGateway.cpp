@@ -38,7 +38,9 @@
 #include "ClientSendTask.h"
 #include "BrokerRecvTask.h"
 #include "BrokerSendTask.h"
+#include "BrokerConnectTask.h"
 #include "GatewayControlTask.h"
+#include "MetricsTask.h"
 #include "lib/ProcessFramework.h"
 
 const char* theCmdlineParameter = "b:d:i:h:p:g:u:l:w:k:";
@@ -54,3 +56,5 @@ ClientRecvTask th1 = ClientRecvTask(&gwR);
 ClientSendTask th2 = ClientSendTask(&gwR);
 BrokerRecvTask th3 = BrokerRecvTask(&gwR);
 BrokerSendTask th4 = BrokerSendTask(&gwR);
+BrokerConnectTask th5 = BrokerConnectTask(&gwR);
+MetricsTask th6 = MetricsTask(&gwR);
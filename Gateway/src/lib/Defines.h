@@ -86,6 +86,15 @@
 #define SCOPE_ID
 #endif
 
+/*=================================
+ *    Batched Transmission
+ ==================================*/
+#if defined(NETWORK_UDP) || defined(NETWORK_UDP6)
+#define NW_SEND_BATCH      // Network has unicastDeferred(), broadcastDeferred() and flush()
+#define NW_RECV_BATCH      // Network has getResponses()
+#define NW_REUSEPORT       // Network can be opened by several ClientRecvTasks
+#endif
+
 /*=================================
  *    Data Type
  ==================================*/
@@ -0,0 +1,117 @@
+/*
+ * LogRecord.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef LOGRECORD_H_
+#define LOGRECORD_H_
+
+#include <stdint.h>
+
+/*
+ *  Binary log records shared by the gateway and LogMonitor.
+ *  The gateway writes them as they are, LogMonitor formats them.
+ */
+#define LOG_RECORD_PAD      0     // filler up to the end of a queue
+#define LOG_RECORD_TEXT     1     // text formatted by the writer, the reader prefixes the time
+#define LOG_RECORD_PACKET   2     // packet trace, hex dumped by the reader
+#define LOG_RECORD_NOTE     3     // packet trace with a text instead of bytes
+#define LOG_RECORD_SAMPLE   4     // TraceSample of a message (MetricsPage.h), the client follows peer
+
+#define LOG_FLAG_TRUNCATED  0x01  // only the first LOG_TRACE_MAX_BYTES are in the record
+#define LOG_FLAG_CLIENT     0x02  // a broker trace, the client's id follows peer
+
+#define LOG_LEVEL_NONE      0
+#define LOG_LEVEL_INFO      1     // LOGWRITE
+#define LOG_LEVEL_TRACE     2     // LOGTRACE and LOGNOTE, a record per packet
+
+#define LOG_TRACE_MAX_BYTES 512
+#define LOG_RECORD_ALIGN    8
+
+/*
+ *  A record starts with its length, the strings of a trace
+ *  (name, arrow, peer and the client of LOG_FLAG_CLIENT, each
+ *  terminated by 0) follow the header
+ *  and the bytes or the note start at dataOffset.
+ */
+struct LogRecord{
+	uint16_t length;      // of the whole record
+	uint8_t  type;
+	uint8_t  format;      // LOG_FMT_xxx of a trace
+	uint8_t  flags;
+	uint8_t  thread;      // registration order of the writing thread
+	uint16_t dataOffset;
+	uint64_t time;        // CLOCK_REALTIME in nanoseconds
+};
+
+/*
+ *  Formats of traces, time, name, arrow, peer and the hex dump or note.
+ */
+enum LogFormat{
+	LOG_FMT_PLAIN = 0,
+	LOG_FMT_PLAIN1,
+	LOG_FMT_PLAIN2,
+	LOG_FMT_RED1,
+	LOG_FMT_RED2,
+	LOG_FMT_GREEN,
+	LOG_FMT_GREEN1,
+	LOG_FMT_GREEN2,
+	LOG_FMT_YELLOW1,
+	LOG_FMT_YELLOW2,
+	LOG_FMT_BLUE,
+	LOG_FMT_BLUE1,
+	LOG_FMT_BLUE2,
+	LOG_FMT_CYAN1,
+	LOG_FMT_CYAN2,
+	LOG_FMT_MAX
+};
+
+static const char* const theLogFormats[LOG_FMT_MAX] = {
+	"%s   %-14s%-8s%-44s%s\n",
+	"%s   %-14s%-8s%-26s%s\n",
+	"\n%s   %-14s%-8s%-26s%s\n",
+	"%s   \x1b[0m\x1b[31m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[31m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[32m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[32m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[32m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[33m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[33m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[34m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[34m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[34m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[36m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[36m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+};
+
+#endif /* LOGRECORD_H_ */
@@ -0,0 +1,231 @@
+/*
+ * MemoryPool.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#include "ProcessFramework.h"
+#include "MemoryPool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*=====================================
+        Size class allocator
+ =====================================*/
+struct PoolHeader{
+	uint32_t sizeClass;
+};
+
+struct PoolCache{
+	uint8_t* head[POOL_SIZE_CLASSES];
+	uint32_t cnt[POOL_SIZE_CLASSES];
+};
+
+struct PoolDepot{
+	pthread_mutex_t mutex;
+	uint8_t* batches;
+};
+
+static __thread PoolCache theCache;
+
+static PoolDepot theDepot[POOL_SIZE_CLASSES] = {
+	{PTHREAD_MUTEX_INITIALIZER, 0}, {PTHREAD_MUTEX_INITIALIZER, 0},
+	{PTHREAD_MUTEX_INITIALIZER, 0}, {PTHREAD_MUTEX_INITIALIZER, 0},
+	{PTHREAD_MUTEX_INITIALIZER, 0}, {PTHREAD_MUTEX_INITIALIZER, 0},
+	{PTHREAD_MUTEX_INITIALIZER, 0}, {PTHREAD_MUTEX_INITIALIZER, 0}
+};
+
+/*
+ *  A free block links the next block of the list and,
+ *  as the first block of a batch in the depot, the next batch.
+ */
+static inline uint8_t*& nextBlock(uint8_t* blk){
+	return *(uint8_t**)(blk + POOL_HEADER_SIZE);
+}
+
+static inline uint8_t*& nextBatch(uint8_t* blk){
+	return *(uint8_t**)(blk + POOL_HEADER_SIZE + sizeof(uint8_t*));
+}
+
+static inline uint32_t getSizeClass(size_t size){
+	size_t blkSize = 1 << POOL_MIN_SHIFT;
+	for(uint32_t sc = 0; sc < POOL_SIZE_CLASSES; sc++){
+		if(size + POOL_HEADER_SIZE <= blkSize){
+			return sc;
+		}
+		blkSize <<= 1;
+	}
+	return POOL_LARGE;
+}
+
+static void refill(PoolCache* cache, uint32_t sc){
+	PoolDepot* depot = &theDepot[sc];
+
+	pthread_mutex_lock(&depot->mutex);
+	uint8_t* batch = depot->batches;
+	if(batch){
+		depot->batches = nextBatch(batch);
+	}
+	pthread_mutex_unlock(&depot->mutex);
+
+	if(batch){
+		cache->head[sc] = batch;
+		cache->cnt[sc] = POOL_BATCH;
+		return;
+	}
+
+	/*------ carve a new chunk, chunks are never returned to malloc ------*/
+	uint32_t blkSize = 1 << (sc + POOL_MIN_SHIFT);
+	uint8_t* chunk = (uint8_t*)malloc(POOL_CHUNK_SIZE);
+	if(chunk == 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate memory.");
+	}
+	METRIC_INC(MC_POOL_CHUNKS);
+	uint8_t* head = 0;
+	cache->cnt[sc] = 0;
+	for(uint32_t pos = 0; pos + blkSize <= POOL_CHUNK_SIZE; pos += blkSize){
+		uint8_t* blk = chunk + pos;
+		((PoolHeader*)blk)->sizeClass = sc;
+		nextBlock(blk) = head;
+		head = blk;
+		cache->cnt[sc]++;
+	}
+	cache->head[sc] = head;
+}
+
+static void release(PoolCache* cache, uint32_t sc){
+	uint8_t* batch = cache->head[sc];
+	uint8_t* last = batch;
+	for(uint32_t i = 1; i < POOL_BATCH; i++){
+		last = nextBlock(last);
+	}
+	cache->head[sc] = nextBlock(last);
+	cache->cnt[sc] -= POOL_BATCH;
+	nextBlock(last) = 0;
+
+	PoolDepot* depot = &theDepot[sc];
+	pthread_mutex_lock(&depot->mutex);
+	nextBatch(batch) = depot->batches;
+	depot->batches = batch;
+	pthread_mutex_unlock(&depot->mutex);
+}
+
+void* mqalloc(size_t size){
+	uint32_t sc = getSizeClass(size);
+	uint8_t* blk;
+
+	if(sc == POOL_LARGE){
+		blk = (uint8_t*)malloc(size + POOL_HEADER_SIZE);
+		if(blk == 0){
+			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate memory.");
+		}
+		((PoolHeader*)blk)->sizeClass = POOL_LARGE;
+		METRIC_INC(MC_LARGE_ALLOCS);
+		return blk + POOL_HEADER_SIZE;
+	}
+
+	PoolCache* cache = &theCache;
+	if(cache->head[sc] == 0){
+		refill(cache, sc);
+	}
+	blk = cache->head[sc];
+	cache->head[sc] = nextBlock(blk);
+	cache->cnt[sc]--;
+	METRIC_INC(MC_ALLOCS);
+	return blk + POOL_HEADER_SIZE;
+}
+
+/*
+ *  A block may be freed by any thread, it joins the cache of that thread.
+ */
+void mqfree(void* ptr){
+	if(ptr == 0){
+		return;
+	}
+	uint8_t* blk = (uint8_t*)ptr - POOL_HEADER_SIZE;
+	uint32_t sc = ((PoolHeader*)blk)->sizeClass;
+
+	METRIC_INC(MC_FREES);
+	if(sc == POOL_LARGE){
+		free(blk);
+		return;
+	}
+
+	PoolCache* cache = &theCache;
+	nextBlock(blk) = cache->head[sc];
+	cache->head[sc] = blk;
+	if(++cache->cnt[sc] >= POOL_CACHE_MAX){
+		release(cache, sc);
+	}
+}
+
+uint8_t* mqcalloc(size_t len){
+	uint8_t* pos = (uint8_t*)mqalloc(len);
+	memset(pos, 0, len);
+	return pos;
+}
+
+/*=====================================
+        Class PacketBuffer
+ =====================================*/
+PacketBuffer* PacketBuffer::create(uint16_t size){
+	PacketBuffer* buf = (PacketBuffer*)mqalloc(sizeof(PacketBuffer) + size);
+	buf->_refCnt = 1;
+	buf->_size = size;
+	return buf;
+}
+
+void PacketBuffer::retain(){
+	__atomic_add_fetch(&_refCnt, 1, __ATOMIC_RELAXED);
+}
+
+void PacketBuffer::release(){
+	if(__atomic_sub_fetch(&_refCnt, 1, __ATOMIC_ACQ_REL) == 0){
+		mqfree(this);
+	}
+}
+
+/*
+ *  Only meaningful to a holder: while it holds a reference nobody else can take a new one.
+ */
+bool PacketBuffer::isShared(){
+	return __atomic_load_n(&_refCnt, __ATOMIC_ACQUIRE) > 1;
+}
+
+uint8_t* PacketBuffer::getData(){
+	return (uint8_t*)(this + 1);
+}
+
+uint16_t PacketBuffer::getSize(){
+	return _size;
+}
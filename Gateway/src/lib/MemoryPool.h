@@ -0,0 +1,82 @@
+/*
+ * MemoryPool.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef MEMORYPOOL_H_
+#define MEMORYPOOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define POOL_HEADER_SIZE        16    // keeps blocks 16 byte aligned
+#define POOL_MIN_SHIFT           5    // 32 bytes, header included
+#define POOL_SIZE_CLASSES        8    // 32 .. 4096 bytes
+#define POOL_LARGE            0xff    // size class of blocks taken from malloc
+#define POOL_CHUNK_SIZE  (64 * 1024)  // carved into blocks of one size class
+#define POOL_BATCH              64    // blocks moved between a thread cache and the depot
+#define POOL_CACHE_MAX   (POOL_BATCH * 2)
+
+/*
+ *  Size class allocator. Each thread allocates from and frees to its own
+ *  cache, surplus blocks go back to the depot in batches.
+ */
+void* mqalloc(size_t size);
+void  mqfree(void* ptr);
+uint8_t* mqcalloc(size_t len);
+
+#define POOLED_ALLOCATION \
+	public: static void* operator new(size_t size){ return mqalloc(size); } \
+	static void operator delete(void* ptr){ mqfree(ptr); }
+
+/*=====================================
+        Class PacketBuffer
+ =====================================*/
+/*
+ *  Reference counted bytes of a packet, shared by the messages which view it.
+ *  The data follows the header in the same pool block.
+ */
+class PacketBuffer{
+public:
+	static PacketBuffer* create(uint16_t size);
+	void retain();
+	void release();
+	bool isShared();
+	uint8_t* getData();
+	uint16_t getSize();
+private:
+	uint32_t _refCnt;
+	uint16_t _size;
+};
+
+#endif /* MEMORYPOOL_H_ */
@@ -47,8 +47,7 @@
 
 extern uint16_t getUint16(uint8_t* pos);
 extern void setUint16(uint8_t* pos, uint16_t val);
-extern void setUint32(uint8_t* pos, uint32_t val);
-extern uint8_t* mqcalloc(uint8_t length);
+extern uint8_t* mqcalloc(size_t length);
 extern void utfSerialize(uint8_t* pos, string str);
 
 using namespace tomyGateway;
@@ -86,13 +85,14 @@ bool isUtf8Valid(string& string)
  ======================================*/
 MQTTSnMessage::MQTTSnMessage(){
     _message = 0;
+    _buffer = 0;
     _length = 0;
     _type = 0;
 }
 
 MQTTSnMessage::~MQTTSnMessage(){
-    if (_message){
-        free(_message);
+    if (_buffer){
+        _buffer->release();
     }
 }
 
@@ -104,25 +104,34 @@ void MQTTSnMessage::setMessageLength(uint16_t length){
     _length = length;
 }
 
-void MQTTSnMessage::setBody(uint8_t* body, uint16_t bodyLength){
-	if(_length > 255){
-		_length = bodyLength + 4;
+/*
+ *  Frames over 255 bytes carry the 3-byte length, 0x01 and a 16-bit length.
+ */
+void MQTTSnMessage::setBodyLength(uint16_t bodyLength){
+	if(bodyLength + MQTTSN_HEADER_SIZE > 255){
+		_length = bodyLength + MQTTSN_LONG_HEADER_SIZE;
 	}else{
 		_length = bodyLength + MQTTSN_HEADER_SIZE;
 	}
+}
+
+void MQTTSnMessage::setBody(uint8_t* body, uint16_t bodyLength){
+	setBodyLength(bodyLength);
     allocate();
 	memcpy(getBodyPtr(), body, bodyLength);
 }
 
 void MQTTSnMessage::allocate(){
 		if ( _length ) {
-			if (_message){
-				  free(_message);
+			if (_buffer){
+				  _buffer->release();
 			}
-			_message = mqcalloc(_length);
+			_buffer = PacketBuffer::create(_length);
+			_message = _buffer->getData();
+			memset(_message, 0, _length);
 			if(_length > 255){
 				*_message = 0x01;
-				setUint32(_message + 1, _length);
+				setUint16(_message + 1, _length);
 				*(_message + 3) = _type;
 			}else{
 				*_message = _length;
@@ -140,16 +149,16 @@ uint8_t MQTTSnMessage::getType(){
 }
 
 uint8_t* MQTTSnMessage::getBodyPtr(){
-	if( _length > 255){
-		return _message + 4;
+	if(*_message == 0x01){
+		return _message + MQTTSN_LONG_HEADER_SIZE;
 	}else{
 		return _message + MQTTSN_HEADER_SIZE;
 	}
 }
 
 uint16_t MQTTSnMessage::getBodyLength(){
-	if(_length > 255){
-		return _length - 4;
+	if(*_message == 0x01){
+		return _length - MQTTSN_LONG_HEADER_SIZE;
 	}else{
 		return _length - MQTTSN_HEADER_SIZE;
 	}
@@ -168,18 +177,43 @@ uint8_t* MQTTSnMessage::getMessagePtr(){
 	return _message;
 }
 
+PacketBuffer* MQTTSnMessage::getPacketBuffer(){
+	return _buffer;
+}
+
+/*
+ *  View the bytes of another buffer, they are not copied.
+ *  A viewing message is read only, allocate() gives it bytes of its own.
+ */
+void MQTTSnMessage::share(PacketBuffer* buf, uint8_t* message){
+	buf->retain();
+	if(_buffer){
+		_buffer->release();
+	}
+	_buffer = buf;
+	_message = message;
+}
+
 void MQTTSnMessage::absorb(MQTTSnMessage* src){
     setMessageLength(src->getMessageLength());
     setType(src->getType());
-    allocate();
-    memcpy(getBodyPtr(), src->getBodyPtr(), (size_t)src->getBodyLength());
+    if(src->getPacketBuffer()){
+        share(src->getPacketBuffer(), src->getMessagePtr());
+    }else{
+        allocate();
+        memcpy(getBodyPtr(), src->getBodyPtr(), (size_t)src->getBodyLength());
+    }
 }
 
 void MQTTSnMessage::absorb(NWResponse* src){
 	setMessageLength(src->getPayloadLength());
 	setType(src->getMsgType());
-	allocate();
-	memcpy(_message,src->getPayloadPtr(), (size_t)src->getPayloadLength());
+	if(src->getPacketBuffer()){
+		share(src->getPacketBuffer(), src->getPayloadPtr());
+	}else{
+		allocate();
+		memcpy(_message,src->getPayloadPtr(), (size_t)src->getPayloadLength());
+	}
 }
 
 
@@ -311,7 +345,7 @@ void MQTTSnConnect::setClientId(string id){
 }
 
 string* MQTTSnConnect::getClientId(){
-	_clientId = string((char*)(getBodyPtr() + 4), getMessageLength() - 6 );
+	_clientId = string((char*)(getBodyPtr() + 4), getBodyLength() - 4 );
     return &_clientId;
 }
 
@@ -384,10 +418,10 @@ void MQTTSnWillTopic::setFlags(uint8_t flags){
 }
 
 void MQTTSnWillTopic::setWillTopic(string* topic){
-    setMessageLength(topic->size() + 3);
+    setBodyLength(topic->size() + 1);
     allocate();
     topic->copy((char*)getBodyPtr() + 1,topic->size() ,0);
-    _message[2] = _flags;
+    getBodyPtr()[0] = _flags;
     _topicName = *topic;
 }
 
@@ -413,7 +447,7 @@ void MQTTSnWillTopic::absorb(NWResponse* src){
 
 void MQTTSnWillTopic::absorb(MQTTSnMessage* src){
 	setFlags(src->getBodyPtr()[0]);
-	_topicName = string((char*)src->getBodyPtr() + 1, src->getMessageLength() - 3);
+	_topicName = string((char*)src->getBodyPtr() + 1, src->getBodyLength() - 1);
 	MQTTSnMessage::absorb(src);
 }
 
@@ -445,7 +479,7 @@ MQTTSnWillMsg::~MQTTSnWillMsg(){
 }
 
 void MQTTSnWillMsg::setWillMsg(string* msg){
-    setMessageLength(2 + msg->size());
+    setBodyLength(msg->size());
     allocate();
     msg->copy((char*)getBodyPtr(),msg->size(),0);
     _willMsg = *msg;
@@ -460,7 +494,7 @@ void MQTTSnWillMsg::absorb(NWResponse* src){
 }
 
 void MQTTSnWillMsg::absorb(MQTTSnMessage* src){
-	_willMsg = string((char*)src->getBodyPtr(), src->getMessageLength() - 2);
+	_willMsg = string((char*)src->getBodyPtr(), src->getBodyLength());
 	MQTTSnMessage::absorb(src);
 }
 /*=====================================
@@ -498,7 +532,7 @@ uint16_t MQTTSnRegister::getMsgId(){
 
 }
 void MQTTSnRegister::setTopicName(string* topicName){
-    setMessageLength(6 + topicName->size());
+    setBodyLength(4 + topicName->size());
     allocate();
     topicName->copy((char*)getBodyPtr() + 4, topicName->size(),0);
     setTopicId(_topicId);
@@ -529,7 +563,7 @@ void MQTTSnRegister::absorb(NWResponse* src){
 void MQTTSnRegister::absorb(MQTTSnMessage* src){
 	_topicId = getUint16((uint8_t*)(src->getBodyPtr()));
 	_msgId = getUint16((uint8_t*)(src->getBodyPtr() +2));
-	_topicName = string((char*)src->getBodyPtr() + 4, src->getMessageLength() - 6);
+	_topicName = string((char*)src->getBodyPtr() + 4, src->getBodyLength() - 4);
 	MQTTSnMessage::absorb(src);
 }
 
@@ -646,11 +680,7 @@ void MQTTSnPublish::setTopic(string* topic){
 }
 
 string* MQTTSnPublish::getTopic(string* str){
-	char tp[3];
-	tp[0] = (char)*(getBodyPtr() + 1);
-	tp[1] = (char)*(getBodyPtr() + 2);
-	tp[2] = 0;
-	str->copy(tp,2);
+	*str = string((char*)getBodyPtr() + 1, 2);
 	return str;
 }
 
@@ -668,8 +698,8 @@ uint16_t MQTTSnPublish::getMsgId(){
 }
 
 
-void MQTTSnPublish::setData(uint8_t* data, uint8_t len){
-    setMessageLength(7 + len);
+void MQTTSnPublish::setData(uint8_t* data, uint16_t len){
+    setBodyLength(5 + len);
     allocate();
     memcpy(getBodyPtr() + 5, data, len);
     setTopicId(_topicId);
@@ -702,13 +732,47 @@ void MQTTSnPublish::setFrame(NWResponse* resp){
 */
 void MQTTSnPublish::absorb(NWResponse* src){
 	MQTTSnMessage::absorb(src);
+	cacheHeader();
 }
 
 void MQTTSnPublish::absorb(MQTTSnMessage* src){
-	_msgId = getUint16((uint8_t*)(src->getBodyPtr() + 3));
-	_flags = src->getBodyPtr()[0];
-	_topicId = getUint16((uint8_t*)(src->getBodyPtr() + 1));
 	MQTTSnMessage::absorb(src);
+	cacheHeader();
+}
+
+void MQTTSnPublish::cacheHeader(){
+	_flags = getBodyPtr()[0];
+	_topicId = getUint16((uint8_t*)(getBodyPtr() + 1));
+	_msgId = getUint16((uint8_t*)(getBodyPtr() + 3));
+}
+
+/*
+ *  MQTT PUBLISH to MQTT-SN PUBLISH, the header is written in place
+ *  and the payload is copied once.
+ */
+void MQTTSnPublish::transcode(MQTTPublish* src, uint16_t topicId, uint8_t topicType){
+	_flags = topicType & MQTTSN_TOPIC_TYPE;
+	if(src->getQos() == 1){
+		_flags |= MQTTSN_FLAG_QOS_1;
+	}else if(src->getQos() == 2){
+		_flags |= MQTTSN_FLAG_QOS_2;
+	}
+	if(src->isDup()){
+		_flags |= MQTTSN_FLAG_DUP;
+	}
+	if(src->isRetain()){
+		_flags |= MQTTSN_FLAG_RETAIN;
+	}
+	_topicId = topicId;
+	_msgId = src->getMessageId();
+
+	setBodyLength(5 + src->getPayloadLength());
+	allocate();
+	uint8_t* body = getBodyPtr();
+	body[0] = _flags;
+	setUint16(body + 1, _topicId);
+	setUint16(body + 3, _msgId);
+	memcpy(body + 5, src->getPayload(), src->getPayloadLength());
 }
 
 /*=====================================
@@ -874,7 +938,7 @@ uint16_t MQTTSnSubscribe::getMsgId(){
     return _msgId;
 }
 void MQTTSnSubscribe::setTopicName(string* data){
-    setMessageLength(5 + data->size());
+    setBodyLength(3 + data->size());
     allocate();
     data->copy((char*)getBodyPtr() + 3, data->size(),0);
     setMsgId(_msgId);
@@ -914,9 +978,9 @@ void MQTTSnSubscribe::absorb(MQTTSnMessage* src){
 	_msgId = getUint16((uint8_t*)(src->getBodyPtr() +1));
 	_flags = src->getBodyPtr()[0];
 	if((_flags & MQTTSN_TOPIC_TYPE) == MQTTSN_TOPIC_TYPE_SHORT ){
-		_topicName = string((char*)src->getBodyPtr() + 3, src->getMessageLength() - 5);
+		_topicName = string((char*)src->getBodyPtr() + 3, src->getBodyLength() - 3);
 	}else if((_flags & MQTTSN_TOPIC_TYPE) == MQTTSN_TOPIC_TYPE_NORMAL){
-		_topicName = string((char*)src->getBodyPtr() + 3, src->getMessageLength() - 5);
+		_topicName = string((char*)src->getBodyPtr() + 3, src->getBodyLength() - 3);
 	}else if((_flags & MQTTSN_TOPIC_TYPE) == MQTTSN_TOPIC_TYPE_PREDEFINED){
 		 _topicId = getUint16(getBodyPtr() +3);
 	}
@@ -1117,7 +1181,7 @@ RemainingLength::~RemainingLength(){
 
 }
 
-void RemainingLength::encode(uint16_t len){
+void RemainingLength::encode(uint32_t len){
 	_size = 0;
 	do{
 		uint8_t digit = len % 128;
@@ -1129,20 +1193,20 @@ void RemainingLength::encode(uint16_t len){
 	}while(len > 0);
 }
 
-uint16_t RemainingLength::decode(){
-	uint16_t multiplier = 1;
-	uint16_t value = 0;
+uint32_t RemainingLength::decode(){
+	uint32_t multiplier = 1;
+	uint32_t value = 0;
 	uint8_t digit;
 	uint8_t pos = 0;
 	do{
 		digit = _digit[pos++];
 		value += (digit & 0x7f) * multiplier;
 		multiplier *= 128;
-	}while((digit & 0x80) != 0);
+	}while((digit & 0x80) != 0 && pos < 4);
 	return value;
 }
 
-uint16_t RemainingLength::serialize(uint8_t* pos){
+uint32_t RemainingLength::serialize(uint8_t* pos){
 	memcpy(pos, _digit, _size);
 	return decode();
 }
@@ -1153,7 +1217,7 @@ void RemainingLength::deserialize(uint8_t* pos){
 	do{
 		_digit[i++] = *pos;
 		_size++;
-	}while((*pos++ & 0x80) != 0 );
+	}while((*pos++ & 0x80) != 0 && i < 4);
 }
 
 uint8_t RemainingLength::getSize(){
@@ -1169,6 +1233,7 @@ MQTTMessage::MQTTMessage(){
 	_messageId = 0;
 	_remainLength = 0;
 	_payload = 0;
+	_payloadBuffer = 0;
 	_userName = string("");
 	_password = string("");
 	_willTopic = string("");
@@ -1178,9 +1243,17 @@ MQTTMessage::MQTTMessage(){
 }
 
 MQTTMessage::~MQTTMessage(){
-	if(_payload){
-		free(_payload);
+	freePayload();
+}
+
+void MQTTMessage::freePayload(){
+	if(_payloadBuffer){
+		_payloadBuffer->release();
+	}else if(_payload){
+		mqfree(_payload);
 	}
+	_payloadBuffer = 0;
+	_payload = 0;
 }
 
 uint8_t MQTTMessage::getType(){
@@ -1191,7 +1264,7 @@ uint8_t MQTTMessage::getQos(){
 	return (_flags & 0x06) >> 1;
 }
 
-uint16_t MQTTMessage::getRemainLength(){
+uint32_t MQTTMessage::getRemainLength(){
 	return _remainLength;
 }
 
@@ -1202,7 +1275,7 @@ uint8_t MQTTMessage::getRemainLengthSize(){
 }
 
 bool MQTTMessage::isDup(){
-	return _flags & 0x80;
+	return _flags & 0x08;
 }
 
 bool MQTTMessage::isRetain(){
@@ -1326,6 +1399,10 @@ uint8_t MQTTConnAck::getReturnCd(){
 	return _returnCd;
 }
 
+void MQTTConnAck::setReturnCd(uint8_t rc){
+	_returnCd = rc;
+}
+
 bool MQTTConnAck::deserialize(uint8_t* buf){
 	MQTTMessage::deserialize(buf);
 
@@ -1341,7 +1418,7 @@ bool MQTTConnAck::deserialize(uint8_t* buf){
          Class MQTTUnsubAck
   ======================================*/
 MQTTUnsubAck::MQTTUnsubAck(){
-	_type = MQTT_TYPE_CONNACK;
+	_type = MQTT_TYPE_UNSUBACK;
 	_remainLength = 2;
 }
 
@@ -1453,6 +1530,10 @@ void MQTTSubAck::setGrantedQos1(){
 	_qos = 1;
 }
 
+void MQTTSubAck::setGrantedQos(uint8_t qos){
+	_qos = qos;
+}
+
 bool MQTTSubAck::deserialize(uint8_t* buf){
 	RemainingLength remLen;
 	remLen.encode(_remainLength);
@@ -1492,6 +1573,10 @@ void MQTTUnsubscribe::setTopicName(string* topic){
 	_topic = *topic;
 }
 
+string* MQTTUnsubscribe::getTopicName(){
+	return &_topic;
+}
+
 uint16_t MQTTUnsubscribe::serialize(uint8_t* buf){
 	RemainingLength remLen;
 	_remainLength = _topic.size() + 4;
@@ -1534,6 +1619,14 @@ void MQTTSubscribe::setTopic(string* topic, uint8_t qos){
 	_qos = qos;
 }
 
+string* MQTTSubscribe::getTopic(){
+	return &_topic;
+}
+
+uint8_t MQTTSubscribe::getRequestedQos(){
+	return _qos;
+}
+
 uint16_t MQTTSubscribe::serialize(uint8_t* buf){
 	RemainingLength remLen;
 	_remainLength = _topic.size() + 5; //length:2, Topic:n, QoS:1
@@ -1615,6 +1708,10 @@ void MQTTConnect::setCleanSessionFlg(){
 	_connectFlags |= 0x02;
 }
 
+bool MQTTConnect::isCleanSession(){
+	return (_connectFlags & 0x02) != 0;
+}
+
 
 uint16_t MQTTConnect::serialize(uint8_t* buf){
 	uint16_t len;
@@ -1706,18 +1803,25 @@ uint8_t* MQTTPublish::getPayload(){
 }
 
 
-uint8_t  MQTTPublish::getPayloadLength(){
+uint32_t MQTTPublish::getPayloadLength(){
 	return _len;
 }
 
+/*
+ *  0 when the payload is not a view of a shared buffer.
+ */
+PacketBuffer* MQTTPublish::getPayloadBuffer(){
+	return _payloadBuffer;
+}
+
 void MQTTPublish::setTopic(string* topic){
 	_topic = *topic;
 }
 
-void MQTTPublish::setPayload(uint8_t* payload, uint8_t length){
+void MQTTPublish::setPayload(uint8_t* payload, uint32_t length){
 	if(_payload){
 		_remainLength -= _len;
-		free(_payload);
+		freePayload();
 	}
 	_payload = mqcalloc(length);
 	memcpy(_payload, payload, length);
@@ -1725,30 +1829,74 @@ void MQTTPublish::setPayload(uint8_t* payload, uint8_t length){
 	_remainLength += length;
 }
 
-uint16_t MQTTPublish::serialize(uint8_t* buf){
+/*
+ *  The payload stays in the buffer of the MQTT-SN message it came from.
+ */
+void MQTTPublish::setPayload(PacketBuffer* buf, uint8_t* payload, uint32_t length){
+	if(buf == 0){
+		setPayload(payload, length);
+		return;
+	}
+	if(_payload){
+		_remainLength -= _len;
+	}
+	buf->retain();
+	freePayload();
+	_payloadBuffer = buf;
+	_payload = payload;
+	_len = length;
+	_remainLength += length;
+}
+
+uint32_t MQTTPublish::serialize(uint8_t* buf){
+	uint16_t len = serializeHeader(buf);
+	memcpy(buf + len, _payload, _len);
+	return len + _len;
+}
+
+/*
+ *  Fixed header, topic and message id, the payload is sent from where it is.
+ */
+uint16_t MQTTPublish::serializeHeader(uint8_t* buf){
 	RemainingLength remLen;
+	uint8_t* pos = buf;
 	_remainLength = _topic.size() + 2 + _len;
 	if(getQos()){
 		_remainLength += 2;
 	}
 	remLen.encode(_remainLength);
 
-	*buf++ = (_type & 0xf0) | (_flags & 0x0f);
-	remLen.serialize(buf);
-	buf += remLen.getSize();
-	utfSerialize(buf, _topic);
-	buf += _topic.size() + 2;
+	*pos++ = (_type & 0xf0) | (_flags & 0x0f);
+	remLen.serialize(pos);
+	pos += remLen.getSize();
+	utfSerialize(pos, _topic);
+	pos += _topic.size() + 2;
 	if(getQos()){
-		setUint16(buf, _messageId);
-		buf += 2;
+		setUint16(pos, _messageId);
+		pos += 2;
 	}
-	memcpy(buf, _payload, _len);
+	return pos - buf;
+}
 
-	return 1 + remLen.getSize() + remLen.decode();
+/*
+ *  MQTT-SN PUBLISH to MQTT PUBLISH, the payload stays in the MQTT-SN buffer.
+ */
+void MQTTPublish::transcode(MQTTSnPublish* src, string* topic){
+	_flags = 0;
+	setQos(src->getQos());
+	if(src->getFlags() & MQTTSN_FLAG_DUP){
+		setDup();
+	}
+	if(src->getFlags() & MQTTSN_FLAG_RETAIN){
+		setRetain();
+	}
+	_messageId = src->getMsgId();
+	_topic = *topic;
+	setPayload(src->getPacketBuffer(), src->getData(), src->getDataLength());
 }
 
 bool MQTTPublish::deserialize(uint8_t* buf){
-	uint8_t pos = 2;
+	uint32_t pos = 2;
 
 	_type = *buf & 0xf0;
 	if(_type != MQTT_TYPE_PUBLISH){
@@ -1761,6 +1909,9 @@ bool MQTTPublish::deserialize(uint8_t* buf){
 	_remainLength = remLen.decode();
 
 	buf += 1 + remLen.getSize();
+	if(_remainLength < pos + getUint16(buf) + (getQos() ? 2 : 0)){
+		return false;
+	}
 	_topic = string((char*)buf + 2, getUint16(buf));
 	if(!isUtf8Valid(_topic)){
 		return false;
@@ -122,6 +122,9 @@
 
 #define MQTTSN_PROTOCOL_ID  0x01
 #define MQTTSN_HEADER_SIZE  2
+#define MQTTSN_LONG_HEADER_SIZE  4     // 0x01, 2-byte length and type
+#define MQTTSN_MAX_MESSAGE_SIZE  65535
+#define MQTTSN_MAX_PUBLISH_DATA  (MQTTSN_MAX_MESSAGE_SIZE - MQTTSN_LONG_HEADER_SIZE - 5)
 
 /*
  *     Return Code
@@ -168,14 +171,18 @@
 using namespace std;
 using namespace tomyGateway;
 
+class MQTTPublish;
+
 /*=====================================
         Class MQTTSnMessage
   =====================================*/
 class MQTTSnMessage{
+	POOLED_ALLOCATION;
 public:
 	MQTTSnMessage();
     ~MQTTSnMessage();
     void setMessageLength(uint16_t length);
+    void setBodyLength(uint16_t bodyLength);
     void setType(uint8_t type);
     void setBody(uint8_t* body, uint16_t bodyLength);
     void setMessage(uint8_t* msg);
@@ -187,12 +194,16 @@ public:
     uint8_t* getBodyPtr();
     bool    getMessage(uint16_t pos, uint8_t& val);
 
+    PacketBuffer* getPacketBuffer();
+
     void absorb(MQTTSnMessage* src);
     void absorb(NWResponse* src);
 protected:
     void allocate();
+    void share(PacketBuffer* buf, uint8_t* message);
     uint8_t* _message;
 private:
+    PacketBuffer* _buffer;
     uint16_t  _length;
 	uint8_t   _type;
 };
@@ -395,7 +406,7 @@ public:
     void setTopicId(uint16_t id);
     void setTopic(string* topic);
     void setMsgId(uint16_t msgId);
-    void setData(uint8_t* data, uint8_t len);
+    void setData(uint8_t* data, uint16_t len);
     //void setFrame(uint8_t* data, uint8_t len);
     //void setFrame(NWResponse* resp);
 	void setQos(uint8_t);
@@ -414,8 +425,10 @@ public:
 
     void absorb(MQTTSnMessage* src);
     void absorb(NWResponse* src);
+    void transcode(MQTTPublish* src, uint16_t topicId, uint8_t topicType);
 
 private:
+    void cacheHeader();
     uint8_t _flags;
     uint16_t _topicId;
     uint16_t _msgId;
@@ -624,9 +637,9 @@ class RemainingLength{
 public:
 	RemainingLength();
 	~RemainingLength();
-	void encode(uint16_t);
-	uint16_t decode();
-	uint16_t serialize(uint8_t* pos);
+	void encode(uint32_t);
+	uint32_t decode();
+	uint32_t serialize(uint8_t* pos);
 	void deserialize(uint8_t* pos);
 	uint8_t getSize();
 
@@ -639,12 +652,13 @@ private:
          Class MQTTMessage
   ======================================*/
 class MQTTMessage{
+	POOLED_ALLOCATION;
 public:
 	MQTTMessage();
 	~MQTTMessage();
 	uint8_t getType();
 	uint8_t getQos();   // QOS0 = 0, QOS1 = 1
-	uint16_t getRemainLength();
+	uint32_t getRemainLength();
 	uint8_t getRemainLengthSize();
 	bool isDup();
 	bool isRetain();
@@ -658,12 +672,15 @@ public:
 	void absorb(MQTTMessage* msg);
 
 protected:
+	void freePayload();
+
 	uint8_t _type;
 	uint8_t _flags;
-	uint16_t _remainLength;
+	uint32_t _remainLength;
 	uint16_t _messageId;
 
 	uint8_t* _payload;
+	PacketBuffer* _payloadBuffer;     // set when _payload is a view
 
 	string _userName;
 	string _password;
@@ -757,6 +774,7 @@ public:
 	MQTTConnAck();
 	~MQTTConnAck();
 	uint8_t getReturnCd();
+	void setReturnCd(uint8_t);
 	bool deserialize(uint8_t* buf);
 private:
 	uint8_t _returnCd;
@@ -785,6 +803,7 @@ public:
 	uint8_t getGrantedQos();
 	void setGrantedQos0();
 	void setGrantedQos1();
+	void setGrantedQos(uint8_t);
 	bool deserialize(uint8_t* buf);
 private:
 	uint8_t _qos;
@@ -801,6 +820,7 @@ public:
 	uint16_t getMessageId();
 	uint16_t serialize(uint8_t* buf);
 	void setTopicName(string*);
+	string* getTopicName();
 private:
 	//string _topic;
 };
@@ -816,6 +836,8 @@ public:
 	uint16_t getMessageId();
 	uint16_t serialize(uint8_t* buf);
 	void setTopic(string* topic, uint8_t qos);
+	string* getTopic();
+	uint8_t getRequestedQos();
 private:
 	//string _topic;
 	uint8_t _qos;
@@ -837,6 +859,7 @@ public:
 	void setWillQos(uint8_t);
 	void setClientId(string*);
 	void setCleanSessionFlg();
+	bool isCleanSession();
 	uint16_t serialize(uint8_t* buf);
 private:
 	uint8_t _connectFlags;
@@ -857,19 +880,23 @@ public:
 	MQTTPublish();
 	~MQTTPublish();
 	void setMessageId(uint16_t);
-	void setPayload(uint8_t*, uint8_t);
+	void setPayload(uint8_t*, uint32_t);
+	void setPayload(PacketBuffer*, uint8_t*, uint32_t);
 	void setTopic(string*);
 	string* getTopic();
 	uint16_t getMessageId();
 	uint8_t* getPayload();
-	uint8_t  getPayloadLength();
+	uint32_t getPayloadLength();
+	PacketBuffer* getPayloadBuffer();
 
-	uint16_t serialize(uint8_t* buf);
+	uint32_t serialize(uint8_t* buf);
+	uint16_t serializeHeader(uint8_t* buf);
 	bool deserialize(uint8_t* buf);
+	void transcode(MQTTSnPublish* src, string* topic);
 
 private:
 	//string _topic;
-	uint16_t _len;
+	uint32_t _len;
 };
 
 #endif /* MESSAGES_H_ */
@@ -0,0 +1,357 @@
+/*
+ * Metrics.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+
+#include "ProcessFramework.h"
+#include "Metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+__thread MetricsBlock* theMetricsBlock = 0;
+
+static MetricsBlock* theMetricsBlocks = 0;       // of all threads, pushed by a CAS
+static int64_t theMetricsGauges[MG_MAX];
+
+/*
+ *  The first count of a thread registers its block. Blocks are not taken
+ *  from the memory pool, which counts its own allocations, and never freed.
+ */
+MetricsBlock* metricsRegister(void){
+	void* mem;
+	if(posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(MetricsBlock)) != 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate MetricsBlock.");
+	}
+	MetricsBlock* blk = (MetricsBlock*)mem;
+	memset(blk, 0, sizeof(MetricsBlock));
+
+	blk->next = __atomic_load_n(&theMetricsBlocks, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&theMetricsBlocks, &blk->next, blk, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	theMetricsBlock = blk;
+	return blk;
+}
+
+/*
+ *  Gauges are shared by the threads, they change only with the state of a client.
+ */
+void metricsGauge(int gauge, int64_t delta){
+	__atomic_add_fetch(&theMetricsGauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+/*
+ *  Every interval-th message a thread receives is logged, 0 logs none.
+ */
+__thread MessageTrace* theCurrentTrace = 0;
+static __thread uint32_t theTraceCount = 0;
+static uint32_t theTraceSampling = TRACE_SAMPLING;
+
+void traceSetSampling(uint32_t interval){
+	__atomic_store_n(&theTraceSampling, interval, __ATOMIC_RELAXED);
+}
+
+void traceStart(MessageTrace* trace, int origin, uint8_t type, uint64_t now){
+	uint32_t interval = __atomic_load_n(&theTraceSampling, __ATOMIC_RELAXED);
+
+	memset(trace->stamps, 0, sizeof(trace->stamps));
+	trace->stamps[TP_RECV] = now;
+	trace->origin = origin;
+	trace->type = type;
+	trace->sampled = (interval && ++theTraceCount >= interval);
+	if(trace->sampled){
+		theTraceCount = 0;
+	}
+}
+
+/*
+ *  The message is written, its stages are counted by the route it took.
+ *  A stage whose points were not both passed is left out.
+ */
+void traceFinish(MessageTrace* trace, int destination, uint64_t now, const char* client){
+	int route;
+
+	if(trace->origin == TRACE_NONE){
+		return;
+	}
+	if(trace->origin == TRACE_CLIENT){
+		route = (destination == TRACE_BROKER ? TR_UPSTREAM : TR_CLIENT_REPLY);
+	}else{
+		route = (destination == TRACE_CLIENT ? TR_DOWNSTREAM : TR_BROKER_REPLY);
+	}
+	uint64_t* stamps = trace->stamps;
+	stamps[TP_WRITTEN] = now;
+	for(int i = 0; i < TS_TOTAL; i++){
+		if(stamps[i] && stamps[i + 1] >= stamps[i]){
+			METRIC_RECORD(MH_STAGE + route * TS_MAX + i, stamps[i + 1] - stamps[i]);
+		}
+	}
+	METRIC_RECORD(MH_STAGE + route * TS_MAX + TS_TOTAL, now - stamps[TP_RECV]);
+
+	if(trace->sampled && theProcess->getLogLevel() >= LOG_LEVEL_INFO){
+		TraceSample sample;
+		memcpy(sample.stamps, stamps, sizeof(sample.stamps));
+		sample.route = route;
+		sample.type = trace->type;
+		memset(sample.reserved, 0, sizeof(sample.reserved));
+		theProcess->putSample(client, (const uint8_t*)&sample, sizeof(sample));
+	}
+}
+
+/*=====================================
+        Class MetricsExporter
+ =====================================*/
+MetricsExporter::MetricsExporter(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	_startTime = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	_shmaddr = 0;
+	_page = 0;
+	_shmid = -1;
+	_threads = 0;
+	if((_data = (MetricsData*)calloc(1, sizeof(MetricsData))) == 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate MetricsData.");
+	}
+}
+
+MetricsExporter::~MetricsExporter(){
+	if(_page){
+		__atomic_store_n(&_page->magic, 0, __ATOMIC_RELEASE);    // readers look for a new page
+		shmdt(_shmaddr);
+		shmctl(_shmid, IPC_RMID, NULL);
+	}
+	free(_data);
+}
+
+/*
+ *  The page of the last run is removed, a LogMonitor still attached
+ *  to it finds the new one by the key.
+ */
+void MetricsExporter::open(void){
+	key_t key = ftok(TOMYFRAME_METRICS_KEY, 1);
+
+	if((_shmid = shmget(key, 0, 0666)) >= 0){
+		shmctl(_shmid, IPC_RMID, NULL);
+	}
+	if((_shmid = shmget(key, sizeof(MetricsPage), IPC_CREAT | IPC_EXCL | 0666)) < 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
+	}
+	if((_shmaddr = shmat(_shmid, NULL, 0)) == (void*)-1){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't attach shared memory.");
+	}
+	_page = (MetricsPage*)_shmaddr;
+	memset(_page, 0, sizeof(MetricsPage));
+	_page->size = sizeof(MetricsPage);
+	_page->startTime = _startTime;
+	__atomic_store_n(&_page->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Sums the blocks of all threads. A block is read while its thread
+ *  writes it, each value is consistent, the set is not.
+ */
+void MetricsExporter::collect(MetricsData* data){
+	int threads = 0;
+
+	memset(data, 0, sizeof(MetricsData));
+	for(MetricsBlock* blk = __atomic_load_n(&theMetricsBlocks, __ATOMIC_ACQUIRE); blk; blk = blk->next){
+		for(int i = 0; i < MC_MAX; i++){
+			data->counters[i] += __atomic_load_n(&blk->counters[i], __ATOMIC_RELAXED);
+		}
+		for(int i = 0; i < MH_MAX; i++){
+			MetricsHistogram* src = &blk->hists[i];
+			MetricsHistogram* dst = &data->hists[i];
+			dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+			dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+			uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+			if(max > dst->max){
+				dst->max = max;
+			}
+			for(int j = 0; j < METRICS_BUCKETS; j++){
+				dst->buckets[j] += __atomic_load_n(&src->buckets[j], __ATOMIC_RELAXED);
+			}
+		}
+		threads++;
+	}
+	for(int i = 0; i < MG_QUE_DEPTH; i++){
+		data->gauges[i] = __atomic_load_n(&theMetricsGauges[i], __ATOMIC_RELAXED);
+	}
+	for(int i = 0; i < MQ_MAX; i++){
+		data->gauges[MG_QUE_DEPTH + i] = (int64_t)(data->counters[MC_EVENTS_IN + i] - data->counters[MC_EVENTS_OUT + i]);
+	}
+	_threads = threads;
+}
+
+/*
+ *  Copies the sums into the page, seq is odd while the page is written.
+ */
+void MetricsExporter::publish(void){
+	struct timespec ts;
+
+	if(_page == 0){
+		return;
+	}
+	collect(_data);
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	uint32_t seq = _page->seq;
+	__atomic_store_n(&_page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&_page->data, _data, sizeof(MetricsData));
+	_page->threads = _threads;
+	_page->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	__atomic_store_n(&_page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Plain text of the current sums, a line per value.
+ */
+void MetricsExporter::write(FILE* fp){
+	char label[64];
+	struct timespec ts;
+
+	collect(_data);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	uint64_t* cnt = _data->counters;
+
+	fprintf(fp, "# TYPE tomygateway_uptime_seconds gauge\n");
+	fprintf(fp, "tomygateway_uptime_seconds %.3f\n", (now - _startTime) / 1e9);
+	fprintf(fp, "# TYPE tomygateway_threads gauge\n");
+	fprintf(fp, "tomygateway_threads %d\n", _threads);
+
+	fprintf(fp, "# TYPE tomygateway_packets_total counter\n");
+	for(int t = 0; t < MT_MAX; t++){
+		fprintf(fp, "tomygateway_packets_total{transport=\"%s\",direction=\"in\"} %llu\n", theMetricsTransports[t], (unsigned long long)cnt[MC_PACKETS_IN + t]);
+		fprintf(fp, "tomygateway_packets_total{transport=\"%s\",direction=\"out\"} %llu\n", theMetricsTransports[t], (unsigned long long)cnt[MC_PACKETS_OUT + t]);
+	}
+	fprintf(fp, "# TYPE tomygateway_bytes_total counter\n");
+	for(int t = 0; t < MT_MAX; t++){
+		fprintf(fp, "tomygateway_bytes_total{transport=\"%s\",direction=\"in\"} %llu\n", theMetricsTransports[t], (unsigned long long)cnt[MC_BYTES_IN + t]);
+		fprintf(fp, "tomygateway_bytes_total{transport=\"%s\",direction=\"out\"} %llu\n", theMetricsTransports[t], (unsigned long long)cnt[MC_BYTES_OUT + t]);
+	}
+
+	/*------ message types which have not been seen are left out ------*/
+	fprintf(fp, "# TYPE tomygateway_messages_total counter\n");
+	for(int i = 0; i < METRICS_SN_TYPES; i++){
+		if(cnt[MC_SN_IN + i]){
+			fprintf(fp, "tomygateway_messages_total{protocol=\"mqttsn\",type=\"%s\",direction=\"in\"} %llu\n", theMetricsSnTypes[i], (unsigned long long)cnt[MC_SN_IN + i]);
+		}
+		if(cnt[MC_SN_OUT + i]){
+			fprintf(fp, "tomygateway_messages_total{protocol=\"mqttsn\",type=\"%s\",direction=\"out\"} %llu\n", theMetricsSnTypes[i], (unsigned long long)cnt[MC_SN_OUT + i]);
+		}
+	}
+	for(int i = 0; i < METRICS_MQTT_TYPES; i++){
+		if(cnt[MC_MQTT_IN + i]){
+			fprintf(fp, "tomygateway_messages_total{protocol=\"mqtt\",type=\"%s\",direction=\"in\"} %llu\n", theMetricsMqttTypes[i], (unsigned long long)cnt[MC_MQTT_IN + i]);
+		}
+		if(cnt[MC_MQTT_OUT + i]){
+			fprintf(fp, "tomygateway_messages_total{protocol=\"mqtt\",type=\"%s\",direction=\"out\"} %llu\n", theMetricsMqttTypes[i], (unsigned long long)cnt[MC_MQTT_OUT + i]);
+		}
+	}
+
+	fprintf(fp, "# TYPE tomygateway_events_total counter\n");
+	for(int q = 0; q < MQ_MAX; q++){
+		fprintf(fp, "tomygateway_events_total{que=\"%s\"} %llu\n", theMetricsQues[q], (unsigned long long)cnt[MC_EVENTS_OUT + q]);
+	}
+	fprintf(fp, "# TYPE tomygateway_eventque_depth gauge\n");
+	for(int q = 0; q < MQ_MAX; q++){
+		fprintf(fp, "tomygateway_eventque_depth{que=\"%s\"} %lld\n", theMetricsQues[q], (long long)_data->gauges[MG_QUE_DEPTH + q]);
+	}
+	fprintf(fp, "# TYPE tomygateway_eventque_wait_seconds summary\n");
+	for(int q = 0; q < MQ_MAX; q++){
+		snprintf(label, sizeof(label), "que=\"%s\"", theMetricsQues[q]);
+		writeHistogram(fp, "tomygateway_eventque_wait_seconds", label, &_data->hists[MH_QUE_WAIT + q], 1e-9);
+	}
+	fprintf(fp, "# TYPE tomygateway_eventque_backlog summary\n");
+	for(int q = 0; q < MQ_MAX; q++){
+		snprintf(label, sizeof(label), "que=\"%s\"", theMetricsQues[q]);
+		writeHistogram(fp, "tomygateway_eventque_backlog", label, &_data->hists[MH_QUE_DEPTH + q], 1);
+	}
+
+	/*------ routes which no message has taken are left out ------*/
+	fprintf(fp, "# TYPE tomygateway_stage_seconds summary\n");
+	for(int r = 0; r < TR_MAX; r++){
+		if(_data->hists[MH_STAGE + r * TS_MAX + TS_TOTAL].count == 0){
+			continue;
+		}
+		for(int i = 0; i < TS_MAX; i++){
+			snprintf(label, sizeof(label), "route=\"%s\",stage=\"%s\"", theTraceRoutes[r], theTraceStages[i]);
+			writeHistogram(fp, "tomygateway_stage_seconds", label, &_data->hists[MH_STAGE + r * TS_MAX + i], 1e-9);
+		}
+	}
+
+	fprintf(fp, "# TYPE tomygateway_broker_connects_total counter\n");
+	fprintf(fp, "tomygateway_broker_connects_total %llu\n", (unsigned long long)cnt[MC_BROKER_CONNECTS]);
+	fprintf(fp, "# TYPE tomygateway_broker_connect_failures_total counter\n");
+	fprintf(fp, "tomygateway_broker_connect_failures_total %llu\n", (unsigned long long)cnt[MC_BROKER_CONNECT_FAILURES]);
+	fprintf(fp, "# TYPE tomygateway_broker_connect_seconds summary\n");
+	writeHistogram(fp, "tomygateway_broker_connect_seconds", "", &_data->hists[MH_BROKER_CONNECT], 1e-9);
+
+	fprintf(fp, "# TYPE tomygateway_clients gauge\n");
+	fprintf(fp, "tomygateway_clients{status=\"active\"} %lld\n", (long long)_data->gauges[MG_CLIENTS_ACTIVE]);
+	fprintf(fp, "tomygateway_clients{status=\"asleep\"} %lld\n", (long long)_data->gauges[MG_CLIENTS_ASLEEP]);
+	fprintf(fp, "tomygateway_clients{status=\"lost\"} %lld\n", (long long)_data->gauges[MG_CLIENTS_LOST]);
+
+	fprintf(fp, "# TYPE tomygateway_allocations_total counter\n");
+	fprintf(fp, "tomygateway_allocations_total{kind=\"pool\"} %llu\n", (unsigned long long)cnt[MC_ALLOCS]);
+	fprintf(fp, "tomygateway_allocations_total{kind=\"large\"} %llu\n", (unsigned long long)cnt[MC_LARGE_ALLOCS]);
+	fprintf(fp, "# TYPE tomygateway_frees_total counter\n");
+	fprintf(fp, "tomygateway_frees_total %llu\n", (unsigned long long)cnt[MC_FREES]);
+	fprintf(fp, "# TYPE tomygateway_pool_chunks_total counter\n");
+	fprintf(fp, "tomygateway_pool_chunks_total %llu\n", (unsigned long long)cnt[MC_POOL_CHUNKS]);
+}
+
+/*
+ *  A summary, values are multiplied by unit.
+ */
+void MetricsExporter::writeHistogram(FILE* fp, const char* name, const char* label, MetricsHistogram* hist, double unit){
+	static const double quantiles[] = {0.5, 0.9, 0.99};
+	const char* sep = (*label ? "," : "");
+
+	for(int i = 0; i < 3; i++){
+		fprintf(fp, "%s{%s%squantile=\"%g\"} %g\n", name, label, sep, quantiles[i],
+				hist->count ? metricsPercentile(hist, quantiles[i] * 100) * unit : 0.0);
+	}
+	if(*label){
+		fprintf(fp, "%s_sum{%s} %g\n", name, label, hist->sum * unit);
+		fprintf(fp, "%s_count{%s} %llu\n", name, label, (unsigned long long)hist->count);
+		fprintf(fp, "%s_max{%s} %g\n", name, label, hist->max * unit);
+	}else{
+		fprintf(fp, "%s_sum %g\n", name, hist->sum * unit);
+		fprintf(fp, "%s_count %llu\n", name, (unsigned long long)hist->count);
+		fprintf(fp, "%s_max %g\n", name, hist->max * unit);
+	}
+}
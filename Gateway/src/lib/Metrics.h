@@ -0,0 +1,181 @@
+/*
+ * Metrics.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "MetricsPage.h"
+
+#define TOMYFRAME_METRICS_KEY  "/usr/local/etc/tomygateway/config/metrics.key"
+#define METRICS_SOCKET         "/var/run/tomygateway.metrics"    // MetricsSocket overrides it
+#define METRICS_PUBLISH_MSEC   1000
+#define TRACE_SAMPLING         1000    // one of the messages is logged, TraceSampling overrides it
+
+#define METRIC_INC(counter)          metricsAdd(counter, 1)
+#define METRIC_ADD(counter, val)     metricsAdd(counter, val)
+#define METRIC_RECORD(hist, val)     metricsRecord(hist, val)
+#define METRIC_GAUGE(gauge, delta)   metricsGauge(gauge, delta)
+
+/*
+ *  Counters and histograms of a thread. Only the thread writes them,
+ *  a reader sums the blocks of all threads without a lock.
+ */
+struct MetricsBlock{
+	uint64_t counters[MC_MAX];
+	MetricsHistogram hists[MH_MAX];
+	MetricsBlock* next;      // never unlinked
+};
+
+extern __thread MetricsBlock* theMetricsBlock;
+MetricsBlock* metricsRegister(void);
+void metricsGauge(int gauge, int64_t delta);
+
+static inline MetricsBlock* metricsBlock(void){
+	MetricsBlock* blk = theMetricsBlock;
+	return (blk ? blk : metricsRegister());
+}
+
+static inline void metricsAdd(int counter, uint64_t val){
+	MetricsBlock* blk = metricsBlock();
+	__atomic_store_n(&blk->counters[counter], blk->counters[counter] + val, __ATOMIC_RELAXED);
+}
+
+static inline void metricsRecord(int hist, uint64_t val){
+	MetricsHistogram* h = &metricsBlock()->hists[hist];
+	int bucket = metricsBucketOf(val);
+	__atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + val, __ATOMIC_RELAXED);
+	if(val > h->max){
+		__atomic_store_n(&h->max, val, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ *  CLOCK_MONOTONIC in nanoseconds.
+ */
+static inline uint64_t metricsNow(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ *  Stamps of a message on its way through the gateway. The Event carries it
+ *  across the queues, the events a handler posts inherit the trace of the
+ *  event it handles.
+ */
+enum TraceSide{
+	TRACE_NONE = 0,          // not traced
+	TRACE_CLIENT,
+	TRACE_BROKER
+};
+
+struct MessageTrace{
+	uint64_t stamps[TP_MAX];    // CLOCK_MONOTONIC ns, 0 where the message has not passed
+	uint8_t  origin;            // TraceSide
+	uint8_t  type;              // of the received message, see TraceSample
+	uint8_t  sampled;           // logged when it is written
+};
+
+extern __thread MessageTrace* theCurrentTrace;
+void traceStart(MessageTrace* trace, int origin, uint8_t type, uint64_t now);
+void traceFinish(MessageTrace* trace, int destination, uint64_t now, const char* client);
+void traceSetSampling(uint32_t interval);
+
+static inline void traceStamp(MessageTrace* trace, int point, uint64_t now){
+	if(trace->origin != TRACE_NONE){
+		trace->stamps[point] = now;
+	}
+}
+
+/*
+ *  A new Event inherits the trace which is handled by the thread.
+ */
+static inline void traceInherit(MessageTrace* trace){
+	if(theCurrentTrace){
+		*trace = *theCurrentTrace;
+	}else{
+		trace->origin = TRACE_NONE;
+	}
+}
+
+static inline void traceSetCurrent(MessageTrace* trace){
+	theCurrentTrace = trace;
+}
+
+/*
+ *  The control task's queue takes a message to the handler,
+ *  the other queues take it to a send task.
+ */
+static inline void tracePosted(MessageTrace* trace, int que, uint64_t now){
+	traceStamp(trace, (que == MQ_GATEWAY ? TP_QUEUED : TP_HANDLED), now);
+}
+
+static inline void traceTaken(MessageTrace* trace, int que, uint64_t now){
+	traceStamp(trace, (que == MQ_GATEWAY ? TP_DEQUEUED : TP_TAKEN), now);
+}
+
+/*=====================================
+        Class MetricsExporter
+ =====================================*/
+/*
+ *  Sums the blocks of the threads, publishes them into the page
+ *  of shared memory and writes them as plain text.
+ */
+class MetricsExporter{
+public:
+	MetricsExporter();
+	~MetricsExporter();
+	void open(void);
+	void publish(void);
+	void write(FILE* fp);
+private:
+	void collect(MetricsData* data);
+	void writeHistogram(FILE* fp, const char* name, const char* label, MetricsHistogram* hist, double unit);
+
+	void* _shmaddr;
+	MetricsPage* _page;
+	MetricsData* _data;
+	int _shmid;
+	int _threads;
+	uint64_t _startTime;
+};
+
+#endif /* METRICS_H_ */
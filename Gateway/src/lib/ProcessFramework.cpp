@@ -52,6 +52,9 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 using namespace std;
 extern const char* theCmdlineParameter;
@@ -64,30 +67,34 @@ Process* theProcess = 0;
 MultiTaskProcess* theMultiTask = 0;
 static volatile int theSignaled = 0;
 
+static __thread LogQueue* theLogQueue = 0;
+
 static void signalHandler(int sig){
 	theSignaled = sig;
 }
 
+/*
+ *  SIGUSR1 turns the packet traces on, SIGUSR2 off.
+ */
+static void logLevelHandler(int sig){
+	theProcess->setLogLevel(sig == SIGUSR1 ? LOG_LEVEL_TRACE : LOG_LEVEL_INFO);
+}
+
 int main(int argc, char** argv){
 	try{
 		signal(SIGINT, signalHandler);
+		signal(SIGUSR1, logLevelHandler);
+		signal(SIGUSR2, logLevelHandler);
 
 		theProcess->initialize(argc, argv);
 		theProcess->run();
 	}catch(Exception& ex){
 		ex.writeMessage();
 	}
+	theProcess->flushLog();
 	return 0;
 }
 
-uint8_t* mqcalloc(uint8_t len){
-	uint8_t* pos = (uint8_t*)calloc(len, sizeof(uint8_t));
-	if( pos == 0){
-		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate memory.");
-	}
-	return pos;
-}
-
 #ifdef CPU_LITTLEENDIANN
 
 /*--- For Little endianness ---*/
@@ -153,12 +160,12 @@ void utfSerialize(uint8_t* pos, string str){
 	str.copy((char*)pos + 2, str.size(), 0);
 }
 
-char theCurrentTime[32];
+static __thread char theCurrentTime[32];
 
 char* currentDateTime() {
     time_t     now = time(0);
     struct tm  tstruct;
-    tstruct = *localtime(&now);
+    localtime_r(&now, &tstruct);
     strftime(theCurrentTime, sizeof(theCurrentTime), "%Y%m%d %H%M%S", &tstruct);
     return theCurrentTime;
 }
@@ -169,22 +176,49 @@ char* currentDateTime() {
 Process::Process(){
 	_argc = 0;
 	_argv = 0;
-	_rb = new RingBuffer();
-	_rbsem = new Semaphore(TOMYFRAME_RB_SEMAPHOR_NAME, 0);
+	_rb = 0;
+	_logQueues = 0;
+	_logQueueCnt = 0;
+	_logLevel = LOG_LEVEL_TRACE;
+	_drainThread = 0;
+	_draining = false;
 }
 
 Process::~Process(){
+	if(__atomic_load_n(&_draining, __ATOMIC_ACQUIRE)){
+		__atomic_store_n(&_draining, false, __ATOMIC_RELEASE);
+		pthread_join(_drainThread, 0);
+	}
+	drainLog();
+	while(_logQueues){
+		LogQueue* que = _logQueues;
+		_logQueues = que->getNext();
+		delete que;
+	}
 	delete(_rb);
-	delete(_rbsem);
 }
 
 void Process::run(){
 
 }
 
+/*
+ *  The RingBuffer is opened here, records written before wait in the LogQueues.
+ */
 void Process::initialize(int argc, char** argv){
+	char param[TOMYFRAME_PARAM_MAX];
+	uint32_t size = RINGBUFFER_SIZE;
+
 	_argc = argc;
 	_argv = argv;
+
+	if(getParam("LogBufferSize", param) == 0){
+		size = atoi(param) * 1024;
+	}
+	RingBuffer* rb = new RingBuffer(size);
+	_mt.lock();
+	_rb = rb;
+	_mt.unlock();
 }
 
 int Process::getArgc(){
@@ -248,32 +282,225 @@ int Process::getParam(const char* parameter, char* value){
 }
 
 
+/*-----------------------------------------
+ *   Logging, a thread writes LogRecords into its own LogQueue.
+ *   The drain thread moves them into the RingBuffer and
+ *   LogMonitor formats them.
+ ------------------------------------------*/
 void Process::putLog(const char* format, ...){
-	_mt.lock();
+	char text[PROCESS_LOG_BUFFER_SIZE];
+
+	if(getLogLevel() < LOG_LEVEL_INFO){
+		return;
+	}
 	va_list arg;
 	va_start(arg, format);
-	vsprintf(_rbdata, format, arg);
+	int len = vsnprintf(text, sizeof(text), format, arg);
 	va_end(arg);
-	if(strlen(_rbdata)){
-		_rb->put(_rbdata);
-		_rbsem->post();
+	if(len <= 0){
+		return;
+	}
+	if(len >= (int)sizeof(text)){
+		len = sizeof(text) - 1;
+	}
+	LogRecord* rec = reserveLog(getLogQueue(), LOG_RECORD_TEXT, 0, len + 1);
+	if(rec){
+		memcpy((uint8_t*)rec + rec->dataOffset, text, len + 1);
+		theLogQueue->commit();
+	}
+}
+
+/*
+ *  Packet trace, the bytes are copied as they are (two pieces at most)
+ *  and hex dumped by LogMonitor.
+ */
+void Process::putTrace(uint8_t format, const char* name, const char* arrow, const char* peer,
+		               const uint8_t* data, uint32_t length, const uint8_t* data2, uint32_t length2){
+	putRecord(LOG_RECORD_PACKET, format, name, arrow, peer, 0, data, length, data2, length2);
+}
+
+/*
+ *  Trace of a packet to or from the broker, on behalf of the client.
+ */
+void Process::putClientTrace(const char* client, uint8_t format, const char* name, const char* arrow, const char* peer,
+		               const uint8_t* data, uint32_t length, const uint8_t* data2, uint32_t length2){
+	putRecord(LOG_RECORD_PACKET, format, name, arrow, peer, client, data, length, data2, length2);
+}
+
+/*
+ *  Trace of a message which has no bytes to dump.
+ */
+void Process::putNote(uint8_t format, const char* name, const char* arrow, const char* peer, const char* note){
+	putRecord(LOG_RECORD_NOTE, format, name, arrow, peer, 0, (const uint8_t*)note, strlen(note) + 1, 0, 0);
+}
+
+/*
+ *  Stamps of a sampled message, formatted by LogMonitor.
+ */
+void Process::putSample(const char* client, const uint8_t* sample, uint32_t length){
+	putRecord(LOG_RECORD_SAMPLE, LOG_FMT_PLAIN, "", "", "", client, sample, length, 0, 0);
+}
+
+void Process::putRecord(uint8_t type, uint8_t format, const char* name, const char* arrow, const char* peer, const char* client,
+		               const uint8_t* data, uint32_t length, const uint8_t* data2, uint32_t length2){
+	uint16_t nameLen = strlen(name) + 1;
+	uint16_t arrowLen = strlen(arrow) + 1;
+	uint16_t peerLen = strlen(peer) + 1;
+	uint16_t clientLen = (client ? strlen(client) + 1 : 0);
+	uint8_t flags = (client ? LOG_FLAG_CLIENT : 0);
+
+	if(length + length2 > LOG_TRACE_MAX_BYTES){
+		flags |= LOG_FLAG_TRUNCATED;
+		if(length > LOG_TRACE_MAX_BYTES){
+			length = LOG_TRACE_MAX_BYTES;
+		}
+		length2 = LOG_TRACE_MAX_BYTES - length;
+	}
+	LogRecord* rec = reserveLog(getLogQueue(), type, format, nameLen + arrowLen + peerLen + clientLen + length + length2);
+	if(rec == 0){
+		return;
+	}
+	rec->flags = flags;
+	uint8_t* pos = (uint8_t*)rec + rec->dataOffset;
+	memcpy(pos, name, nameLen);
+	pos += nameLen;
+	memcpy(pos, arrow, arrowLen);
+	pos += arrowLen;
+	memcpy(pos, peer, peerLen);
+	pos += peerLen;
+	if(client){
+		memcpy(pos, client, clientLen);
+		pos += clientLen;
+	}
+	rec->dataOffset = pos - (uint8_t*)rec;
+	if(length){
+		memcpy(pos, data, length);
+	}
+	if(data2 && length2){
+		memcpy(pos + length, data2, length2);
+	}
+	theLogQueue->commit();
+}
+
+void Process::setLogLevel(int level){
+	__atomic_store_n(&_logLevel, level, __ATOMIC_RELAXED);
+}
+
+LogRecord* Process::reserveLog(LogQueue* que, uint8_t type, uint8_t format, uint32_t length){
+	if(que == 0){
+		return 0;
+	}
+	LogRecord* rec = que->reserve(sizeof(LogRecord) + length);
+	if(rec){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rec->length = sizeof(LogRecord) + length;
+		rec->type = type;
+		rec->format = format;
+		rec->flags = 0;
+		rec->thread = que->getThreadNo();
+		rec->dataOffset = sizeof(LogRecord);
+		rec->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	return rec;
+}
+
+/*
+ *  The LogQueue of the calling thread, created and registered by its first record.
+ */
+LogQueue* Process::getLogQueue(){
+	if(theLogQueue){
+		return theLogQueue;
+	}
+	_mt.lock();
+	LogQueue* que = new LogQueue(_logQueueCnt++);
+	que->setNext(_logQueues);
+	__atomic_store_n(&_logQueues, que, __ATOMIC_RELEASE);
+	if(!_draining){
+		__atomic_store_n(&_draining, true, __ATOMIC_RELEASE);
+		if(pthread_create(&_drainThread, 0, _drain, this) != 0){
+			_draining = false;
+		}
 	}
 	_mt.unlock();
+	theLogQueue = que;
+	return que;
 }
 
-const char* Process::getLog(){
-	int len = 0;
+void* Process::_drain(void* arg){
+	Process* process = static_cast<Process*>(arg);
+	while(__atomic_load_n(&process->_draining, __ATOMIC_ACQUIRE)){
+		if(process->drainLog() == 0){
+			usleep(LOG_DRAIN_USEC);
+		}
+	}
+	return 0;
+}
+
+/*
+ *  Moves the records of all threads into the RingBuffer,
+ *  LogMonitors are woken once per thread.
+ */
+int Process::drainLog(){
+	int cnt = 0;
+	LogRecord* rec;
+
 	_mt.lock();
-	while((len = _rb->get(_rbdata, PROCESS_LOG_BUFFER_SIZE)) == 0){
-		_rbsem->wait();
+	if(_rb == 0){
+		_mt.unlock();
+		return 0;
+	}
+	for(LogQueue* que = __atomic_load_n(&_logQueues, __ATOMIC_ACQUIRE); que; que = que->getNext()){
+		int n = 0;
+		while((rec = que->front())){
+			_rb->put((uint8_t*)rec, rec->length);
+			que->pop();
+			n++;
+		}
+		uint32_t dropped = que->getDropCount();
+		if(dropped){
+			uint8_t buf[sizeof(LogRecord) + 64];
+			rec = (LogRecord*)buf;
+			int len = snprintf((char*)buf + sizeof(LogRecord), 64, "%u log records of thread %u dropped.\n", dropped, que->getThreadNo());
+			rec->length = sizeof(LogRecord) + len + 1;
+			rec->type = LOG_RECORD_TEXT;
+			rec->format = 0;
+			rec->flags = 0;
+			rec->thread = que->getThreadNo();
+			rec->dataOffset = sizeof(LogRecord);
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			rec->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			_rb->put(buf, rec->length);
+			n++;
+		}
+		if(n){
+			_rb->notify();
+			cnt += n;
+		}
 	}
-	*(_rbdata + len) = 0;
 	_mt.unlock();
-	return _rbdata;
+	return cnt;
 }
 
-void Process::resetRingBuffer(){
-	_rb->reset();
+/*
+ *  Called before the process exits, the records left are not lost.
+ */
+void Process::flushLog(){
+	drainLog();
+}
+
+/*
+ *  Whole records, blocks until there are any. lost is the number
+ *  of bytes overwritten before this process could read them.
+ */
+int Process::getLog(uint8_t* buf, int length, uint64_t* lost){
+	int len = 0;
+	*lost = 0;
+	while((len = _rb->get(buf, length, lost)) == 0 && *lost == 0){
+		_rb->wait(RINGBUFFER_WAIT_MSEC);
+	}
+	return len;
 }
 
 int Process::checkSignal(){
@@ -493,7 +720,7 @@ Semaphore::Semaphore(const char* name,unsigned int val){
 		//perror("Semaphore");
 		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a Semaphore.");
 	}
-	_name = (char*)mqcalloc(strlen(name + 1));
+	_name = (char*)mqcalloc(strlen(name) + 1);
 	strcpy(_name, name);
 }
 
@@ -501,7 +728,7 @@ Semaphore::~Semaphore(){
 	if(_name){
 		sem_close(_psem);
 		sem_unlink(_name);
-		free((void*)_name);
+		mqfree((void*)_name);
 	}else{
 		sem_destroy(&_sem);
 	}
@@ -542,163 +769,268 @@ void Semaphore::timedwait(uint16_t millsec){
 	}
 }
 
+/*=========================================
+             Class LogQueue
+ =========================================*/
+#define LOG_QUEUE_MASK  (LOG_QUEUE_SIZE - 1)
+#define LOG_ALIGN(len)  (((len) + LOG_RECORD_ALIGN - 1) & ~(LOG_RECORD_ALIGN - 1))
+
+LogQueue::LogQueue(uint8_t threadNo){
+	_buf = (uint8_t*)malloc(LOG_QUEUE_SIZE);
+	if(_buf == 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate a LogQueue.");
+	}
+	_next = 0;
+	_threadNo = threadNo;
+	_tail = 0;
+	_reserved = 0;
+	_dropped = 0;
+	_head = 0;
+}
+
+LogQueue::~LogQueue(){
+	free(_buf);
+}
+
+/*
+ *  A record never wraps, the space left at the end
+ *  is filled by a PAD record.
+ */
+LogRecord* LogQueue::reserve(uint32_t length){
+	uint32_t len = LOG_ALIGN(length);
+	uint32_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+	uint32_t offset = _tail & LOG_QUEUE_MASK;
+	uint32_t pad = (LOG_QUEUE_SIZE - offset < len) ? LOG_QUEUE_SIZE - offset : 0;
+
+	if(length > 0xFFFF || LOG_QUEUE_SIZE - (_tail - head) < pad + len){
+		__atomic_fetch_add(&_dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if(pad){
+		LogRecord* rec = (LogRecord*)(_buf + offset);
+		rec->length = pad;
+		rec->type = LOG_RECORD_PAD;
+		offset = 0;
+	}
+	_reserved = pad + len;
+	return (LogRecord*)(_buf + offset);
+}
+
+void LogQueue::commit(void){
+	__atomic_store_n(&_tail, _tail + _reserved, __ATOMIC_RELEASE);
+	_reserved = 0;
+}
+
+LogRecord* LogQueue::front(void){
+	uint32_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+	while(_head != tail){
+		LogRecord* rec = (LogRecord*)(_buf + (_head & LOG_QUEUE_MASK));
+		if(rec->type != LOG_RECORD_PAD){
+			return rec;
+		}
+		__atomic_store_n(&_head, _head + rec->length, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+void LogQueue::pop(void){
+	LogRecord* rec = (LogRecord*)(_buf + (_head & LOG_QUEUE_MASK));
+	__atomic_store_n(&_head, _head + LOG_ALIGN(rec->length), __ATOMIC_RELEASE);
+}
+
+uint32_t LogQueue::getDropCount(void){
+	return __atomic_exchange_n(&_dropped, 0, __ATOMIC_RELAXED);
+}
+
+uint8_t LogQueue::getThreadNo(void){
+	return _threadNo;
+}
+
+LogQueue* LogQueue::getNext(void){
+	return _next;
+}
+
+void LogQueue::setNext(LogQueue* que){
+	_next = que;
+}
+
 /*=========================================
              Class RingBuffer
  =========================================*/
-RingBuffer::RingBuffer(){
+RingBuffer::RingBuffer(uint32_t size){
 	key_t key = ftok(TOMYFRAME_RINGBUFFER_KEY, 1);
+	uint32_t len = RINGBUFFER_MIN_SIZE;
 
-	if((_shmid = shmget(key, RINGBUFFER_SIZE, IPC_CREAT | IPC_EXCL | 0666)) >= 0){
-		if((_shmaddr = (uint16_t*)shmat(_shmid, NULL, 0)) > 0 ){
-			_length = (uint16_t*)_shmaddr;
-			_start = (uint16_t*)_length + sizeof(uint16_t*);
-			_end = (uint16_t*)_start + sizeof(uint16_t*);
-			_buffer = (char*)_end + sizeof(uint16_t*);
-			_createFlg = true;
-
-			*_length = RINGBUFFER_SIZE - sizeof(uint16_t*) * 3 - 16;
-			*_start = *_end = 0;
-		}else{
-			//perror("RingBuffer");
-			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't attach shared memory.");
-		}
-	}else if((_shmid = shmget(key, RINGBUFFER_SIZE, IPC_CREAT | 0666)) >= 0){
-		if((_shmaddr = (uint16_t*)shmat(_shmid, NULL, 0)) > 0 ){
-			_length = (uint16_t*)_shmaddr;
-			_start = (uint16_t*)_length + sizeof(uint16_t*);
-			_end = (uint16_t*)_start + sizeof(uint16_t*);
-			_buffer = (char*)_end + sizeof(uint16_t*);
-			_createFlg = false;
-		}else{
-			//perror("RingBuffer");
+	while(len < size && len < RINGBUFFER_MAX_SIZE){
+		len <<= 1;
+	}
+	_pos = 0;
+	if(!attach(key, len) || _header->size != len){
+		/*  a segment of an old layout or size is replaced, readers keep it until they detach  */
+		shmdt(_shmaddr);
+		shmctl(_shmid, IPC_RMID, NULL);
+		if(!attach(key, len)){
 			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
 		}
-	}else{
-		//perror("RingBuffer");
-		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
 	}
+	_mask = _header->size - 1;
 
-	_pmx = new Mutex(TOMYFRAME_RB_MUTEX_KEY);
+	/*  a reader starts from the first record unless the ring has wrapped  */
+	uint64_t head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+	_pos = (head > _header->size ? head : 0);
 }
 
+/*
+ *  The segment is kept for the next run and LogMonitor, it is removed only when replaced.
+ */
 RingBuffer::~RingBuffer(){
-	if(_createFlg){
-		if(_shmid > 0){
-			shmctl(_shmid, IPC_RMID, NULL);
-		}
-		if(_pmx > 0){
-			delete _pmx;
-		}
-	}else{
-		if(_shmid > 0){
-			shmdt(_shmaddr);
+	if(_shmid > 0){
+		shmdt(_shmaddr);
+	}
+}
+
+/*
+ *  Creates the segment or attaches to the existing one, false if its layout is not ours.
+ */
+bool RingBuffer::attach(key_t key, uint32_t size){
+	_createFlg = true;
+	if((_shmid = shmget(key, sizeof(RingHeader) + size, IPC_CREAT | IPC_EXCL | 0666)) < 0){
+		_createFlg = false;
+		if((_shmid = shmget(key, 0, 0666)) < 0){
+			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
 		}
 	}
+	if((_shmaddr = shmat(_shmid, NULL, 0)) == (void*)-1){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't attach shared memory.");
+	}
+	_header = (RingHeader*)_shmaddr;
+	_buffer = (uint8_t*)_shmaddr + sizeof(RingHeader);
+
+	if(_createFlg){
+		_header->size = size;
+		_header->waiters = 0;
+		_header->wake = 0;
+		_header->head = 0;
+		__atomic_store_n(&_header->magic, RINGBUFFER_MAGIC, __ATOMIC_RELEASE);
+		return true;
+	}
+	/*  the creator may be initializing it  */
+	for(int i = 0; i < 100 && __atomic_load_n(&_header->magic, __ATOMIC_ACQUIRE) != RINGBUFFER_MAGIC; i++){
+		usleep(10000);
+	}
+	return __atomic_load_n(&_header->magic, __ATOMIC_ACQUIRE) == RINGBUFFER_MAGIC;
 }
 
-void RingBuffer::put(char* data){
-	_pmx->lock();
+RingSlot* RingBuffer::slotAt(uint64_t pos){
+	return (RingSlot*)(_buffer + (pos & _mask));
+}
 
-	uint16_t dlen = strlen(data);
-	uint16_t blen = *_length - *_end;
+/*
+ *  A record never wraps, the space left at the end is filled by a pad slot.
+ *  Returns false when the record is larger than the ring.
+ */
+bool RingBuffer::put(const uint8_t* data, uint16_t length){
+	uint32_t len = (sizeof(RingSlot) + length + sizeof(RingSlot) - 1) & ~(sizeof(RingSlot) - 1);
+	uint64_t head = __atomic_load_n(&_header->head, __ATOMIC_RELAXED);
+	uint32_t pad;
 
-	if(*_end > *_start){
-		if(dlen < blen){
-			strncpy(_buffer + *_end, data, dlen);
-			if(*_end - *_start == 1){ // Buffer is empty.
-				*_start = *_end;
-			}
-			*_end += dlen;
-		}else{
-			strncpy(_buffer + *_end, data, blen);
-			strncpy(_buffer, data + blen, dlen - blen);
-			if(*_end - *_start == 1){ // Buffer is empty.
-				*_start = *_end;
-				*_end = dlen - blen;
-			}else{
-				*_end = dlen - blen;
-				*_start = *_end + 1;
-			}
-		}
-	}else if(*_end == *_start){
-		if(dlen < blen){
-			strncpy(_buffer + *_end, data, dlen);
-			*_end += dlen;
-		}else{
-			const char* errmsg = "RingBuffer Error: data is too long";
-			strcpy(_buffer + *_end, errmsg);
-			*_end += strlen(errmsg);
-		}
-	}else{    // *_end < *_start
-		if(dlen < *_start - *_end){
-			strncpy(_buffer + *_end, data, dlen);
-			*_end += dlen;
-			*_start = *_end + 1;
-		}else {
-			if( dlen < blen){
-				strncpy(_buffer + *_end, data, dlen);
-				*_end += dlen;
-				*_start = *_end + 1;
-			}else {
-				strncpy(_buffer + *_end, data, blen);
-				strncpy(_buffer, data + blen, dlen - blen);
-				*_start = *_end;
-				*_end = dlen - blen;
-			}
-		}
+	if(len > _header->size / 2){
+		return false;
+	}
+	do{
+		uint32_t rest = _header->size - (head & _mask);
+		pad = (rest < len ? rest : 0);
+	}while(!__atomic_compare_exchange_n(&_header->head, &head, head + pad + len, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if(pad){
+		RingSlot* slot = slotAt(head);
+		slot->length = pad;
+		slot->pad = 1;
+		__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+		head += pad;
 	}
-	_pmx->unlock();
+	RingSlot* slot = slotAt(head);
+	slot->length = length;
+	slot->pad = 0;
+	memcpy(slot + 1, data, length);
+	__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-int RingBuffer::get(char* buf, int length){
+/*
+ *  Wakes the readers, a system call only when one of them sleeps.
+ */
+void RingBuffer::notify(void){
+	__atomic_add_fetch(&_header->wake, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_header->waiters, __ATOMIC_SEQ_CST)){
+		syscall(SYS_futex, &_header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+void RingBuffer::wait(uint16_t millsec){
+	struct timespec ts;
+	ts.tv_sec = millsec / 1000;
+	ts.tv_nsec = (millsec % 1000) * 1000000;
+
+	__atomic_add_fetch(&_header->waiters, 1, __ATOMIC_SEQ_CST);
+	uint32_t wake = __atomic_load_n(&_header->wake, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_header->head, __ATOMIC_ACQUIRE) == _pos){
+		syscall(SYS_futex, &_header->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+	}
+	__atomic_sub_fetch(&_header->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *  Copies as many whole records as the buffer can hold. A reader
+ *  lapped by the writers loses the records in between, the count
+ *  of bytes is added to lost and it restarts from the head.
+ */
+int RingBuffer::get(uint8_t* buf, int length, uint64_t* lost){
 	int len = 0;
-	_pmx->lock();
 
-	if(*_end > *_start){
-		if(length > *_end - *_start){
-			len = *_end - *_start;
-			if (len == 1){
-				len = 0;
-			}
-			strncpy(buf, _buffer + *_start, len);
-			*_start = *_end - 1;
-		}else{
-			len = length;
-			strncpy(buf, _buffer + *_start, len);
-			*_start = *_start + len;
+	while(true){
+		uint64_t head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+		if(_pos == head){
+			break;
+		}
+		if(head - _pos > _header->size){
+			*lost += head - _pos;
+			_pos = head;
+			break;
 		}
-	}else if(*_end < *_start){
-		int blen = *_length - *_start;
-		if(length > blen ){
-			strncpy(buf, _buffer + *_start, blen);
-			*_start = 0;
-			if(length - (blen + *_end) > 0){
-				strncpy(buf + blen , _buffer, *_end);
-				len = blen + *_end;
-				if(*_end > 0){
-					*_start = *_end - 1;
-				}
-			}else{
-				strncpy(buf + blen, _buffer, length - blen);
-				len = length;
-				*_start = length - blen;
+		RingSlot* slot = slotAt(_pos);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != _pos + 1){
+			break;                    // not completed yet
+		}
+		uint32_t rlen = slot->length;
+		bool isPad = slot->pad;
+		uint32_t span = (isPad ? rlen : (sizeof(RingSlot) + rlen + sizeof(RingSlot) - 1) & ~(sizeof(RingSlot) - 1));
+
+		if(!isPad && len + (int)rlen > length){
+			if(len > 0){
+				break;
 			}
-		}else{
-			strncpy(buf, _buffer + *_start, length);
-			*_start += length;
-			len = length;
+			span = (rlen > _header->size ? 0 : span);    // never fits, skipped
+		}else if(!isPad){
+			memcpy(buf + len, slot + 1, rlen);
+		}
+
+		/*  the writers may have reused the slot while it was copied  */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+		if(span == 0 || head - _pos > _header->size){
+			*lost += head - _pos;
+			_pos = head;
+			break;
+		}
+		if(!isPad && len + (int)rlen <= length){
+			len += rlen;
 		}
+		_pos += span;
 	}
-	_pmx->unlock();
 	return len;
 }
 
-void RingBuffer::reset(){
-	_pmx->lock();
-	*_start = *_end = 0;
-	_pmx->unlock();
-}
-
 /*=====================================
         Class Exception
  ======================================*/
@@ -787,7 +1119,7 @@ Timer::Timer(){
 }
 
 void Timer::start(uint32_t msec){
-  gettimeofday(&_startTime, 0);
+  clock_gettime(CLOCK_MONOTONIC, &_startTime);
   _millis = msec;
 }
 
@@ -796,16 +1128,28 @@ bool Timer::isTimeup(){
 }
 
 bool Timer::isTimeup(uint32_t msec){
-    struct timeval curTime;
-    long secs, usecs;
     if (_startTime.tv_sec == 0){
         return false;
     }else{
-        gettimeofday(&curTime, 0);
-        secs  = (curTime.tv_sec  - _startTime.tv_sec) * 1000;
-        usecs = (curTime.tv_usec - _startTime.tv_usec) / 1000.0;
-        return ((secs + usecs) > (long)msec);
+        return (getElapse() > (long)msec);
+    }
+}
+
+/*
+ *  msecs left until the time is up, 0 if it is up or the timer is stopped.
+ */
+uint32_t Timer::getRemain(){
+    if (_startTime.tv_sec == 0){
+        return 0;
     }
+    long elapse = getElapse();
+    return (elapse < (long)_millis) ? (uint32_t)(_millis - elapse) : 0;
+}
+
+long Timer::getElapse(){
+    struct timespec curTime;
+    clock_gettime(CLOCK_MONOTONIC, &curTime);
+    return (curTime.tv_sec - _startTime.tv_sec) * 1000 + (curTime.tv_nsec - _startTime.tv_nsec) / 1000000;
 }
 
 void Timer::stop(){
@@ -54,21 +54,41 @@
 #include <string>
 #include <arpa/inet.h>
 #include "Defines.h"
+#include "MemoryPool.h"
+#include "LogRecord.h"
+#include "Metrics.h"
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <errno.h>
 
 #define TOMYFRAME_PARAM_MAX     128
 #define TOMYFRAME_CONFIG_FILE      "/usr/local/etc/tomygateway/config/param.conf"
 
 #define TOMYFRAME_RINGBUFFER_KEY   "/usr/local/etc/tomygateway/config/ringbuffer.key"
-#define TOMYFRAME_RB_MUTEX_KEY     "/usr/local/etc/tomygateway/config/rbmutex.key"
-#define TOMYFRAME_RB_SEMAPHOR_NAME "/rbsemaphor"
 
 #define LOGWRITE theProcess->putLog
 //#define LOGWRITE printf
-#define RINGBUFFER_SIZE 16384
+#define LOGTRACE(format, name, arrow, peer, ...) \
+	do{ if(theProcess->getLogLevel() >= LOG_LEVEL_TRACE){ theProcess->putTrace(format, name, arrow, peer, __VA_ARGS__); } }while(0)
+#define LOGTRACE_CLIENT(client, format, name, arrow, peer, ...) \
+	do{ if(theProcess->getLogLevel() >= LOG_LEVEL_TRACE){ theProcess->putClientTrace(client, format, name, arrow, peer, __VA_ARGS__); } }while(0)
+#define LOGNOTE(format, name, arrow, peer, note) \
+	do{ if(theProcess->getLogLevel() >= LOG_LEVEL_TRACE){ theProcess->putNote(format, name, arrow, peer, note); } }while(0)
+#define RINGBUFFER_SIZE      262144    // default, LogBufferSize in KB overrides it
+#define RINGBUFFER_MIN_SIZE   16384
+#define RINGBUFFER_MAX_SIZE  (64 * 1024 * 1024)
+#define RINGBUFFER_MAGIC     0x4C4F4752    // "LOGR", layout of the shared memory
+#define RINGBUFFER_WAIT_MSEC  1000
 #define PROCESS_LOG_BUFFER_SIZE  2048
+#define LOG_QUEUE_SIZE  65536    // per thread, must be a power of 2
+#define LOG_DRAIN_USEC  10000    // interval of the log drain thread while idle
+
+#define EVENTQUE_SIZE    4096    // must be a power of 2
+#define CACHE_LINE_SIZE  64
 
 #define ERRNO_SYS_01  1   // Application Frame Error
 
@@ -120,6 +140,19 @@ private:
 /*=====================================
          Class EventQue
   ====================================*/
+/*
+ *  Bounded multi-producer / single-consumer ring.
+ *  Producers never take a lock. The consumer sleeps on an eventfd
+ *  and is woken only when it announced itself sleeping, so a burst
+ *  of posts costs one wakeup. When the ring is full post() yields
+ *  until the consumer makes room.
+ *  postDeferred() skips the wakeup; the producer calls flush() once
+ *  after a batch of posts.
+ *  drain() can also return when another descriptor (e.g. an epoll) is ready.
+ *  A queue given a MetricsQue by setMetrics() stamps each cell when it is
+ *  posted and records the wait and the depth when it is taken,
+ *  T::getTrace() is stamped as well.
+ */
 template <class T>
 class EventQue{
 public:
@@ -127,33 +160,115 @@ public:
 	~EventQue();
 	T*  wait(void);
 	T*  timedwait(uint16_t millsec);
+	int drain(int maxN, T** evs, uint16_t millsec, int pollFd = -1);
     int post(T*);
+    int postDeferred(T*);
+    void flush(void);
     int size();
+    void setMetrics(int que);
+
+private:
+    void push(T*);
+    T*   pop(void);
+    bool isEmpty(void);
+    void sleep(int millsec, int pollFd = -1);
+
+    struct Cell{
+    	uint32_t seq;
+    	T*       ev;
+    	uint64_t time;     // of the post, metered queues only
+    };
+
+    Cell*    _cells;
+    int      _efd;
+    int      _metrics;    // MetricsQue, -1 if not metered
+    char     _pad0[CACHE_LINE_SIZE];
+    uint32_t _tail;       // written by producers
+    char     _pad1[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    uint32_t _head;       // written by the consumer
+    char     _pad2[CACHE_LINE_SIZE - sizeof(uint32_t)];
+    int      _sleeping;   // consumer is (about to be) blocked on _efd
+    char     _pad3[CACHE_LINE_SIZE - sizeof(int)];
+};
+
+/*=====================================
+        Class LogQueue
+ =====================================*/
+/*
+ *  Single-producer / single-consumer queue of LogRecords,
+ *  one per thread. The thread never blocks, a record which
+ *  does not fit is dropped and counted.
+ */
+class LogQueue{
+public:
+	LogQueue(uint8_t threadNo);
+	~LogQueue();
+	LogRecord* reserve(uint32_t length);
+	void commit(void);
+	LogRecord* front(void);
+	void pop(void);
+	uint32_t getDropCount(void);
+	uint8_t getThreadNo(void);
+	LogQueue* getNext(void);
+	void setNext(LogQueue* que);
 
 private:
-    queue<T*> _que;
-    Mutex         _mutex;
-    Semaphore     _sem;
+	uint8_t*  _buf;
+	LogQueue* _next;
+	uint8_t   _threadNo;
+	char      _pad0[CACHE_LINE_SIZE];
+	uint32_t  _tail;       // written by the thread
+	uint32_t  _reserved;
+	uint32_t  _dropped;
+	char      _pad1[CACHE_LINE_SIZE - sizeof(uint32_t) * 3];
+	uint32_t  _head;       // written by the drain thread
+	char      _pad2[CACHE_LINE_SIZE - sizeof(uint32_t)];
 };
 
 /*=====================================
         Class RingBuffer
  =====================================*/
+/*
+ *  Shared memory of whole records, written by the gateway and
+ *  followed by any number of LogMonitors. Writers reserve space
+ *  with a CAS on the head and publish a record by its sequence,
+ *  no lock is taken. Every reader keeps its own position and
+ *  finds the records it was too slow for overwritten (overrun).
+ */
+struct RingHeader{
+	uint32_t magic;
+	uint32_t size;             // of the data area, a power of 2
+	uint32_t waiters;          // readers sleeping on wake
+	uint32_t wake;             // futex, incremented by notify()
+	char     pad0[CACHE_LINE_SIZE - sizeof(uint32_t) * 4];
+	uint64_t head;             // free running, next record
+	char     pad1[CACHE_LINE_SIZE - sizeof(uint64_t)];
+};
+
+struct RingSlot{
+	uint64_t seq;              // position + 1 once the record is complete
+	uint32_t length;           // of the record, of the whole slot for a pad
+	uint32_t pad;
+};
+
 class RingBuffer{
 public:
-	RingBuffer();
+	RingBuffer(uint32_t size);
 	~RingBuffer();
-	void put(char* buffer);
-	int get(char* buffer, int bufferLength);
-	void reset();
+	bool put(const uint8_t* data, uint16_t length);
+	void notify(void);
+	int get(uint8_t* buffer, int bufferLength, uint64_t* lost);
+	void wait(uint16_t millsec);
 private:
+	bool attach(key_t key, uint32_t size);
+	RingSlot* slotAt(uint64_t pos);
+
 	void* _shmaddr;
-	uint16_t* _length;
-	uint16_t* _start;
-	uint16_t* _end;
-	char* _buffer;
+	RingHeader* _header;
+	uint8_t* _buffer;
+	uint32_t _mask;
+	uint64_t _pos;             // of this reader
 	int _shmid;
-	Mutex* _pmx;
 	bool _createFlg;
 };
 
@@ -206,16 +321,34 @@ public:
 	char*  getArgv(char option);
 	int    getParam(const char* param, char* value);
 	void   putLog(const char* format, ...);
-	void   resetRingBuffer();
+	void   putTrace(uint8_t format, const char* name, const char* arrow, const char* peer,
+	                const uint8_t* data, uint32_t length, const uint8_t* data2 = 0, uint32_t length2 = 0);
+	void   putClientTrace(const char* client, uint8_t format, const char* name, const char* arrow, const char* peer,
+	                const uint8_t* data, uint32_t length, const uint8_t* data2 = 0, uint32_t length2 = 0);
+	void   putNote(uint8_t format, const char* name, const char* arrow, const char* peer, const char* note);
+	void   putSample(const char* client, const uint8_t* sample, uint32_t length);
+	int    getLogLevel(){ return __atomic_load_n(&_logLevel, __ATOMIC_RELAXED); }
+	void   setLogLevel(int level);
+	void   flushLog(void);
 	int    checkSignal();
-	const char*  getLog(void);
+	int    getLog(uint8_t* buf, int length, uint64_t* lost);
 private:
+	void   putRecord(uint8_t type, uint8_t format, const char* name, const char* arrow, const char* peer, const char* client,
+	                 const uint8_t* data, uint32_t length, const uint8_t* data2, uint32_t length2);
+	LogQueue*  getLogQueue(void);
+	LogRecord* reserveLog(LogQueue* que, uint8_t type, uint8_t format, uint32_t length);
+	int    drainLog(void);
+	static void* _drain(void*);
+
 	int _argc;
 	char** _argv;
 	RingBuffer* _rb;
-	Mutex _mt;
-	Semaphore* _rbsem;
-	char _rbdata[PROCESS_LOG_BUFFER_SIZE + 1];
+	Mutex _mt;             // registers a LogQueue and drains them
+	LogQueue* _logQueues;
+	int       _logQueueCnt;
+	int       _logLevel;
+	pthread_t _drainThread;
+	bool      _draining;      // the drain thread runs while it is true
 
 };
 
@@ -298,9 +431,11 @@ public:
     void start(uint32_t msec = 0);
     bool isTimeup(uint32_t msec);
     bool isTimeup(void);
+    uint32_t getRemain();
     void stop();
 private:
-    struct timeval _startTime;
+    long getElapse();
+    struct timespec _startTime;    // CLOCK_MONOTONIC
     uint32_t _millis;
 };
 
@@ -308,57 +443,163 @@ private:
         Class EventQue
  =====================================*/
 template<class T> EventQue<T>::EventQue(){
-
+	void* cells;
+	if(posix_memalign(&cells, CACHE_LINE_SIZE, sizeof(Cell) * EVENTQUE_SIZE) != 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate EventQue.");
+	}
+	_cells = (Cell*)cells;
+	for(uint32_t i = 0; i < EVENTQUE_SIZE; i++){
+		_cells[i].seq = i;
+		_cells[i].ev = 0;
+	}
+	_tail = _head = 0;
+	_sleeping = 0;
+	_metrics = -1;
+	if((_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't create eventfd for EventQue.");
+	}
 }
 
 template<class T> EventQue<T>::~EventQue(){
-	_mutex.lock();
-	while(!_que.empty()){
-		delete _que.front();
-		_que.pop();
+	T* ev;
+	while((ev = pop())){
+		delete ev;
 	}
-	_mutex.unlock();
+	close(_efd);
+	free(_cells);
 }
 
 template<class T> T* EventQue<T>::wait(void){
 	T* ev;
-	_sem.wait();
-	_mutex.lock();
-	ev = _que.front();
-	_que.pop();
-	_mutex.unlock();
+	while((ev = pop()) == 0){
+		sleep(-1);
+	}
 	return ev;
 }
 
 template<class T> T* EventQue<T>::timedwait(uint16_t millsec){
-	T* ev;
-	_sem.timedwait(millsec);
-	_mutex.lock();
-
-	if(_que.empty()){
-		ev = new T();
-		ev->setTimeout();
-	}else{
-		ev = _que.front();
-		_que.pop();
+	T* ev = pop();
+	if(ev == 0){
+		sleep(millsec);
+		if((ev = pop()) == 0){
+			ev = new T();
+			ev->setTimeout();
+		}
 	}
-	_mutex.unlock();
 	return ev;
 }
 
+template<class T> int EventQue<T>::drain(int maxN, T** evs, uint16_t millsec, int pollFd){
+	int cnt = 0;
+	while(cnt < maxN && (evs[cnt] = pop())){
+		cnt++;
+	}
+	if(cnt == 0){
+		sleep(millsec, pollFd);
+		while(cnt < maxN && (evs[cnt] = pop())){
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
 template<class T> int EventQue<T>::post(T* ev){
-	_mutex.lock();
-	_que.push(ev);
-	_mutex.unlock();
-	_sem.post();
+	push(ev);
+	flush();
+	return 0;
+}
+
+template<class T> int EventQue<T>::postDeferred(T* ev){
+	push(ev);
 	return 0;
 }
 
+template<class T> void EventQue<T>::flush(void){
+	/* pairs with the fence in sleep(): either we see _sleeping or the consumer sees the cell */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_sleeping, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&_sleeping, 0, __ATOMIC_ACQ_REL)){
+		uint64_t val = 1;
+		while(write(_efd, &val, sizeof(val)) < 0 && errno == EINTR);
+	}
+}
+
+template<class T> void EventQue<T>::push(T* ev){
+	Cell* cell;
+	uint32_t pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+
+	for(;;){
+		cell = &_cells[pos & (EVENTQUE_SIZE - 1)];
+		int dif = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if(dif == 0){
+			if(__atomic_compare_exchange_n(&_tail, &pos, pos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}else if(dif < 0){
+			sched_yield();         // full, wait for the consumer
+			pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+		}else{
+			pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->ev = ev;
+	if(_metrics >= 0){
+		cell->time = metricsNow();
+		tracePosted(ev->getTrace(), _metrics, cell->time);
+		METRIC_INC(MC_EVENTS_IN + _metrics);
+	}
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
 template<class T> int EventQue<T>::size(){
-	_mutex.lock();
-	int sz = _que.size();
-	_mutex.unlock();
-	return sz;
+	return (int)(__atomic_load_n(&_tail, __ATOMIC_RELAXED) - __atomic_load_n(&_head, __ATOMIC_RELAXED));
+}
+
+template<class T> void EventQue<T>::setMetrics(int que){
+	_metrics = que;
+}
+
+template<class T> T* EventQue<T>::pop(void){
+	Cell* cell = &_cells[_head & (EVENTQUE_SIZE - 1)];
+	if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != _head + 1){
+		return 0;
+	}
+	T* ev = cell->ev;
+	if(_metrics >= 0){
+		uint64_t now = metricsNow();
+		traceTaken(ev->getTrace(), _metrics, now);
+		METRIC_INC(MC_EVENTS_OUT + _metrics);
+		METRIC_RECORD(MH_QUE_WAIT + _metrics, now - cell->time);
+		METRIC_RECORD(MH_QUE_DEPTH + _metrics, __atomic_load_n(&_tail, __ATOMIC_RELAXED) - _head - 1);
+	}
+	__atomic_store_n(&cell->seq, _head + EVENTQUE_SIZE, __ATOMIC_RELEASE);
+	__atomic_store_n(&_head, _head + 1, __ATOMIC_RELAXED);
+	return ev;
+}
+
+template<class T> bool EventQue<T>::isEmpty(void){
+	Cell* cell = &_cells[_head & (EVENTQUE_SIZE - 1)];
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != _head + 1;
+}
+
+template<class T> void EventQue<T>::sleep(int millsec, int pollFd){
+	__atomic_store_n(&_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(isEmpty()){
+		struct pollfd pfd[2];
+		pfd[0].fd = _efd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = pollFd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if(poll(pfd, (pollFd < 0 ? 1 : 2), millsec) > 0 && (pfd[0].revents & POLLIN)){
+			uint64_t val;
+			while(read(_efd, &val, sizeof(val)) < 0 && errno == EINTR);
+		}
+	}
+	__atomic_store_n(&_sleeping, 0, __ATOMIC_RELAXED);
 }
 
 
@@ -0,0 +1,232 @@
+/*
+ * Resolver.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#include "Defines.h"
+#include "Resolver.h"
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+/*
+ *  Shared by all broker connections of the gateway.
+ */
+ResolverCache theResolverCache;
+
+static long monotonicSecs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*=====================================
+        Class ResolverEntry
+ =====================================*/
+ResolverEntry::ResolverEntry(const char* host, const char* service){
+	_host = host;
+	_service = service;
+	_addrCnt = 0;
+	_preferred = 0;
+	_error = 0;
+	_refreshTime = 0;
+	_expireTime = 0;
+	_resolving = false;
+}
+
+ResolverEntry::~ResolverEntry(){
+
+}
+
+bool ResolverEntry::equals(const char* host, const char* service){
+	return _host == host && _service == service;
+}
+
+/*=====================================
+        Class ResolverCache
+ =====================================*/
+ResolverCache::ResolverCache(){
+	_ttl = RESOLVER_TTL;
+	_negativeTtl = RESOLVER_NEGATIVE_TTL;
+}
+
+ResolverCache::~ResolverCache(){
+	for(vector<ResolverEntry*>::iterator it = _entries.begin(); it != _entries.end(); ++it){
+		delete *it;
+	}
+}
+
+void ResolverCache::setTTL(int ttl, int negativeTtl){
+	_mutex.lock();
+	_ttl = ttl;
+	_negativeTtl = negativeTtl;
+	_mutex.unlock();
+}
+
+/*
+ *  Returns the number of addresses, preferred address first.
+ *  0 when the host is unknown (cached for the negative TTL).
+ *
+ *  A fresh entry is returned as is. After 3/4 of the TTL one background
+ *  lookup is started and the cached addresses are used meanwhile.
+ *  Only an expired or unknown entry is looked up by the caller.
+ */
+int ResolverCache::getAddresses(const char* host, const char* service,
+		sockaddr_storage* addr, socklen_t* addrLen, int maxCnt){
+	int cnt = 0;
+	long now = monotonicSecs();
+
+	_mutex.lock();
+	ResolverEntry* entry = getEntry(host, service);
+
+	if(now < entry->_expireTime || (entry->_resolving && entry->_addrCnt)){
+		cnt = copyAddresses(entry, addr, addrLen, maxCnt);
+		if(now >= entry->_refreshTime && !entry->_resolving && entry->_addrCnt){
+			pthread_t thread;
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			entry->_resolving = true;
+			if(pthread_create(&thread, &attr, refresh, entry) != 0){
+				entry->_resolving = false;
+			}
+			pthread_attr_destroy(&attr);
+		}
+		_mutex.unlock();
+		return cnt;
+	}
+
+	entry->_resolving = true;
+	_mutex.unlock();
+
+	resolve(entry);
+
+	_mutex.lock();
+	cnt = copyAddresses(entry, addr, addrLen, maxCnt);
+	_mutex.unlock();
+	return cnt;
+}
+
+void ResolverCache::setPreferred(const char* host, const char* service, sockaddr_storage* addr){
+	_mutex.lock();
+	ResolverEntry* entry = getEntry(host, service);
+	for(int i = 0; i < entry->_addrCnt; i++){
+		if(memcmp(&entry->_addr[i], addr, entry->_addrLen[i]) == 0){
+			entry->_preferred = i;
+			break;
+		}
+	}
+	_mutex.unlock();
+}
+
+/*
+ *  called with _mutex locked
+ */
+ResolverEntry* ResolverCache::getEntry(const char* host, const char* service){
+	for(vector<ResolverEntry*>::iterator it = _entries.begin(); it != _entries.end(); ++it){
+		if((*it)->equals(host, service)){
+			return *it;
+		}
+	}
+	ResolverEntry* entry = new ResolverEntry(host, service);
+	_entries.push_back(entry);
+	return entry;
+}
+
+/*
+ *  called with _mutex locked
+ */
+int ResolverCache::copyAddresses(ResolverEntry* entry, sockaddr_storage* addr, socklen_t* addrLen, int maxCnt){
+	int cnt = 0;
+	for(int i = 0; i < entry->_addrCnt && cnt < maxCnt; i++){
+		int pos = (entry->_preferred + i) % entry->_addrCnt;
+		memcpy(&addr[cnt], &entry->_addr[pos], sizeof(sockaddr_storage));
+		addrLen[cnt] = entry->_addrLen[pos];
+		cnt++;
+	}
+	return cnt;
+}
+
+/*
+ *  Looks up the host without the lock. When the lookup fails and old
+ *  addresses exist, they are kept for another negative TTL.
+ */
+void ResolverCache::resolve(ResolverEntry* entry){
+	addrinfo hints;
+	addrinfo* result = 0;
+	sockaddr_storage addr[RESOLVER_MAX_ADDRESSES];
+	socklen_t addrLen[RESOLVER_MAX_ADDRESSES];
+	int cnt = 0;
+
+	memset(&hints, 0, sizeof(addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int err = getaddrinfo(entry->_host.c_str(), entry->_service.c_str(), &hints, &result);
+	if(err){
+		LOGWRITE("\n  \x1b[0m\x1b[31merror:\x1b[0m\x1b[37mgetaddrinfo(): %s\n",gai_strerror(err));
+	}else{
+		for(addrinfo* ai = result; ai && cnt < RESOLVER_MAX_ADDRESSES; ai = ai->ai_next){
+			memset(&addr[cnt], 0, sizeof(sockaddr_storage));
+			memcpy(&addr[cnt], ai->ai_addr, ai->ai_addrlen);
+			addrLen[cnt] = ai->ai_addrlen;
+			cnt++;
+		}
+		freeaddrinfo(result);
+	}
+
+	long now = monotonicSecs();
+	_mutex.lock();
+	entry->_error = err;
+	if(cnt){
+		memcpy(entry->_addr, addr, sizeof(sockaddr_storage) * cnt);
+		memcpy(entry->_addrLen, addrLen, sizeof(socklen_t) * cnt);
+		entry->_addrCnt = cnt;
+		entry->_preferred = 0;
+		entry->_refreshTime = now + _ttl * 3 / 4;
+		entry->_expireTime = now + _ttl;
+	}else{
+		entry->_refreshTime = now + _negativeTtl;
+		entry->_expireTime = now + _negativeTtl;
+	}
+	entry->_resolving = false;
+	_mutex.unlock();
+}
+
+void* ResolverCache::refresh(void* entry){
+	theResolverCache.resolve(static_cast<ResolverEntry*>(entry));
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Resolver.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include "ProcessFramework.h"
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+#define RESOLVER_TTL            300    // secs
+#define RESOLVER_NEGATIVE_TTL    10    // secs
+#define RESOLVER_MAX_ADDRESSES    8
+
+using namespace std;
+
+/*=====================================
+        Class ResolverEntry
+ =====================================*/
+class ResolverEntry{
+	friend class ResolverCache;
+public:
+	ResolverEntry(const char* host, const char* service);
+	~ResolverEntry();
+	bool equals(const char* host, const char* service);
+private:
+	string _host;
+	string _service;
+	sockaddr_storage _addr[RESOLVER_MAX_ADDRESSES];
+	socklen_t _addrLen[RESOLVER_MAX_ADDRESSES];
+	int  _addrCnt;
+	int  _preferred;     // address which connected last
+	int  _error;         // getaddrinfo() error of the last lookup
+	long _refreshTime;   // starts a background lookup
+	long _expireTime;
+	bool _resolving;
+};
+
+/*=====================================
+        Class ResolverCache
+ =====================================*/
+class ResolverCache{
+public:
+	ResolverCache();
+	~ResolverCache();
+	void setTTL(int ttl, int negativeTtl);
+	int  getAddresses(const char* host, const char* service,
+			sockaddr_storage* addr, socklen_t* addrLen, int maxCnt);
+	void setPreferred(const char* host, const char* service, sockaddr_storage* addr);
+private:
+	ResolverEntry* getEntry(const char* host, const char* service);
+	void resolve(ResolverEntry* entry);
+	int  copyAddresses(ResolverEntry* entry, sockaddr_storage* addr, socklen_t* addrLen, int maxCnt);
+	static void* refresh(void* entry);
+
+	vector<ResolverEntry*> _entries;
+	Mutex _mutex;
+	int _ttl;
+	int _negativeTtl;
+};
+
+extern ResolverCache theResolverCache;
+
+#endif /* RESOLVER_H_ */
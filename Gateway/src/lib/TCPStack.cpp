@@ -35,16 +35,22 @@
 
 #include "Defines.h"
 #include "TCPStack.h"
+#include "Resolver.h"
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 
 using namespace std;
-extern char* currentDateTime();
+
+int TCPStack::_pollFd = -1;
+int TCPStack::_pollCnt = 0;
 
 /*========================================
        Class TCPStack
@@ -53,12 +59,33 @@ TCPStack::TCPStack(){
     _addrinfo = 0;
     _disconReq = false;
     _sockfd = -1;
+    _pollData.ptr = this;
+    _pollFlg = false;
+    _outBuf = 0;
+    _outSize = 0;
+    _outHead = 0;
+    _outTail = 0;
+    _outLength = 0;
+    _outWait = EPOLLOUT;
+    _outEvents = 0;
+    _outPollFd = -1;
+    _inBuf = 0;
+    _inSize = 0;
+    _inHead = 0;
+    _inTail = 0;
 }
 
 TCPStack::~TCPStack(){
     if(_addrinfo){
 		freeaddrinfo(_addrinfo);
 	}
+    for(size_t i = 0; i < _outSegs.size(); i++){
+        if(_outSegs[i].buffer){
+            _outSegs[i].buffer->release();
+        }
+    }
+    free(_outBuf);
+    free(_inBuf);
 }
 
 bool TCPStack::isValid(){
@@ -73,18 +100,32 @@ bool TCPStack::isValid(){
 	return false;
 }
 
+/*
+ *  The socket is closed by the receiving task in isValid().
+ *  EPOLLOUT is added so that the task sees the socket at once.
+ */
 void TCPStack::disconnect(){
     if ( _sockfd > 0 ){
     	_disconReq = true;
-    	_sem.wait();
+    	if(_pollFlg){
+    		struct epoll_event ev;
+    		ev.events = EPOLLIN | EPOLLOUT;
+    		ev.data = _pollData;
+    		epoll_ctl(_pollFd, EPOLL_CTL_MOD, _sockfd, &ev);
+    		_sem.wait();
+    	}else{
+    		close();
+    	}
     }
 }
 
 void TCPStack::close(){
 	if(_sockfd > 0){
+		deregisterPoll();
 		::close(_sockfd);
 		_sockfd = -1;
 		_disconReq = false;
+		clearInput();
 		if(_addrinfo){
 			freeaddrinfo(_addrinfo);
 			_addrinfo = 0;
@@ -107,7 +148,7 @@ bool TCPStack::bind ( const char* service ){
 	}
 	int err = getaddrinfo(0, service, &hints, &_addrinfo);
     if (err) {
-    	LOGWRITE("\n%s   \x1b[0m\x1b[31merror:\x1b[0m\x1b[37mgetaddrinfo(): %s\n", currentDateTime(),gai_strerror(err));
+    	LOGWRITE("\n  \x1b[0m\x1b[31merror:\x1b[0m\x1b[37mgetaddrinfo(): %s\n",gai_strerror(err));
         return false;
     }
 
@@ -153,48 +194,346 @@ int TCPStack::send (const uint8_t* buf, uint16_t length  ){
 	return ::send ( _sockfd, buf, length, MSG_NOSIGNAL );
 }
 
-int TCPStack::recv ( uint8_t* buf, uint16_t len ){
-	return ::recv ( _sockfd, buf, len, 0 );
+/*------------------------------------------
+ *   Output buffer of the sending task
+ ------------------------------------------*/
+/*
+ *  Appends a packet, returns false when SOCKET_OUTPUT_MAX would be exceeded.
+ *  The last iov may be a part of shared, it is retained instead of copied.
+ */
+bool TCPStack::queue(const struct iovec* iov, int iovcnt, PacketBuffer* shared){
+	uint32_t length = 0;
+	uint32_t total = 0;
+	int copycnt = (shared ? iovcnt - 1 : iovcnt);
+
+	for(int i = 0; i < iovcnt; i++){
+		total += iov[i].iov_len;
+		if(i < copycnt){
+			length += iov[i].iov_len;
+		}
+	}
+	if(_outLength + total > SOCKET_OUTPUT_MAX){
+		return false;
+	}
+	if(_outTail + length > _outSize && _outHead > 0){
+		memmove(_outBuf, _outBuf + _outHead, _outTail - _outHead);
+		_outTail -= _outHead;
+		_outHead = 0;
+	}
+	if(_outTail + length > _outSize){
+		uint32_t size = (_outSize ? _outSize : SOCKET_OUTPUT_CHUNK);
+		while(size < _outTail + length){
+			size *= 2;
+		}
+		uint8_t* buf = (uint8_t*)realloc(_outBuf, size);
+		if(buf == 0){
+			return false;
+		}
+		_outBuf = buf;
+		_outSize = size;
+	}
+	for(int i = 0; i < copycnt; i++){
+		memcpy(_outBuf + _outTail, iov[i].iov_base, iov[i].iov_len);
+		_outTail += iov[i].iov_len;
+	}
+	if(length){
+		if(_outSegs.empty() || _outSegs.back().buffer){
+			OutputSegment seg;
+			seg.buffer = 0;
+			seg.data = 0;
+			seg.length = 0;
+			_outSegs.push_back(seg);
+		}
+		_outSegs.back().length += length;    // copied bytes follow each other in the output buffer
+	}
+	if(shared && iov[copycnt].iov_len){
+		OutputSegment seg;
+		shared->retain();
+		seg.buffer = shared;
+		seg.data = (uint8_t*)iov[copycnt].iov_base;
+		seg.length = iov[copycnt].iov_len;
+		_outSegs.push_back(seg);
+	}
+	_outLength += total;
+	return true;
 }
 
+/*
+ *  Writes the queued segments with sendmsg() without blocking.
+ *  returns the bytes left, -1 when the connection is broken.
+ */
+int TCPStack::flush(){
+	struct iovec iov[SOCKET_OUTPUT_IOV];
+	struct msghdr msg;
 
-bool TCPStack::connect ( const char* host, const char* service ){
-	if(isValid()){
-		return false;
+	_outWait = EPOLLOUT;
+	while(_outLength > 0){
+		uint32_t pos = _outHead;
+		int iovcnt = 0;
+		for(size_t i = 0; i < _outSegs.size() && iovcnt < SOCKET_OUTPUT_IOV; i++){
+			if(_outSegs[i].buffer){
+				iov[iovcnt].iov_base = _outSegs[i].data;
+			}else{
+				iov[iovcnt].iov_base = _outBuf + pos;
+				pos += _outSegs[i].length;
+			}
+			iov[iovcnt++].iov_len = _outSegs[i].length;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		int rc = ::sendmsg(_sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(rc < 0){
+			if(errno == EINTR){
+				continue;
+			}else if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			return -1;
+		}
+		consumeOutput(rc);
 	}
-	addrinfo hints;
-	memset(&hints, 0, sizeof(addrinfo));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	if (_addrinfo){
-		freeaddrinfo(_addrinfo);
+	return _outLength;
+}
+
+bool TCPStack::hasOutput(){
+	return _outLength > 0;
+}
+
+/*
+ *  Called when the connection is broken. An open socket leaves the sending task's epoll,
+ *  a closed one has already left it.
+ */
+void TCPStack::clearOutput(){
+	for(size_t i = 0; i < _outSegs.size(); i++){
+		if(_outSegs[i].buffer){
+			_outSegs[i].buffer->release();
+		}
+	}
+	_outSegs.clear();
+	_outHead = _outTail = 0;
+	_outLength = 0;
+	if(_outEvents && _sockfd > 0){
+		epoll_ctl(_outPollFd, EPOLL_CTL_DEL, _sockfd, 0);
 	}
+	_outEvents = 0;
+}
 
-	int err = getaddrinfo(host, service, &hints, &_addrinfo);
-    if (err) {
-    	LOGWRITE("\n%s   \x1b[0m\x1b[31merror:\x1b[0m\x1b[37mgetaddrinfo(): %s\n", currentDateTime(),gai_strerror(err));
-        return false;
-    }
+/*
+ *  The first segment, SSL_write() takes one buffer.
+ */
+uint8_t* TCPStack::getOutput(){
+	if(_outSegs.empty()){
+		return 0;
+	}
+	return (_outSegs.front().buffer ? _outSegs.front().data : _outBuf + _outHead);
+}
 
-	int sockfd = socket(_addrinfo->ai_family, _addrinfo->ai_socktype, _addrinfo->ai_protocol);
+uint32_t TCPStack::getOutputLength(){
+	return (_outSegs.empty() ? 0 : _outSegs.front().length);
+}
 
-    if (sockfd < 0){
-    	return false;
+void TCPStack::consumeOutput(uint32_t length){
+	while(length > 0){
+		OutputSegment* seg = &_outSegs.front();
+		uint32_t len = (length < seg->length ? length : seg->length);
+		if(seg->buffer){
+			seg->data += len;
+		}else{
+			_outHead += len;
+		}
+		seg->length -= len;
+		_outLength -= len;
+		length -= len;
+		if(seg->length == 0){
+			if(seg->buffer){
+				seg->buffer->release();
+			}
+			_outSegs.pop_front();
+		}
 	}
-	int on = 1;
+	if(_outLength == 0){
+		_outHead = _outTail = 0;
+	}
+}
+
+/*
+ *  The event flush() waits for, EPOLLOUT unless TLS has to read first.
+ */
+void TCPStack::setOutputWait(uint32_t events){
+	_outWait = events;
+}
+
+/*
+ *  The sending task's epoll watches the connection while output is left.
+ */
+void TCPStack::watchOutput(int epfd, bool on){
+	uint32_t events = (on ? _outWait : 0);
+
+	if(_sockfd < 0 || events == _outEvents){
+		return;
+	}
+	if(events){
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data = _pollData;
+		if(epoll_ctl(epfd, (_outEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), _sockfd, &ev) < 0){
+			if(errno == EEXIST){
+				epoll_ctl(epfd, EPOLL_CTL_MOD, _sockfd, &ev);
+			}else if(errno == ENOENT){
+				epoll_ctl(epfd, EPOLL_CTL_ADD, _sockfd, &ev);
+			}
+		}
+	}else{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, _sockfd, 0);
+	}
+	_outEvents = events;
+	_outPollFd = epfd;
+}
+
+/*-----------------------------------------
+ *   Input buffer of the receiving task
+ ------------------------------------------*/
+/*
+ *  Returns room for length bytes after the buffered ones,
+ *  0 when SOCKET_INPUT_MAX would be exceeded.
+ */
+uint8_t* TCPStack::reserveInput(uint32_t length){
+	if(_inTail + length > _inSize && _inHead > 0){
+		memmove(_inBuf, _inBuf + _inHead, _inTail - _inHead);
+		_inTail -= _inHead;
+		_inHead = 0;
+	}
+	if(_inTail + length > _inSize){
+		uint32_t size = (_inSize ? _inSize : SOCKET_INPUT_CHUNK);
+		while(size < _inTail + length){
+			size *= 2;
+		}
+		if(size > SOCKET_INPUT_MAX){
+			size = SOCKET_INPUT_MAX;
+			if(_inTail + length > size){
+				return 0;
+			}
+		}
+		uint8_t* buf = (uint8_t*)realloc(_inBuf, size);
+		if(buf == 0){
+			return 0;
+		}
+		_inBuf = buf;
+		_inSize = size;
+	}
+	return _inBuf + _inTail;
+}
+
+void TCPStack::commitInput(uint32_t length){
+	_inTail += length;
+}
+
+/*
+ *  Takes the next complete MQTT packet out of the buffer.
+ *  The Remaining Length is decoded from the bytes received so far,
+ *  returns the packet length, 0 when more bytes are needed,
+ *  -1 when the stream is malformed or the packet exceeds MQTT_MAX_PACKET_SIZE.
+ *  The packet is valid until the next reserveInput().
+ */
+int TCPStack::getPacket(uint8_t** packet){
+	uint32_t avail = _inTail - _inHead;
+	uint8_t* pos = _inBuf + _inHead;
+	uint32_t remainLength = 0;
+	uint32_t multiplier = 1;
+	uint32_t i = 1;
+
+	for(;; i++){
+		if(i > 4){
+			return -1;
+		}
+		if(i >= avail){
+			return 0;
+		}
+		remainLength += (pos[i] & 0x7f) * multiplier;
+		multiplier *= 128;
+		if((pos[i] & 0x80) == 0){
+			break;
+		}
+	}
+	uint32_t length = 1 + i + remainLength;
+	if(length > MQTT_MAX_PACKET_SIZE){
+		return -1;
+	}
+	if(length > avail){
+		return 0;
+	}
+	*packet = pos;
+	_inHead += length;
+	if(_inHead == _inTail){
+		_inHead = _inTail = 0;
+	}
+	return length;
+}
+
+/*
+ *  Bytes in the socket's receive queue, the size of the next read.
+ */
+int TCPStack::getReadableLength(){
+	int length = 0;
+	if(ioctl(_sockfd, FIONREAD, &length) < 0){
+		return 0;
+	}
+	return length;
+}
+
+void TCPStack::clearInput(){
+	_inHead = _inTail = 0;
+}
+
+/*
+ *  returns -1 when the connection is closed or broken, 0 when no data.
+ */
+int TCPStack::recv ( uint8_t* buf, uint16_t len ){
+	int rc = ::recv ( _sockfd, buf, len, MSG_DONTWAIT );
+	if(rc == 0){
+		return -1;
+	}else if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return 0;
+	}
+	return rc;
+}
+
 
-	if ( setsockopt (sockfd, SOL_SOCKET, SO_REUSEADDR, ( const char* ) &on, sizeof ( on ) ) == -1 ){
+/*
+ *  Addresses come from the gateway-wide resolver cache and are tried in turn.
+ */
+bool TCPStack::connect ( const char* host, const char* service ){
+	sockaddr_storage addr[RESOLVER_MAX_ADDRESSES];
+	socklen_t addrLen[RESOLVER_MAX_ADDRESSES];
+
+	if(isValid()){
 		return false;
 	}
 
-	if( ::connect (sockfd, _addrinfo->ai_addr,  _addrinfo->ai_addrlen ) <0){
+	int cnt = theResolverCache.getAddresses(host, service, addr, addrLen, RESOLVER_MAX_ADDRESSES);
+
+	for(int i = 0; i < cnt; i++){
+		int sockfd = socket(addr[i].ss_family, SOCK_STREAM, 0);
+		if (sockfd < 0){
+			return false;
+		}
+		int on = 1;
+
+		if ( setsockopt (sockfd, SOL_SOCKET, SO_REUSEADDR, ( const char* ) &on, sizeof ( on ) ) == -1 ){
+			::close(sockfd);
+			return false;
+		}
+
+		if( ::connect (sockfd, (struct sockaddr*)&addr[i], addrLen[i]) == 0){
+			theResolverCache.setPreferred(host, service, &addr[i]);
+			_sockfd = sockfd;
+			return true;
+		}
 		//perror("TCPStack connect");
 		::close(sockfd);
-	    return false;
 	}
-
-	_sockfd = sockfd;
-	return true;
+	return false;
 }
 
 void TCPStack::setNonBlocking ( const bool b ){
@@ -213,3 +552,41 @@ void TCPStack::setNonBlocking ( const bool b ){
 	}
 	fcntl ( _sockfd,  F_SETFL,opts );
 }
+
+/*------------------------------------------
+ *   epoll of the receiving task
+ ------------------------------------------*/
+void TCPStack::setPollFd(int epfd){
+	_pollFd = epfd;
+}
+
+void TCPStack::setPollData(uint64_t data){
+	_pollData.u64 = data;
+}
+
+int TCPStack::getPollCount(){
+	return __atomic_load_n(&_pollCnt, __ATOMIC_RELAXED);
+}
+
+bool TCPStack::registerPoll(){
+	if(_pollFd < 0 || _pollFlg || _sockfd < 0){
+		return false;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data = _pollData;
+	if(epoll_ctl(_pollFd, EPOLL_CTL_ADD, _sockfd, &ev) < 0){
+		return false;
+	}
+	_pollFlg = true;
+	__atomic_add_fetch(&_pollCnt, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+void TCPStack::deregisterPoll(){
+	if(_pollFlg){
+		epoll_ctl(_pollFd, EPOLL_CTL_DEL, _sockfd, 0);
+		_pollFlg = false;
+		__atomic_sub_fetch(&_pollCnt, 1, __ATOMIC_RELAXED);
+	}
+}
@@ -39,19 +39,39 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <string>
+#include <deque>
 #include <arpa/inet.h>
 #include "Defines.h"
 #include "Messages.h"
 
 #define SOCKET_MAXCONNECTIONS  5
 #define SOCKET_MAXBUFFER_LENGTH 1280 // buffer size
+#define SOCKET_OUTPUT_CHUNK    4096  // initial size of the output buffer
+#define SOCKET_OUTPUT_MAX    262144  // output buffer limit, the broker is assumed dead beyond it
+#define SOCKET_OUTPUT_IOV        64  // segments written by one sendmsg()
+#define SOCKET_INPUT_CHUNK     4096  // initial size of the input buffer
+#define SOCKET_INPUT_MAX     327680  // input buffer limit, an MQTT packet and a read
+#define SOCKET_READ_MAX       65535  // largest single read
+#define MQTT_MAX_PACKET_SIZE 262144  // larger packets from the broker close the connection
 
 using namespace std;
 
+/*
+ *  Queued output, either bytes copied into the output buffer
+ *  or a part of a shared PacketBuffer which is retained until it is sent.
+ */
+struct OutputSegment{
+	PacketBuffer* buffer;    // 0 when the bytes are in the output buffer
+	uint8_t* data;           // first byte not sent yet, shared bytes only
+	uint32_t length;         // bytes not sent yet
+};
+
 /*========================================
        Class TCPStack
  =======================================*/
@@ -77,12 +97,57 @@ public:
 
 	bool isValid();
 	int getSock(){return _sockfd;}
+
+	// Receiving task's epoll
+	void setPollData(uint64_t data);
+	static void setPollFd(int epfd);
+	static int getPollCount();
+
+	// Output buffer, used by the sending task only
+	bool queue( const struct iovec* iov, int iovcnt, PacketBuffer* shared = 0 );
+	int  flush();
+	bool hasOutput();
+	void clearOutput();
+	void watchOutput( int epfd, bool on );
+
+	// Input buffer, used by the receiving task only
+	uint8_t* reserveInput( uint32_t length );
+	void commitInput( uint32_t length );
+	int  getPacket( uint8_t** packet );
+	int  getReadableLength();
+	void clearInput();
+protected:
+	bool registerPoll();
+	void deregisterPoll();
+	uint8_t* getOutput();
+	uint32_t getOutputLength();
+	void consumeOutput( uint32_t length );
+	void setOutputWait( uint32_t events );
 private:
 	int _sockfd;
 	addrinfo* _addrinfo;
 	Semaphore _sem;
 	bool   _disconReq;
+	epoll_data_t _pollData;    // handle of the owner, this by default
+	bool   _pollFlg;
+
+	uint8_t* _outBuf;
+	uint32_t _outSize;
+	uint32_t _outHead;     // first byte not sent yet
+	uint32_t _outTail;
+	uint32_t _outLength;   // bytes of all segments
+	deque<OutputSegment> _outSegs;
+	uint32_t _outWait;     // EPOLLOUT, or EPOLLIN while TLS waits for the peer
+	uint32_t _outEvents;   // events in the sending task's epoll
+	int      _outPollFd;
+
+	uint8_t* _inBuf;
+	uint32_t _inSize;
+	uint32_t _inHead;      // first byte of the next packet
+	uint32_t _inTail;
 
+	static int _pollFd;
+	static int _pollCnt;
 };
 
 
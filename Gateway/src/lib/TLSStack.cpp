@@ -36,6 +36,7 @@
 #include "Defines.h"
 #include "TLSStack.h"
 #include <string.h>
+#include <sys/epoll.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
@@ -111,6 +112,7 @@ bool TLSStack::connect ( const char* host, const char* service ){
 		return false;
 	}
 	if(!_secureFlg){
+		registerPoll();
 		return true;
 	}
 
@@ -121,9 +123,11 @@ bool TLSStack::connect ( const char* host, const char* service ){
 		return false;
 	}
 
+	SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 	rc = SSL_set_fd(ssl, TCPStack::getSock());
 	if(rc == 0){
 		SSL_free(ssl);
+		TCPStack::close();
 		return false;
 	}
 
@@ -136,12 +140,14 @@ bool TLSStack::connect ( const char* host, const char* service ){
 		ERR_error_string_n(ERR_get_error(), errmsg, sizeof(errmsg));
 		LOGWRITE("SSL_connect() %s\n",errmsg);
 		SSL_free(ssl);
+		TCPStack::close();
 		return false;
 	}
 
 	if(SSL_get_verify_result(ssl) != X509_V_OK){
 		LOGWRITE("SSL_get_verify_result() error: Certificate doesn't verify.\n");
 		SSL_free(ssl);
+		TCPStack::close();
 		return false;
 	}
 
@@ -150,82 +156,74 @@ bool TLSStack::connect ( const char* host, const char* service ){
 	if(strcasecmp(peer_CN, host)){
 		LOGWRITE("SSL_get_peer_certificate() error: Broker dosen't much host name.\n");
 		SSL_free(ssl);
+		TCPStack::close();
 		return false;
 	}
 	if(_session == 0){
 		_session = sess;
 	}
 	_ssl = ssl;
+	setNonBlocking(true);    // SSL_write() of the sending task must not block
+	registerPoll();
 	return true;
 }
 
 
-int TLSStack::send (const uint8_t* buf, uint16_t length  ){
-	char errmsg[256];
-	fd_set rset;
-	fd_set wset;
-	bool writeBlockedOnRead = false;
-	int bpos = 0;
-
-	if(_secureFlg){
-		_mutex.lock();
-		_busy = true;
-
-		while(true){
-			FD_ZERO(&rset);
-			FD_ZERO(&wset);
-			FD_SET(getSock(), &rset);
-			FD_SET(getSock(), &wset);
-
-			int activity =  select( getSock() + 1 , &rset , &wset , 0 , 0);
-			if (activity > 0){
-				if(FD_ISSET(getSock(),&wset) ||
-					(writeBlockedOnRead && FD_ISSET(getSock(),&rset))){
+/*
+ *  SSL_write() encrypts into its own buffer, a shared payload is copied
+ *  so that the queued packets stay in one segment.
+ */
+bool TLSStack::queue(const struct iovec* iov, int iovcnt, PacketBuffer* shared){
+	return TCPStack::queue(iov, iovcnt, (_secureFlg ? 0 : shared));
+}
 
-					writeBlockedOnRead = false;
-					int r = SSL_write(_ssl, buf + bpos, length);
+/*
+ *  The queued packets go out in one SSL_write(). Partial writes are
+ *  allowed, the rest waits for EPOLLOUT of the sending task,
+ *  or for EPOLLIN when the TLS session has to read first.
+ *  returns the bytes left, -1 when the connection is broken.
+ */
+int TLSStack::flush(){
+	char errmsg[256];
+	int rc = 0;
 
-					switch(SSL_get_error(_ssl, r)){
-					case SSL_ERROR_NONE:
-						length -= r;
-						bpos += r;
-						if( length == 0){
-							_busy = false;
-							_mutex.unlock();
-							return bpos;
-						}
-						break;
-					case SSL_ERROR_WANT_WRITE:
-						break;
-					case SSL_ERROR_WANT_READ:
-						writeBlockedOnRead = true;
-						break;
-					default:
-						ERR_error_string_n(ERR_get_error(), errmsg, sizeof(errmsg));
-						LOGWRITE("TLSStack::send() default %s\n",errmsg);
-						_busy = false;
-						_mutex.unlock();
-						return -1;
-					}
-				}
-			}
+	if(!_secureFlg){
+		return TCPStack::flush();
+	}
+	_mutex.lock();
+	_busy = true;
+	setOutputWait(EPOLLOUT);
+	while(_ssl && getOutputLength() > 0){
+		int w = SSL_write(_ssl, getOutput(), getOutputLength());
+		int err = SSL_get_error(_ssl, w);
+		if(err == SSL_ERROR_NONE){
+			consumeOutput(w);
+		}else if(err == SSL_ERROR_WANT_WRITE){
+			break;
+		}else if(err == SSL_ERROR_WANT_READ){
+			setOutputWait(EPOLLIN);
+			break;
+		}else{
+			ERR_error_string_n(ERR_get_error(), errmsg, sizeof(errmsg));
+			LOGWRITE("TLSStack::flush() %s\n",errmsg);
+			rc = -1;
+			break;
 		}
-	}else{
-		return TCPStack::send (buf, length);
 	}
+	_busy = false;
+	_mutex.unlock();
+	return (rc < 0 ? rc : (int)getOutputLength());
 }
 
 
+/*
+ *  The socket is non-blocking, a record which is not complete yet
+ *  is read when the next EPOLLIN comes.
+ *  returns -1 when the connection is closed or broken, 0 when no data.
+ */
 int TLSStack::recv ( uint8_t* buf, uint16_t len ){
 	char errmsg[256];
-	bool writeBlockedOnRead = false;
-	bool readBlockedOnWrite = false;
-	bool readBlocked = false;
-	int rlen = 0;
 	int bpos = 0;
-	fd_set rset;
-	fd_set wset;
-
 
 	if(_secureFlg){
 		if(_busy){
@@ -234,63 +232,34 @@ int TLSStack::recv ( uint8_t* buf, uint16_t len ){
 		_mutex.lock();
 		_busy = true;
 
-	loop:
-		do{
-			readBlockedOnWrite = false;
-			readBlocked = false;
-
-			rlen = SSL_read(_ssl, buf + bpos, len - bpos);
+		while(_ssl && bpos < len){
+			int rlen = SSL_read(_ssl, buf + bpos, len - bpos);
 
 			switch (SSL_get_error(_ssl, rlen)){
-				case SSL_ERROR_NONE:
-					_busy = false;
-					_mutex.unlock();
-					return rlen + bpos;
-					break;
-				case SSL_ERROR_ZERO_RETURN:
-					SSL_shutdown(_ssl);
-					_ssl = 0;
-					TCPStack::close();
-					_busy = false;
-					_mutex.unlock();
-					return -1;
-					break;
-				case SSL_ERROR_WANT_READ:
-					readBlocked = true;
-					break;
-				case SSL_ERROR_WANT_WRITE:
-					readBlockedOnWrite = true;
-					break;
-				default:
-					ERR_error_string_n(ERR_get_error(), errmsg, sizeof(errmsg));
-					LOGWRITE("TLSStack::recv() default %s\n", errmsg);
-					_busy = false;
-					_mutex.unlock();
-					return -1;
-			}
-		}while(SSL_pending(_ssl) && !readBlocked);
-
-		bpos += rlen;
-		while(true){
-			FD_ZERO(&rset);
-			FD_ZERO(&wset);
-			FD_SET(getSock(), &rset);
-			FD_SET(getSock(), &wset);
-
-			int activity =  select( getSock() + 1 , &rset , &wset , 0 , 0);
-			if (activity > 0){
-				if((FD_ISSET(getSock(),&rset) && !writeBlockedOnRead) ||
-					(readBlockedOnWrite && FD_ISSET(getSock(),&wset))){
-					goto loop;
+			case SSL_ERROR_NONE:
+				bpos += rlen;
+				if(SSL_pending(_ssl)){
+					continue;
 				}
-			}else{
+				break;
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				closeSSL();
+				bpos = -1;
+				break;
+			default:
 				ERR_error_string_n(ERR_get_error(), errmsg, sizeof(errmsg));
-				LOGWRITE("TLSStack::recv() select %s\n",errmsg);
-				_busy = false;
-				_mutex.unlock();
-				return -1;
+				LOGWRITE("TLSStack::recv() default %s\n", errmsg);
+				bpos = -1;
+				break;
 			}
+			break;
 		}
+		_busy = false;
+		_mutex.unlock();
+		return bpos;
 	}
 	return TCPStack::recv (buf, len);
 }
@@ -302,10 +271,13 @@ bool TLSStack::isValid(){
 	}
 	if(_ssl){
 		if(_disconReq){
+			_mutex.lock();
 			SSL_shutdown(_ssl);
+			SSL_free(_ssl);
 			_ssl = 0;
-			TCPStack::close();
+			_mutex.unlock();
 			_disconReq = false;
+			TCPStack::isValid();   // closes the socket and releases disconnect()
 		}else{
 			return true;
 		}
@@ -313,6 +285,28 @@ bool TLSStack::isValid(){
 	return false;
 }
 
+/*
+ *  Close by the receiving task itself, never waits.
+ */
+void TLSStack::close(){
+	if(_secureFlg){
+		_mutex.lock();
+		closeSSL();
+		_mutex.unlock();
+	}else{
+		TCPStack::close();
+	}
+}
+
+void TLSStack::closeSSL(){
+	if(_ssl){
+		SSL_shutdown(_ssl);
+		SSL_free(_ssl);
+		_ssl = 0;
+	}
+	TCPStack::close();
+}
+
 void TLSStack::disconnect(){
     if (_ssl){
     	_disconReq = true;
@@ -59,8 +59,10 @@ public:
 
 	bool connect( const char* host, const char* service );
 	void disconnect();
-	int send( const uint8_t* buf, uint16_t length );
+	bool queue( const struct iovec* iov, int iovcnt, PacketBuffer* shared = 0 );
+	int  flush();
 	int  recv ( uint8_t* buf, uint16_t len );
+	void close();
 
 	bool isValid();
 	bool isSecure();
@@ -71,6 +73,8 @@ private:
 	static int  _numOfInstance;
 	static SSL_SESSION* _session;
 
+	void closeSSL();
+
 	SSL*     _ssl;
 	bool   _secureFlg;
 	bool   _disconReq;
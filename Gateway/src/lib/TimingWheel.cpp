@@ -0,0 +1,235 @@
+/*
+ * TimingWheel.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#include "TimingWheel.h"
+#include <time.h>
+
+/*=====================================
+        Class WheelTimer
+ =====================================*/
+WheelTimer::WheelTimer(){
+	_next = 0;
+	_prev = 0;
+	_wheel = 0;
+	_expire = 0;
+}
+
+WheelTimer::~WheelTimer(){
+	cancel();
+}
+
+bool WheelTimer::isPending(){
+	return (_next != 0);
+}
+
+/*
+ *  Re-arm on the wheel this timer was last started on.
+ */
+void WheelTimer::restart(uint32_t msec){
+	if(_wheel){
+		_wheel->start(this, msec);
+	}
+}
+
+void WheelTimer::cancel(){
+	if(_wheel){
+		_wheel->stop(this);
+	}
+}
+
+/*=====================================
+        Class TimingWheel
+ =====================================*/
+TimingWheel::TimingWheel(){
+	for(int i = 0; i < WHEEL_LEVELS; i++){
+		for(int j = 0; j < WHEEL_SLOTS; j++){
+			_slots[i][j]._next = &_slots[i][j];
+			_slots[i][j]._prev = &_slots[i][j];
+		}
+	}
+	_tick = 0;
+	_timerCnt = 0;
+	_baseMsec = getMonotonicMsec();
+}
+
+TimingWheel::~TimingWheel(){
+	for(int i = 0; i < WHEEL_LEVELS; i++){
+		for(int j = 0; j < WHEEL_SLOTS; j++){
+			WheelLink* head = &_slots[i][j];
+			while(head->_next != head){
+				WheelLink* link = head->_next;
+				head->_next = link->_next;
+				link->_next = 0;
+				link->_prev = 0;
+			}
+		}
+	}
+}
+
+uint64_t TimingWheel::getMonotonicMsec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ *  The timer fires on the first tick at or after msec from now.
+ */
+void TimingWheel::start(WheelTimer* timer, uint32_t msec){
+	stop(timer);
+	timer->_wheel = this;
+	timer->_expire = (getMonotonicMsec() - _baseMsec + msec + WHEEL_TICK_MSEC - 1) / WHEEL_TICK_MSEC;
+	add(timer);
+	_timerCnt++;
+}
+
+void TimingWheel::stop(WheelTimer* timer){
+	if(timer->_next){
+		timer->_prev->_next = timer->_next;
+		timer->_next->_prev = timer->_prev;
+		timer->_next = 0;
+		timer->_prev = 0;
+		_timerCnt--;
+	}
+}
+
+/*
+ *  Level n holds the timers which expire within 64^(n+1) ticks,
+ *  slotted by bits [6n, 6n+6) of the expiry tick.
+ */
+void TimingWheel::add(WheelTimer* timer){
+	if(timer->_expire < _tick){
+		timer->_expire = _tick;
+	}
+	uint64_t delta = timer->_expire - _tick;
+	if(delta >= (1ULL << (WHEEL_LEVELS * WHEEL_SLOT_BITS))){
+		timer->_expire = _tick + (1ULL << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1;
+		delta = timer->_expire - _tick;
+	}
+
+	int level = 0;
+	while(level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_SLOT_BITS))){
+		level++;
+	}
+	WheelLink* head = &_slots[level][(timer->_expire >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK];
+
+	timer->_next = head;
+	timer->_prev = head->_prev;
+	head->_prev->_next = timer;
+	head->_prev = timer;
+}
+
+void TimingWheel::detach(WheelLink* head, WheelLink* list){
+	if(head->_next == head){
+		list->_next = list;
+		list->_prev = list;
+	}else{
+		list->_next = head->_next;
+		list->_prev = head->_prev;
+		list->_next->_prev = list;
+		list->_prev->_next = list;
+		head->_next = head;
+		head->_prev = head;
+	}
+}
+
+/*
+ *  Move the timers of the current slot of a level down to the lower levels.
+ *  Returns the slot index, 0 means the upper level has to be cascaded too.
+ */
+uint32_t TimingWheel::cascade(int level){
+	uint32_t idx = (_tick >> (level * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK;
+	WheelLink list;
+	detach(&_slots[level][idx], &list);
+
+	while(list._next != &list){
+		WheelTimer* timer = static_cast<WheelTimer*>(list._next);
+		list._next = timer->_next;
+		add(timer);
+	}
+	return idx;
+}
+
+/*
+ *  Fire the timers due up to now. The work per tick does not depend on
+ *  the number of timers, a timeout() may start or stop any timer.
+ */
+int TimingWheel::advance(){
+	uint64_t now = (getMonotonicMsec() - _baseMsec) / WHEEL_TICK_MSEC;
+	int cnt = 0;
+
+	if(_timerCnt == 0){
+		if(_tick <= now){
+			_tick = now + 1;
+		}
+		return 0;
+	}
+
+	while(_tick <= now){
+		uint32_t idx = _tick & WHEEL_SLOT_MASK;
+		if(idx == 0){
+			for(int level = 1; level < WHEEL_LEVELS && cascade(level) == 0; level++){
+				;
+			}
+		}
+		WheelLink list;
+		detach(&_slots[0][idx], &list);
+		_tick++;
+
+		while(list._next != &list){
+			WheelTimer* timer = static_cast<WheelTimer*>(list._next);
+			list._next = timer->_next;
+			timer->_next->_prev = &list;
+			timer->_next = 0;
+			timer->_prev = 0;
+			_timerCnt--;
+			timer->timeout();
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+/*
+ *  msecs until the next tick is due.
+ */
+uint32_t TimingWheel::getWaitMsec(){
+	if(_timerCnt == 0){
+		return WHEEL_IDLE_MSEC;
+	}
+	uint64_t next = _baseMsec + _tick * WHEEL_TICK_MSEC;
+	uint64_t now = getMonotonicMsec();
+	return (next > now) ? (uint32_t)(next - now) : 0;
+}
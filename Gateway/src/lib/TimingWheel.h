@@ -0,0 +1,100 @@
+/*
+ * TimingWheel.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef TIMINGWHEEL_H_
+#define TIMINGWHEEL_H_
+
+#include <stdint.h>
+
+#define WHEEL_TICK_MSEC        100    // resolution of the wheel
+#define WHEEL_SLOT_BITS          6
+#define WHEEL_SLOTS            (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK        (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS             4    // 64^4 ticks, about 19 days
+#define WHEEL_IDLE_MSEC       1000    // wait of a wheel without timers
+
+class TimingWheel;
+
+/*=====================================
+        Class WheelLink
+ =====================================*/
+class WheelLink{
+	friend class TimingWheel;
+protected:
+	WheelLink* _next;
+	WheelLink* _prev;
+};
+
+/*=====================================
+        Class WheelTimer
+ =====================================*/
+class WheelTimer : public WheelLink{
+	friend class TimingWheel;
+public:
+	WheelTimer();
+	virtual ~WheelTimer();
+	virtual void timeout() = 0;
+	bool isPending();
+	void restart(uint32_t msec);
+	void cancel();
+private:
+	TimingWheel* _wheel;
+	uint64_t _expire;                 // tick
+};
+
+/*=====================================
+        Class TimingWheel
+ =====================================*/
+class TimingWheel{
+public:
+	TimingWheel();
+	~TimingWheel();
+	void start(WheelTimer* timer, uint32_t msec);
+	void stop(WheelTimer* timer);
+	int  advance();
+	uint32_t getWaitMsec();
+	static uint64_t getMonotonicMsec();
+private:
+	void add(WheelTimer* timer);
+	uint32_t cascade(int level);
+	void detach(WheelLink* head, WheelLink* list);
+
+	WheelLink _slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t _tick;                   // next tick to be processed
+	uint64_t _baseMsec;
+	uint32_t _timerCnt;
+};
+
+#endif /* TIMINGWHEEL_H_ */
@@ -77,6 +77,8 @@ void Network::unicast(NWAddress128* addr128,
 		#endif
 		uint16_t addr16, uint8_t* payload, uint16_t payloadLength){
 	uint8_t ipAddress[16];
+	METRIC_INC(MC_PACKETS_OUT + MT_UDP6);
+	METRIC_ADD(MC_BYTES_OUT + MT_UDP6, payloadLength);
 	UDPPort::unicast(payload, payloadLength, addr128->getAddress(ipAddress),
 		#ifdef SCOPE_ID
 			scopeId,
@@ -85,27 +87,105 @@ void Network::unicast(NWAddress128* addr128,
 }
 
 void Network::broadcast(uint8_t* payload, uint16_t payloadLength){
+	METRIC_INC(MC_PACKETS_OUT + MT_UDP6);
+	METRIC_ADD(MC_BYTES_OUT + MT_UDP6, payloadLength);
 	UDPPort::multicast(payload, payloadLength);
 }
 
+/*
+ *  Deferred variants only stage the datagram; the payload must stay valid until flush().
+ */
+void Network::unicastDeferred(NWAddress128* addr128,
+		#ifdef SCOPE_ID
+			uint32_t scopeId,
+		#endif
+		uint16_t addr16, uint8_t* payload, uint16_t payloadLength){
+	uint8_t ipAddress[16];
+	METRIC_INC(MC_PACKETS_OUT + MT_UDP6);
+	METRIC_ADD(MC_BYTES_OUT + MT_UDP6, payloadLength);
+	UDPPort::unicastDeferred(payload, payloadLength, addr128->getAddress(ipAddress),
+		#ifdef SCOPE_ID
+			scopeId,
+		#endif
+		addr16);
+}
+
+void Network::broadcastDeferred(uint8_t* payload, uint16_t payloadLength){
+	METRIC_INC(MC_PACKETS_OUT + MT_UDP6);
+	METRIC_ADD(MC_BYTES_OUT + MT_UDP6, payloadLength);
+	UDPPort::multicastDeferred(payload, payloadLength);
+}
+
 bool Network::getResponse(NWResponse* response){
 	uint8_t ipAddress[16];
 	uint32_t scopeId = 0;
 	uint16_t portNo = 0;
+
+	memset(ipAddress, 0, 16*sizeof(uint8_t));
+	int recvLen = UDPPort::recv(response->getPayloadPtr(), MQTTSN_MAX_FRAME_SIZE, ipAddress, &scopeId, &portNo);
+	return setResponse(response, recvLen, ipAddress, scopeId, portNo);
+}
+
+/*
+ *  Receives up to maxCnt datagrams into the buffers of responses.
+ *  Valid ones are moved to the front and their number is returned.
+ */
+int Network::getResponses(NWResponse* responses[], int maxCnt){
+	uint8_t* bufs[UDP_RECV_BATCH];
+	uint8_t ipAddress[16];
+	uint32_t scopeId;
+	uint16_t portNo;
+	int valid = 0;
+
+	if(maxCnt > UDP_RECV_BATCH){
+		maxCnt = UDP_RECV_BATCH;
+	}
+	for(int i = 0; i < maxCnt; i++){
+		bufs[i] = responses[i]->getPayloadPtr();
+	}
+	int cnt = UDPPort::recv(bufs, MQTTSN_MAX_FRAME_SIZE, maxCnt);
+
+	for(int i = 0; i < cnt; i++){
+		int recvLen = UDPPort::getDatagram(i, ipAddress, &scopeId, &portNo);
+		if(recvLen > MQTTSN_MAX_FRAME_SIZE){
+			responses[i]->expand(UDPPort::getOverflow(i), recvLen - MQTTSN_MAX_FRAME_SIZE);
+		}
+		if(setResponse(responses[i], recvLen, ipAddress, scopeId, portNo)){
+			NWResponse* resp = responses[valid];
+			responses[valid++] = responses[i];
+			responses[i] = resp;
+		}
+	}
+	return valid;
+}
+
+bool Network::setResponse(NWResponse* response, int recvLen, uint8_t ipAddress[16], uint32_t scopeId, uint16_t portNo){
 	uint16_t msgLen;
 	uint8_t  msgType;
 
 	uint8_t* buf = response->getPayloadPtr();
-	memset(ipAddress, 0, 16*sizeof(uint8_t));
-	uint16_t recvLen = UDPPort::recv(buf, MQTTSN_MAX_FRAME_SIZE, ipAddress, &scopeId, &portNo);
-	if(recvLen < 0){
+	if(recvLen <= 0){
 		return false;
 	}else{
+		METRIC_INC(MC_PACKETS_IN + MT_UDP6);
+		METRIC_ADD(MC_BYTES_IN + MT_UDP6, recvLen);
 		if(buf[0] == 0x01){
+			if(recvLen < 4){
+				return false;
+			}
 			msgLen = getUint16(buf + 1);
+			if(msgLen < 4){
+				return false;
+			}
 			msgType = *(buf + 3);
 		}else{
+			if(recvLen < 2){
+				return false;
+			}
 			msgLen = (uint16_t)*(buf);
+			if(msgLen < 2){
+				return false;
+			}
 			msgType = *(buf + 1);
 		}
 		if(msgLen != recvLen){
@@ -122,8 +202,8 @@ bool Network::getResponse(NWResponse* response){
 	}
 }
 
-int Network::initialize(Udp6Config  config){
-	return UDPPort::open(config);
+int Network::initialize(Udp6Config  config, int taskNo, int taskCnt){
+	return UDPPort::open(config, taskNo, taskCnt);
 }
 
 
@@ -137,11 +217,13 @@ UDPPort::UDPPort(){
     _sockfdMulticast = -1;
 	_gPortNo = 0;
 	memset(_gIpAddr, 0, 16*sizeof(uint8_t));
-
+	_sendCnt = 0;
+	_recvOverflow = 0;
 }
 
 UDPPort::~UDPPort(){
     close();
+    free(_recvOverflow);
 }
 
 void UDPPort::close(){
@@ -155,7 +237,11 @@ void UDPPort::close(){
 	}
 }
 
-int UDPPort::open(Udp6Config config){
+/*
+ *  taskCnt > 1 opens one socket of a SO_REUSEPORT group per ClientRecvTask.
+ *  Only task 0 also opens the multicast socket and joins the group.
+ */
+int UDPPort::open(Udp6Config config, int taskNo, int taskCnt){
 
 	const int loopch = 0;
 	const int reuse = 1;
@@ -184,6 +270,11 @@ int UDPPort::open(Udp6Config config){
 	}
 
 	setsockopt(_sockfdUnicast, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if(taskCnt > 1 && setsockopt(_sockfdUnicast, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0){
+		D_NWSTACK("error SO_REUSEPORT in UDPPort::open\n");
+		close();
+		return -1;
+	}
 
 	sockaddr_in6 addru;
 	memset(&addru, 0, sizeof(addru));
@@ -194,6 +285,11 @@ int UDPPort::open(Udp6Config config){
 	if( ::bind ( _sockfdUnicast, (sockaddr*)&addru,  sizeof(addru)) <0){
 		return -1;
 	}
+	if(taskCnt > 1 && attachSteering(_sockfdUnicast, taskCnt) < 0){
+		D_NWSTACK("error SO_ATTACH_REUSEPORT_CBPF in UDPPort::open\n");
+		close();
+		return -1;
+	}
 
 	if(setsockopt(_sockfdUnicast, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loopch, sizeof(loopch)) <0 ){
 		D_NWSTACK("error IPV6_MULTICAST_LOOP in UDPPort::open\n");
@@ -201,6 +297,10 @@ int UDPPort::open(Udp6Config config){
 		return -1;
 	}
 
+	if(taskNo > 0){
+		return 0;
+	}
+
 	/*------ Create Multicast socket --------*/
 	_sockfdMulticast = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
 	if (_sockfdMulticast < 0){
@@ -257,6 +357,25 @@ int UDPPort::open(Udp6Config config){
 }
 
 
+/*
+ *  Classic BPF run by the kernel for the SO_REUSEPORT group. It returns the index of
+ *  the socket from a hash of the source address, so every datagram of a client
+ *  reaches the same ClientRecvTask whatever its source port is.
+ */
+int UDPPort::attachSteering(int sockfd, int groupSize){
+	sock_filter code[] = {
+		{ BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 20) },    // last word of the IPv6 source address
+		{ BPF_ALU | BPF_MUL | BPF_K,   0, 0, 0x9E3779B1 },                // Fibonacci hashing
+		{ BPF_ALU | BPF_RSH | BPF_K,   0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K,   0, 0, (uint32_t)groupSize },
+		{ BPF_RET | BPF_A,             0, 0, 0 },
+	};
+	sock_fprog prog;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
 int UDPPort::unicast(const uint8_t* buf, uint32_t length, uint8_t ipaddress[16],
 		#ifdef SCOPE_ID
 			uint32_t scopeId,
@@ -292,6 +411,65 @@ int UDPPort::multicast( const uint8_t* buf, uint32_t length ){
 	return unicast(buf, length,_gIpAddr, 0, _gPortNo);
 }
 
+int UDPPort::unicastDeferred(const uint8_t* buf, uint32_t length, uint8_t ipaddress[16],
+		#ifdef SCOPE_ID
+			uint32_t scopeId,
+		#endif
+		uint16_t port){
+	if(_sendCnt == UDP_SEND_BATCH){
+		flush();
+	}
+	sockaddr_in6* dest = &_sendAddr[_sendCnt];
+	memset(dest, 0, sizeof(sockaddr_in6));
+	dest->sin6_family = AF_INET6;
+	dest->sin6_port = port;
+	#ifdef SCOPE_ID
+		dest->sin6_scope_id = scopeId;
+	#endif
+	memcpy(&dest->sin6_addr, ipaddress, sizeof(dest->sin6_addr));
+
+	_sendIov[_sendCnt].iov_base = (void*)buf;
+	_sendIov[_sendCnt].iov_len = length;
+
+	msghdr* hdr = &_sendMsg[_sendCnt].msg_hdr;
+	memset(hdr, 0, sizeof(msghdr));
+	hdr->msg_name = dest;
+	hdr->msg_namelen = sizeof(sockaddr_in6);
+	hdr->msg_iov = &_sendIov[_sendCnt];
+	hdr->msg_iovlen = 1;
+	return ++_sendCnt;
+}
+
+int UDPPort::multicastDeferred(const uint8_t* buf, uint32_t length){
+	return unicastDeferred(buf, length, _gIpAddr, 0, _gPortNo);
+}
+
+/*
+ *  Sends all staged datagrams, one sendmmsg() per UDP_SEND_BATCH.
+ *  A datagram the kernel refuses is dropped as sendto() would, the rest are still sent.
+ */
+int UDPPort::flush(){
+	int sent = 0;
+	int pos = 0;
+
+	while(pos < _sendCnt){
+		int status = ::sendmmsg(_sockfdUnicast, _sendMsg + pos, _sendCnt - pos, 0);
+		if(status < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			D_NWSTACK("errno == %d in UDP6Port::sendmmsg\n", errno);
+			pos++;
+		}else{
+			sent += status;
+			pos += status;
+		}
+	}
+	D_NWSTACK("sendmmsg %d of %d datagrams\n", sent, _sendCnt);
+	_sendCnt = 0;
+	return sent;
+}
+
 int UDPPort::recv(uint8_t* buf, uint16_t len, uint8_t ipaddress[16], uint32_t* scopeIdPtr, uint16_t* portPtr){
 	fd_set recvfds;
 	int maxSock = 0;
@@ -316,6 +494,94 @@ int UDPPort::recv(uint8_t* buf, uint16_t len, uint8_t ipaddress[16], uint32_t* s
 	return 0;
 }
 
+/*
+ *  Batched receive: drains both sockets with recvmmsg() and blocks in select()
+ *  only when both are empty. Lengths and senders are read with getDatagram().
+ */
+int UDPPort::recv(uint8_t* bufs[], uint16_t len, int maxCnt){
+	fd_set recvfds;
+	int maxSock = (_sockfdMulticast > _sockfdUnicast ? _sockfdMulticast : _sockfdUnicast);
+
+	if(maxCnt > UDP_RECV_BATCH){
+		maxCnt = UDP_RECV_BATCH;
+	}
+	while(true){
+		int cnt = recvmmsg(_sockfdUnicast, bufs, len, 0, maxCnt);
+		if(_sockfdMulticast >= 0){    // only ClientRecvTask 0 has one
+			cnt += recvmmsg(_sockfdMulticast, bufs, len, cnt, maxCnt - cnt);
+		}
+		if(cnt > 0){
+			return cnt;
+		}
+		FD_ZERO(&recvfds);
+		FD_SET(_sockfdUnicast, &recvfds);
+		if(_sockfdMulticast >= 0){
+			FD_SET(_sockfdMulticast, &recvfds);
+		}
+		select(maxSock + 1, &recvfds, 0, 0, 0);
+	}
+}
+
+int UDPPort::getDatagram(int index, uint8_t ipaddress[16], uint32_t* scopeIdPtr, uint16_t* portPtr){
+	memcpy(ipaddress, &_recvAddr[index].sin6_addr, sizeof(_recvAddr[index].sin6_addr));
+	#ifdef SCOPE_ID
+		*scopeIdPtr = _recvAddr[index].sin6_scope_id;
+	#endif
+	*portPtr = (uint16_t)_recvAddr[index].sin6_port;
+
+	char straddr[INET6_ADDRSTRLEN];
+	D_NWSTACK("recved from %s/%d:%d length = %d\n",
+			inet_ntop(AF_INET6, ipaddress, straddr, sizeof(straddr)),
+			#ifdef SCOPE_ID
+				*scopeIdPtr,
+			#else
+				0,
+			#endif
+			htons(*portPtr), _recvMsg[index].msg_len);
+	return _recvMsg[index].msg_len;
+}
+
+/*
+ *  Bytes of datagram index beyond the MQTTSN_MAX_FRAME_SIZE of its buffer.
+ */
+uint8_t* UDPPort::getOverflow(int index){
+	return _recvOverflow + index * UDP_RECV_OVERFLOW;
+}
+
+int UDPPort::recvmmsg(int sockfd, uint8_t* bufs[], uint16_t len, int pos, int cnt){
+	if(cnt <= 0){
+		return 0;
+	}
+	if(_recvOverflow == 0){
+		_recvOverflow = (uint8_t*)malloc(UDP_RECV_BATCH * UDP_RECV_OVERFLOW);
+		if(_recvOverflow == 0){
+			return 0;
+		}
+	}
+	for(int i = pos; i < pos + cnt; i++){
+		_recvIov[i][0].iov_base = bufs[i];
+		_recvIov[i][0].iov_len = len;
+		_recvIov[i][1].iov_base = getOverflow(i);
+		_recvIov[i][1].iov_len = UDP_RECV_OVERFLOW;
+
+		msghdr* hdr = &_recvMsg[i].msg_hdr;
+		memset(hdr, 0, sizeof(msghdr));
+		hdr->msg_name = &_recvAddr[i];
+		hdr->msg_namelen = sizeof(sockaddr_in6);
+		hdr->msg_iov = _recvIov[i];
+		hdr->msg_iovlen = 2;
+	}
+
+	int status = ::recvmmsg(sockfd, _recvMsg + pos, cnt, MSG_DONTWAIT, 0);
+	if(status < 0){
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+			D_NWSTACK("errno == %d in UDP6Port::recvmmsg\n", errno);
+		}
+		return 0;
+	}
+	return status;
+}
+
 int UDPPort::recvfrom (int sockfd, uint8_t* buf, uint16_t len, uint8_t flags, uint8_t ipaddress[16], uint32_t* scopeIdPtr, uint16_t* portPtr ){
 	sockaddr_in6 sender;
 	socklen_t addrlen = sizeof(sender);
@@ -379,10 +645,45 @@ bool NWAddress128::operator==(NWAddress128& addr){
  =========================================*/
 NWResponse::NWResponse(){
     _addr16 = 0;
-    memset( _frameDataPtr, 0, MQTTSN_MAX_FRAME_SIZE);
+    _len = 0;
+    _buffer = PacketBuffer::create(MQTTSN_MAX_FRAME_SIZE);
+    _frameDataPtr = _buffer->getData();
+}
+
+NWResponse::~NWResponse(){
+    _buffer->release();
+}
+
+PacketBuffer* NWResponse::getPacketBuffer(){
+	return _buffer;
+}
+
+/*
+ *  Makes the response ready for the next datagram.
+ *  The buffer is kept unless a message absorbed it.
+ */
+void NWResponse::recycle(){
+	if(_buffer->isShared() || _buffer->getSize() != MQTTSN_MAX_FRAME_SIZE){
+		_buffer->release();
+		_buffer = PacketBuffer::create(MQTTSN_MAX_FRAME_SIZE);
+		_frameDataPtr = _buffer->getData();
+	}
+	_len = 0;
+}
+
+/*
+ *  A datagram longer than the receive buffer, its tail is in the overflow area.
+ */
+void NWResponse::expand(const uint8_t* rest, uint16_t restLength){
+	PacketBuffer* buf = PacketBuffer::create(MQTTSN_MAX_FRAME_SIZE + restLength);
+	memcpy(buf->getData(), _frameDataPtr, MQTTSN_MAX_FRAME_SIZE);
+	memcpy(buf->getData() + MQTTSN_MAX_FRAME_SIZE, rest, restLength);
+	_buffer->release();
+	_buffer = buf;
+	_frameDataPtr = buf->getData();
 }
 
-uint8_t  NWResponse::getFrameLength(){
+uint16_t NWResponse::getFrameLength(){
 	return _len;
 }
 
@@ -422,7 +723,7 @@ void NWResponse::setMsgType(uint8_t type){
 
 
 uint8_t NWResponse::getMsgType(){
-	if(_len > 255){
+	if(_frameDataPtr[0] == 0x01){
 		return _frameDataPtr[3];
 	}else{
 		return _frameDataPtr[1];
@@ -430,7 +731,7 @@ uint8_t NWResponse::getMsgType(){
 }
 
 uint8_t* NWResponse::getBody(){
-	if(_len > 255){
+	if(_frameDataPtr[0] == 0x01){
 		return _frameDataPtr + 4;
 	}else{
 		return _frameDataPtr + 2;
@@ -438,14 +739,14 @@ uint8_t* NWResponse::getBody(){
 }
 
 uint16_t NWResponse::getBodyLength(){
-	if(_len > 255){
+	if(_frameDataPtr[0] == 0x01){
 		return getPayloadLength() - 4;
 	}else{
 		return getPayloadLength() - 2;
 	}
 }
 
-uint8_t NWResponse::getPayload(uint8_t index){
+uint8_t NWResponse::getPayload(uint16_t index){
 		return _frameDataPtr[index + 2];
 
 }
@@ -456,7 +757,7 @@ uint8_t* NWResponse::getPayloadPtr(){
 
 }
 
-uint8_t NWResponse::getPayloadLength(){
+uint16_t NWResponse::getPayloadLength(){
 
 	return _len;
 }
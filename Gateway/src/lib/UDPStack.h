@@ -49,6 +49,15 @@
 #include <unistd.h>
 #include <string>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <linux/filter.h>
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT              15
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF  51
+#endif
 
 /*
  *   MQTTS  Client's state
@@ -59,7 +68,11 @@
 #define MQTTS_DEVICE_AWAKE            3
 #define MQTTS_DEVICE_LOST             4
 
-#define MQTTSN_MAX_FRAME_SIZE      1024
+#define MQTTSN_MAX_FRAME_SIZE      1024    // receive buffer of a response
+#define MQTTSN_MAX_DATAGRAM_SIZE  65535    // 3-byte length limit
+#define UDP_RECV_OVERFLOW  (MQTTSN_MAX_DATAGRAM_SIZE - MQTTSN_MAX_FRAME_SIZE)
+#define UDP_SEND_BATCH               32    // datagrams per sendmmsg()
+#define UDP_RECV_BATCH               16    // datagrams per recvmmsg()
 
 using namespace std;
 
@@ -86,15 +99,20 @@ private:
  =============================================*/
 
 class NWResponse {
+	POOLED_ALLOCATION;
 public:
 	NWResponse();
+	~NWResponse();
 	uint8_t  getMsgType();
-	uint8_t  getFrameLength();
-	uint8_t  getPayload(uint8_t index);
+	uint16_t getFrameLength();
+	uint8_t  getPayload(uint16_t index);
 	uint8_t* getPayloadPtr();
+	PacketBuffer* getPacketBuffer();
+	void recycle();
+	void expand(const uint8_t* rest, uint16_t restLength);
 	uint8_t* getBody();
 	uint16_t getBodyLength();
-	uint8_t  getPayloadLength();
+	uint16_t getPayloadLength();
 	uint16_t getClientAddress16();
 	NWAddress64* getClientAddress64();
 
@@ -107,7 +125,8 @@ private:
 	uint16_t _addr16;
 	uint16_t _len;
 	uint8_t  _type;
-	uint8_t _frameDataPtr[MQTTSN_MAX_FRAME_SIZE];
+	PacketBuffer* _buffer;           // received into, shared by the message
+	uint8_t* _frameDataPtr;
 };
 
 
@@ -119,16 +138,24 @@ public:
 	UDPPort();
 	virtual ~UDPPort();
 
-	int open(UdpConfig config);
+	int open(UdpConfig config, int taskNo = 0, int taskCnt = 1);
 
 	int unicast(const uint8_t* buf, uint32_t length, uint32_t ipaddress, uint16_t port  );
 	int multicast( const uint8_t* buf, uint32_t length );
+	int unicastDeferred(const uint8_t* buf, uint32_t length, uint32_t ipaddress, uint16_t port);
+	int multicastDeferred(const uint8_t* buf, uint32_t length);
+	int flush();
 	int recv(uint8_t* buf, uint16_t len, uint32_t* ipaddress, uint16_t* port );
+	int recv(uint8_t* bufs[], uint16_t len, int maxCnt);
+	int getDatagram(int index, uint32_t* ipaddress, uint16_t* port);
+	uint8_t* getOverflow(int index);
 
 private:
 	void close();
 	void setNonBlocking( const bool );
+	int attachSteering(int sockfd, int groupSize);
 	int recvfrom (int sockfd, uint8_t* buf, uint16_t len, uint8_t flags, uint32_t* ipaddress, uint16_t* port );
+	int recvmmsg(int sockfd, uint8_t* bufs[], uint16_t len, int pos, int cnt);
 
 	int _sockfdUnicast;
 	int _sockfdMulticast;
@@ -137,6 +164,18 @@ private:
 	uint32_t _gIpAddr;
 	bool    _disconReq;
 
+	/*------ datagrams staged for the next sendmmsg() ------*/
+	mmsghdr  _sendMsg[UDP_SEND_BATCH];
+	iovec    _sendIov[UDP_SEND_BATCH];
+	sockaddr_in _sendAddr[UDP_SEND_BATCH];
+	int      _sendCnt;
+
+	/*------ datagrams of the last recvmmsg(), tails beyond the buffer go to the overflow area ------*/
+	mmsghdr  _recvMsg[UDP_RECV_BATCH];
+	iovec    _recvIov[UDP_RECV_BATCH][2];
+	uint8_t* _recvOverflow;
+	sockaddr_in _recvAddr[UDP_RECV_BATCH];
+
 };
 
 /*===========================================
@@ -148,11 +187,15 @@ public:
     ~Network();
 
     void unicast(NWAddress64* addr64, uint16_t addr16,	uint8_t* payload, uint16_t payloadLength);
+    void unicastDeferred(NWAddress64* addr64, uint16_t addr16, uint8_t* payload, uint16_t payloadLength);
 	void broadcast(uint8_t* payload, uint16_t payloadLength);
+	void broadcastDeferred(uint8_t* payload, uint16_t payloadLength);
 	bool getResponse(NWResponse* response);
-    int  initialize(UdpConfig  config);
+	int  getResponses(NWResponse* responses[], int maxCnt);
+    int  initialize(UdpConfig  config, int taskNo = 0, int taskCnt = 1);
 
 private:
+	bool setResponse(NWResponse* response, int recvLen, uint32_t ipAddress, uint16_t portNo);
 
 };
 
@@ -172,7 +172,17 @@ bool NWAddress64::operator==(NWAddress64& addr){
  =========================================*/
 NWResponse::NWResponse(){
     _addr16 = 0;
-    memset( _frameDataPtr, 0, MQTTSN_MAX_FRAME_SIZE);
+    _len = 0;
+    _buffer = PacketBuffer::create(MQTTSN_MAX_FRAME_SIZE);
+    _frameDataPtr = _buffer->getData();
+}
+
+NWResponse::~NWResponse(){
+    _buffer->release();
+}
+
+PacketBuffer* NWResponse::getPacketBuffer(){
+	return _buffer;
 }
 
 uint8_t  NWResponse::getFrameLength(){
@@ -86,12 +86,15 @@ private:
  =============================================*/
 
 class NWResponse {
+	POOLED_ALLOCATION;
 public:
 	NWResponse();
+	~NWResponse();
 	uint8_t  getMsgType();
 	uint8_t  getFrameLength();
 	uint8_t  getPayload(uint8_t index);
 	uint8_t* getPayloadPtr();
+	PacketBuffer* getPacketBuffer();
 	uint8_t* getBody();
 	uint16_t getBodyLength();
 	uint8_t  getPayloadLength();
@@ -107,7 +110,8 @@ private:
 	uint16_t _addr16;
 	uint16_t _len;
 	uint8_t  _type;
-	uint8_t _frameDataPtr[MQTTSN_MAX_FRAME_SIZE];
+	PacketBuffer* _buffer;           // received into, shared by the message
+	uint8_t* _frameDataPtr;
 };
 
 
@@ -50,7 +50,7 @@
 
 using namespace std;
 
-extern uint8_t* mqcalloc(uint8_t length);
+extern uint8_t* mqcalloc(size_t length);
 extern uint16_t getUint16(uint8_t* pos);
 extern uint32_t getUint32(uint8_t* pos);
 extern void setUint16(uint8_t* pos, uint16_t val);
@@ -107,7 +107,7 @@ NWResponse::NWResponse(){
 
 NWResponse::~NWResponse(){
   if(_frameDataPtr){
-	  free(_frameDataPtr);
+	  mqfree(_frameDataPtr);
   }
 }
 
@@ -180,7 +180,7 @@ void NWResponse::setApiId(uint8_t apiId){
 
 void NWResponse::reset(){
 	if(_frameDataPtr){
-		  free(_frameDataPtr);
+		  mqfree(_frameDataPtr);
 	}
 	_msbLength = 0;
 	_lsbLength = 0;
@@ -202,6 +202,13 @@ uint8_t NWResponse::getPayloadLength(){
   return getFrameDataLength() - ZB_PAYLOAD_OFFSET;
 }
 
+/*
+ *  The frame buffer is reused by the serial reader, messages copy it.
+ */
+PacketBuffer* NWResponse::getPacketBuffer(){
+  return 0;
+}
+
 uint16_t NWResponse::getClientAddress16(){
 	return getUint16(getFrameData() + 8);
 }
@@ -244,7 +251,7 @@ bool NWResponse::isBroadcast(){
 
 void NWResponse::absorb(NWResponse* resp){
 	if(_frameDataPtr){
-		free(_frameDataPtr);
+		mqfree(_frameDataPtr);
 	}
 	_apiId = resp->getApiId();
 	_msbLength = resp->getMsbLength();
@@ -574,6 +581,8 @@ void Network::unicast(NWAddress64* addr64, uint16_t addr16,
 	_txRequest.setOption(0);
 	_txRequest.setPayload(payload);
 	_txRequest.setPayloadLength(payloadLength);
+	METRIC_INC(MC_PACKETS_OUT + MT_XBEE);
+	METRIC_ADD(MC_BYTES_OUT + MT_XBEE, payloadLength);
 	sendRequest(_txRequest);
 }
 
@@ -585,7 +594,12 @@ void Network::broadcast(uint8_t* payload, uint16_t payloadLength){
 }
 
 bool Network::getResponse(NWResponse* response){
-	return receiveResponse(response);
+	if(!receiveResponse(response)){
+		return false;
+	}
+	METRIC_INC(MC_PACKETS_IN + MT_XBEE);
+	METRIC_ADD(MC_BYTES_IN + MT_XBEE, response->getPayloadLength());
+	return true;
 }
 
 int Network::initialize(NETWORK_CONFIG config){
@@ -119,6 +119,7 @@ private:
                 NWResponse
  =============================================*/
 class NWResponse {
+	POOLED_ALLOCATION;
 public:
 	 NWResponse();
 	~NWResponse();
@@ -136,6 +137,7 @@ public:
 	uint8_t getErrorCode();
 	uint8_t* getFrameData();
 	uint8_t* getPayloadPtr();
+	PacketBuffer* getPacketBuffer();
 	uint16_t getPacketLength();
 	uint16_t getClientAddress16();
 	NWAddress64* getClientAddress64();
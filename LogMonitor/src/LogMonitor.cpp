@@ -32,38 +32,103 @@
  *      Author: Tomoaki YAMAGUCHI
  *     Version: 0.0.0
  */
-#ifndef LOGMONITOR_H_
-#define LOGMONITOR_H_
-
-#include "lib/ProcessFramework.h"
+#include "LogMonitor.h"
+#include <string.h>
+#include <time.h>
 
 using namespace std;
 
-class LogMonitor:public Process{
-public:
-	LogMonitor();
-	~LogMonitor();
-	void initialize(int argc, char** argv);
-	void run();
-};
-
 
 LogMonitor::LogMonitor(){
 	theProcess = this;
+	_analyzer = 0;
+	_interval = TRACE_REPORT_SEC;
+	_recordFile = 0;
+	_replayFile = 0;
+	_view = 0;
 }
 
 LogMonitor::~LogMonitor(){
-
+	if(_recordFile){
+		fclose(_recordFile);
+	}
+	delete _analyzer;
+	delete _view;
 }
 
+/*
+ *  -a sec   : reports the latencies of flows every sec seconds
+ *  -t sec   : flows not completed in sec seconds are timeouts
+ *  -w file  : saves the records
+ *  -r file  : reads saved records instead of the gateway's
+ *  -m sec   : shows the gateway's metrics every sec seconds
+ */
 void LogMonitor::initialize(int argc, char** argv){
-	Process::initialize(0, NULL);
+	char* arg;
+	Process::initialize(argc, argv);
+
+	if((arg = getArgv('a'))){
+		_analyzer = new TraceAnalyzer();
+		_interval = atoi(arg);
+		if(_interval <= 0){
+			_interval = TRACE_REPORT_SEC;
+		}
+	}
+	if((arg = getArgv('t')) && _analyzer){
+		_analyzer->setTimeout(atoi(arg));
+	}
+	if((arg = getArgv('w'))){
+		if((_recordFile = fopen(arg, "ab")) == 0){
+			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't open the record file.");
+		}
+	}
+	_replayFile = getArgv('r');
+	if((arg = getArgv('m'))){
+		_view = new MetricsView();
+		_interval = atoi(arg);
+		if(_interval <= 0){
+			_interval = METRICS_REPORT_SEC;
+		}
+	}
 }
 
 void LogMonitor::run(){
+	if(_replayFile){
+		replay(_replayFile);
+	}else if(_view){
+		metrics();
+	}else{
+		monitor();
+	}
+}
+
+void LogMonitor::monitor(void){
+	uint64_t lost;
+	time_t nextReport = time(0) + _interval;
+
 	while(true){
-		const char* data = getLog();
-		printf("%s", data);
+		int len = getLog(_records, sizeof(_records), &lost);
+		if(lost){
+			printf("\n\x1b[0m\x1b[31m*** %llu bytes of log overwritten before they were read ***\x1b[0m\x1b[37m\n\n", (unsigned long long)lost);
+		}
+		for(int pos = 0; pos + (int)sizeof(LogRecord) <= len; ){
+			LogRecord* rec = (LogRecord*)(_records + pos);
+			if(rec->length < sizeof(LogRecord) || rec->dataOffset > rec->length){
+				break;
+			}
+			handleRecord(rec);
+			pos += rec->length;
+		}
+		if(_recordFile && len){
+			fflush(_recordFile);
+		}
+		if(_analyzer && time(0) >= nextReport){
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			_analyzer->report(stdout, (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+			nextReport = time(0) + _interval;
+		}
+		fflush(stdout);
 		if(int rc = checkSignal()){
 			printf("\n\n\n");
 			THROW_EXCEPTION(ExInfo, rc, " Terminated normally\n");
@@ -71,8 +136,141 @@ void LogMonitor::run(){
 	}
 }
 
+/*
+ *  Records saved by -w, the flows are timed by the records' clock.
+ */
+void LogMonitor::replay(const char* file){
+	FILE* fp = fopen(file, "rb");
+	LogRecord* rec = (LogRecord*)_records;
+
+	if(fp == 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't open the record file.");
+	}
+	while(fread(rec, sizeof(LogRecord), 1, fp) == 1){
+		if(rec->length < sizeof(LogRecord) || rec->dataOffset > rec->length ||
+			fread(rec + 1, rec->length - sizeof(LogRecord), 1, fp) != 1){
+			printf("Broken record file.\n");
+			break;
+		}
+		handleRecord(rec);
+	}
+	fclose(fp);
+	if(_analyzer){
+		_analyzer->flush();
+		_analyzer->report(stdout, _analyzer->getLastTime());
+	}
+	fflush(stdout);
+}
+
+/*
+ *  The page of metrics is read, the log is not.
+ */
+void LogMonitor::metrics(void){
+	while(true){
+		if(_view->read()){
+			_view->report(stdout);
+		}else{
+			printf("Waiting for the gateway's metrics.\n");
+		}
+		fflush(stdout);
+		for(int i = 0; i < _interval * 10; i++){
+			if(int rc = checkSignal()){
+				printf("\n\n\n");
+				THROW_EXCEPTION(ExInfo, rc, " Terminated normally\n");
+			}
+			usleep(100000);
+		}
+	}
+}
+
+void LogMonitor::handleRecord(LogRecord* rec){
+	if(_recordFile){
+		fwrite(rec, rec->length, 1, _recordFile);
+	}
+	if(_analyzer){
+		_analyzer->analyze(rec);
+	}else{
+		printRecord(rec);
+	}
+}
+
+/*
+ *  Records are formatted here, the gateway only copies
+ *  the bytes of a packet trace. A text record is formatted by the writer
+ *  without the time, which is taken from the record.
+ */
+void LogMonitor::printRecord(LogRecord* rec){
+	char* data = (char*)rec + rec->dataOffset;
+	int len = rec->length - rec->dataOffset;
+
+	if(rec->type == LOG_RECORD_TEXT){
+		while(len > 0 && *data == '\n'){
+			putchar('\n');         // leading line feeds stay before the time
+			data++;
+			len--;
+		}
+		printf("%s %.*s", timeOf(rec), len, data);
+	}else if((rec->type == LOG_RECORD_PACKET || rec->type == LOG_RECORD_NOTE) && rec->format < LOG_FMT_MAX){
+		const char* name = (char*)rec + sizeof(LogRecord);
+		const char* arrow = name + strlen(name) + 1;
+		const char* peer = arrow + strlen(arrow) + 1;
+
+		if(rec->type == LOG_RECORD_NOTE){
+			printf(theLogFormats[rec->format], timeOf(rec), name, arrow, peer, data);
+			return;
+		}
+		char* pos = _dump;
+		for(int i = 0; i < len; i++){
+			pos += sprintf(pos, " %02X", (uint8_t)data[i]);
+		}
+		if(rec->flags & LOG_FLAG_TRUNCATED){
+			strcpy(pos, " ...");
+		}else{
+			*pos = 0;
+		}
+		printf(theLogFormats[rec->format], timeOf(rec), name, arrow, peer, _dump);
+	}else if(rec->type == LOG_RECORD_SAMPLE){
+		printSample(rec);
+	}
+}
+
+/*
+ *  Stages of a sampled message in ms, - where it did not pass.
+ */
+void LogMonitor::printSample(LogRecord* rec){
+	TraceSample sample;
+	const char* client = (char*)rec + sizeof(LogRecord) + 3;    // name, arrow and peer are empty
+	char* pos = _dump;
+
+	if(rec->length - rec->dataOffset < (int)sizeof(TraceSample)){
+		return;
+	}
+	memcpy(&sample, (uint8_t*)rec + rec->dataOffset, sizeof(TraceSample));
+	if(sample.route >= TR_MAX){
+		return;
+	}
+	for(int i = 0; i < TS_TOTAL; i++){
+		if(sample.stamps[i] && sample.stamps[i + 1] >= sample.stamps[i]){
+			pos += sprintf(pos, "  %s %.3f", theTraceStages[i], (sample.stamps[i + 1] - sample.stamps[i]) / 1e6);
+		}else{
+			pos += sprintf(pos, "  %s -", theTraceStages[i]);
+		}
+	}
+	sprintf(pos, "  %s %.3f ms", theTraceStages[TS_TOTAL], (sample.stamps[TP_WRITTEN] - sample.stamps[TP_RECV]) / 1e6);
+
+	const char* type = (sample.route == TR_UPSTREAM || sample.route == TR_CLIENT_REPLY ?
+			theMetricsSnTypes[metricsSnIndex(sample.type)] : theMetricsMqttTypes[sample.type & 0x0f]);
+	printf("%s   %-14s%-14s%-18s%s\n", timeOf(rec), type, theTraceRoutes[sample.route], client, _dump);
+}
+
+const char* LogMonitor::timeOf(LogRecord* rec){
+	time_t sec = rec->time / 1000000000ULL;
+	struct tm tstruct;
+	localtime_r(&sec, &tstruct);
+	strftime(_time, sizeof(_time), "%Y%m%d %H%M%S", &tstruct);
+	return _time;
+}
 
-#endif /* LOGMONITOR_H_ */
 
 
 
@@ -36,6 +36,8 @@
 #define LOGMONITOR_H_
 
 #include "lib/ProcessFramework.h"
+#include "TraceAnalyzer.h"
+#include "MetricsView.h"
 
 using namespace std;
 
@@ -45,6 +47,22 @@ public:
 	~LogMonitor();
 	void initialize(int argc, char** argv);
 	void run();
+private:
+	void monitor(void);
+	void replay(const char* file);
+	void metrics(void);
+	void handleRecord(LogRecord* rec);
+	void printRecord(LogRecord* rec);
+	void printSample(LogRecord* rec);
+	const char* timeOf(LogRecord* rec);
+	uint8_t _records[RINGBUFFER_MIN_SIZE * 4];
+	char _time[32];
+	char _dump[LOG_TRACE_MAX_BYTES * 3 + 8];
+	TraceAnalyzer* _analyzer;    // -a, flows are reported instead of printing the records
+	int   _interval;
+	FILE* _recordFile;           // -w, records are saved for -r
+	char* _replayFile;
+	MetricsView* _view;          // -m, the gateway's metrics are shown instead of the records
 };
 
 
@@ -38,7 +38,7 @@
 /**************************************
  *       LogMonitor Application
  **************************************/
-const char* theCmdlineParameter = "";
+const char* theCmdlineParameter = "a:t:w:r:m:";
 
 LogMonitor lp = LogMonitor();
 
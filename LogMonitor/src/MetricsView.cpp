@@ -0,0 +1,209 @@
+/*
+ * MetricsView.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+
+#include "MetricsView.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+/*=====================================
+        Class MetricsView
+ =====================================*/
+MetricsView::MetricsView(){
+	_shmaddr = 0;
+	_page = 0;
+	_shmid = -1;
+	_time = _lastTime = _startTime = 0;
+	_threads = 0;
+	_data = (MetricsData*)calloc(1, sizeof(MetricsData));
+	_last = (MetricsData*)calloc(1, sizeof(MetricsData));
+	if(_data == 0 || _last == 0){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't allocate MetricsData.");
+	}
+}
+
+MetricsView::~MetricsView(){
+	detach();
+	free(_data);
+	free(_last);
+}
+
+/*
+ *  A restarted gateway publishes into a new page, which is found by the key.
+ */
+bool MetricsView::attach(void){
+	int shmid = shmget(ftok(TOMYFRAME_METRICS_KEY, 1), 0, 0);
+
+	if(shmid < 0){
+		detach();
+		return false;
+	}
+	if(shmid != _shmid){
+		detach();
+		if((_shmaddr = shmat(shmid, NULL, SHM_RDONLY)) == (void*)-1){
+			_shmaddr = 0;
+			return false;
+		}
+		_shmid = shmid;
+		_page = (MetricsPage*)_shmaddr;
+		_lastTime = 0;
+	}
+	return __atomic_load_n(&_page->magic, __ATOMIC_ACQUIRE) == METRICS_MAGIC && _page->size == sizeof(MetricsPage);
+}
+
+void MetricsView::detach(void){
+	if(_shmaddr){
+		shmdt(_shmaddr);
+	}
+	_shmaddr = 0;
+	_page = 0;
+	_shmid = -1;
+}
+
+/*
+ *  Copies the page, again if the gateway wrote it meanwhile.
+ *  Returns false when there is no page of this layout.
+ */
+bool MetricsView::read(void){
+	if(!attach()){
+		return false;
+	}
+	for(int i = 0; i < METRICS_READ_RETRY; i++){
+		uint32_t seq = __atomic_load_n(&_page->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1){
+			usleep(1000);
+			continue;
+		}
+		memcpy(_data, &_page->data, sizeof(MetricsData));
+		_time = _page->time;
+		_startTime = _page->startTime;
+		_threads = _page->threads;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&_page->seq, __ATOMIC_RELAXED) == seq){
+			return _time != 0;
+		}
+	}
+	return false;
+}
+
+/*
+ *  Per second since the last report, 0 for the first one.
+ */
+double MetricsView::rateOf(int counter){
+	if(_lastTime == 0 || _time <= _lastTime){
+		return 0;
+	}
+	return (_data->counters[counter] - _last->counters[counter]) / ((_time - _lastTime) / 1e9);
+}
+
+void MetricsView::report(FILE* fp){
+	char tm[32];
+	time_t sec = _time / 1000000000ULL;
+	struct tm tstruct;
+	localtime_r(&sec, &tstruct);
+	strftime(tm, sizeof(tm), "%Y%m%d %H%M%S", &tstruct);
+	uint64_t* cnt = _data->counters;
+
+	fprintf(fp, "\n===== Metrics  %s   uptime %llu s   threads %u =====\n", tm,
+			(unsigned long long)((_time - _startTime) / 1000000000ULL), _threads);
+
+	fprintf(fp, "%-14s%12s%12s%14s%14s%10s%10s\n", "transport", "pkts in", "pkts out", "bytes in", "bytes out", "in/s", "out/s");
+	for(int t = 0; t < MT_MAX; t++){
+		if(cnt[MC_PACKETS_IN + t] || cnt[MC_PACKETS_OUT + t]){
+			fprintf(fp, "%-14s%12llu%12llu%14llu%14llu%10.0f%10.0f\n", theMetricsTransports[t],
+					(unsigned long long)cnt[MC_PACKETS_IN + t], (unsigned long long)cnt[MC_PACKETS_OUT + t],
+					(unsigned long long)cnt[MC_BYTES_IN + t], (unsigned long long)cnt[MC_BYTES_OUT + t],
+					rateOf(MC_PACKETS_IN + t), rateOf(MC_PACKETS_OUT + t));
+		}
+	}
+
+	fprintf(fp, "%-14s%12s%12s%10s%10s\n", "message", "in", "out", "in/s", "out/s");
+	for(int i = 0; i < METRICS_SN_TYPES; i++){
+		if(cnt[MC_SN_IN + i] || cnt[MC_SN_OUT + i]){
+			fprintf(fp, "  %-12s%12llu%12llu%10.0f%10.0f\n", theMetricsSnTypes[i],
+					(unsigned long long)cnt[MC_SN_IN + i], (unsigned long long)cnt[MC_SN_OUT + i],
+					rateOf(MC_SN_IN + i), rateOf(MC_SN_OUT + i));
+		}
+	}
+	for(int i = 0; i < METRICS_MQTT_TYPES; i++){
+		if(cnt[MC_MQTT_IN + i] || cnt[MC_MQTT_OUT + i]){
+			fprintf(fp, "  %-12s%12llu%12llu%10.0f%10.0f   (broker)\n", theMetricsMqttTypes[i],
+					(unsigned long long)cnt[MC_MQTT_IN + i], (unsigned long long)cnt[MC_MQTT_OUT + i],
+					rateOf(MC_MQTT_IN + i), rateOf(MC_MQTT_OUT + i));
+		}
+	}
+
+	fprintf(fp, "%-16s%12s%10s%8s%11s%11s%11s%11s%9s\n", "eventque", "events", "/s", "depth",
+			"p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "backlog");
+	for(int q = 0; q < MQ_MAX; q++){
+		MetricsHistogram* wait = &_data->hists[MH_QUE_WAIT + q];
+		fprintf(fp, "%-16s%12llu%10.0f%8lld%11.3f%11.3f%11.3f%11.3f%9llu\n", theMetricsQues[q],
+				(unsigned long long)cnt[MC_EVENTS_OUT + q], rateOf(MC_EVENTS_OUT + q), (long long)_data->gauges[MG_QUE_DEPTH + q],
+				metricsPercentile(wait, 50) / 1e6, metricsPercentile(wait, 90) / 1e6,
+				metricsPercentile(wait, 99) / 1e6, wait->max / 1e6,
+				(unsigned long long)_data->hists[MH_QUE_DEPTH + q].max);
+	}
+
+	/*------ routes which no message has taken are left out ------*/
+	for(int r = 0; r < TR_MAX; r++){
+		if(_data->hists[MH_STAGE + r * TS_MAX + TS_TOTAL].count == 0){
+			continue;
+		}
+		fprintf(fp, "%-16s%12s%11s%11s%11s%11s\n", theTraceRoutes[r], "messages", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)");
+		for(int i = 0; i < TS_MAX; i++){
+			MetricsHistogram* stage = &_data->hists[MH_STAGE + r * TS_MAX + i];
+			fprintf(fp, "  %-14s%12llu%11.3f%11.3f%11.3f%11.3f\n", theTraceStages[i], (unsigned long long)stage->count,
+					metricsPercentile(stage, 50) / 1e6, metricsPercentile(stage, 90) / 1e6,
+					metricsPercentile(stage, 99) / 1e6, stage->max / 1e6);
+		}
+	}
+
+	MetricsHistogram* conn = &_data->hists[MH_BROKER_CONNECT];
+	fprintf(fp, "clients   active %lld  asleep %lld  lost %lld\n", (long long)_data->gauges[MG_CLIENTS_ACTIVE],
+			(long long)_data->gauges[MG_CLIENTS_ASLEEP], (long long)_data->gauges[MG_CLIENTS_LOST]);
+	fprintf(fp, "broker    connects %llu  failures %llu  connect p50 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+			(unsigned long long)cnt[MC_BROKER_CONNECTS], (unsigned long long)cnt[MC_BROKER_CONNECT_FAILURES],
+			metricsPercentile(conn, 50) / 1e6, metricsPercentile(conn, 99) / 1e6, conn->max / 1e6);
+	fprintf(fp, "memory    allocs %llu (%.0f/s)  frees %llu  large %llu  chunks %llu\n",
+			(unsigned long long)cnt[MC_ALLOCS], rateOf(MC_ALLOCS), (unsigned long long)cnt[MC_FREES],
+			(unsigned long long)cnt[MC_LARGE_ALLOCS], (unsigned long long)cnt[MC_POOL_CHUNKS]);
+
+	memcpy(_last, _data, sizeof(MetricsData));
+	_lastTime = _time;
+}
@@ -0,0 +1,77 @@
+/*
+ * MetricsView.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+
+#ifndef METRICSVIEW_H_
+#define METRICSVIEW_H_
+
+#include "lib/ProcessFramework.h"
+#include "lib/MetricsPage.h"
+#include <stdio.h>
+
+#define TOMYFRAME_METRICS_KEY  "/usr/local/etc/tomygateway/config/metrics.key"
+#define METRICS_REPORT_SEC     5
+#define METRICS_READ_RETRY     100      // while the gateway writes the page
+
+/*=====================================
+        Class MetricsView
+ =====================================*/
+/*
+ *  Reads the page the gateway publishes its metrics into, without a lock,
+ *  and shows them with the rates since the last read.
+ */
+class MetricsView{
+public:
+	MetricsView();
+	~MetricsView();
+	bool read(void);
+	void report(FILE* fp);
+private:
+	bool attach(void);
+	void detach(void);
+	double rateOf(int counter);
+
+	void* _shmaddr;
+	MetricsPage* _page;
+	int _shmid;
+	MetricsData* _data;
+	MetricsData* _last;          // of the last report
+	uint64_t _time;
+	uint64_t _lastTime;
+	uint64_t _startTime;
+	uint32_t _threads;
+};
+
+#endif /* METRICSVIEW_H_ */
@@ -0,0 +1,393 @@
+/*
+ * TraceAnalyzer.cpp
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#include "TraceAnalyzer.h"
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+using namespace std;
+
+static const char* theFlowNames[FLOW_KINDS] = {"PUBLISH", "PUBLISH0", "CONNECT", "REGISTER"};
+static const char* theStageNames[FLOW_STAGES - 1] = {"gateway in", "broker", "gateway out"};
+
+/*=====================================
+        Class LatencyHistogram
+ =====================================*/
+LatencyHistogram::LatencyHistogram(){
+	_count = 0;
+	_max = 0;
+	memset(_buckets, 0, sizeof(_buckets));
+}
+
+int LatencyHistogram::bucketOf(uint64_t ns){
+	if(ns < LATENCY_SUB_BUCKETS){
+		return ns;
+	}
+	int exp = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (exp - 4)) & (LATENCY_SUB_BUCKETS - 1);
+	return (exp - 3) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/*
+ *  The upper edge of the bucket.
+ */
+uint64_t LatencyHistogram::valueOf(int bucket){
+	if(bucket < LATENCY_SUB_BUCKETS){
+		return bucket;
+	}
+	int exp = bucket / LATENCY_SUB_BUCKETS + 3;
+	uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+	return ((LATENCY_SUB_BUCKETS + sub + 1) << (exp - 4)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns){
+	_buckets[bucketOf(ns)]++;
+	_count++;
+	if(ns > _max){
+		_max = ns;
+	}
+}
+
+uint64_t LatencyHistogram::getPercentile(double percent){
+	uint64_t target = (uint64_t)(_count * percent / 100.0 + 0.5);
+	uint64_t sum = 0;
+
+	if(target == 0){
+		target = 1;
+	}
+	for(int i = 0; i < LATENCY_BUCKETS; i++){
+		sum += _buckets[i];
+		if(sum >= target){
+			uint64_t val = valueOf(i);
+			return (val > _max ? _max : val);
+		}
+	}
+	return _max;
+}
+
+uint64_t LatencyHistogram::getMax(void){
+	return _max;
+}
+
+uint64_t LatencyHistogram::getCount(void){
+	return _count;
+}
+
+/*=====================================
+        Class TraceAnalyzer
+ =====================================*/
+TraceAnalyzer::TraceAnalyzer(){
+	memset(_done, 0, sizeof(_done));
+	memset(_timeout, 0, sizeof(_timeout));
+	memset(_retransmit, 0, sizeof(_retransmit));
+	_records = 0;
+	_traces = 0;
+	_lastTime = 0;
+	_timeoutNs = TRACE_TIMEOUT_SEC * 1000000000ULL;
+}
+
+TraceAnalyzer::~TraceAnalyzer(){
+
+}
+
+void TraceAnalyzer::setTimeout(int sec){
+	_timeoutNs = sec * 1000000000ULL;
+}
+
+uint64_t TraceAnalyzer::getLastTime(void){
+	return _lastTime;
+}
+
+/*
+ *  Records come in the order of the writers' queues, not of their time.
+ *  A trace waits TRACE_REORDER_MSEC so that a later stage of a flow
+ *  drained from another thread's queue is not seen before its start.
+ */
+void TraceAnalyzer::analyze(LogRecord* rec){
+	_records++;
+	if(rec->time > _lastTime){
+		_lastTime = rec->time;
+	}
+	if(rec->type != LOG_RECORD_PACKET){
+		return;
+	}
+	_window.insert(make_pair((uint64_t)rec->time, vector<uint8_t>((uint8_t*)rec, (uint8_t*)rec + rec->length)));
+	if(_lastTime > TRACE_REORDER_MSEC * 1000000ULL){
+		release(_lastTime - TRACE_REORDER_MSEC * 1000000ULL);
+	}
+}
+
+/*
+ *  All traces in the window are analyzed, at the end of a replay.
+ */
+void TraceAnalyzer::flush(void){
+	release(~0ULL);
+}
+
+void TraceAnalyzer::release(uint64_t until){
+	while(!_window.empty() && _window.begin()->first <= until){
+		trace((LogRecord*)&_window.begin()->second[0]);
+		_window.erase(_window.begin());
+	}
+}
+
+void TraceAnalyzer::trace(LogRecord* rec){
+	const char* name = (char*)rec + sizeof(LogRecord);
+	const char* arrow = name + strlen(name) + 1;
+	const char* peer = arrow + strlen(arrow) + 1;
+	const uint8_t* data = (uint8_t*)rec + rec->dataOffset;
+	int len = rec->length - rec->dataOffset;
+	bool recv = (strcmp(arrow, TRACE_RECV_ARROW) == 0);
+
+	_traces++;
+	if(rec->flags & LOG_FLAG_CLIENT){
+		brokerTrace(name, recv, peer + strlen(peer) + 1, data, len, rec->time);
+	}else{
+		clientTrace(name, recv, peer, data, len, rec->time);
+	}
+}
+
+/*
+ *  MQTT-SN messages, data is the body after MsgType.
+ */
+void TraceAnalyzer::clientTrace(const char* name, bool recv, const char* client, const uint8_t* data, int len, uint64_t time){
+	if(recv){
+		if(!strcmp(name, "PUBLISH") && len >= 5 && strcmp(client, TRACE_GATEWAY)){
+			uint16_t msgId = (data[3] << 8) | data[4];
+			start(msgId ? FLOW_PUBLISH : FLOW_PUBLISH0, client, msgId, time);
+		}else if(!strcmp(name, "CONNECT")){
+			start(FLOW_CONNECT, client, 0, time);
+		}else if(!strcmp(name, "REGISTER") && len >= 4){
+			start(FLOW_REGISTER, client, (data[2] << 8) | data[3], time);
+		}
+	}else{
+		if(!strcmp(name, "PUBACK") && len >= 4){
+			advance(FLOW_PUBLISH, client, (data[2] << 8) | data[3], 3, time);
+		}else if(!strcmp(name, "PUBREC") && len >= 2){
+			advance(FLOW_PUBLISH, client, (data[0] << 8) | data[1], 3, time);
+		}else if(!strcmp(name, "CONNACK") || !strcmp(name, "*CONNACK")){
+			advance(FLOW_CONNECT, client, 0, 3, time);
+		}else if(!strcmp(name, "REGACK") && len >= 4){
+			advance(FLOW_REGISTER, client, (data[2] << 8) | data[3], 3, time);
+		}
+	}
+}
+
+/*
+ *  MQTT packets exchanged with the broker on behalf of the client.
+ */
+void TraceAnalyzer::brokerTrace(const char* name, bool recv, const char* client, const uint8_t* data, int len, uint64_t time){
+	if(recv){
+		if((!strcmp(name, "PUBACK") || !strcmp(name, "PUBREC")) && len >= 4){
+			advance(FLOW_PUBLISH, client, (data[2] << 8) | data[3], 2, time);
+		}else if(!strcmp(name, "CONNACK")){
+			advance(FLOW_CONNECT, client, 0, 2, time);
+		}
+	}else{
+		if(!strcmp(name, "PUBLISH") && len >= 2){
+			uint8_t qos = (data[0] >> 1) & 0x03;
+			int pos = 1;
+			while(pos < len && pos < 5 && (data[pos] & 0x80)){    // remaining length
+				pos++;
+			}
+			pos++;
+			if(pos + 2 > len){
+				return;
+			}
+			pos += 2 + ((data[pos] << 8) | data[pos + 1]);         // topic
+			if(qos == 0){
+				advance(FLOW_PUBLISH0, client, 0, 1, time);
+			}else if(pos + 2 <= len){
+				advance(FLOW_PUBLISH, client, (data[pos] << 8) | data[pos + 1], 1, time);
+			}
+		}else if(!strcmp(name, "CONNECT")){
+			advance(FLOW_CONNECT, client, 0, 1, time);
+		}
+	}
+}
+
+string TraceAnalyzer::keyOf(int kind, const char* client, uint16_t msgId){
+	char buf[16];
+	sprintf(buf, "%d/%u/", kind, msgId);
+	return string(buf) + client;
+}
+
+void TraceAnalyzer::start(int kind, const char* client, uint16_t msgId, uint64_t time){
+	Flow flow;
+	flow.kind = kind;
+	flow.client = client;
+	flow.msgId = msgId;
+	flow.stage = 0;
+	memset(flow.time, 0, sizeof(flow.time));
+	flow.time[0] = time;
+
+	if(kind == FLOW_PUBLISH0){
+		_qos0[flow.client].push_back(flow);
+		return;
+	}
+	string key = keyOf(kind, client, msgId);
+	if(_flows.find(key) != _flows.end()){
+		_retransmit[kind]++;          // the first one is timed
+		return;
+	}
+	_flows[key] = flow;
+}
+
+void TraceAnalyzer::advance(int kind, const char* client, uint16_t msgId, int stage, uint64_t time){
+	if(kind == FLOW_PUBLISH0){
+		map<string, list<Flow> >::iterator it = _qos0.find(client);
+		if(it == _qos0.end() || it->second.empty()){
+			return;
+		}
+		Flow flow = it->second.front();
+		it->second.pop_front();
+		flow.time[stage] = time;
+		flow.stage = stage;
+		complete(&flow);
+		return;
+	}
+	map<string, Flow>::iterator it = _flows.find(keyOf(kind, client, msgId));
+	if(it == _flows.end()){
+		return;
+	}
+	Flow* flow = &it->second;
+	if(flow->time[stage] == 0){
+		flow->time[stage] = time;
+	}
+	if(stage > flow->stage){
+		flow->stage = stage;
+	}
+	if(stage == FLOW_STAGES - 1){
+		complete(flow);
+		_flows.erase(it);
+	}
+}
+
+/*
+ *  Stages are timed only when both ends were traced.
+ */
+void TraceAnalyzer::complete(Flow* flow){
+	_done[flow->kind]++;
+	_total[flow->kind].record(flow->time[flow->stage] - flow->time[0]);
+	for(int i = 1; i <= flow->stage; i++){
+		if(flow->time[i] && flow->time[i - 1]){
+			_stage[flow->kind][i - 1].record(flow->time[i] - flow->time[i - 1]);
+		}
+	}
+}
+
+const char* TraceAnalyzer::waitingFor(Flow* flow){
+	switch(flow->kind){
+	case FLOW_PUBLISH:
+		return (flow->stage == 0 ? "PUBLISH to the broker" : flow->stage == 1 ? "PUBACK from the broker" : "PUBACK to the client");
+	case FLOW_PUBLISH0:
+		return "PUBLISH to the broker";
+	case FLOW_CONNECT:
+		return (flow->stage == 0 ? "CONNECT to the broker" : flow->stage == 1 ? "CONNACK from the broker" : "CONNACK to the client");
+	default:
+		return "REGACK to the client";
+	}
+}
+
+/*
+ *  Flows older than the timeout are dropped and counted.
+ */
+void TraceAnalyzer::expire(uint64_t now){
+	map<string, Flow>::iterator it = _flows.begin();
+	while(it != _flows.end()){
+		if(now - it->second.time[0] > _timeoutNs && now > it->second.time[0]){
+			_timeout[it->second.kind]++;
+			_flows.erase(it++);
+		}else{
+			++it;
+		}
+	}
+	for(map<string, list<Flow> >::iterator q = _qos0.begin(); q != _qos0.end(); ++q){
+		while(!q->second.empty() && now > q->second.front().time[0] && now - q->second.front().time[0] > _timeoutNs){
+			_timeout[FLOW_PUBLISH0]++;
+			q->second.pop_front();
+		}
+	}
+}
+
+void TraceAnalyzer::report(FILE* fp, uint64_t now){
+	char tm[32];
+	time_t sec = now / 1000000000ULL;
+	struct tm tstruct;
+	localtime_r(&sec, &tstruct);
+	strftime(tm, sizeof(tm), "%Y%m%d %H%M%S", &tstruct);
+
+	if(now > TRACE_REORDER_MSEC * 1000000ULL){
+		release(now - TRACE_REORDER_MSEC * 1000000ULL);
+	}
+	expire(now);
+	fprintf(fp, "\n===== Flows  %s   records %llu  traces %llu =====\n", tm, (unsigned long long)_records, (unsigned long long)_traces);
+	fprintf(fp, "%-14s%9s%9s%9s%9s%11s%11s%11s%11s\n", "flow", "done", "timeout", "retrans", "pending", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)");
+
+	int pending[FLOW_KINDS] = {0};
+	for(map<string, Flow>::iterator it = _flows.begin(); it != _flows.end(); ++it){
+		pending[it->second.kind]++;
+	}
+	for(map<string, list<Flow> >::iterator q = _qos0.begin(); q != _qos0.end(); ++q){
+		pending[FLOW_PUBLISH0] += q->second.size();
+	}
+	for(int k = 0; k < FLOW_KINDS; k++){
+		LatencyHistogram* h = &_total[k];
+		fprintf(fp, "%-14s%9llu%9llu%9llu%9d%11.3f%11.3f%11.3f%11.3f\n", theFlowNames[k],
+				(unsigned long long)_done[k], (unsigned long long)_timeout[k], (unsigned long long)_retransmit[k], pending[k],
+				h->getPercentile(50) / 1e6, h->getPercentile(90) / 1e6, h->getPercentile(99) / 1e6, h->getMax() / 1e6);
+		for(int s = 0; s < FLOW_STAGES - 1; s++){
+			h = &_stage[k][s];
+			if(h->getCount()){
+				fprintf(fp, "  %-30s%11.3f%11.3f%11.3f%11.3f\n", theStageNames[s],
+						h->getPercentile(50) / 1e6, h->getPercentile(90) / 1e6, h->getPercentile(99) / 1e6, h->getMax() / 1e6);
+			}
+		}
+	}
+
+	int cnt = 0;
+	for(map<string, Flow>::iterator it = _flows.begin(); it != _flows.end() && cnt < TRACE_STUCK_LIST; ++it){
+		Flow* flow = &it->second;
+		if(now > flow->time[0] && now - flow->time[0] > TRACE_STUCK_MSEC * 1000000ULL){
+			if(cnt++ == 0){
+				fprintf(fp, "stuck flows (pending over %d ms):\n", TRACE_STUCK_MSEC);
+			}
+			fprintf(fp, "  %-10s %-20s msgId %-6u %8.3f s  waiting for %s\n", theFlowNames[flow->kind], flow->client.c_str(),
+					flow->msgId, (now - flow->time[0]) / 1e9, waitingFor(flow));
+		}
+	}
+	fflush(fp);
+}
@@ -0,0 +1,145 @@
+/*
+ * TraceAnalyzer.h
+ *
+ *                      The BSD License
+ *
+ *           Copyright (c) 2014, tomoaki@tomy-tech.com
+ *                    All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef TRACEANALYZER_H_
+#define TRACEANALYZER_H_
+
+#include "lib/ProcessFramework.h"
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+#define TRACE_RECV_ARROW   "<---"        // LEFTARROW of the gateway
+#define TRACE_SEND_ARROW   "--->"        // RIGHTARROW of the gateway
+#define TRACE_GATEWAY      "Gateway"     // messages made by the gateway itself
+
+#define TRACE_TIMEOUT_SEC       10       // a flow not completed by then is a timeout
+#define TRACE_STUCK_MSEC      1000       // pending flows older than this are listed
+#define TRACE_STUCK_LIST        10
+#define TRACE_REPORT_SEC        10
+#define TRACE_REORDER_MSEC     100       // the gateway drains its threads' queues every 10 ms (LOG_DRAIN_USEC)
+
+/*
+ *  Latencies in ns, 16 linear buckets in each power of 2 (6% at most).
+ */
+#define LATENCY_SUB_BUCKETS     16
+#define LATENCY_BUCKETS       (64 * LATENCY_SUB_BUCKETS)
+
+/*=====================================
+        Class LatencyHistogram
+ =====================================*/
+class LatencyHistogram{
+public:
+	LatencyHistogram();
+	void record(uint64_t ns);
+	uint64_t getPercentile(double percent);
+	uint64_t getMax(void);
+	uint64_t getCount(void);
+private:
+	int bucketOf(uint64_t ns);
+	uint64_t valueOf(int bucket);
+
+	uint64_t _count;
+	uint64_t _max;
+	uint32_t _buckets[LATENCY_BUCKETS];
+};
+
+/*
+ *  Flows, each is a sequence of traces of the same client.
+ *     PUBLISH   : PUBLISH <--- client, PUBLISH ---> broker, PUBACK/PUBREC <--- broker, PUBACK/PUBREC ---> client
+ *     PUBLISH0  : PUBLISH <--- client, PUBLISH ---> broker (QoS 0)
+ *     CONNECT   : CONNECT <--- client, CONNECT ---> broker, CONNACK <--- broker, CONNACK ---> client
+ *     REGISTER  : REGISTER <--- client, REGACK ---> client
+ */
+#define FLOW_PUBLISH    0
+#define FLOW_PUBLISH0   1
+#define FLOW_CONNECT    2
+#define FLOW_REGISTER   3
+#define FLOW_KINDS      4
+
+#define FLOW_STAGES     4            // client in, broker out, broker in, client out
+
+struct Flow{
+	int kind;
+	string client;
+	uint16_t msgId;
+	int stage;                       // the last stage seen
+	uint64_t time[FLOW_STAGES];      // 0 if the stage was not seen
+};
+
+/*=====================================
+        Class TraceAnalyzer
+ =====================================*/
+class TraceAnalyzer{
+public:
+	TraceAnalyzer();
+	~TraceAnalyzer();
+	void setTimeout(int sec);
+	void analyze(LogRecord* rec);
+	void flush(void);
+	void expire(uint64_t now);
+	void report(FILE* fp, uint64_t now);
+	uint64_t getLastTime(void);
+
+private:
+	void release(uint64_t until);
+	void trace(LogRecord* rec);
+	void clientTrace(const char* name, bool recv, const char* client, const uint8_t* data, int len, uint64_t time);
+	void brokerTrace(const char* name, bool recv, const char* client, const uint8_t* data, int len, uint64_t time);
+	void start(int kind, const char* client, uint16_t msgId, uint64_t time);
+	void advance(int kind, const char* client, uint16_t msgId, int stage, uint64_t time);
+	void complete(Flow* flow);
+	string keyOf(int kind, const char* client, uint16_t msgId);
+	const char* waitingFor(Flow* flow);
+
+	multimap<uint64_t, vector<uint8_t> > _window;    // packet traces sorted by time
+	map<string, Flow> _flows;
+	map<string, list<Flow> > _qos0;          // QoS 0 PUBLISH have no msgId, matched in order
+	LatencyHistogram _total[FLOW_KINDS];
+	LatencyHistogram _stage[FLOW_KINDS][FLOW_STAGES - 1];
+	uint64_t _done[FLOW_KINDS];
+	uint64_t _timeout[FLOW_KINDS];
+	uint64_t _retransmit[FLOW_KINDS];
+	uint64_t _records;
+	uint64_t _traces;
+	uint64_t _lastTime;
+	uint64_t _timeoutNs;
+};
+
+
+#endif /* TRACEANALYZER_H_ */
@@ -0,0 +1,113 @@
+/*
+ * LogRecord.h
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 tomoaki@tomy-tech.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef LOGRECORD_H_
+#define LOGRECORD_H_
+
+#include <stdint.h>
+
+/*
+ *  Binary log records shared by the gateway and LogMonitor.
+ *  The gateway writes them as they are, LogMonitor formats them.
+ */
+#define LOG_RECORD_PAD      0     // filler up to the end of a queue
+#define LOG_RECORD_TEXT     1     // text formatted by the writer, the reader prefixes the time
+#define LOG_RECORD_PACKET   2     // packet trace, hex dumped by the reader
+#define LOG_RECORD_NOTE     3     // packet trace with a text instead of bytes
+#define LOG_RECORD_SAMPLE   4     // TraceSample of a message (MetricsPage.h), the client follows peer
+
+#define LOG_FLAG_TRUNCATED  0x01  // only the first LOG_TRACE_MAX_BYTES are in the record
+#define LOG_FLAG_CLIENT     0x02  // a broker trace, the client's id follows peer
+
+#define LOG_LEVEL_NONE      0
+#define LOG_LEVEL_INFO      1     // LOGWRITE
+#define LOG_LEVEL_TRACE     2     // LOGTRACE and LOGNOTE, a record per packet
+
+#define LOG_TRACE_MAX_BYTES 512
+#define LOG_RECORD_ALIGN    8
+
+/*
+ *  A record starts with its length, the strings of a trace
+ *  (name, arrow, peer and the client of LOG_FLAG_CLIENT, each
+ *  terminated by 0) follow the header
+ *  and the bytes or the note start at dataOffset.
+ */
+struct LogRecord{
+	uint16_t length;      // of the whole record
+	uint8_t  type;
+	uint8_t  format;      // LOG_FMT_xxx of a trace
+	uint8_t  flags;
+	uint8_t  thread;      // registration order of the writing thread
+	uint16_t dataOffset;
+	uint64_t time;        // CLOCK_REALTIME in nanoseconds
+};
+
+/*
+ *  Formats of traces, time, name, arrow, peer and the hex dump or note.
+ */
+enum LogFormat{
+	LOG_FMT_PLAIN = 0,
+	LOG_FMT_PLAIN1,
+	LOG_FMT_PLAIN2,
+	LOG_FMT_RED1,
+	LOG_FMT_RED2,
+	LOG_FMT_GREEN,
+	LOG_FMT_GREEN1,
+	LOG_FMT_GREEN2,
+	LOG_FMT_YELLOW1,
+	LOG_FMT_YELLOW2,
+	LOG_FMT_BLUE,
+	LOG_FMT_BLUE1,
+	LOG_FMT_BLUE2,
+	LOG_FMT_CYAN1,
+	LOG_FMT_CYAN2,
+	LOG_FMT_MAX
+};
+
+static const char* const theLogFormats[LOG_FMT_MAX] = {
+	"%s   %-14s%-8s%-44s%s\n",
+	"%s   %-14s%-8s%-26s%s\n",
+	"\n%s   %-14s%-8s%-26s%s\n",
+	"%s   \x1b[0m\x1b[31m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[31m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[32m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[32m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[32m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[33m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[33m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[34m%-14s%-8s%-44s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[34m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[34m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"%s   \x1b[0m\x1b[36m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n",
+	"\n%s   \x1b[0m\x1b[36m%-14s%-8s%-26s\x1b[0m\x1b[37m%s\n"
+};
+
+#endif /* LOGRECORD_H_ */
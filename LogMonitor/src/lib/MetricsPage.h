@@ -0,0 +1,261 @@
+/*
+ * MetricsPage.h
+ *
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2015 tomoaki@tomy-tech.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *  Created on: 2026/10/18
+ *    Modified:
+ *      Author: Tomoaki YAMAGUCHI
+ *     Version: 0.0.0
+ */
+
+#ifndef METRICSPAGE_H_
+#define METRICSPAGE_H_
+
+#include <stdint.h>
+
+/*
+ *  Metrics of the gateway, published into a page of shared memory.
+ *  The gateway writes the page, LogMonitor and the scrape endpoint read it.
+ */
+#define METRICS_MAGIC         0x4D545243    // "MTRC", layout of the page
+#define METRICS_SN_TYPES      32            // 0x00 - 0x1D, ENCAPSULATED and unknown
+#define METRICS_MQTT_TYPES    16            // by the upper 4 bits of the fixed header
+
+/*
+ *  Histograms of ns or counts, 16 linear buckets in each power of 2 (6% at most).
+ *  Values from 2^METRICS_MAX_BITS on are counted in the last bucket.
+ */
+#define METRICS_SUB_BUCKETS   16
+#define METRICS_MAX_BITS      40
+#define METRICS_BUCKETS       ((METRICS_MAX_BITS - 3) * METRICS_SUB_BUCKETS)
+
+enum MetricsTransport{
+	MT_UDP = 0,
+	MT_UDP6,
+	MT_XBEE,
+	MT_TCP,                 // broker
+	MT_TLS,                 // broker
+	MT_MAX
+};
+
+enum MetricsQue{
+	MQ_GATEWAY = 0,         // of the control tasks
+	MQ_CLIENT_SEND,
+	MQ_BROKER_SEND,
+	MQ_BROKER_CONNECT,
+	MQ_MAX
+};
+
+enum MetricsCounter{
+	MC_PACKETS_IN = 0,                                  // [MT_MAX]
+	MC_PACKETS_OUT = MC_PACKETS_IN + MT_MAX,            // [MT_MAX]
+	MC_BYTES_IN = MC_PACKETS_OUT + MT_MAX,              // [MT_MAX]
+	MC_BYTES_OUT = MC_BYTES_IN + MT_MAX,                // [MT_MAX]
+	MC_SN_IN = MC_BYTES_OUT + MT_MAX,                   // [METRICS_SN_TYPES] by metricsSnIndex()
+	MC_SN_OUT = MC_SN_IN + METRICS_SN_TYPES,            // [METRICS_SN_TYPES]
+	MC_MQTT_IN = MC_SN_OUT + METRICS_SN_TYPES,          // [METRICS_MQTT_TYPES]
+	MC_MQTT_OUT = MC_MQTT_IN + METRICS_MQTT_TYPES,      // [METRICS_MQTT_TYPES]
+	MC_EVENTS_IN = MC_MQTT_OUT + METRICS_MQTT_TYPES,    // [MQ_MAX] posted
+	MC_EVENTS_OUT = MC_EVENTS_IN + MQ_MAX,              // [MQ_MAX] taken
+	MC_BROKER_CONNECTS = MC_EVENTS_OUT + MQ_MAX,
+	MC_BROKER_CONNECT_FAILURES,
+	MC_ALLOCS,                                          // blocks of the memory pool
+	MC_FREES,
+	MC_LARGE_ALLOCS,                                    // taken from malloc
+	MC_POOL_CHUNKS,                                     // of POOL_CHUNK_SIZE, never returned
+	MC_MAX
+};
+
+enum MetricsGauge{
+	MG_CLIENTS_ACTIVE = 0,
+	MG_CLIENTS_ASLEEP,                                  // asleep or awake
+	MG_CLIENTS_LOST,
+	MG_QUE_DEPTH,                                       // [MQ_MAX] events posted and not taken
+	MG_MAX = MG_QUE_DEPTH + MQ_MAX
+};
+
+/*
+ *  Points a message passes from the read of its packet to the write
+ *  of the packet it turned into. The handler is done with the message
+ *  when it posts the event of the send task.
+ */
+enum TracePoint{
+	TP_RECV = 0,            // read from the socket
+	TP_QUEUED,              // posted to the control task
+	TP_DEQUEUED,            // taken by the control task
+	TP_HANDLED,             // posted to the send task by the handler
+	TP_TAKEN,               // taken by the send task
+	TP_WRITTEN,             // written to the socket
+	TP_MAX
+};
+
+/*
+ *  Time between two points, TS_TOTAL from the read to the write.
+ */
+enum TraceStage{
+	TS_INGRESS = 0,         // TP_RECV - TP_QUEUED, parse
+	TS_CONTROL_QUE,         // TP_QUEUED - TP_DEQUEUED
+	TS_HANDLER,             // TP_DEQUEUED - TP_HANDLED
+	TS_SEND_QUE,            // TP_HANDLED - TP_TAKEN
+	TS_WRITE,               // TP_TAKEN - TP_WRITTEN, encode and syscall
+	TS_TOTAL,
+	TS_MAX
+};
+
+enum TraceRoute{
+	TR_UPSTREAM = 0,        // client to broker
+	TR_DOWNSTREAM,          // broker to client
+	TR_CLIENT_REPLY,        // answered to the client by the gateway
+	TR_BROKER_REPLY,        // answered to the broker by the gateway
+	TR_MAX
+};
+
+enum MetricsHist{
+	MH_QUE_WAIT = 0,                                    // [MQ_MAX] ns from post to take
+	MH_QUE_DEPTH = MH_QUE_WAIT + MQ_MAX,                // [MQ_MAX] events left when one is taken
+	MH_BROKER_CONNECT = MH_QUE_DEPTH + MQ_MAX,          // ns of the TCP connect and TLS handshake
+	MH_STAGE,                                           // [TR_MAX * TS_MAX] ns of a stage by route
+	MH_MAX = MH_STAGE + TR_MAX * TS_MAX
+};
+
+struct MetricsHistogram{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct MetricsData{
+	uint64_t counters[MC_MAX];
+	int64_t  gauges[MG_MAX];
+	MetricsHistogram hists[MH_MAX];
+};
+
+/*
+ *  The publisher makes seq odd while it copies the data,
+ *  a reader retries until it sees the same even seq before and after.
+ */
+struct MetricsPage{
+	uint32_t magic;
+	uint32_t size;           // sizeof(MetricsPage), the layout of a reader must match
+	uint32_t seq;
+	uint32_t threads;        // which have counted
+	uint64_t startTime;      // CLOCK_REALTIME in nanoseconds
+	uint64_t time;           // of the last publication
+	MetricsData data;
+};
+
+/*
+ *  A sampled message, the data of a LOG_RECORD_SAMPLE.
+ */
+struct TraceSample{
+	uint64_t stamps[TP_MAX];    // CLOCK_MONOTONIC ns, 0 where the message has not passed
+	uint8_t  route;
+	uint8_t  type;              // MQTT-SN type from a client, upper 4 bits of MQTT from the broker
+	uint8_t  reserved[6];
+};
+
+static const char* const theMetricsTransports[MT_MAX] = {
+	"udp", "udp6", "xbee", "tcp", "tls"
+};
+
+static const char* const theMetricsQues[MQ_MAX] = {
+	"gateway", "client_send", "broker_send", "broker_connect"
+};
+
+static const char* const theTraceStages[TS_MAX] = {
+	"ingress", "control_que", "handler", "send_que", "write", "total"
+};
+
+static const char* const theTraceRoutes[TR_MAX] = {
+	"upstream", "downstream", "client_reply", "broker_reply"
+};
+
+static const char* const theMetricsSnTypes[METRICS_SN_TYPES] = {
+	"ADVERTISE", "SEARCHGW", "GWINFO", "RESERVED", "CONNECT", "CONNACK",
+	"WILLTOPICREQ", "WILLTOPIC", "WILLMSGREQ", "WILLMSG", "REGISTER", "REGACK",
+	"PUBLISH", "PUBACK", "PUBCOMP", "PUBREC", "PUBREL", "RESERVED",
+	"SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP",
+	"DISCONNECT", "RESERVED", "WILLTOPICUPD", "WILLTOPICRESP", "WILLMSGUPD", "WILLMSGRESP",
+	"ENCAPSULATED", "UNKNOWN"
+};
+
+static const char* const theMetricsMqttTypes[METRICS_MQTT_TYPES] = {
+	"RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+	"SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "RESERVED"
+};
+
+static inline int metricsSnIndex(uint8_t type){
+	if(type < METRICS_SN_TYPES - 2){
+		return type;
+	}
+	return (type == 0xFE ? METRICS_SN_TYPES - 2 : METRICS_SN_TYPES - 1);
+}
+
+static inline int metricsBucketOf(uint64_t val){
+	if(val < METRICS_SUB_BUCKETS){
+		return (int)val;
+	}
+	int exp = 63 - __builtin_clzll(val);
+	if(exp >= METRICS_MAX_BITS){
+		return METRICS_BUCKETS - 1;
+	}
+	int sub = (val >> (exp - 4)) & (METRICS_SUB_BUCKETS - 1);
+	return (exp - 3) * METRICS_SUB_BUCKETS + sub;
+}
+
+/*
+ *  The upper edge of the bucket.
+ */
+static inline uint64_t metricsValueOf(int bucket){
+	if(bucket < METRICS_SUB_BUCKETS){
+		return bucket;
+	}
+	int exp = bucket / METRICS_SUB_BUCKETS + 3;
+	uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+	return ((METRICS_SUB_BUCKETS + sub + 1) << (exp - 4)) - 1;
+}
+
+static inline uint64_t metricsPercentile(const MetricsHistogram* hist, double percent){
+	uint64_t count = 0;
+	uint64_t sum = 0;
+
+	for(int i = 0; i < METRICS_BUCKETS; i++){
+		count += hist->buckets[i];
+	}
+	uint64_t target = (uint64_t)(count * percent / 100.0 + 0.5);
+	if(target == 0){
+		target = 1;
+	}
+	for(int i = 0; i < METRICS_BUCKETS; i++){
+		sum += hist->buckets[i];
+		if(sum >= target){
+			uint64_t val = metricsValueOf(i);
+			return (val > hist->max ? hist->max : val);
+		}
+	}
+	return hist->max;
+}
+
+#endif /* METRICSPAGE_H_ */
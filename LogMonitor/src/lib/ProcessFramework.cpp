@@ -48,6 +48,9 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 using namespace std;
 extern const char* theCmdlineParameter;
@@ -63,7 +66,6 @@ static volatile int theSignaled = 0;
 static void signalHandler(int sig){
 	assert(sig == SIGINT || sig == SIGHUP || sig == SIGTERM);
 	theSignaled = sig;
-	theProcess->releaseLog();
 	exit(-1);
 }
 
@@ -170,13 +172,11 @@ char* currentDateTime() {
 Process::Process(){
 	_argc = 0;
 	_argv = 0;
-	_rb = new RingBuffer();
-	_rbsem = new Semaphore(TOMYFRAME_RB_SEMAPHOR_NAME, 0);
+	_rb = 0;
 }
 
 Process::~Process(){
 	delete(_rb);
-	delete(_rbsem);
 }
 
 void Process::run(){
@@ -188,6 +188,19 @@ void Process::initialize(int argc, char** argv){
 	_argv = argv;
 }
 
+/*
+ *  The RingBuffer is opened by the first getLog(), LogMonitor reading a file does not need it.
+ */
+void Process::openLog(void){
+	char param[TOMYFRAME_PARAM_MAX];
+	uint32_t size = RINGBUFFER_SIZE;
+
+	if(getParam("LogBufferSize", param) == 0){
+		size = atoi(param) * 1024;
+	}
+	_rb = new RingBuffer(size);
+}
+
 int Process::getArgc(){
 	return _argc;
 }
@@ -251,35 +264,49 @@ int Process::getParam(const char* parameter, char* value){
 
 
 void Process::putLog(const char* format, ...){
-	_mt.lock();
+	uint8_t buf[sizeof(LogRecord) + PROCESS_LOG_BUFFER_SIZE];
+	LogRecord* rec = (LogRecord*)buf;
+
 	va_list arg;
 	va_start(arg, format);
-	vsprintf(_rbdata, format, arg);
+	int len = vsnprintf((char*)buf + sizeof(LogRecord), PROCESS_LOG_BUFFER_SIZE, format, arg);
 	va_end(arg);
-	if(strlen(_rbdata)){
-		_rb->put(_rbdata);
-		_rbsem->post();
+	if(len <= 0){
+		return;
+	}
+	if(len >= PROCESS_LOG_BUFFER_SIZE){
+		len = PROCESS_LOG_BUFFER_SIZE - 1;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->length = sizeof(LogRecord) + len + 1;
+	rec->type = LOG_RECORD_TEXT;
+	rec->format = 0;
+	rec->flags = 0;
+	rec->thread = 0;
+	rec->dataOffset = sizeof(LogRecord);
+	rec->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if(_rb){
+		_rb->put(buf, rec->length);
+		_rb->notify();
 	}
-	_mt.unlock();
 }
 
-const char* Process::getLog(){
+/*
+ *  Whole records, waits for them up to millsec. lost is the number
+ *  of bytes overwritten before this process could read them.
+ */
+int Process::getLog(uint8_t* buf, int length, uint64_t* lost, uint16_t millsec){
 	int len = 0;
-	_mt.lock();
-	while((len = _rb->get(_rbdata, PROCESS_LOG_BUFFER_SIZE)) == 0){
-		_rbsem->wait();
+	*lost = 0;
+	if(_rb == 0){
+		openLog();
 	}
-	*(_rbdata + len) = 0;
-	_mt.unlock();
-	return _rbdata;
-}
-
-void   Process::releaseLog(void){
-	_mt.unlock();
-}
-
-void Process::resetRingBuffer(){
-	_rb->reset();
+	if((len = _rb->get(buf, length, lost)) == 0 && *lost == 0){
+		_rb->wait(millsec);
+		len = _rb->get(buf, length, lost);
+	}
+	return len;
 }
 
 int Process::checkSignal(){
@@ -549,161 +576,176 @@ void Semaphore::timedwait(uint16_t millsec){
 /*=========================================
              Class RingBuffer
  =========================================*/
-RingBuffer::RingBuffer(){
+RingBuffer::RingBuffer(uint32_t size){
 	key_t key = ftok(TOMYFRAME_RINGBUFFER_KEY, 1);
+	uint32_t len = RINGBUFFER_MIN_SIZE;
 
-	if((_shmid = shmget(key, RINGBUFFER_SIZE, IPC_CREAT | IPC_EXCL | 0666)) >= 0){
-		if((_shmaddr = (uint16_t*)shmat(_shmid, NULL, 0)) > 0 ){
-			_length = (uint16_t*)_shmaddr;
-			_start = (uint16_t*)_length + sizeof(uint16_t*);
-			_end = (uint16_t*)_start + sizeof(uint16_t*);
-			_buffer = (char*)_end + sizeof(uint16_t*);
-			_createFlg = true;
-
-			*_length = RINGBUFFER_SIZE - sizeof(uint16_t*) * 3 - 16;
-			*_start = *_end = 0;
-		}else{
-			perror("RingBuffer");
-			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't attach shared memory.");
-		}
-	}else if((_shmid = shmget(key, RINGBUFFER_SIZE, IPC_CREAT | 0666)) >= 0){
-		if((_shmaddr = (uint16_t*)shmat(_shmid, NULL, 0)) > 0 ){
-			_length = (uint16_t*)_shmaddr;
-			_start = (uint16_t*)_length + sizeof(uint16_t*);
-			_end = (uint16_t*)_start + sizeof(uint16_t*);
-			_buffer = (char*)_end + sizeof(uint16_t*);
-			_createFlg = false;
-		}else{
-			perror("RingBuffer");
-			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
-		}
-	}else{
-		perror("RingBuffer");
-		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
+	while(len < size && len < RINGBUFFER_MAX_SIZE){
+		len <<= 1;
 	}
+	_pos = 0;
+	if(!attach(key, len)){
+		/*  the segment is replaced by the gateway, not by a reader  */
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "RingBuffer of an old layout, restart the gateway.");
+	}
+	_mask = _header->size - 1;
 
-	_pmx = new Mutex(TOMYFRAME_RB_MUTEX_KEY);
+	/*  a reader starts from the first record unless the ring has wrapped  */
+	uint64_t head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+	_pos = (head > _header->size ? head : 0);
 }
 
+/*
+ *  A reader only detaches, the segment belongs to the gateway.
+ */
 RingBuffer::~RingBuffer(){
-	if(_createFlg){
-		if(_shmid > 0){
-			shmctl(_shmid, IPC_RMID, NULL);
-		}
-		if(_pmx > 0){
-			delete _pmx;
-		}
-	}else{
-		if(_shmid > 0){
-			shmdt(_shmaddr);
+	if(_shmid > 0){
+		shmdt(_shmaddr);
+	}
+}
+
+/*
+ *  Creates the segment or attaches to the existing one, false if its layout is not ours.
+ */
+bool RingBuffer::attach(key_t key, uint32_t size){
+	_createFlg = true;
+	if((_shmid = shmget(key, sizeof(RingHeader) + size, IPC_CREAT | IPC_EXCL | 0666)) < 0){
+		_createFlg = false;
+		if((_shmid = shmget(key, 0, 0666)) < 0){
+			THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "Can't create a shared memory.");
 		}
 	}
+	if((_shmaddr = shmat(_shmid, NULL, 0)) == (void*)-1){
+		THROW_EXCEPTION(ExFatal, ERRNO_SYS_01, "can't attach shared memory.");
+	}
+	_header = (RingHeader*)_shmaddr;
+	_buffer = (uint8_t*)_shmaddr + sizeof(RingHeader);
+
+	if(_createFlg){
+		_header->size = size;
+		_header->waiters = 0;
+		_header->wake = 0;
+		_header->head = 0;
+		__atomic_store_n(&_header->magic, RINGBUFFER_MAGIC, __ATOMIC_RELEASE);
+		return true;
+	}
+	/*  the creator may be initializing it  */
+	for(int i = 0; i < 100 && __atomic_load_n(&_header->magic, __ATOMIC_ACQUIRE) != RINGBUFFER_MAGIC; i++){
+		usleep(10000);
+	}
+	return __atomic_load_n(&_header->magic, __ATOMIC_ACQUIRE) == RINGBUFFER_MAGIC;
 }
 
-void RingBuffer::put(char* data){
-	_pmx->lock();
+RingSlot* RingBuffer::slotAt(uint64_t pos){
+	return (RingSlot*)(_buffer + (pos & _mask));
+}
 
-	uint16_t dlen = strlen(data);
-	uint16_t blen = *_length - *_end;
+/*
+ *  A record never wraps, the space left at the end is filled by a pad slot.
+ *  Returns false when the record is larger than the ring.
+ */
+bool RingBuffer::put(const uint8_t* data, uint16_t length){
+	uint32_t len = (sizeof(RingSlot) + length + sizeof(RingSlot) - 1) & ~(sizeof(RingSlot) - 1);
+	uint64_t head = __atomic_load_n(&_header->head, __ATOMIC_RELAXED);
+	uint32_t pad;
 
-	if(*_end > *_start){
-		if(dlen < blen){
-			strncpy(_buffer + *_end, data, dlen);
-			if(*_end - *_start == 1){ // Buffer is empty.
-				*_start = *_end;
-			}
-			*_end += dlen;
-		}else{
-			strncpy(_buffer + *_end, data, blen);
-			strncpy(_buffer, data + blen, dlen - blen);
-			if(*_end - *_start == 1){ // Buffer is empty.
-				*_start = *_end;
-				*_end = dlen - blen;
-			}else{
-				*_end = dlen - blen;
-				*_start = *_end + 1;
-			}
-		}
-	}else if(*_end == *_start){
-		if(dlen < blen){
-			strncpy(_buffer + *_end, data, dlen);
-			*_end += dlen;
-		}else{
-			const char* errmsg = "RingBuffer Error: data is too long";
-			strcpy(_buffer + *_end, errmsg);
-			*_end += strlen(errmsg);
-		}
-	}else{    // *_end < *_start
-		if(dlen < *_start - *_end){
-			strncpy(_buffer + *_end, data, dlen);
-			*_end += dlen;
-			*_start = *_end + 1;
-		}else {
-			if( dlen < blen){
-				strncpy(_buffer + *_end, data, dlen);
-				*_end += dlen;
-				*_start = *_end + 1;
-			}else {
-				strncpy(_buffer + *_end, data, blen);
-				strncpy(_buffer, data + blen, dlen - blen);
-				*_start = *_end;
-				*_end = dlen - blen;
-			}
-		}
+	if(len > _header->size / 2){
+		return false;
+	}
+	do{
+		uint32_t rest = _header->size - (head & _mask);
+		pad = (rest < len ? rest : 0);
+	}while(!__atomic_compare_exchange_n(&_header->head, &head, head + pad + len, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if(pad){
+		RingSlot* slot = slotAt(head);
+		slot->length = pad;
+		slot->pad = 1;
+		__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+		head += pad;
 	}
-	_pmx->unlock();
+	RingSlot* slot = slotAt(head);
+	slot->length = length;
+	slot->pad = 0;
+	memcpy(slot + 1, data, length);
+	__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-int RingBuffer::get(char* buf, int length){
+/*
+ *  Wakes the readers, a system call only when one of them sleeps.
+ */
+void RingBuffer::notify(void){
+	__atomic_add_fetch(&_header->wake, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_header->waiters, __ATOMIC_SEQ_CST)){
+		syscall(SYS_futex, &_header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+void RingBuffer::wait(uint16_t millsec){
+	struct timespec ts;
+	ts.tv_sec = millsec / 1000;
+	ts.tv_nsec = (millsec % 1000) * 1000000;
+
+	__atomic_add_fetch(&_header->waiters, 1, __ATOMIC_SEQ_CST);
+	uint32_t wake = __atomic_load_n(&_header->wake, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&_header->head, __ATOMIC_ACQUIRE) == _pos){
+		syscall(SYS_futex, &_header->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+	}
+	__atomic_sub_fetch(&_header->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *  Copies as many whole records as the buffer can hold. A reader
+ *  lapped by the writers loses the records in between, the count
+ *  of bytes is added to lost and it restarts from the head.
+ */
+int RingBuffer::get(uint8_t* buf, int length, uint64_t* lost){
 	int len = 0;
-	_pmx->lock();
 
-	if(*_end > *_start){
-		if(length > *_end - *_start){
-			len = *_end - *_start;
-			if (len == 1){
-				len = 0;
-			}
-			strncpy(buf, _buffer + *_start, len);
-			*_start = *_end - 1;
-		}else{
-			len = length;
-			strncpy(buf, _buffer + *_start, len);
-			*_start = *_start + len;
+	while(true){
+		uint64_t head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+		if(_pos == head){
+			break;
+		}
+		if(head - _pos > _header->size){
+			*lost += head - _pos;
+			_pos = head;
+			break;
+		}
+		RingSlot* slot = slotAt(_pos);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != _pos + 1){
+			break;                    // not completed yet
 		}
-	}else if(*_end < *_start){
-		int blen = *_length - *_start;
-		if(length > blen ){
-			strncpy(buf, _buffer + *_start, blen);
-			*_start = 0;
-			if(length - (blen + *_end) > 0){
-				strncpy(buf + blen , _buffer, *_end);
-				len = blen + *_end;
-				if(*_end > 0){
-					*_start = *_end - 1;
-				}
-			}else{
-				printf("length=%d blen=%d len = %d\n", length, blen, length - *_end );
-				strncpy(buf + blen, _buffer, length - blen);
-				len = length;
-				*_start = length - blen;
+		uint32_t rlen = slot->length;
+		bool isPad = slot->pad;
+		uint32_t span = (isPad ? rlen : (sizeof(RingSlot) + rlen + sizeof(RingSlot) - 1) & ~(sizeof(RingSlot) - 1));
+
+		if(!isPad && len + (int)rlen > length){
+			if(len > 0){
+				break;
 			}
-		}else{
-			strncpy(buf, _buffer + *_start, length);
-			*_start += length;
-			len = length;
+			span = (rlen > _header->size ? 0 : span);    // never fits, skipped
+		}else if(!isPad){
+			memcpy(buf + len, slot + 1, rlen);
 		}
+
+		/*  the writers may have reused the slot while it was copied  */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&_header->head, __ATOMIC_ACQUIRE);
+		if(span == 0 || head - _pos > _header->size){
+			*lost += head - _pos;
+			_pos = head;
+			break;
+		}
+		if(!isPad && len + (int)rlen <= length){
+			len += rlen;
+		}
+		_pos += span;
 	}
-	_pmx->unlock();
 	return len;
 }
 
-void RingBuffer::reset(){
-	_pmx->lock();
-	*_start = *_end = 0;
-	_pmx->unlock();
-}
-
 /*=====================================
         Class Exception
  ======================================*/
@@ -50,6 +50,7 @@
 #include <string>
 #include <arpa/inet.h>
 #include "Defines.h"
+#include "LogRecord.h"
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
@@ -58,13 +59,16 @@
 #define TOMYFRAME_CONFIG_FILE      "/usr/local/etc/tomygateway/config/param.conf"
 
 #define TOMYFRAME_RINGBUFFER_KEY   "/usr/local/etc/tomygateway/config/ringbuffer.key"
-#define TOMYFRAME_RB_MUTEX_KEY     "/usr/local/etc/tomygateway/config/rbmutex.key"
-#define TOMYFRAME_RB_SEMAPHOR_NAME "/rbsemaphor"
 
 #define LOGWRITE theProcess->putLog
 //#define LOGWRITE printf
-#define RINGBUFFER_SIZE 16384
+#define RINGBUFFER_SIZE      262144    // default, LogBufferSize in KB overrides it
+#define RINGBUFFER_MIN_SIZE   16384
+#define RINGBUFFER_MAX_SIZE  (64 * 1024 * 1024)
+#define RINGBUFFER_MAGIC     0x4C4F4752    // "LOGR", layout of the shared memory
+#define RINGBUFFER_WAIT_MSEC  1000
 #define PROCESS_LOG_BUFFER_SIZE  2048
+#define CACHE_LINE_SIZE  64
 
 #define ERRNO_SYS_01  1   // Application Frame Error
 
@@ -135,21 +139,47 @@ private:
 /*=====================================
         Class RingBuffer
  =====================================*/
+/*
+ *  Shared memory of whole records, written by the gateway and
+ *  followed by any number of LogMonitors. Writers reserve space
+ *  with a CAS on the head and publish a record by its sequence,
+ *  no lock is taken. Every reader keeps its own position and
+ *  finds the records it was too slow for overwritten (overrun).
+ */
+struct RingHeader{
+	uint32_t magic;
+	uint32_t size;             // of the data area, a power of 2
+	uint32_t waiters;          // readers sleeping on wake
+	uint32_t wake;             // futex, incremented by notify()
+	char     pad0[CACHE_LINE_SIZE - sizeof(uint32_t) * 4];
+	uint64_t head;             // free running, next record
+	char     pad1[CACHE_LINE_SIZE - sizeof(uint64_t)];
+};
+
+struct RingSlot{
+	uint64_t seq;              // position + 1 once the record is complete
+	uint32_t length;           // of the record, of the whole slot for a pad
+	uint32_t pad;
+};
+
 class RingBuffer{
 public:
-	RingBuffer();
+	RingBuffer(uint32_t size);
 	~RingBuffer();
-	void put(char* buffer);
-	int get(char* buffer, int bufferLength);
-	void reset();
+	bool put(const uint8_t* data, uint16_t length);
+	void notify(void);
+	int get(uint8_t* buffer, int bufferLength, uint64_t* lost);
+	void wait(uint16_t millsec);
 private:
+	bool attach(key_t key, uint32_t size);
+	RingSlot* slotAt(uint64_t pos);
+
 	void* _shmaddr;
-	uint16_t* _length;
-	uint16_t* _start;
-	uint16_t* _end;
-	char* _buffer;
+	RingHeader* _header;
+	uint8_t* _buffer;
+	uint32_t _mask;
+	uint64_t _pos;             // of this reader
 	int _shmid;
-	Mutex* _pmx;
 	bool _createFlg;
 };
 
@@ -195,24 +225,22 @@ class Process{
 public:
 	Process();
 	virtual ~Process();
-	void initialize(int argc, char** argv);
+	virtual void initialize(int argc, char** argv);
 	virtual void run();
 	int getArgc();
 	char** getArgv();
 	char*  getArgv(char option);
 	int    getParam(const char* param, char* value);
 	void   putLog(const char* format, ...);
-	void   resetRingBuffer();
 	int    checkSignal();
-	const char*  getLog(void);
-	void   releaseLog(void);
+	int    getLog(uint8_t* buf, int length, uint64_t* lost, uint16_t millsec = RINGBUFFER_WAIT_MSEC);
 private:
+	void   openLog(void);
+
 	int _argc;
 	char** _argv;
 	RingBuffer* _rb;
 	Mutex _mt;
-	Semaphore* _rbsem;
-	char _rbdata[PROCESS_LOG_BUFFER_SIZE + 1];
 
 };
 